@@ -0,0 +1,30 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compressed bitmap of 32-bit ids, split into containers of 65536 ids each.
+ * Sparse containers hold a sorted array, dense ones a plain bitset.
+ */
+struct bitmap_container {
+	uint16_t key; // high 16 bits of the ids in this container
+	uint32_t cardinality;
+	uint32_t capacity; // allocated array elements, `0` for a bitset
+	uint16_t *array; // sorted low 16 bits, `NULL` for a bitset
+	uint64_t *bits;
+};
+
+struct bitmap {
+	struct bitmap_container *containers; // sorted by key
+	size_t count;
+	size_t capacity;
+};
+
+struct bitmap* bitmap_new(void);
+void bitmap_free(struct bitmap *bitmap);
+int bitmap_add(struct bitmap *bitmap, uint32_t value);
+int bitmap_remove(struct bitmap *bitmap, uint32_t value);
+int bitmap_contains(const struct bitmap *bitmap, uint32_t value);
+uint64_t bitmap_cardinality(const struct bitmap *bitmap);
+struct bitmap* bitmap_and(const struct bitmap *a, const struct bitmap *b);
+uint64_t bitmap_and_cardinality(const struct bitmap *a, const struct bitmap *b);
+size_t bitmap_to_array(const struct bitmap *bitmap, uint32_t *values, size_t max_values);
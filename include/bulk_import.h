@@ -0,0 +1,25 @@
+#include "sqlite3.h"
+#include <stdio.h>
+
+struct tagger_db;
+
+typedef enum {IMPORT_CSV = 0, IMPORT_JSONL = 1} IMPORT_FORMAT;
+typedef enum {IMPORT_INDEXES_AUTO = 0, IMPORT_KEEP_INDEXES = 1, IMPORT_REBUILD_INDEXES = 2} IMPORT_INDEXES;
+
+struct import_options {
+	IMPORT_FORMAT format;
+	int auto_add_tags; // add tags that don't exist yet instead of skipping their rows
+	IMPORT_INDEXES indexes;
+	size_t rows_per_transaction; // `0` for the default
+};
+
+struct import_stats {
+	size_t rows; // rows read, including the skipped ones
+	size_t malformed_rows;
+	size_t unknown_items; // rows whose relpath is not an item of any listing
+	size_t unknown_tags; // rows whose tag doesn't exist when tags are not auto-added
+	sqlite3_int64 tags_added;
+	sqlite3_int64 item_tags_added;
+};
+
+int bulk_import_item_tags(struct tagger_db *db, FILE *input, const struct import_options *options, struct import_stats *stats);
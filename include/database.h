@@ -1,16 +1,78 @@
 #include "sqlite3.h"
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {DIR_AS_ITEM = 0, FILE_AS_ITEM = 1, ANY_AS_ITEM = 2} LISTING_TYPE;
 typedef enum {AUTO_ADD_TAGS, DONT_AUTO_ADD_TAGS} ON_NEW_TAGS;
+typedef enum {PROFILE_INTERACTIVE = 0, PROFILE_BULK_LOAD = 1, PROFILE_READ_ONLY = 2, PROFILE_SERVER = 3} DATABASE_PROFILE;
 
-sqlite3_int64 add_new_tag(sqlite3 *db, char *tagName);
-int get_item_tag_ids(sqlite3 *db, sqlite3_int64 item_id, int *tags_array_size, sqlite3_int64 **tags_array);
-int add_tag_to_item(sqlite3 *db, sqlite3_int64 item_id, sqlite3_int64 tag_id);
-int update_tags(sqlite3 *db, sqlite3_int64 item_id, char **tags, ON_NEW_TAGS on_new_tags);
-int add_new_listing(sqlite3 *db, char *name, LISTING_TYPE type, char *path);
-int refresh_listing(sqlite3 *db, sqlite3_int64 listing_id);
-int get_listing_size(sqlite3 *db, sqlite3_int64 listing_id);
-int init_tables(sqlite3 *db);
-sqlite3* open_database(char *database_location);
-void close_database(sqlite3 *db);
+struct tag_events;
+
+/**
+ * Handle of an open tagger database, wraps the connection together with
+ * the statements prepared on it, which are reused by every call.
+ */
+struct tagger_db {
+	sqlite3 *connection;
+	sqlite3_stmt **statements; // lazily prepared statements, indexed by the statement enum in database.c
+	unsigned char *borrowed; // statements currently held by an open cursor
+	struct tag_events *events; // tag events state, `NULL` while nobody is subscribed
+	sqlite3_int64 maintained_changes; // rows changed on the connection before the last `PRAGMA optimize`
+};
+
+struct tagger_cursor {
+	struct tagger_db *db;
+	sqlite3_stmt *stmt;
+	int statement; // index of the borrowed cached statement, or `-1` if the cursor owns `stmt`
+	sqlite3_int64 last_key;
+};
+
+struct item_row {
+	sqlite3_int64 item_id;
+	const char *item_name;
+	const char *item_relpath;
+	sqlite3_int64 listing_id;
+};
+
+struct item_tags {
+	sqlite3_int64 item_id;
+	char **tags; // tag names ending with NULL
+};
+
+struct item_tag_pair {
+	sqlite3_int64 item_id;
+	sqlite3_int64 tag_id;
+};
+
+struct tag_row {
+	sqlite3_int64 tag_id;
+	const char *tag_name;
+};
+
+sqlite3_int64 add_new_tag(struct tagger_db *db, char *tagName);
+int get_item_tag_ids(struct tagger_db *db, sqlite3_int64 item_id, int *tags_array_size, sqlite3_int64 **tags_array);
+struct tagger_cursor* open_listing_items_cursor(struct tagger_db *db, sqlite3_int64 listing_id, sqlite3_int64 after_item_id, int limit);
+struct tagger_cursor* open_tag_items_cursor(struct tagger_db *db, sqlite3_int64 tag_id, sqlite3_int64 after_item_id, int limit);
+struct tagger_cursor* open_item_tags_cursor(struct tagger_db *db, sqlite3_int64 item_id, sqlite3_int64 after_tag_id, int limit);
+struct tagger_cursor* open_tags_cursor(struct tagger_db *db, sqlite3_int64 after_tag_id, int limit);
+int cursor_next_item(struct tagger_cursor *cursor, struct item_row *row);
+int cursor_next_tag(struct tagger_cursor *cursor, struct tag_row *row);
+sqlite3_int64 cursor_last_key(struct tagger_cursor *cursor);
+void close_cursor(struct tagger_cursor *cursor);
+int add_tag_to_item(struct tagger_db *db, sqlite3_int64 item_id, sqlite3_int64 tag_id);
+int update_tags(struct tagger_db *db, sqlite3_int64 item_id, char **tags, ON_NEW_TAGS on_new_tags);
+sqlite3_int64 update_tags_batch(struct tagger_db *db, const struct item_tags *updates, size_t updates_count,
+								ON_NEW_TAGS on_new_tags, size_t chunk_size, size_t *updates_applied);
+int rename_tag(struct tagger_db *db, sqlite3_int64 tag_id, char *new_name);
+sqlite3_int64 merge_tags(struct tagger_db *db, sqlite3_int64 from_tag_id, sqlite3_int64 into_tag_id);
+sqlite3_int64 remove_tag_from_all_items(struct tagger_db *db, sqlite3_int64 tag_id);
+sqlite3_int64 remove_item_tags(struct tagger_db *db, const sqlite3_int64 *item_ids, size_t items_count,
+							   const sqlite3_int64 *tag_ids, size_t tags_count);
+int add_new_listing(struct tagger_db *db, char *name, LISTING_TYPE type, char *path);
+int refresh_listing(struct tagger_db *db, sqlite3_int64 listing_id);
+int get_listing_size(struct tagger_db *db, sqlite3_int64 listing_id);
+int init_tables(struct tagger_db *db);
+int database_profile_from_name(const char *name);
+const char* database_profile_name(DATABASE_PROFILE profile);
+struct tagger_db* open_database(char *database_location, DATABASE_PROFILE profile);
+void close_database(struct tagger_db *db);
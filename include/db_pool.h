@@ -0,0 +1,16 @@
+#include "sqlite3.h"
+
+struct tagger_db;
+struct db_pool;
+
+/**
+ * Work run against a pooled connection, the return value is handed back to the caller
+ */
+typedef int (*db_pool_fn)(struct tagger_db *db, void *arg);
+
+struct db_pool* db_pool_open(char *database_location, int readers);
+int db_pool_read(struct db_pool *pool, db_pool_fn fn, void *arg);
+int db_pool_write(struct db_pool *pool, db_pool_fn fn, void *arg);
+int db_pool_write_async(struct db_pool *pool, db_pool_fn fn, void *arg);
+int db_pool_flush(struct db_pool *pool);
+void db_pool_close(struct db_pool *pool);
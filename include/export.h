@@ -0,0 +1,8 @@
+#include "sqlite3.h"
+#include <stdio.h>
+
+struct tagger_db;
+
+typedef enum {EXPORT_CSV = 0, EXPORT_JSONL = 1} EXPORT_FORMAT;
+
+sqlite3_int64 export_database(struct tagger_db *db, FILE *output, EXPORT_FORMAT format);
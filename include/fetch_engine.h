@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <curl/curl.h>
+
+struct response;
+struct fetch_engine;
+struct rate_limiter;
+struct retry_policy;
+struct circuit_breaker;
+struct provider_attempt;
+
+/**
+ * Called once a transfer finished, `response` is freed when the callback returns
+ * unless the callback sets `*response` to `NULL` to keep it
+ */
+typedef void (*fetch_callback)(const char *url, CURLcode result, long status, struct response **response, void *user_data);
+
+struct fetch_request {
+	const char *url;
+	fetch_callback callback;
+	void *user_data;
+};
+
+struct fetch_engine* fetch_engine_create(int max_in_flight);
+void fetch_engine_set_rate_limiter(struct fetch_engine *engine, struct rate_limiter *limiter);
+void fetch_engine_set_retry_policy(struct fetch_engine *engine, const struct retry_policy *policy, struct circuit_breaker *breaker);
+int fetch_engine_submit(struct fetch_engine *engine, const char *url, fetch_callback callback, void *user_data);
+int fetch_engine_submit_attempt(struct fetch_engine *engine, const char *url, const struct provider_attempt *hooks,
+								fetch_callback callback, void *user_data);
+int fetch_engine_submit_batch(struct fetch_engine *engine, const struct fetch_request *requests, size_t requests_count);
+int fetch_engine_perform(struct fetch_engine *engine, int timeout_ms);
+int fetch_engine_run(struct fetch_engine *engine);
+void fetch_engine_destroy(struct fetch_engine *engine);
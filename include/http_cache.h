@@ -0,0 +1,17 @@
+#include "sqlite3.h"
+
+struct response;
+struct http_cache;
+
+struct http_cache_stats {
+	sqlite3_int64 hits; // served from the cache without a request
+	sqlite3_int64 revalidations; // served from the cache after a `304 Not Modified`
+	sqlite3_int64 misses; // served from a full response
+	sqlite3_int64 evictions;
+	sqlite3_int64 stored_bytes;
+};
+
+struct http_cache* http_cache_open(const char *location, sqlite3_int64 max_bytes);
+struct response* http_cache_get(struct http_cache *cache, const char *url);
+void http_cache_get_stats(struct http_cache *cache, struct http_cache_stats *stats);
+void http_cache_close(struct http_cache *cache);
@@ -0,0 +1,23 @@
+#include "sqlite3.h"
+#include <stddef.h>
+
+/**
+ * Hash map from positive ids (tag_id, item_id) to pointers, open addressing.
+ * Zero-initialize it before use.
+ */
+struct id_map_slot {
+	sqlite3_int64 key;
+	void *value;
+};
+
+struct id_map {
+	struct id_map_slot *slots;
+	size_t capacity;
+	size_t used; // including deleted slots
+	size_t size;
+};
+
+int id_map_put(struct id_map *map, sqlite3_int64 key, void *value);
+void* id_map_get(const struct id_map *map, sqlite3_int64 key);
+int id_map_remove(struct id_map *map, sqlite3_int64 key);
+void id_map_clear(struct id_map *map);
@@ -0,0 +1,53 @@
+#include <stddef.h>
+
+#define JSON_STREAM_MAX_DEPTH 128
+
+struct json_stream;
+
+typedef enum {
+	JSON_FALSE,
+	JSON_TRUE,
+	JSON_NULL
+} JSON_LITERAL;
+
+/**
+ * Callbacks of a streaming JSON parser, `NULL` members are skipped.
+ * A callback returning non-zero stops the parser with an error.
+ * Strings are unescaped and null terminated, they only live during the callback.
+ */
+struct json_stream_handler {
+	int (*start_object)(void *user_data);
+	int (*end_object)(void *user_data);
+	int (*start_array)(void *user_data);
+	int (*end_array)(void *user_data);
+	int (*key)(void *user_data, const char *key, size_t length);
+	int (*string)(void *user_data, const char *value, size_t length);
+	int (*number)(void *user_data, const char *text, size_t length);
+	int (*literal)(void *user_data, JSON_LITERAL literal);
+};
+
+typedef int (*json_tag_callback)(const char *tag, size_t length, void *user_data);
+
+/**
+ * Handler state emitting the strings found under given keys as tag candidates,
+ * directly or in arrays, for example every string of `{"tags": ["a", "b"]}`
+ */
+struct json_tag_extractor {
+	const char *const *keys; // `NULL` terminated
+	json_tag_callback callback;
+	void *user_data;
+	int depth;
+	int key_matches; // the last key of the innermost object is a tag key
+	unsigned char in_tags[JSON_STREAM_MAX_DEPTH]; // per open container, whether its values are tags
+	unsigned char is_array[JSON_STREAM_MAX_DEPTH];
+};
+
+extern const struct json_stream_handler json_tag_extractor_handler;
+
+struct json_stream* json_stream_create(const struct json_stream_handler *handler, void *user_data);
+int json_stream_feed(struct json_stream *stream, const char *data, size_t length);
+int json_stream_finish(struct json_stream *stream);
+void json_stream_destroy(struct json_stream *stream);
+size_t json_stream_writefunc(void *ptr, size_t size, size_t nmemb, struct json_stream *stream);
+void json_tag_extractor_init(struct json_tag_extractor *extractor, const char *const *keys, json_tag_callback callback, void *user_data);
+int stream_tags_from_url(const char *url, const char *const *keys, json_tag_callback callback, void *user_data);
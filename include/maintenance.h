@@ -0,0 +1,23 @@
+#include "sqlite3.h"
+
+struct tagger_db;
+
+/**
+ * Thresholds of the maintenance tasks, `0` fields take their defaults
+ */
+struct maintenance_options {
+	sqlite3_int64 changes_threshold; // rows changed on the connection before the statistics are refreshed, negative to always refresh them
+	sqlite3_int64 freelist_threshold; // free pages kept in the file before they are vacuumed
+	sqlite3_int64 wal_threshold; // size of the WAL file in bytes before it is checkpointed
+	int slice_ms; // time a slice may take, in milliseconds
+	int vacuum_pages_per_step; // free pages returned per incremental vacuum step
+};
+
+struct maintenance_stats {
+	int optimized; // `PRAGMA optimize` ran
+	sqlite3_int64 pages_vacuumed;
+	int checkpointed; // a passive WAL checkpoint ran
+	int wal_frames_left; // frames the checkpoint couldn't copy because of open readers
+};
+
+int run_maintenance_slice(struct tagger_db *db, const struct maintenance_options *options, struct maintenance_stats *stats);
@@ -0,0 +1,10 @@
+#include "sqlite3.h"
+#include <stddef.h>
+
+// schema version created by `init_tables`, stored in `PRAGMA user_version`
+#define SCHEMA_VERSION 2
+
+struct tagger_db;
+
+int get_schema_version(struct tagger_db *db);
+int migrate_database(struct tagger_db *db, int target_version, size_t chunk_size, size_t max_chunks);
@@ -0,0 +1,27 @@
+#include <stddef.h>
+
+struct mock_provider;
+
+/**
+ * Behaviour of a mock provider, `0` fields take their defaults
+ */
+struct mock_provider_options {
+	const char *body; // canned body of every successful response, `NULL` for a small JSON document with tags
+	int latency_ms; // time before a response is sent
+	int latency_jitter_ms; // random extra latency, up to this much
+	double error_rate; // fraction of requests answered with `500`, from `0` to `1`
+	double requests_per_second; // requests above this rate are answered with `429`, `0` for no limit
+	int retry_after; // seconds in the `Retry-After` header of throttled responses
+};
+
+struct mock_provider_stats {
+	size_t requests;
+	size_t errors; // `500` responses
+	size_t throttled; // `429` responses
+	size_t connections; // connections accepted, lower than `requests` when connections are reused
+};
+
+struct mock_provider* mock_provider_start(const struct mock_provider_options *options);
+int mock_provider_port(const struct mock_provider *server);
+void mock_provider_get_stats(struct mock_provider *server, struct mock_provider_stats *stats);
+void mock_provider_stop(struct mock_provider *server);
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include "sqlite3.h"
+
+struct tagger_db;
+struct tag_provider;
+struct provider_options;
+struct provider_stats;
+
+/**
+ * Workers and queues of a scan and enrich run, `0` fields take their defaults
+ */
+struct pipeline_options {
+	int scan_workers; // threads walking the directories of the listing
+	int lookup_workers; // threads asking the providers, each with its own fetch engine
+	size_t queue_capacity; // items a queue between two stages holds before its producers wait
+};
+
+struct pipeline_stats {
+	size_t items_scanned;
+	size_t items_skipped; // items not added because another item has the same name
+	size_t transactions;
+	size_t scan_waits; // times a scan worker waited for the lookups to catch up
+	size_t lookup_waits; // times a lookup worker waited for the writes to catch up
+	double scan_seconds; // time from the start until each stage finished
+	double lookup_seconds;
+	double write_seconds;
+};
+
+int scan_and_enrich_listing(struct tagger_db *db, sqlite3_int64 listing_id, const struct tag_provider *providers,
+							size_t providers_count, const struct provider_options *provider_options,
+							const struct pipeline_options *options, struct provider_stats *provider_stats,
+							struct pipeline_stats *stats);
@@ -1,8 +1,44 @@
 #include <stddef.h>
+#include <stdio.h>
+#include <curl/curl.h>
+#include "retry_policy.h"
+
+// longest host name of a provider url
+#define PROVIDER_HOST_SIZE 256
+
+struct rate_limiter;
+
 struct response {
-  char *ptr;
+  char *ptr; // body, null terminated
   size_t len;
+  size_t capacity; // bytes allocated at `ptr`
+  FILE *spill; // temporary file holding the body while it is too large for memory
+  int mapped; // `ptr` maps the spilled body
+  CURL *curl; // transfer writing the body
+};
+
+/**
+ * Hooks of a blocking provider request, called for every attempt
+ */
+struct provider_attempt {
+  int (*start)(CURL *curl, void *user_data); // prepares the handle of an attempt, non-zero on error
+  int (*discard)(void *user_data); // drops what a failed attempt received, non-zero if it can't be attempted again
+  void *user_data;
 };
 
+struct response* init_response(void);
 void free_response(struct response *r);
+void set_response_spill_threshold(size_t bytes);
+void attach_response(CURL *curl, struct response *r);
+int finish_response(struct response *r);
 struct response* get_response_from_url(char* url);
+CURL* acquire_easy_handle(void);
+void release_easy_handle(CURL *curl);
+void cleanup_provider_connections(void);
+int url_host(const char *url, char *host, size_t size);
+void set_provider_rate_limiter(struct rate_limiter *limiter);
+int wait_for_provider_rate_limit(const char *url);
+void report_provider_response(CURL *curl, const char *url);
+void set_provider_retry_policy(const struct retry_policy *policy, struct circuit_breaker *breaker);
+PROVIDER_RESULT perform_provider_request(const char *url, const struct provider_attempt *hooks, long *status);
+PROVIDER_RESULT get_provider_response(const char *url, struct response **response, long *status);
@@ -0,0 +1,8 @@
+struct rate_limiter;
+
+struct rate_limiter* rate_limiter_create(double rate, double burst);
+int rate_limiter_set_host(struct rate_limiter *limiter, const char *host, double rate, double burst);
+long rate_limiter_try_acquire(struct rate_limiter *limiter, const char *url);
+int rate_limiter_acquire(struct rate_limiter *limiter, const char *url);
+void rate_limiter_throttled(struct rate_limiter *limiter, const char *url, long retry_after);
+void rate_limiter_destroy(struct rate_limiter *limiter);
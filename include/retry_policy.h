@@ -0,0 +1,32 @@
+#include <curl/curl.h>
+
+struct circuit_breaker;
+
+/**
+ * Retries of failed provider requests, `0` fields take their defaults
+ */
+struct retry_policy {
+	int max_attempts; // attempts per request, including the first one
+	long base_delay_ms; // backoff before the first retry, it doubles for every further retry
+	long max_delay_ms; // longest backoff
+};
+
+/**
+ * Outcome of a provider request
+ */
+typedef enum {
+	PROVIDER_OK, // successful response, or any response of a protocol without status codes
+	PROVIDER_TRANSPORT_ERROR, // no response, even after retrying
+	PROVIDER_HTTP_ERROR, // the final response had an error status
+	PROVIDER_CIRCUIT_OPEN, // not attempted, the host failed too often recently
+	PROVIDER_INTERNAL_ERROR // out of memory or a similar local failure
+} PROVIDER_RESULT;
+
+int is_transient_failure(CURLcode result, long status);
+int retry_attempts(const struct retry_policy *policy);
+long retry_backoff_ms(const struct retry_policy *policy, int attempt);
+struct circuit_breaker* circuit_breaker_create(int failure_threshold, long cooldown_ms);
+int circuit_breaker_allow(struct circuit_breaker *breaker, const char *url);
+void circuit_breaker_record(struct circuit_breaker *breaker, const char *url, CURLcode result, long status);
+void circuit_breaker_release(struct circuit_breaker *breaker, const char *url);
+void circuit_breaker_destroy(struct circuit_breaker *breaker);
@@ -0,0 +1,8 @@
+#include "sqlite3.h"
+#include <stddef.h>
+
+struct tagger_db;
+
+int listing_shard_location(struct tagger_db *catalog, sqlite3_int64 listing_id, char *location, size_t size);
+struct tagger_db* open_listing_shard(struct tagger_db *catalog, sqlite3_int64 listing_id, int profile);
+int attach_listing_shards(struct tagger_db *catalog);
@@ -0,0 +1,11 @@
+#include "sqlite3.h"
+
+struct tagger_db;
+
+struct related_tag {
+	sqlite3_int64 tag_id;
+	sqlite3_int64 count; // number of items having both tags (summed over the queried tags)
+};
+
+int get_related_tags(struct tagger_db *db, sqlite3_int64 *tag_ids, int tag_ids_count, struct related_tag *related, int max_related);
+int rebuild_tag_cooccurrence(struct tagger_db *db, int threads);
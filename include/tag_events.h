@@ -0,0 +1,22 @@
+#include "sqlite3.h"
+
+struct tagger_db;
+
+/**
+ * Callbacks invoked after a transaction that changed tags or item tags commits,
+ * `unknown_tag` is invoked right away when a tag name could not be resolved.
+ * Any callback may be `NULL`. Callbacks must not use the database connection.
+ */
+struct tag_events_listener {
+	void *ctx;
+	void (*tag_added)(void *ctx, sqlite3_int64 tag_id, const char *tag_name);
+	void (*tag_removed)(void *ctx, sqlite3_int64 tag_id, const char *tag_name);
+	void (*item_tag_added)(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id);
+	void (*item_tag_removed)(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id);
+	void (*unknown_tag)(void *ctx, const char *tag_name);
+};
+
+int tag_events_subscribe(struct tagger_db *db, const struct tag_events_listener *listener);
+int tag_events_unsubscribe(struct tagger_db *db, const struct tag_events_listener *listener);
+void tag_events_unknown_tag(struct tagger_db *db, const char *tag_name);
+void tag_events_detach(struct tagger_db *db);
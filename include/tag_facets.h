@@ -0,0 +1,15 @@
+#include "sqlite3.h"
+#include "bitmap.h"
+
+struct tagger_db;
+struct tag_bitmap_index;
+
+struct tag_facet {
+	sqlite3_int64 tag_id;
+	sqlite3_int64 count; // number of items in the set having the tag
+};
+
+struct tag_bitmap_index* tag_bitmap_index_build(struct tagger_db *db);
+int tag_bitmap_index_query(struct tag_bitmap_index *index, const sqlite3_int64 *tag_ids, int tag_ids_count, struct bitmap **items);
+int tag_facets_top_k(struct tag_bitmap_index *index, const struct bitmap *items, struct tag_facet *facets, int max_facets);
+void tag_bitmap_index_free(struct tag_bitmap_index *index);
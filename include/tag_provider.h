@@ -0,0 +1,77 @@
+#include <stddef.h>
+#include "sqlite3.h"
+
+struct tagger_db;
+struct item_row;
+struct response;
+struct rate_limiter;
+struct retry_policy;
+struct circuit_breaker;
+struct provider_stream;
+
+// longest url a provider builds for an item
+#define PROVIDER_URL_SIZE 2048
+
+typedef enum {PROVIDER_MERGE_ALL = 0, PROVIDER_MERGE_FIRST = 1} PROVIDER_MERGE;
+
+typedef int (*provider_tag_callback)(const char *tag, size_t length, void *user_data);
+
+/**
+ * Source of tags for items, `NULL` callbacks use the defaults: the url is built
+ * from `url_template` and the response is parsed as JSON with `tag_keys` while it downloads
+ */
+struct tag_provider {
+	const char *name;
+	const char *url_template; // `{name}` and `{path}` are replaced by the escaped item name and relpath
+	const char *const *tag_keys; // `NULL` terminated JSON keys whose strings are tags
+	// `0` on success, `1` to skip the item, `-1` on error
+	int (*build_url)(const struct tag_provider *provider, const struct item_row *item, char *url, size_t size);
+	// calls `callback` for every tag of the response, `0` on success, otherwise `-1`
+	int (*parse_response)(const struct tag_provider *provider, const struct response *response,
+						  provider_tag_callback callback, void *user_data);
+	void *data;
+};
+
+// tags one provider found for one item
+struct provider_tags {
+	char **tags;
+	size_t count;
+	size_t capacity;
+};
+
+struct provider_stats;
+
+// request of one provider about one item, run by a fetch engine
+struct provider_request {
+	const struct tag_provider *provider;
+	struct provider_tags *found;
+	struct provider_stats *stats;
+	struct provider_stream *stream; // parses a JSON response while it downloads, `NULL` when it is buffered
+};
+
+struct provider_options {
+	PROVIDER_MERGE merge; // tags of every provider, or only of the first one that found any
+	int auto_add_tags; // add tags that don't exist yet instead of skipping them
+	int max_in_flight; // concurrent requests, `0` for the default
+	size_t items_per_batch; // items fetched per transaction of a listing, `0` for the default
+	struct rate_limiter *limiter; // requests per host, `NULL` for no limit
+	const struct retry_policy *retry_policy; // retries of transient failures, `NULL` for a single attempt
+	struct circuit_breaker *breaker; // fails fast on failing hosts, `NULL` for none
+};
+
+struct provider_stats {
+	size_t items;
+	size_t requests;
+	size_t failed_requests; // requests without a usable response, or whose response didn't parse
+	size_t tags_found; // tags of all responses, before merging
+	size_t unknown_tags; // merged tags skipped because they don't exist and tags are not auto-added
+	size_t items_tagged; // items with tags left after merging
+	sqlite3_int64 item_tags_added;
+};
+
+int build_provider_url(const char *url_template, const struct item_row *item, char *url, size_t size);
+int run_tag_providers(struct tagger_db *db, const struct tag_provider *providers, size_t providers_count,
+					  const struct item_row *items, size_t items_count, const struct provider_options *options,
+					  struct provider_stats *stats);
+int run_tag_providers_on_listing(struct tagger_db *db, sqlite3_int64 listing_id, const struct tag_provider *providers,
+								 size_t providers_count, const struct provider_options *options, struct provider_stats *stats);
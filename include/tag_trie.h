@@ -0,0 +1,16 @@
+#include "sqlite3.h"
+#include <stddef.h>
+
+struct tagger_db;
+struct tag_trie;
+
+struct tag_completion {
+	sqlite3_int64 tag_id;
+	sqlite3_int64 usage_count;
+	const char *tag_name; // owned by the trie, valid until the trie changes
+};
+
+struct tag_trie* tag_trie_build(struct tagger_db *db);
+int tag_trie_complete(struct tag_trie *trie, const char *prefix, struct tag_completion *completions, int max_completions);
+size_t tag_trie_size(struct tag_trie *trie);
+void tag_trie_free(struct tag_trie *trie);
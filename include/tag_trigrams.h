@@ -0,0 +1,21 @@
+#include "sqlite3.h"
+#include <stddef.h>
+
+struct tagger_db;
+struct tag_trigrams;
+
+struct tag_suggestion {
+	sqlite3_int64 tag_id;
+	int distance; // edit distance from the query, ignoring ASCII case
+	const char *tag_name; // owned by the index, valid until the index changes
+};
+
+// called with the closest existing tags when `update_tags` is given an unknown tag name
+typedef void (*tag_suggestions_callback)(void *ctx, const char *tag_name, const struct tag_suggestion *suggestions, int count);
+
+struct tag_trigrams* tag_trigrams_build(struct tagger_db *db);
+int tag_trigrams_suggest(struct tag_trigrams *index, const char *query, int max_distance,
+						 struct tag_suggestion *suggestions, int max_suggestions);
+void tag_trigrams_on_unknown_tag(struct tag_trigrams *index, tag_suggestions_callback callback, void *ctx);
+size_t tag_trigrams_size(struct tag_trigrams *index);
+void tag_trigrams_free(struct tag_trigrams *index);
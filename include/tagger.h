@@ -1,2 +1,7 @@
 #include <stdio.h>
-#include "database.h"
\ No newline at end of file
+#include <string.h>
+#include <unistd.h>
+#include "database.h"
+#include "bulk_import.h"
+#include "export.h"
+#include "maintenance.h"
\ No newline at end of file
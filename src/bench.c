@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../include/database.h"
+#include "../include/db_pool.h"
+
+#define BENCH_DATABASE_LOCATION "bench.tdb"
+#define BENCH_SEED_DATABASE_LOCATION "bench_seed.tdb"
+#define BENCH_ITEMS 20000
+#define BENCH_TAGS 200
+#define BENCH_TAGS_PER_ITEM 3
+#define BENCH_UPDATES 2000
+#define BENCH_LOOKUPS 20000
+#define BENCH_POOL_MAX_THREADS 8
+
+/**
+ * @brief Get a monotonic timestamp in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Remove a database file together with its WAL and shared memory files
+ */
+static void remove_database(const char *location) {
+	char path[256];
+
+	unlink(location);
+	snprintf(path, sizeof(path), "%s-wal", location);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s-shm", location);
+	unlink(path);
+}
+
+/**
+ * @brief Fill a database with a listing, items and tags in a single statement each
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int seed_database(struct tagger_db *db) {
+	char sql[512];
+	char *errmsg;
+
+	if (init_tables(db)) return -1;
+
+	snprintf(sql, sizeof(sql), "BEGIN;"
+		"INSERT INTO listings (listing_name, listing_type, listing_path) VALUES ('bench', 1, '/bench');"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<%d) "
+		"INSERT INTO items (item_name, item_relpath, listing_id) SELECT 'item'||i, '/item'||i, 1 FROM n;"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<%d) "
+		"INSERT INTO tags (tag_name) SELECT 'tag'||i FROM n;"
+		"COMMIT;", BENCH_ITEMS, BENCH_TAGS);
+
+	if (sqlite3_exec(db->connection, sql, NULL, 0, &errmsg) != SQLITE_OK) {
+		fprintf(stderr, "Could not seed the benchmark database: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Tag items one `update_tags` call (one transaction) at a time
+ *
+ * @return seconds taken, or `-1` on error
+ */
+static double bench_updates(struct tagger_db *db, int updates) {
+	char names[BENCH_TAGS_PER_ITEM][16];
+	char *tags[BENCH_TAGS_PER_ITEM + 1];
+	double start = now();
+
+	for (int i = 0; i < updates; i++) {
+		for (int j = 0; j < BENCH_TAGS_PER_ITEM; j++) {
+			snprintf(names[j], sizeof(names[j]), "tag%d", (i * 7 + j * 13) % BENCH_TAGS + 1);
+			tags[j] = names[j];
+		}
+		tags[BENCH_TAGS_PER_ITEM] = NULL;
+
+		if (update_tags(db, i % BENCH_ITEMS + 1, tags, DONT_AUTO_ADD_TAGS) == -1) return -1;
+	}
+
+	return now() - start;
+}
+
+/**
+ * @brief Tag the same items as `bench_updates` with `update_tags_batch`
+ *
+ * @return seconds taken, or `-1` on error
+ */
+static double bench_batch_updates(struct tagger_db *db, int updates, size_t chunk_size) {
+	char (*names)[BENCH_TAGS_PER_ITEM][16] = malloc(updates * sizeof(*names));
+	char *(*tags)[BENCH_TAGS_PER_ITEM + 1] = malloc(updates * sizeof(*tags));
+	struct item_tags *batch = malloc(updates * sizeof(struct item_tags));
+	double start;
+	sqlite3_int64 added = -1;
+
+	if (names != NULL && tags != NULL && batch != NULL) {
+		for (int i = 0; i < updates; i++) {
+			for (int j = 0; j < BENCH_TAGS_PER_ITEM; j++) {
+				snprintf(names[i][j], sizeof(names[i][j]), "tag%d", (i * 7 + j * 13) % BENCH_TAGS + 1);
+				tags[i][j] = names[i][j];
+			}
+			tags[i][BENCH_TAGS_PER_ITEM] = NULL;
+			batch[i].item_id = i % BENCH_ITEMS + 1;
+			batch[i].tags = tags[i];
+		}
+
+		start = now();
+		added = update_tags_batch(db, batch, updates, DONT_AUTO_ADD_TAGS, chunk_size, NULL);
+	}
+
+	free(names);
+	free(tags);
+	free(batch);
+	return added == -1 ? -1 : now() - start;
+}
+
+/**
+ * @brief Read the tags of random items, then scan all items of the listing
+ *
+ * @return seconds taken, or `-1` on error
+ */
+static double bench_reads(struct tagger_db *db, int lookups) {
+	struct tagger_cursor *cursor;
+	struct item_row item;
+	sqlite3_int64 *tag_ids;
+	int tag_ids_count, rc;
+	double start = now();
+
+	srand(1);
+	for (int i = 0; i < lookups; i++) {
+		// items without tags fail the lookup, that is expected here
+		if (get_item_tag_ids(db, rand() % BENCH_UPDATES + 1, &tag_ids_count, &tag_ids) == 0) {
+			free(tag_ids);
+		}
+	}
+
+	cursor = open_listing_items_cursor(db, 1, 0, 0);
+	if (cursor == NULL) return -1;
+	while ((rc = cursor_next_item(cursor, &item)) == 1);
+	close_cursor(cursor);
+	if (rc != 0) return -1;
+
+	return now() - start;
+}
+
+static int pool_lookup(struct tagger_db *db, void *arg) {
+	sqlite3_int64 *tag_ids;
+	int tag_ids_count;
+
+	if (get_item_tag_ids(db, *(sqlite3_int64*) arg, &tag_ids_count, &tag_ids) == 0) {
+		free(tag_ids);
+	}
+	return 0;
+}
+
+static void* pool_lookups_run(void *arg) {
+	struct db_pool *pool = arg;
+	sqlite3_int64 item_id;
+
+	for (int i = 0; i < BENCH_LOOKUPS / BENCH_POOL_MAX_THREADS; i++) {
+		item_id = i % BENCH_UPDATES + 1;
+		db_pool_read(pool, pool_lookup, &item_id);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Run the same number of lookups per thread from more and more threads on a pool
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int bench_pool(void) {
+	pthread_t threads[BENCH_POOL_MAX_THREADS];
+	struct db_pool *pool;
+	double start, elapsed;
+
+	printf("\n%-12s %18s\n", "pool threads", "lookups/s");
+	for (int count = 1; count <= BENCH_POOL_MAX_THREADS; count *= 2) {
+		pool = db_pool_open(BENCH_SEED_DATABASE_LOCATION, count);
+		if (pool == NULL) return -1;
+
+		start = now();
+		for (int i = 0; i < count; i++) pthread_create(&threads[i], NULL, pool_lookups_run, pool);
+		for (int i = 0; i < count; i++) pthread_join(threads[i], NULL);
+		elapsed = now() - start;
+
+		db_pool_close(pool);
+		printf("%-12d %18.0f\n", count, count * (BENCH_LOOKUPS / BENCH_POOL_MAX_THREADS) / elapsed);
+	}
+	return 0;
+}
+
+int main(void) {
+	struct tagger_db *db;
+	double updates_time, reads_time;
+
+	// every profile reads the same database, written once with the bulk-load profile
+	remove_database(BENCH_SEED_DATABASE_LOCATION);
+	db = open_database(BENCH_SEED_DATABASE_LOCATION, PROFILE_BULK_LOAD);
+	if (db == NULL || seed_database(db) || bench_updates(db, BENCH_UPDATES) < 0) {
+		fputs("Could not create the benchmark database\n", stderr);
+		close_database(db);
+		return -1;
+	}
+	close_database(db);
+
+	printf("%-12s %18s %18s\n", "profile", "update_tags/s", "lookups/s");
+	for (int profile = PROFILE_INTERACTIVE; profile <= PROFILE_SERVER; profile++) {
+		updates_time = -1;
+
+		// a read-only connection cannot write, so the profile is only measured on reads
+		if (profile != PROFILE_READ_ONLY) {
+			remove_database(BENCH_DATABASE_LOCATION);
+			db = open_database(BENCH_DATABASE_LOCATION, profile);
+			if (db == NULL || seed_database(db) || (updates_time = bench_updates(db, BENCH_UPDATES)) < 0) {
+				fprintf(stderr, "Could not run the update benchmark with the %s profile\n", database_profile_name(profile));
+				close_database(db);
+				return -1;
+			}
+			close_database(db);
+		}
+
+		db = open_database(BENCH_SEED_DATABASE_LOCATION, profile);
+		if (db == NULL || (reads_time = bench_reads(db, BENCH_LOOKUPS)) < 0) {
+			fprintf(stderr, "Could not run the read benchmark with the %s profile\n", database_profile_name(profile));
+			close_database(db);
+			return -1;
+		}
+		close_database(db);
+
+		if (updates_time < 0) {
+			printf("%-12s %18s %18.0f\n", database_profile_name(profile), "-", BENCH_LOOKUPS / reads_time);
+		} else {
+			printf("%-12s %18.0f %18.0f\n", database_profile_name(profile), BENCH_UPDATES / updates_time, BENCH_LOOKUPS / reads_time);
+		}
+	}
+
+	// the same updates as above, but many per transaction
+	printf("\n%-12s %18s\n", "batch chunk", "updates/s");
+	for (size_t chunk_size = 1; chunk_size <= BENCH_UPDATES; chunk_size *= 10) {
+		remove_database(BENCH_DATABASE_LOCATION);
+		db = open_database(BENCH_DATABASE_LOCATION, PROFILE_INTERACTIVE);
+		if (db == NULL || seed_database(db) || (updates_time = bench_batch_updates(db, BENCH_UPDATES, chunk_size)) < 0) {
+			fputs("Could not run the batch update benchmark\n", stderr);
+			close_database(db);
+			return -1;
+		}
+		close_database(db);
+		printf("%-12zu %18.0f\n", chunk_size, BENCH_UPDATES / updates_time);
+	}
+
+	if (bench_pool()) {
+		fputs("Could not run the database pool benchmark\n", stderr);
+		return -1;
+	}
+
+	remove_database(BENCH_DATABASE_LOCATION);
+	remove_database(BENCH_SEED_DATABASE_LOCATION);
+	return 0;
+}
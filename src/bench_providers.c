@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../include/database.h"
+#include "../include/provider_utils.h"
+#include "../include/fetch_engine.h"
+#include "../include/rate_limiter.h"
+#include "../include/mock_provider.h"
+#include "../include/tag_provider.h"
+#include "../include/pipeline.h"
+
+#define BENCH_REQUESTS 2000
+#define BENCH_LATENCY_MS 5
+#define BENCH_LATENCY_JITTER_MS 5
+#define BENCH_MAX_CONCURRENCY 64
+#define BENCH_SCENARIO_CONCURRENCY 16
+#define BENCH_LISTING_FILES 2000
+#define BENCH_LISTING_DATABASE "bench_pipeline.tdb"
+
+struct bench_run;
+
+struct bench_request {
+	struct bench_run *run;
+	double submitted;
+};
+
+/**
+ * Closed loop of requests, every finished request submits the next one
+ * so `concurrency` requests are in flight all the time
+ */
+struct bench_run {
+	struct fetch_engine *engine;
+	int port;
+	struct bench_request *requests;
+	double *latencies; // milliseconds per finished request
+	int submitted;
+	size_t finished;
+	size_t failed; // requests without a `200` response
+	int error;
+};
+
+struct bench_result {
+	double requests_per_second;
+	double p50_ms;
+	double p99_ms;
+	size_t failed;
+	long peak_rss_kib;
+};
+
+/**
+ * @brief Get a monotonic timestamp in seconds
+ */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Get the largest resident set size of the process so far, in KiB
+ *
+ * Every benchmark step runs in its own process, so this is the peak of the step.
+ */
+static long peak_rss_kib(void) {
+	struct rusage usage;
+	return getrusage(RUSAGE_SELF, &usage) ? -1 : usage.ru_maxrss;
+}
+
+/**
+ * @brief Run a benchmark step in a child process and wait for it
+ *
+ * The high-water mark of the resident set size never goes down, in one process a
+ * step would report the peak of the largest step before it.
+ *
+ * @param step benchmark step, it prints its own results
+ * @param arg handed to the step
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int run_in_child(int (*step)(void *arg), void *arg) {
+	int status;
+
+	// buffered output would be written by both processes
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		int rc = step(arg);
+		fflush(stdout);
+		_exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, &status, 0) != pid) {
+		perror("waitpid");
+		return -1;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ? 0 : -1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get a percentile of sorted values, by the nearest rank
+ */
+static double percentile(const double *sorted, size_t count, double fraction) {
+	if (count == 0) return 0;
+	return sorted[(size_t) (fraction * (count - 1) + 0.5)];
+}
+
+static void bench_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data);
+
+static int submit_next_request(struct bench_run *run) {
+	struct bench_request *request = run->requests + run->submitted;
+	char url[64];
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/item%d", run->port, run->submitted++);
+	request->run = run;
+	request->submitted = now();
+	return fetch_engine_submit(run->engine, url, bench_callback, request);
+}
+
+static void bench_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	struct bench_request *request = user_data;
+	struct bench_run *run = request->run;
+	(void) url;
+	(void) response;
+
+	// a slot is free again as soon as the request finished, so there is no queueing in the latency
+	run->latencies[run->finished++] = (now() - request->submitted) * 1000;
+	if (result != CURLE_OK || status != 200) run->failed++;
+	if (run->submitted < BENCH_REQUESTS && submit_next_request(run)) run->error = 1;
+}
+
+/**
+ * @brief Fetch from a mock provider through the fetch engine and measure it
+ *
+ * Latencies include retries and waits for the rate limiter, as seen by the caller.
+ *
+ * @param port port of the mock provider
+ * @param concurrency transfers in flight at once
+ * @param policy retry policy of the engine, `NULL` for no retries
+ * @param limiter rate limiter of the engine, may be `NULL`
+ * @param result where to store the measurements
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int bench_fetch(int port, int concurrency, const struct retry_policy *policy, struct rate_limiter *limiter,
+					   struct bench_result *result) {
+	struct bench_run run = {fetch_engine_create(concurrency), port, calloc(BENCH_REQUESTS, sizeof(struct bench_request)),
+		calloc(BENCH_REQUESTS, sizeof(double)), 0, 0, 0, 0};
+	double start;
+	int rc = -1;
+
+	if (run.engine == NULL || run.requests == NULL || run.latencies == NULL) goto cleanup;
+	if (policy != NULL) fetch_engine_set_retry_policy(run.engine, policy, NULL);
+	fetch_engine_set_rate_limiter(run.engine, limiter);
+
+	start = now();
+	while (run.submitted < concurrency && run.submitted < BENCH_REQUESTS) {
+		if (submit_next_request(&run)) goto cleanup;
+	}
+	if (fetch_engine_run(run.engine) || run.error) goto cleanup;
+
+	result->requests_per_second = run.finished / (now() - start);
+	result->failed = run.failed;
+	result->peak_rss_kib = peak_rss_kib();
+	qsort(run.latencies, run.finished, sizeof(double), compare_doubles);
+	result->p50_ms = percentile(run.latencies, run.finished, 0.5);
+	result->p99_ms = percentile(run.latencies, run.finished, 0.99);
+	rc = 0;
+
+cleanup:
+	fetch_engine_destroy(run.engine);
+	free(run.requests);
+	free(run.latencies);
+	return rc;
+}
+
+static void print_result(const char *label, const struct bench_result *result) {
+	printf("%-24s %12.0f %10.2f %10.2f %8zu %14ld\n", label, result->requests_per_second, result->p50_ms,
+		result->p99_ms, result->failed, result->peak_rss_kib);
+}
+
+// one row of the fetch benchmark
+struct bench_fetch_step {
+	const char *label;
+	int port;
+	int concurrency;
+	const struct retry_policy *policy;
+	struct rate_limiter *limiter;
+};
+
+static int bench_fetch_step(void *arg) {
+	const struct bench_fetch_step *step = arg;
+	struct bench_result result;
+
+	if (bench_fetch(step->port, step->concurrency, step->policy, step->limiter, &result)) return -1;
+	print_result(step->label, &result);
+	return 0;
+}
+
+/**
+ * @brief Measure the fetch path against a mock provider with the given behaviour
+ *
+ * The mock provider runs in this process, the requests in a child process.
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int bench_scenario(const char *label, const struct mock_provider_options *options, int concurrency,
+						  const struct retry_policy *policy, struct rate_limiter *limiter) {
+	struct mock_provider *server = mock_provider_start(options);
+
+	if (server == NULL) return -1;
+	struct bench_fetch_step step = {label, mock_provider_port(server), concurrency, policy, limiter};
+	int rc = run_in_child(bench_fetch_step, &step);
+	mock_provider_stop(server);
+	return rc;
+}
+
+static void remove_bench_database(void) {
+	remove(BENCH_LISTING_DATABASE);
+	remove(BENCH_LISTING_DATABASE "-wal");
+	remove(BENCH_LISTING_DATABASE "-shm");
+}
+
+// one row of the scan and enrich benchmark
+struct bench_listing_step {
+	char *directory; // listing directory
+	const char *url_template; // url template of the mock provider
+	int pipelined; // whether to use `scan_and_enrich_listing`
+};
+
+/**
+ * @brief Scan a listing and tag its items from a mock provider, one step after the other or pipelined
+ *
+ * @param arg a `struct bench_listing_step`
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int bench_listing(void *arg) {
+	const struct bench_listing_step *step = arg;
+	char *directory = step->directory;
+	const char *url_template = step->url_template;
+	int pipelined = step->pipelined;
+	static const char *const tag_keys[] = {"tags", NULL};
+	struct tag_provider provider = {"mock", url_template, tag_keys, NULL, NULL, NULL};
+	struct provider_options options = {PROVIDER_MERGE_ALL, 1, BENCH_SCENARIO_CONCURRENCY, 0, NULL, NULL, NULL};
+	// one lookup worker, so both runs have the same transfers in flight
+	struct pipeline_options pipeline_options = {0, 1, 0};
+	struct pipeline_stats stats = {0};
+	struct provider_stats provider_stats;
+	struct tagger_db *db;
+	double start, scanned;
+	int rc = -1;
+
+	remove_bench_database();
+	if ((db = open_database(BENCH_LISTING_DATABASE, PROFILE_INTERACTIVE)) == NULL) return -1;
+	if (init_tables(db) || add_new_listing(db, "bench", FILE_AS_ITEM, directory) != 1) goto cleanup;
+
+	start = now();
+	if (pipelined) {
+		if (scan_and_enrich_listing(db, 1, &provider, 1, &options, &pipeline_options, &provider_stats, &stats)) goto cleanup;
+		scanned = start + stats.scan_seconds;
+	} else {
+		if (refresh_listing(db, 1)) goto cleanup;
+		scanned = now();
+		if (run_tag_providers_on_listing(db, 1, &provider, 1, &options, &provider_stats)) goto cleanup;
+	}
+
+	double seconds = now() - start;
+	printf("%-24s %10.3f %10.3f %12.0f %10lld %14ld\n", pipelined ? "pipelined" : "sequential", scanned - start, seconds,
+		provider_stats.items / seconds, provider_stats.item_tags_added, peak_rss_kib());
+	rc = 0;
+
+cleanup:
+	close_database(db);
+	remove_bench_database();
+	return rc;
+}
+
+/**
+ * @brief Compare a sequential scan and enrich run of a listing with a pipelined one
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int bench_scan_and_enrich(const struct mock_provider_options *options) {
+	char pattern[] = "/tmp/tmp.XXXXXX", url_template[64], path[64];
+	char *directory = mkdtemp(pattern);
+	struct mock_provider *server = NULL;
+	int rc = -1;
+
+	if (directory == NULL) return -1;
+	for (int i = 0; i < BENCH_LISTING_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/item%d.txt", directory, i);
+		FILE *file = fopen(path, "w");
+		if (file == NULL || fclose(file)) goto cleanup;
+	}
+	if ((server = mock_provider_start(options)) == NULL) goto cleanup;
+	snprintf(url_template, sizeof(url_template), "http://127.0.0.1:%d/{name}", mock_provider_port(server));
+
+	printf("\n%d files, %d transfers in flight\n", BENCH_LISTING_FILES, BENCH_SCENARIO_CONCURRENCY);
+	printf("%-24s %10s %10s %12s %10s %14s\n", "scan and enrich", "scan s", "total s", "items/s", "tags", "peak RSS KiB");
+	struct bench_listing_step steps[] = {{directory, url_template, 0}, {directory, url_template, 1}};
+	rc = run_in_child(bench_listing, steps) || run_in_child(bench_listing, steps + 1) ? -1 : 0;
+
+cleanup:
+	mock_provider_stop(server);
+	for (int i = 0; i < BENCH_LISTING_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/item%d.txt", directory, i);
+		remove(path);
+	}
+	rmdir(directory);
+	return rc;
+}
+
+int main(void) {
+	struct mock_provider_options options = {NULL, BENCH_LATENCY_MS, BENCH_LATENCY_JITTER_MS, 0, 0, 1};
+	struct retry_policy retries = {3, 10, 100};
+	struct rate_limiter *limiter;
+	char label[32];
+
+	printf("%d requests, %d-%d ms of server latency\n\n", BENCH_REQUESTS, BENCH_LATENCY_MS, BENCH_LATENCY_MS + BENCH_LATENCY_JITTER_MS);
+	printf("%-24s %12s %10s %10s %8s %14s\n", "concurrency", "requests/s", "p50 ms", "p99 ms", "failed", "peak RSS KiB");
+	for (int concurrency = 1; concurrency <= BENCH_MAX_CONCURRENCY; concurrency *= 4) {
+		snprintf(label, sizeof(label), "%d", concurrency);
+		if (bench_scenario(label, &options, concurrency, NULL, NULL)) {
+			fprintf(stderr, "Could not run the provider benchmark with %d transfers in flight\n", concurrency);
+			return -1;
+		}
+	}
+
+	// failing and throttling providers, at the same concurrency
+	printf("\n%-24s %12s %10s %10s %8s %14s\n", "scenario", "requests/s", "p50 ms", "p99 ms", "failed", "peak RSS KiB");
+	options.error_rate = 0.05;
+	if (bench_scenario("5% errors", &options, BENCH_SCENARIO_CONCURRENCY, NULL, NULL) ||
+		bench_scenario("5% errors, retried", &options, BENCH_SCENARIO_CONCURRENCY, &retries, NULL)) {
+		fputs("Could not run the provider benchmark with errors\n", stderr);
+		return -1;
+	}
+
+	options.error_rate = 0;
+	options.requests_per_second = 500;
+	if (bench_scenario("throttled at 500/s", &options, BENCH_SCENARIO_CONCURRENCY, NULL, NULL)) {
+		fputs("Could not run the throttled provider benchmark\n", stderr);
+		return -1;
+	}
+	// a limiter slightly below the provider's rate avoids the 429 responses
+	if ((limiter = rate_limiter_create(450, 10)) == NULL) return -1;
+	int rc = bench_scenario("throttled, rate limited", &options, BENCH_SCENARIO_CONCURRENCY, NULL, limiter);
+	rate_limiter_destroy(limiter);
+	if (rc) {
+		fputs("Could not run the rate limited provider benchmark\n", stderr);
+		return -1;
+	}
+
+	options.requests_per_second = 0;
+	if (bench_scan_and_enrich(&options)) {
+		fputs("Could not run the scan and enrich benchmark\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/bitmap.h"
+
+#define BITMAP_ARRAY_MAX 4096 // above this many ids a bitset is smaller than an array
+#define BITMAP_ARRAY_SHRINK 2048 // a bitset only goes back to an array well below the limit
+#define BITMAP_WORDS 1024 // 65536 bits
+
+/**
+ * @brief Allocate an empty bitmap
+ *
+ * @return a pointer to the new bitmap, or `NULL` on error
+ */
+struct bitmap* bitmap_new(void) {
+	return calloc(1, sizeof(struct bitmap));
+}
+
+static void container_free(struct bitmap_container *c) {
+	free(c->array);
+	free(c->bits);
+}
+
+/**
+ * @brief Free a bitmap
+ *
+ * @param bitmap bitmap to free, may be `NULL`
+ */
+void bitmap_free(struct bitmap *bitmap) {
+	if (bitmap == NULL) return;
+
+	for (size_t i = 0; i < bitmap->count; i++) {
+		container_free(&bitmap->containers[i]);
+	}
+	free(bitmap->containers);
+	free(bitmap);
+}
+
+/**
+ * @brief Binary search for a container by key
+ *
+ * @return index of the container, or `-(insert_position + 1)` if there is no such container
+ */
+static long find_container(const struct bitmap *bitmap, uint16_t key) {
+	// ids are mostly added in increasing order, so check the last container first
+	if (bitmap->count > 0 && bitmap->containers[bitmap->count - 1].key == key) return (long) bitmap->count - 1;
+
+	size_t low = 0, high = bitmap->count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (bitmap->containers[mid].key == key) return (long) mid;
+		if (bitmap->containers[mid].key < key) low = mid + 1;
+		else high = mid;
+	}
+	return -((long) low + 1);
+}
+
+/**
+ * @brief Binary search in an array container
+ *
+ * @return index of the value, or `-(insert_position + 1)` if the value is not there
+ */
+static long find_in_array(const uint16_t *array, uint32_t cardinality, uint16_t value) {
+	if (cardinality > 0 && array[cardinality - 1] < value) return -((long) cardinality + 1);
+
+	size_t low = 0, high = cardinality;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (array[mid] == value) return (long) mid;
+		if (array[mid] < value) low = mid + 1;
+		else high = mid;
+	}
+	return -((long) low + 1);
+}
+
+static int container_to_bitset(struct bitmap_container *c) {
+	uint64_t *bits = calloc(BITMAP_WORDS, sizeof(uint64_t));
+	if (bits == NULL) return -1;
+
+	for (uint32_t i = 0; i < c->cardinality; i++) {
+		bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+	}
+	free(c->array);
+	c->array = NULL;
+	c->bits = bits;
+	c->capacity = 0;
+	return 0;
+}
+
+static int container_to_array(struct bitmap_container *c) {
+	uint16_t *array = malloc((c->cardinality ? c->cardinality : 1) * sizeof(uint16_t));
+	if (array == NULL) return -1;
+
+	uint32_t n = 0;
+	for (uint32_t word = 0; word < BITMAP_WORDS; word++) {
+		uint64_t w = c->bits[word];
+		while (w) {
+			array[n++] = (uint16_t) (word * 64 + __builtin_ctzll(w));
+			w &= w - 1;
+		}
+	}
+	free(c->bits);
+	c->bits = NULL;
+	c->array = array;
+	c->capacity = c->cardinality ? c->cardinality : 1;
+	return 0;
+}
+
+/**
+ * @brief Add an id to the bitmap
+ *
+ * @return `1` if the id was added, `0` if it was already there, `-1` on error
+ */
+int bitmap_add(struct bitmap *bitmap, uint32_t value) {
+	uint16_t key = (uint16_t) (value >> 16), low = (uint16_t) value;
+	long position = find_container(bitmap, key);
+	struct bitmap_container *c;
+
+	if (position < 0) {
+		if (bitmap->count == bitmap->capacity) {
+			size_t new_capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+			struct bitmap_container *new_containers = realloc(bitmap->containers, new_capacity * sizeof(struct bitmap_container));
+			if (new_containers == NULL) return -1;
+			bitmap->containers = new_containers;
+			bitmap->capacity = new_capacity;
+		}
+		position = -position - 1;
+		memmove(bitmap->containers + position + 1, bitmap->containers + position, (bitmap->count - position) * sizeof(struct bitmap_container));
+		bitmap->count++;
+		c = &bitmap->containers[position];
+		memset(c, 0, sizeof(struct bitmap_container));
+		c->key = key;
+		c->array = malloc(4 * sizeof(uint16_t));
+		if (c->array == NULL) {
+			memmove(bitmap->containers + position, bitmap->containers + position + 1, (bitmap->count - position - 1) * sizeof(struct bitmap_container));
+			bitmap->count--;
+			return -1;
+		}
+		c->capacity = 4;
+	}
+	c = &bitmap->containers[position];
+
+	if (c->array != NULL) {
+		long i = find_in_array(c->array, c->cardinality, low);
+		if (i >= 0) return 0;
+
+		if (c->cardinality == BITMAP_ARRAY_MAX) {
+			if (container_to_bitset(c)) return -1;
+		} else {
+			if (c->cardinality == c->capacity) {
+				uint32_t new_capacity = c->capacity * 2 > BITMAP_ARRAY_MAX ? BITMAP_ARRAY_MAX : c->capacity * 2;
+				uint16_t *new_array = realloc(c->array, new_capacity * sizeof(uint16_t));
+				if (new_array == NULL) return -1;
+				c->array = new_array;
+				c->capacity = new_capacity;
+			}
+			i = -i - 1;
+			memmove(c->array + i + 1, c->array + i, (c->cardinality - i) * sizeof(uint16_t));
+			c->array[i] = low;
+			c->cardinality++;
+			return 1;
+		}
+	}
+
+	uint64_t mask = 1ULL << (low & 63);
+	if (c->bits[low >> 6] & mask) return 0;
+	c->bits[low >> 6] |= mask;
+	c->cardinality++;
+	return 1;
+}
+
+/**
+ * @brief Remove an id from the bitmap
+ *
+ * @return `1` if the id was removed, `0` if it was not there
+ */
+int bitmap_remove(struct bitmap *bitmap, uint32_t value) {
+	uint16_t low = (uint16_t) value;
+	long position = find_container(bitmap, (uint16_t) (value >> 16));
+	if (position < 0) return 0;
+
+	struct bitmap_container *c = &bitmap->containers[position];
+	if (c->array != NULL) {
+		long i = find_in_array(c->array, c->cardinality, low);
+		if (i < 0) return 0;
+		memmove(c->array + i, c->array + i + 1, (c->cardinality - i - 1) * sizeof(uint16_t));
+		c->cardinality--;
+	} else {
+		uint64_t mask = 1ULL << (low & 63);
+		if (!(c->bits[low >> 6] & mask)) return 0;
+		c->bits[low >> 6] &= ~mask;
+		c->cardinality--;
+		if (c->cardinality <= BITMAP_ARRAY_SHRINK) {
+			container_to_array(c); // on failure the container simply stays a bitset
+		}
+	}
+
+	if (c->cardinality == 0) {
+		container_free(c);
+		memmove(bitmap->containers + position, bitmap->containers + position + 1, (bitmap->count - position - 1) * sizeof(struct bitmap_container));
+		bitmap->count--;
+	}
+	return 1;
+}
+
+/**
+ * @brief Check if an id is in the bitmap
+ *
+ * @return `1` if the id is there, otherwise `0`
+ */
+int bitmap_contains(const struct bitmap *bitmap, uint32_t value) {
+	uint16_t low = (uint16_t) value;
+	long position = find_container(bitmap, (uint16_t) (value >> 16));
+	if (position < 0) return 0;
+
+	const struct bitmap_container *c = &bitmap->containers[position];
+	if (c->array != NULL) return find_in_array(c->array, c->cardinality, low) >= 0;
+	return (c->bits[low >> 6] >> (low & 63)) & 1;
+}
+
+/**
+ * @brief Get the number of ids in the bitmap
+ */
+uint64_t bitmap_cardinality(const struct bitmap *bitmap) {
+	uint64_t cardinality = 0;
+	for (size_t i = 0; i < bitmap->count; i++) {
+		cardinality += bitmap->containers[i].cardinality;
+	}
+	return cardinality;
+}
+
+/**
+ * @brief Intersect two containers with the same key
+ *
+ * @param a first container
+ * @param b second container
+ * @param out where to store the intersection, or `NULL` to only count it
+ * @return cardinality of the intersection, or `-1` on error
+ */
+static long container_and(const struct bitmap_container *a, const struct bitmap_container *b, struct bitmap_container *out) {
+	long cardinality = 0;
+
+	if (a->array == NULL && b->array == NULL) {
+		for (uint32_t i = 0; i < BITMAP_WORDS; i++) {
+			cardinality += __builtin_popcountll(a->bits[i] & b->bits[i]);
+		}
+		if (out == NULL) return cardinality;
+
+		out->key = a->key;
+		out->cardinality = (uint32_t) cardinality;
+		out->array = NULL;
+		out->capacity = 0;
+		out->bits = malloc(BITMAP_WORDS * sizeof(uint64_t));
+		if (out->bits == NULL) return -1;
+		for (uint32_t i = 0; i < BITMAP_WORDS; i++) {
+			out->bits[i] = a->bits[i] & b->bits[i];
+		}
+		if (cardinality <= BITMAP_ARRAY_MAX && container_to_array(out)) {
+			free(out->bits);
+			return -1;
+		}
+		return cardinality;
+	}
+
+	// at least one side is an array, the result is never larger than it
+	if (a->array == NULL || (b->array != NULL && b->cardinality < a->cardinality)) {
+		const struct bitmap_container *swap = a;
+		a = b;
+		b = swap;
+	}
+
+	if (out != NULL) {
+		out->key = a->key;
+		out->bits = NULL;
+		out->capacity = a->cardinality ? a->cardinality : 1;
+		out->array = malloc(out->capacity * sizeof(uint16_t));
+		if (out->array == NULL) return -1;
+	}
+
+	if (b->array == NULL) {
+		for (uint32_t i = 0; i < a->cardinality; i++) {
+			if ((b->bits[a->array[i] >> 6] >> (a->array[i] & 63)) & 1) {
+				if (out != NULL) out->array[cardinality] = a->array[i];
+				cardinality++;
+			}
+		}
+	} else if ((uint64_t) a->cardinality * 32 < b->cardinality) {
+		// very different sizes, binary search the small side in the large one
+		for (uint32_t i = 0; i < a->cardinality; i++) {
+			if (find_in_array(b->array, b->cardinality, a->array[i]) >= 0) {
+				if (out != NULL) out->array[cardinality] = a->array[i];
+				cardinality++;
+			}
+		}
+	} else {
+		uint32_t i = 0, j = 0;
+		while (i < a->cardinality && j < b->cardinality) {
+			if (a->array[i] < b->array[j]) i++;
+			else if (a->array[i] > b->array[j]) j++;
+			else {
+				if (out != NULL) out->array[cardinality] = a->array[i];
+				cardinality++;
+				i++;
+				j++;
+			}
+		}
+	}
+
+	if (out != NULL) out->cardinality = (uint32_t) cardinality;
+	return cardinality;
+}
+
+/**
+ * @brief Intersect two bitmaps
+ *
+ * @return a pointer to a new bitmap with the ids found in both, or `NULL` on error
+ */
+struct bitmap* bitmap_and(const struct bitmap *a, const struct bitmap *b) {
+	struct bitmap *result = bitmap_new();
+	if (result == NULL) return NULL;
+
+	size_t max_count = a->count < b->count ? a->count : b->count;
+	if (max_count == 0) return result;
+
+	result->containers = malloc(max_count * sizeof(struct bitmap_container));
+	if (result->containers == NULL) {
+		free(result);
+		return NULL;
+	}
+	result->capacity = max_count;
+
+	size_t i = 0, j = 0;
+	while (i < a->count && j < b->count) {
+		if (a->containers[i].key < b->containers[j].key) i++;
+		else if (a->containers[i].key > b->containers[j].key) j++;
+		else {
+			struct bitmap_container *out = &result->containers[result->count];
+			long cardinality = container_and(&a->containers[i], &b->containers[j], out);
+			if (cardinality < 0) {
+				bitmap_free(result);
+				return NULL;
+			}
+			if (cardinality > 0) result->count++;
+			else container_free(out);
+			i++;
+			j++;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * @brief Count the ids found in both bitmaps without building the intersection
+ */
+uint64_t bitmap_and_cardinality(const struct bitmap *a, const struct bitmap *b) {
+	uint64_t cardinality = 0;
+	size_t i = 0, j = 0;
+
+	while (i < a->count && j < b->count) {
+		if (a->containers[i].key < b->containers[j].key) i++;
+		else if (a->containers[i].key > b->containers[j].key) j++;
+		else {
+			cardinality += (uint64_t) container_and(&a->containers[i], &b->containers[j], NULL);
+			i++;
+			j++;
+		}
+	}
+
+	return cardinality;
+}
+
+/**
+ * @brief Copy the ids of the bitmap into an array in increasing order
+ *
+ * @param bitmap bitmap
+ * @param values array where to store the ids
+ * @param max_values size of the `values` array
+ * @return number of ids stored
+ */
+size_t bitmap_to_array(const struct bitmap *bitmap, uint32_t *values, size_t max_values) {
+	size_t n = 0;
+
+	for (size_t i = 0; i < bitmap->count && n < max_values; i++) {
+		const struct bitmap_container *c = &bitmap->containers[i];
+		uint32_t high = (uint32_t) c->key << 16;
+
+		if (c->array != NULL) {
+			for (uint32_t j = 0; j < c->cardinality && n < max_values; j++) {
+				values[n++] = high | c->array[j];
+			}
+		} else {
+			for (uint32_t word = 0; word < BITMAP_WORDS && n < max_values; word++) {
+				uint64_t w = c->bits[word];
+				while (w && n < max_values) {
+					values[n++] = high | (word * 64 + __builtin_ctzll(w));
+					w &= w - 1;
+				}
+			}
+		}
+	}
+
+	return n;
+}
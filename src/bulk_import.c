@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../include/database.h"
+#include "../include/bulk_import.h"
+#include "../include/tag_cooccurrence.h"
+
+#define DEFAULT_ROWS_PER_TRANSACTION 500000
+#define STRING_ARENA_BLOCK_SIZE 65536
+#define ESTIMATED_BYTES_PER_ROW 24
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+extern int create_item_tags_indexes(struct tagger_db *db);
+extern int drop_item_tags_indexes(struct tagger_db *db);
+extern int compare_item_tag_pairs(const void *a, const void *b);
+extern sqlite3_int64 insert_item_tag_pairs(struct tagger_db *db, const struct item_tag_pair *pairs, size_t pairs_count);
+
+struct string_arena_block {
+	struct string_arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct string_map_slot {
+	const char *key; // `NULL` for an empty slot, owned by the arena
+	uint64_t hash;
+	sqlite3_int64 value;
+};
+
+/**
+ * Hash map from strings to ids, the keys are copied into an arena and freed all at once
+ */
+struct string_map {
+	struct string_map_slot *slots;
+	size_t capacity; // always a power of two
+	size_t size;
+	struct string_arena_block *blocks;
+};
+
+static uint64_t hash_string(const char *s) {
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	while (*s) {
+		hash ^= (unsigned char) *s++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static char* string_arena_copy(struct string_map *map, const char *s) {
+	size_t bytes = strlen(s) + 1;
+	struct string_arena_block *block = map->blocks;
+
+	if (block == NULL || block->size - block->used < bytes) {
+		size_t size = bytes > STRING_ARENA_BLOCK_SIZE ? bytes : STRING_ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct string_arena_block) + size);
+		if (block == NULL) return NULL;
+		block->next = map->blocks;
+		block->used = 0;
+		block->size = size;
+		map->blocks = block;
+	}
+
+	char *copy = block->data + block->used;
+	memcpy(copy, s, bytes);
+	block->used += bytes;
+	return copy;
+}
+
+static struct string_map_slot* string_map_find(const struct string_map *map, const char *key, uint64_t hash) {
+	size_t i = hash & (map->capacity - 1);
+	while (map->slots[i].key != NULL && (map->slots[i].hash != hash || strcmp(map->slots[i].key, key))) {
+		i = (i + 1) & (map->capacity - 1);
+	}
+	return &map->slots[i];
+}
+
+/**
+ * @brief Get the id of a string
+ *
+ * @return the id, or `0` if the string is not in the map
+ */
+static sqlite3_int64 string_map_get(const struct string_map *map, const char *key) {
+	if (map->capacity == 0) return 0;
+	return string_map_find(map, key, hash_string(key))->value;
+}
+
+/**
+ * @brief Add a string with its id, the map grows at a load factor of 1/2
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int string_map_put(struct string_map *map, const char *key, sqlite3_int64 value) {
+	if ((map->size + 1) * 2 > map->capacity) {
+		size_t new_capacity = map->capacity ? map->capacity * 2 : 1024;
+		struct string_map_slot *old_slots = map->slots;
+		size_t old_capacity = map->capacity;
+
+		map->slots = calloc(new_capacity, sizeof(struct string_map_slot));
+		if (map->slots == NULL) {
+			map->slots = old_slots;
+			return -1;
+		}
+		map->capacity = new_capacity;
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old_slots[i].key != NULL) *string_map_find(map, old_slots[i].key, old_slots[i].hash) = old_slots[i];
+		}
+		free(old_slots);
+	}
+
+	uint64_t hash = hash_string(key);
+	struct string_map_slot *slot = string_map_find(map, key, hash);
+	if (slot->key == NULL) {
+		if ((slot->key = string_arena_copy(map, key)) == NULL) return -1;
+		slot->hash = hash;
+		map->size++;
+	}
+	slot->value = value;
+	return 0;
+}
+
+static void string_map_free(struct string_map *map) {
+	struct string_arena_block *next;
+	for (struct string_arena_block *block = map->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(map->slots);
+}
+
+/**
+ * @brief Load a whole two column (name, id) table into a string map
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int load_string_map(struct tagger_db *db, const char *sql, struct string_map *map) {
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (string_map_put(map, (const char*) sqlite3_column_text(stmt, 0), sqlite3_column_int64(stmt, 1))) {
+			fputs("Could not allocate memory for import lookup table\n", stderr);
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Parse one CSV field in place, quoted fields may contain commas and doubled quotes
+ *
+ * @param p where the field starts, set to where the next field starts on return
+ * @param more set to `1` if another field follows, otherwise `0`
+ * @return the unquoted field, or `NULL` if it is malformed
+ */
+static char* parse_csv_field(char **p, int *more) {
+	char *field = *p, *out = *p, *in = *p;
+
+	if (*in != '"') {
+		while (*in != ',' && *in != '\0') in++;
+	} else {
+		for (in++; ; in++) {
+			if (*in == '\0') return NULL; // unterminated quote
+			if (*in == '"') {
+				if (in[1] != '"') break;
+				in++;
+			}
+			*out++ = *in;
+		}
+		in++;
+		if (*in != ',' && *in != '\0') return NULL;
+		*out = '\0';
+	}
+
+	*more = *in == ',';
+	*p = *more ? in + 1 : in;
+	*in = '\0';
+	return field;
+}
+
+/**
+ * @brief Parse a `relpath,tag` CSV line in place
+ *
+ * @return `0` on success, otherwise `-1` if the line is malformed
+ */
+static int parse_csv_line(char *line, char **relpath, char **tag) {
+	char *p = line;
+	int more;
+
+	if ((*relpath = parse_csv_field(&p, &more)) == NULL || !more) return -1;
+	if ((*tag = parse_csv_field(&p, &more)) == NULL || more) return -1;
+	return 0;
+}
+
+static char* skip_json_whitespace(char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+	return p;
+}
+
+static int parse_hex4(const char *p, unsigned *value) {
+	*value = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		*value <<= 4;
+		if (c >= '0' && c <= '9') *value |= c - '0';
+		else if (c >= 'a' && c <= 'f') *value |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') *value |= c - 'A' + 10;
+		else return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Parse a JSON string in place, the unescaped string is never longer than the escaped one
+ *
+ * @param p points at the opening quote, set to the character after the closing quote on return
+ * @return the unescaped string, or `NULL` if it is malformed
+ */
+static char* parse_json_string(char **p) {
+	char *in = *p + 1, *out = *p + 1, *string = *p + 1;
+	unsigned code, low;
+
+	while (*in != '"') {
+		if (*in == '\0') return NULL;
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+
+		in++;
+		switch (*in) {
+			case '"': case '\\': case '/': *out++ = *in; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				if (parse_hex4(in + 1, &code)) return NULL;
+				in += 4;
+				if (code >= 0xD800 && code <= 0xDBFF) { // a surrogate pair
+					if (in[1] != '\\' || in[2] != 'u' || parse_hex4(in + 3, &low) || low < 0xDC00 || low > 0xDFFF) return NULL;
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					in += 6;
+				}
+				if (code == 0) return NULL; // would end the string early
+				if (code < 0x80) {
+					*out++ = code;
+				} else if (code < 0x800) {
+					*out++ = 0xC0 | (code >> 6);
+					*out++ = 0x80 | (code & 0x3F);
+				} else if (code < 0x10000) {
+					*out++ = 0xE0 | (code >> 12);
+					*out++ = 0x80 | ((code >> 6) & 0x3F);
+					*out++ = 0x80 | (code & 0x3F);
+				} else {
+					*out++ = 0xF0 | (code >> 18);
+					*out++ = 0x80 | ((code >> 12) & 0x3F);
+					*out++ = 0x80 | ((code >> 6) & 0x3F);
+					*out++ = 0x80 | (code & 0x3F);
+				}
+				break;
+			default:
+				return NULL;
+		}
+		in++;
+	}
+
+	*p = in + 1;
+	*out = '\0';
+	return string;
+}
+
+/**
+ * @brief Skip a JSON value that is not a string, nested objects and arrays included
+ *
+ * @return the character after the value, or `NULL` if it is malformed
+ */
+static char* skip_json_value(char *p) {
+	int depth = 0;
+
+	while (*p != '\0') {
+		if (*p == '"') {
+			if (parse_json_string(&p) == NULL) return NULL;
+			continue;
+		}
+		if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			if (depth == 0) return p; // end of the enclosing object
+			depth--;
+		} else if (*p == ',' && depth == 0) {
+			return p;
+		}
+		p++;
+	}
+
+	return depth == 0 ? p : NULL;
+}
+
+/**
+ * @brief Parse a `{"relpath": "...", "tag": "..."}` JSON line in place, other keys are ignored
+ *
+ * @return `0` on success, otherwise `-1` if the line is malformed or a key is missing
+ */
+static int parse_jsonl_line(char *line, char **relpath, char **tag) {
+	char *p = skip_json_whitespace(line), *key;
+
+	*relpath = NULL;
+	*tag = NULL;
+	if (*p++ != '{') return -1;
+
+	p = skip_json_whitespace(p);
+	while (*p != '}') {
+		if (*p != '"' || (key = parse_json_string(&p)) == NULL) return -1;
+		p = skip_json_whitespace(p);
+		if (*p++ != ':') return -1;
+		p = skip_json_whitespace(p);
+
+		if (*p == '"' && (!strcmp(key, "relpath") || !strcmp(key, "tag"))) {
+			char **value = !strcmp(key, "relpath") ? relpath : tag;
+			if ((*value = parse_json_string(&p)) == NULL) return -1;
+		} else if ((p = skip_json_value(p)) == NULL) {
+			return -1;
+		}
+
+		p = skip_json_whitespace(p);
+		if (*p == ',') p = skip_json_whitespace(p + 1);
+		else if (*p != '}') return -1;
+	}
+
+	return *relpath != NULL && *tag != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Decide whether dropping the item tags indexes pays off for an input
+ *
+ * Rebuilding costs about as much as inserting the existing rows again, so it pays off
+ * when the import is expected to add more rows than the table already has.
+ */
+static int should_rebuild_indexes(struct tagger_db *db, FILE *input, const struct import_options *options) {
+	struct stat s;
+	sqlite3_stmt *stmt;
+	sqlite3_int64 existing_rows = 0;
+
+	if (options->indexes != IMPORT_INDEXES_AUTO) return options->indexes == IMPORT_REBUILD_INDEXES;
+
+	// the size of a pipe is unknown, keeping the indexes is the safe choice
+	if (fstat(fileno(input), &s) || !S_ISREG(s.st_mode)) return 0;
+
+	// max(rowid) is a lookup in the table's b-tree, count() would scan it
+	if (sqlite3_prepare_v2(db->connection, "SELECT max(rowid) FROM itemtags;", -1, &stmt, NULL) != SQLITE_OK) return 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW) existing_rows = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return s.st_size / ESTIMATED_BYTES_PER_ROW > existing_rows;
+}
+
+/**
+ * @brief Sort the buffered pairs, insert them and commit the current transaction
+ *
+ * @return number of item tags added, or `-1` on error
+ */
+static sqlite3_int64 flush_pairs(struct tagger_db *db, struct item_tag_pair *pairs, size_t pairs_count) {
+	size_t distinct = 0;
+
+	qsort(pairs, pairs_count, sizeof(struct item_tag_pair), compare_item_tag_pairs);
+	for (size_t i = 0; i < pairs_count; i++) {
+		if (distinct == 0 || compare_item_tag_pairs(&pairs[distinct - 1], &pairs[i])) pairs[distinct++] = pairs[i];
+	}
+
+	sqlite3_int64 added = insert_item_tag_pairs(db, pairs, distinct);
+	if (added == -1 || execute_sql_string(db, "COMMIT;")) return -1;
+	return added;
+}
+
+/**
+ * @brief Stream (relpath, tag) rows from CSV or JSONL and add them as item tags
+ *
+ * Relpaths and tag names are resolved with in-memory maps loaded up front,
+ * the resulting pairs are inserted sorted in large transactions. Rows with unknown
+ * relpaths or tags are counted and skipped. When the item tags indexes are rebuilt,
+ * they are dropped for the import and the tag co-occurrence counts are recomputed at the end.
+ *
+ * A failed import leaves the transactions committed before the failure in the database.
+ *
+ * @param db tagger database, tables must be initialized
+ * @param input CSV with `relpath,tag` lines, an optional header line is skipped,
+ * or JSONL with one `{"relpath": "...", "tag": "..."}` object per line
+ * @param options import options, `NULL` for CSV with the defaults
+ * @param stats where to store the import statistics, may be `NULL`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int bulk_import_item_tags(struct tagger_db *db, FILE *input, const struct import_options *options, struct import_stats *stats) {
+	static const struct import_options default_options = {IMPORT_CSV, 0, IMPORT_INDEXES_AUTO, 0};
+	struct string_map items = {0}, tags = {0};
+	struct import_stats counts = {0};
+	struct item_tag_pair *pairs = NULL;
+	size_t pairs_count = 0, line_capacity = 0;
+	char *line = NULL, *relpath, *tag;
+	ssize_t line_length;
+	sqlite3_int64 item_id, tag_id, added;
+	int rebuild_indexes = 0, in_transaction = 0, result = -1;
+
+	if (db == NULL || input == NULL) return -1;
+	if (options == NULL) options = &default_options;
+	size_t chunk_rows = options->rows_per_transaction ? options->rows_per_transaction : DEFAULT_ROWS_PER_TRANSACTION;
+
+	pairs = malloc(chunk_rows * sizeof(struct item_tag_pair));
+	if (pairs == NULL) {
+		fputs("Could not allocate memory for import\n", stderr);
+		return -1;
+	}
+
+	if (load_string_map(db, "SELECT item_relpath, item_id FROM items;", &items) ||
+		load_string_map(db, "SELECT tag_name, tag_id FROM tags;", &tags)) {
+		goto cleanup;
+	}
+
+	rebuild_indexes = should_rebuild_indexes(db, input, options);
+	if (rebuild_indexes && drop_item_tags_indexes(db)) {
+		fputs("Could not drop the item tags indexes\n", stderr);
+		goto cleanup;
+	}
+
+	while ((line_length = getline(&line, &line_capacity, input)) != -1) {
+		while (line_length > 0 && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) line[--line_length] = '\0';
+		if (line_length == 0) continue;
+
+		if ((options->format == IMPORT_JSONL ? parse_jsonl_line(line, &relpath, &tag) : parse_csv_line(line, &relpath, &tag))) {
+			counts.rows++;
+			counts.malformed_rows++;
+			continue;
+		}
+		if (options->format == IMPORT_CSV && counts.rows == 0 && !strcmp(relpath, "relpath") && !strcmp(tag, "tag")) {
+			continue; // header
+		}
+		counts.rows++;
+
+		if ((item_id = string_map_get(&items, relpath)) == 0) {
+			counts.unknown_items++;
+			continue;
+		}
+
+		if (!in_transaction) {
+			if (execute_sql_string(db, "BEGIN;")) goto cleanup;
+			in_transaction = 1;
+		}
+
+		if ((tag_id = string_map_get(&tags, tag)) == 0) {
+			if (!options->auto_add_tags) {
+				counts.unknown_tags++;
+				continue;
+			}
+			if ((tag_id = add_new_tag(db, tag)) <= 0 || string_map_put(&tags, tag, tag_id)) {
+				fprintf(stderr, "Could not add tag %s\n", tag);
+				goto cleanup;
+			}
+			counts.tags_added++;
+		}
+
+		pairs[pairs_count].item_id = item_id;
+		pairs[pairs_count].tag_id = tag_id;
+		if (++pairs_count == chunk_rows) {
+			if ((added = flush_pairs(db, pairs, pairs_count)) == -1) goto cleanup;
+			counts.item_tags_added += added;
+			pairs_count = 0;
+			in_transaction = 0;
+		}
+	}
+
+	if (ferror(input)) {
+		fputs("Error when reading the import input\n", stderr);
+		goto cleanup;
+	}
+
+	if (in_transaction) {
+		if ((added = flush_pairs(db, pairs, pairs_count)) == -1) goto cleanup;
+		counts.item_tags_added += added;
+		in_transaction = 0;
+	}
+	result = 0;
+
+cleanup:
+	if (in_transaction) {
+		execute_sql_string(db, "ROLLBACK;");
+	}
+	if (rebuild_indexes) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (create_item_tags_indexes(db) || rebuild_tag_cooccurrence(db, cpus > 0 ? (int) cpus : 1)) {
+			fputs("Could not rebuild the item tags indexes\n", stderr);
+			result = -1;
+		}
+	}
+
+	free(line);
+	free(pairs);
+	string_map_free(&items);
+	string_map_free(&tags);
+	if (stats != NULL) *stats = counts;
+	return result;
+}
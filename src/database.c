@@ -6,14 +6,144 @@
 #include <dirent.h>
 
 #include "../include/database.h"
+#include "../include/tag_events.h"
+#include "../include/migrations.h"
 
 #define LISTINGS_TABLE_NAME "listings"
 #define TAGS_TABLE_NAME "tags"
 #define ITEMS_TABLE_NAME "items"
 #define ITEM_TAGS_TABLE_NAME "itemtags"
+#define TAG_COOCCURRENCE_TABLE_NAME "tag_cooccurrence"
+// has a row while a set-based change of the item tags updates the co-occurrence counts itself
+#define TAG_COOCCURRENCE_PAUSED_TABLE_NAME "tag_cooccurrence_paused"
 #define DATABASE_DEFAULT_LOCATION "test.tdb"
 
-int execute_sql_string(sqlite3 *db, char *sql);
+int execute_sql_string(struct tagger_db *db, char *sql);
+int create_tag_cooccurrence_triggers(struct tagger_db *db, const char *counted_items_sql);
+int has_listing_shards(struct tagger_db *db);
+
+// rows of a multi-row insert into ITEM_TAGS
+#define ITEM_TAG_ROWS_BATCH 64
+#define ITEM_TAG_ROWS_4 "(?,?),(?,?),(?,?),(?,?)"
+#define ITEM_TAG_ROWS_16 ITEM_TAG_ROWS_4 "," ITEM_TAG_ROWS_4 "," ITEM_TAG_ROWS_4 "," ITEM_TAG_ROWS_4
+#define ITEM_TAG_ROWS_64 ITEM_TAG_ROWS_16 "," ITEM_TAG_ROWS_16 "," ITEM_TAG_ROWS_16 "," ITEM_TAG_ROWS_16
+
+// statements kept prepared for the lifetime of a `struct tagger_db`
+typedef enum {
+	STMT_TAG_EXISTS,
+	STMT_ADD_NEW_TAG,
+	STMT_GET_TAG_ID,
+	STMT_TOTAL_TAGS_COUNT,
+	STMT_ITEM_TAGS_COUNT,
+	STMT_ITEM_TAG_IDS,
+	STMT_ADD_TAG_TO_ITEM,
+	STMT_ADD_LISTING,
+	STMT_ADD_ITEM,
+	STMT_ITEM_ID_BY_RELPATH,
+	STMT_GET_LISTING,
+	STMT_LISTING_SIZE,
+	STMT_LISTING_ITEMS_CURSOR,
+	STMT_TAG_ITEMS_CURSOR,
+	STMT_ITEM_TAGS_CURSOR,
+	STMT_TAGS_CURSOR,
+	STMT_ADD_ITEM_TAGS_BATCH,
+	STMT_ADD_ITEM_TAG_IF_MISSING,
+	STMT_SAVEPOINT,
+	STMT_RELEASE,
+	STMT_ROLLBACK_TO,
+	STMT_RENAME_TAG,
+	STMT_TAG_ID_EXISTS,
+	STMT_COUNT
+} STATEMENT;
+
+static const char *statement_sqls[STMT_COUNT] = {
+	[STMT_TAG_EXISTS] = "SELECT EXISTS(SELECT 1 FROM " TAGS_TABLE_NAME " WHERE tag_name=? LIMIT 1);",
+	[STMT_ADD_NEW_TAG] = "INSERT INTO " TAGS_TABLE_NAME " (tag_name) VALUES(?);",
+	[STMT_GET_TAG_ID] = "SELECT tag_id FROM " TAGS_TABLE_NAME " WHERE tag_name=? LIMIT 1;",
+	[STMT_TOTAL_TAGS_COUNT] = "SELECT count() FROM " TAGS_TABLE_NAME ";",
+	[STMT_ITEM_TAGS_COUNT] = "SELECT count() FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id=?;",
+	[STMT_ITEM_TAG_IDS] = "SELECT tag_id FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id=?;",
+	[STMT_ADD_TAG_TO_ITEM] = "INSERT INTO " ITEM_TAGS_TABLE_NAME " (item_id,tag_id) VALUES (?,?);",
+	[STMT_ADD_LISTING] = "INSERT INTO " LISTINGS_TABLE_NAME " (listing_name,listing_type,listing_path) VALUES(?,?,?);",
+	[STMT_ADD_ITEM] = "INSERT OR IGNORE INTO " ITEMS_TABLE_NAME " (item_name, item_relpath, listing_id) VALUES (?,?,?);",
+	[STMT_ITEM_ID_BY_RELPATH] = "SELECT item_id FROM " ITEMS_TABLE_NAME " WHERE item_relpath=? AND listing_id=?;",
+	[STMT_GET_LISTING] = "SELECT listing_type,listing_path FROM " LISTINGS_TABLE_NAME " WHERE listing_id=? LIMIT 1;",
+	[STMT_LISTING_SIZE] = "SELECT COUNT(*) FROM " ITEMS_TABLE_NAME " WHERE listing_id=?;",
+	[STMT_LISTING_ITEMS_CURSOR] = "SELECT item_id, item_name, item_relpath, listing_id FROM " ITEMS_TABLE_NAME
+		" WHERE listing_id=:filter AND item_id>:after ORDER BY item_id LIMIT :limit;",
+	[STMT_TAG_ITEMS_CURSOR] = "SELECT i.item_id, i.item_name, i.item_relpath, i.listing_id FROM " ITEM_TAGS_TABLE_NAME " it "
+		"JOIN " ITEMS_TABLE_NAME " i ON i.item_id=it.item_id WHERE it.tag_id=:filter AND it.item_id>:after ORDER BY it.item_id LIMIT :limit;",
+	[STMT_ITEM_TAGS_CURSOR] = "SELECT t.tag_id, t.tag_name FROM " ITEM_TAGS_TABLE_NAME " it "
+		"JOIN " TAGS_TABLE_NAME " t ON t.tag_id=it.tag_id WHERE it.item_id=:filter AND it.tag_id>:after ORDER BY it.tag_id LIMIT :limit;",
+	[STMT_TAGS_CURSOR] = "SELECT tag_id, tag_name FROM " TAGS_TABLE_NAME " WHERE tag_id>:after ORDER BY tag_id LIMIT :limit;",
+	[STMT_ADD_ITEM_TAGS_BATCH] = "INSERT OR IGNORE INTO " ITEM_TAGS_TABLE_NAME " (item_id,tag_id) VALUES " ITEM_TAG_ROWS_64 ";",
+	[STMT_ADD_ITEM_TAG_IF_MISSING] = "INSERT OR IGNORE INTO " ITEM_TAGS_TABLE_NAME " (item_id,tag_id) VALUES (?,?);",
+	// savepoints work like a transaction on their own and can also be nested in the caller's transaction
+	[STMT_SAVEPOINT] = "SAVEPOINT tagger_update;",
+	[STMT_RELEASE] = "RELEASE tagger_update;",
+	[STMT_ROLLBACK_TO] = "ROLLBACK TO tagger_update;",
+	[STMT_RENAME_TAG] = "UPDATE " TAGS_TABLE_NAME " SET tag_name=? WHERE tag_id=?;",
+	[STMT_TAG_ID_EXISTS] = "SELECT EXISTS(SELECT 1 FROM " TAGS_TABLE_NAME " WHERE tag_id=?);",
+};
+
+/**
+ * @brief Get a cached statement, preparing it on first use
+ *
+ * The statement is reset, so it is ready to be bound and stepped.
+ * Hand it back with `release_statement` instead of finalizing it.
+ *
+ * @param db tagger database
+ * @param statement which statement to get
+ * @return the prepared statement, or `NULL` on error
+ */
+static sqlite3_stmt* get_statement(struct tagger_db *db, STATEMENT statement) {
+	sqlite3_stmt *stmt = db->statements[statement];
+	if (stmt != NULL) {
+		sqlite3_reset(stmt);
+		return stmt;
+	}
+
+	// persistent statements are expected to be reused many times and are allocated accordingly
+	if (sqlite3_prepare_v3(db->connection, statement_sqls[statement], -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return NULL;
+	}
+
+	db->statements[statement] = stmt;
+	return stmt;
+}
+
+/**
+ * @brief Reset a cached statement after use and drop its bindings
+ *
+ * Bound strings are not copied by SQLite, so they must not outlive the call that bound them.
+ *
+ * @param stmt statement from `get_statement`
+ */
+static void release_statement(sqlite3_stmt *stmt) {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+/**
+ * @brief Run one of the cached statements that take no parameters and return no rows
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int run_statement(struct tagger_db *db, STATEMENT statement) {
+	sqlite3_stmt *stmt = get_statement(db, statement);
+	if (stmt == NULL) {
+		return -1;
+	}
+
+	int rc = sqlite3_step(stmt);
+	release_statement(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL error when executing statement \"%s\": %s\n", statement_sqls[statement], sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return 0;
+}
 
 /**
  * @brief Expand a parameter in an sql query into an array
@@ -28,12 +158,14 @@ char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_siz
 		fputs("Wrong param number, index starts with 1!\n", stderr);
 		return NULL;
 	}
-	if (param_num == 1) {
-		return (char*) malloc(sizeof(char) * (strlen(sql) + 1));
+	if (array_size == 0) {
+		fputs("Wrong array size, should be at least 1!\n", stderr);
+		return NULL;
 	}
 	param_num--;
 
 	size_t array_start = 0;
+	int array_found = 0;
 	size_t sql_initial_length = strlen(sql);
 	size_t to_find = param_num;
 
@@ -42,6 +174,7 @@ char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_siz
 		if (sql[i] == '?') {
 			if (!to_find) {
 				array_start = i;
+				array_found = 1;
 				break;
 			} else {
 				to_find--;
@@ -49,7 +182,7 @@ char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_siz
 		}
 	}
 
-	if (array_start == 0) {
+	if (!array_found) {
 		fprintf(stderr, "Could not find the %luth parameter\n", param_num+1);
 		return NULL;
 	}
@@ -68,7 +201,7 @@ char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_siz
 	bytes_written += sizeof(char) * array_start;
 
 	// adding the array of parameters (-1 because of the original `?` that will be copied later)
-	for (size_t i = 0; i<=param_num; i++) {
+	for (size_t i = 0; i < array_size-1; i++) {
 		new_sql[bytes_written] = '?';
 		new_sql[bytes_written+1] = ',';
 		bytes_written += 2;
@@ -91,41 +224,40 @@ char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_siz
  * @param tagName string with the tag name
  * @return `1` if the tag was found, `0` if not, `-1` on error
  */
-int tag_exists(sqlite3 *db, char *tagName) {
+int tag_exists(struct tagger_db *db, char *tagName) {
 	sqlite3_stmt *stmt;
 
-	int rc = sqlite3_prepare_v2(db,
-		"SELECT EXISTS(SELECT 1 FROM " TAGS_TABLE_NAME " WHERE tag_name=? LIMIT 1);", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_TAG_EXISTS);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_text(stmt, 1, tagName, -1, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	} else if (rc == SQLITE_ROW) {
 		// Tag found
 		if (sqlite3_column_int(stmt, 0) == 1) {
-			sqlite3_finalize(stmt);
+			release_statement(stmt);
 			return 1;
 		} else {
-			sqlite3_finalize(stmt);
+			release_statement(stmt);
 			return 0;
 		}
 	} else {
 		// Table not found
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return 0;
 	}
 }
@@ -137,37 +269,37 @@ int tag_exists(sqlite3 *db, char *tagName) {
  * @param tagName new tag's name
  * @return `tag_id` if the tag was added, `0` if tag already exists, `-1` on error
  */
-sqlite3_int64 add_new_tag(sqlite3 *db, char *tagName) {
+sqlite3_int64 add_new_tag(struct tagger_db *db, char *tagName) {
 	if (db == NULL || tagName == NULL) {
 		return -1;
 	}
 
 	sqlite3_stmt *stmt;
 
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO " TAGS_TABLE_NAME " (tag_name) VALUES(?);", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_ADD_NEW_TAG);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_text(stmt, 1, tagName, -1, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_DONE) {
-		sqlite3_finalize(stmt);
-		return sqlite3_last_insert_rowid(db);
+		release_statement(stmt);
+		return sqlite3_last_insert_rowid(db->connection);
 	} else if (rc == SQLITE_CONSTRAINT) { // Tag already exists
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return 0;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 }
@@ -175,40 +307,40 @@ sqlite3_int64 add_new_tag(sqlite3 *db, char *tagName) {
 /**
  * @brief Get tag id by name
  *
- * @param db sqlite3 database
+ * @param db tagger database
  * @param tag_name a null-terminated string with the exact tag name
  * @return `tag_id` if the tag was found or `0` if the tag doesn't exist, or `-1` on error
  */
-sqlite3_int64 get_tag_id(sqlite3 *db, char *tag_name) {
+sqlite3_int64 get_tag_id(struct tagger_db *db, char *tag_name) {
 	sqlite3_stmt *stmt;
 	sqlite3_int64 tag_id = 0;
 
-	int rc = sqlite3_prepare_v2(db, "SELECT tag_id FROM " TAGS_TABLE_NAME " WHERE tag_name=? LIMIT 1;", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_GET_TAG_ID);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_text(stmt, 1, tag_name, -1, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
 		tag_id = sqlite3_column_int64(stmt, 0);
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return tag_id;
 	} else if (rc == SQLITE_DONE) {
 		// tag not found
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return 0;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 }
@@ -216,27 +348,27 @@ sqlite3_int64 get_tag_id(sqlite3 *db, char *tag_name) {
 /**
  * @brief Get the total number of tags in the database
  *
- * @param db sqlite3 database
+ * @param db tagger database
  * @return number of tags or `-1` on error
  */
-int get_total_tags_count(sqlite3 *db) {
+int get_total_tags_count(struct tagger_db *db) {
 	sqlite3_stmt *stmt;
 
 	int tag_count = -1;
-	int rc = sqlite3_prepare_v2(db, "SELECT count() FROM " TAGS_TABLE_NAME ";", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_TOTAL_TAGS_COUNT);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
 		tag_count = sqlite3_column_int64(stmt, 0);
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return tag_count;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 }
@@ -244,40 +376,228 @@ int get_total_tags_count(sqlite3 *db) {
 /**
  * @brief Get the number of tags of an item
  *
- * @param db sqlite3 database
+ * @param db tagger database
  * @param item_id id of an item to get the tags count of
  * @return number of tags of an item or `-1` on error
  */
-int get_item_tags_count(sqlite3 *db, sqlite3_int64 item_id) {
+int get_item_tags_count(struct tagger_db *db, sqlite3_int64 item_id) {
 	sqlite3_stmt *stmt;
 
 	int tag_count = -1;
-	int rc = sqlite3_prepare_v2(db, "SELECT count() FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id=?;", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_ITEM_TAGS_COUNT);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_int64(stmt, 1, item_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
 		tag_count = sqlite3_column_int64(stmt, 0);
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		return tag_count;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
+		return -1;
+	}
+}
+
+/**
+ * @brief Open a cursor over a query whose first column is the keyset pagination key
+ *
+ * The cursor borrows the cached statement, only a second cursor of the same kind
+ * open at the same time prepares a statement of its own.
+ *
+ * @param db tagger database
+ * @param statement cached query with the `:after` and `:limit` parameters and optionally a `:filter` parameter
+ * @param filter_id id to bind to `:filter`
+ * @param after_key only rows with a larger key are returned, `0` starts from the beginning
+ * @param limit maximum number of rows, `0` or less for no limit
+ * @return a pointer to the new cursor, or `NULL` on error
+ */
+static struct tagger_cursor* open_cursor(struct tagger_db *db, STATEMENT statement, sqlite3_int64 filter_id, sqlite3_int64 after_key, int limit) {
+	struct tagger_cursor *cursor = malloc(sizeof(struct tagger_cursor));
+	if (cursor == NULL) {
+		fputs("Could not allocate memory for cursor\n", stderr);
+		return NULL;
+	}
+	cursor->db = db;
+	cursor->last_key = after_key;
+
+	if (!db->borrowed[statement]) {
+		cursor->statement = statement;
+		cursor->stmt = get_statement(db, statement);
+	} else {
+		// another cursor of the same kind is open, this one gets a statement of its own
+		cursor->statement = -1;
+		if (sqlite3_prepare_v2(db->connection, statement_sqls[statement], -1, &cursor->stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+			cursor->stmt = NULL;
+		}
+	}
+	if (cursor->stmt == NULL) {
+		free(cursor);
+		return NULL;
+	}
+	if (cursor->statement != -1) {
+		db->borrowed[statement] = 1;
+	}
+
+	int filter_index = sqlite3_bind_parameter_index(cursor->stmt, ":filter");
+	if ((filter_index && sqlite3_bind_int64(cursor->stmt, filter_index, filter_id) != SQLITE_OK) ||
+		sqlite3_bind_int64(cursor->stmt, sqlite3_bind_parameter_index(cursor->stmt, ":after"), after_key) != SQLITE_OK ||
+		sqlite3_bind_int(cursor->stmt, sqlite3_bind_parameter_index(cursor->stmt, ":limit"), limit > 0 ? limit : -1) != SQLITE_OK) { // a negative limit means no limit
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		close_cursor(cursor);
+		return NULL;
+	}
+
+	return cursor;
+}
+
+/**
+ * @brief Open a cursor over the items of a listing ordered by `item_id`
+ *
+ * @param db tagger database
+ * @param listing_id id of the listing
+ * @param after_item_id only items with a larger id are returned, `0` starts from the beginning
+ * @param limit maximum number of items, `0` or less for no limit
+ * @return a pointer to the new cursor, or `NULL` on error, read it with `cursor_next_item`
+ */
+struct tagger_cursor* open_listing_items_cursor(struct tagger_db *db, sqlite3_int64 listing_id, sqlite3_int64 after_item_id, int limit) {
+	return open_cursor(db, STMT_LISTING_ITEMS_CURSOR, listing_id, after_item_id, limit);
+}
+
+/**
+ * @brief Open a cursor over the items that have a tag ordered by `item_id`
+ *
+ * @param db tagger database
+ * @param tag_id id of the tag
+ * @param after_item_id only items with a larger id are returned, `0` starts from the beginning
+ * @param limit maximum number of items, `0` or less for no limit
+ * @return a pointer to the new cursor, or `NULL` on error, read it with `cursor_next_item`
+ */
+struct tagger_cursor* open_tag_items_cursor(struct tagger_db *db, sqlite3_int64 tag_id, sqlite3_int64 after_item_id, int limit) {
+	return open_cursor(db, STMT_TAG_ITEMS_CURSOR, tag_id, after_item_id, limit);
+}
+
+/**
+ * @brief Open a cursor over the tags of an item ordered by `tag_id`
+ *
+ * @param db tagger database
+ * @param item_id id of the item
+ * @param after_tag_id only tags with a larger id are returned, `0` starts from the beginning
+ * @param limit maximum number of tags, `0` or less for no limit
+ * @return a pointer to the new cursor, or `NULL` on error, read it with `cursor_next_tag`
+ */
+struct tagger_cursor* open_item_tags_cursor(struct tagger_db *db, sqlite3_int64 item_id, sqlite3_int64 after_tag_id, int limit) {
+	return open_cursor(db, STMT_ITEM_TAGS_CURSOR, item_id, after_tag_id, limit);
+}
+
+/**
+ * @brief Open a cursor over all tags ordered by `tag_id`
+ *
+ * @param db tagger database
+ * @param after_tag_id only tags with a larger id are returned, `0` starts from the beginning
+ * @param limit maximum number of tags, `0` or less for no limit
+ * @return a pointer to the new cursor, or `NULL` on error, read it with `cursor_next_tag`
+ */
+struct tagger_cursor* open_tags_cursor(struct tagger_db *db, sqlite3_int64 after_tag_id, int limit) {
+	return open_cursor(db, STMT_TAGS_CURSOR, 0, after_tag_id, limit);
+}
+
+/**
+ * @brief Step a cursor
+ *
+ * @return `1` if a row is available, `0` when there are no more rows, `-1` on error
+ */
+int cursor_step(struct tagger_cursor *cursor) {
+	if (cursor == NULL) return -1;
+
+	int rc = sqlite3_step(cursor->stmt);
+	if (rc == SQLITE_ROW) {
+		cursor->last_key = sqlite3_column_int64(cursor->stmt, 0);
+		return 1;
+	} else if (rc == SQLITE_DONE) {
+		return 0;
+	} else {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(cursor->db->connection));
 		return -1;
 	}
 }
 
+/**
+ * @brief Read the next item of an item cursor
+ *
+ * Strings in `row` stay valid until the next call or until the cursor is closed.
+ *
+ * @param cursor cursor opened with `open_listing_items_cursor` or `open_tag_items_cursor`
+ * @param row where to store the item
+ * @return `1` if an item was read, `0` when there are no more items, `-1` on error
+ */
+int cursor_next_item(struct tagger_cursor *cursor, struct item_row *row) {
+	int rc = cursor_step(cursor);
+	if (rc != 1) return rc;
+
+	row->item_id = sqlite3_column_int64(cursor->stmt, 0);
+	row->item_name = (const char*) sqlite3_column_text(cursor->stmt, 1);
+	row->item_relpath = (const char*) sqlite3_column_text(cursor->stmt, 2);
+	row->listing_id = sqlite3_column_int64(cursor->stmt, 3);
+	return 1;
+}
+
+/**
+ * @brief Read the next tag of a tag cursor
+ *
+ * Strings in `row` stay valid until the next call or until the cursor is closed.
+ *
+ * @param cursor cursor opened with `open_item_tags_cursor` or `open_tags_cursor`
+ * @param row where to store the tag
+ * @return `1` if a tag was read, `0` when there are no more tags, `-1` on error
+ */
+int cursor_next_tag(struct tagger_cursor *cursor, struct tag_row *row) {
+	int rc = cursor_step(cursor);
+	if (rc != 1) return rc;
+
+	row->tag_id = sqlite3_column_int64(cursor->stmt, 0);
+	row->tag_name = (const char*) sqlite3_column_text(cursor->stmt, 1);
+	return 1;
+}
+
+/**
+ * @brief Get the key of the last row read, pass it as `after_*_id` to open the next page
+ *
+ * @return the last key, or the key the cursor was opened after if no row was read yet
+ */
+sqlite3_int64 cursor_last_key(struct tagger_cursor *cursor) {
+	return cursor != NULL ? cursor->last_key : 0;
+}
+
+/**
+ * @brief Close a cursor
+ *
+ * @param cursor cursor to close, may be `NULL`
+ */
+void close_cursor(struct tagger_cursor *cursor) {
+	if (cursor == NULL) return;
+
+	if (cursor->statement != -1) {
+		release_statement(cursor->stmt);
+		cursor->db->borrowed[cursor->statement] = 0;
+	} else {
+		sqlite3_finalize(cursor->stmt);
+	}
+	free(cursor);
+}
+
 /**
  * @brief Get an item's tag ids
  *
@@ -285,263 +605,688 @@ int get_item_tags_count(sqlite3 *db, sqlite3_int64 item_id) {
  * values in `tags_array_size` and `tags_array` are undefined
  * and should not be used (caller should not try to free `tags_array`)!
  *
- * @param db sqlite3 database
+ * @param db tagger database
  * @param item_id id of an item to get the tags of
  * @param tags_array_size pointer where to store resulting array size
  * @param tags_array pointer where to store the array of tag ids
- * @return `0` on success, otherwise `-1` on error
+ * @return `0` on success, otherwise `-1` on error or if the item has no tags
  */
-int get_item_tag_ids(sqlite3 *db, sqlite3_int64 item_id, int *tags_array_size, sqlite3_int64 **tags_array) {
+int get_item_tag_ids(struct tagger_db *db, sqlite3_int64 item_id, int *tags_array_size, sqlite3_int64 **tags_array) {
 	if (item_id < 1 || tags_array_size == NULL || tags_array == NULL) { return -1; }
 
 	sqlite3_stmt *stmt;
+	sqlite3_int64 *tags = NULL, *new_tags;
+	int tag_count = 0, tags_capacity = 0;
 
-	// get tags count
-	int tag_count = get_item_tags_count(db, item_id);
-	if (tag_count < 1) {
-		fprintf(stderr, "Error when getting item's tags count for item_id %lld\n", item_id);
-		return -1;
-	}
-
-	// if item has no tags
-	if (tag_count == 0) {
-		*tags_array_size = 0;
-		*tags_array = NULL;
-		return 0;
-	}
-
-	// allocate memory to store tags
-	*tags_array = malloc(tag_count * sizeof(int));
-	if (*tags_array == NULL) {
-		fprintf(stderr, "Error when getting item's tags count for item_id %lld\n", item_id);
-		return -1;
-	}
-
-	// get tags from the database
-	int rc = sqlite3_prepare_v2(db, "SELECT tag_id FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id=?;", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	// a single pass, the array grows geometrically instead of being sized by a count query first
+	int rc;
+	stmt = get_statement(db, STMT_ITEM_TAG_IDS);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_int64(stmt, 1, item_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
-	// fill tags_array
-	for (int i = 0; i < tag_count; i++) {
-		rc = sqlite3_step(stmt);
-		switch (rc) {
-			case SQLITE_ROW:
-				(*tags_array)[i] = sqlite3_column_int64(stmt, 0);
-				break;
-			case SQLITE_DONE:
-				// less tags than expected!
-				sqlite3_finalize(stmt);
-				fprintf(stderr, "Error while getting item tags for item_id %lld, got less tags than expected!\n", item_id);
-				free(*tags_array);
-				return -1;
-			default:
-				// error
-				sqlite3_finalize(stmt);
-				fprintf(stderr, "Error while getting item tags for item_id %lld, %s\n", item_id, sqlite3_errmsg(db));
-				free(*tags_array);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (tag_count == tags_capacity) {
+			tags_capacity = tags_capacity ? tags_capacity * 2 : 16;
+			new_tags = realloc(tags, tags_capacity * sizeof(sqlite3_int64));
+			if (new_tags == NULL) {
+				fprintf(stderr, "Error when allocating memory for item tags for item_id %lld\n", item_id);
+				release_statement(stmt);
+				free(tags);
 				return -1;
+			}
+			tags = new_tags;
 		}
+		tags[tag_count++] = sqlite3_column_int64(stmt, 0);
 	}
 
-	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error while getting item tags for item_id %lld, %s\n", item_id, sqlite3_errmsg(db->connection));
+		release_statement(stmt);
+		free(tags);
+		return -1;
+	}
+	release_statement(stmt);
+
+	if (tag_count == 0) {
+		fprintf(stderr, "Error when getting item's tags for item_id %lld, item has no tags\n", item_id);
+		return -1;
+	}
 
 	*tags_array_size = tag_count;
+	*tags_array = tags;
 	return 0;
 }
 
 /**
  * @brief Tag an item with a tag
  *
- * @param db sqlite3 database
+ * @param db tagger database
  * @param item_id id of the item to tag
  * @param tag_id id of the tag
  * @return `1` if the tag was added, `0` if the item already had the tag, `-1` on error
  */
-int add_tag_to_item(sqlite3 *db, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+int add_tag_to_item(struct tagger_db *db, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
 	sqlite3_stmt *stmt;
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO " ITEM_TAGS_TABLE_NAME " (item_id,tag_id) VALUES (?,?);", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_ADD_TAG_TO_ITEM);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// 1 here means leftmost SQL parameter index
 	rc = sqlite3_bind_int64(stmt, 1, item_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_bind_int64(stmt, 2, tag_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_DONE) {
+		release_statement(stmt);
 		return 1;
 	} else if (rc == SQLITE_CONSTRAINT) { // item already has this tag
+		release_statement(stmt);
 		return 0;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 }
 
+struct tag_name_id {
+	const char *tag_name;
+	sqlite3_int64 tag_id;
+};
+
+static int compare_tag_name_ids(const void *a, const void *b) {
+	return strcmp(((const struct tag_name_id*) a)->tag_name, ((const struct tag_name_id*) b)->tag_name);
+}
+
+int compare_item_tag_pairs(const void *a, const void *b) {
+	const struct item_tag_pair *x = a, *y = b;
+	if (x->item_id != y->item_id) return (x->item_id > y->item_id) - (x->item_id < y->item_id);
+	return (x->tag_id > y->tag_id) - (x->tag_id < y->tag_id);
+}
+
 /**
- * @brief Update item's tags to include those supplied in the provided tag array
+ * @brief Resolve every distinct tag name of some updates to its tag id
  *
- * @param db sqlite3 database
- * @param item_id id of the item to update
- * @param tags array with tag names of char* ending with NULL
- * @param on_new_tags flag whether or not to auto-add non-existing tags
- * @return `1` if the item was updated, `0` if the item wasn't updated and `-1` on error
+ * Each distinct name is looked up once. Missing tags are added in the order
+ * they first appear in the updates.
+ *
+ * @param names array of all tag names of the updates, sorted and deduplicated on return
+ * @param names_count size of the `names` array, the number of distinct names on return
+ * @return `0` on success, otherwise `-1` on error or if a tag doesn't exist and cannot be auto-added
  */
-int update_tags(sqlite3 *db, sqlite3_int64 item_id, char **tags, ON_NEW_TAGS on_new_tags) {
-	if (item_id <= 0) return -1; // bad item_id
-	if (tags == NULL) return 0; // no updates needed
-	sqlite3_int64 tag_id;
-	
-	// begin a transaction
-	if (execute_sql_string(db, "BEGIN TRANSACTION;")) {
-		fprintf(stderr, "Error when trying to begin a transaction: %s\n", sqlite3_errmsg(db));
-		return -1;
-	}
-
-	int item_tags_added = 0;
-	sqlite3_stmt *stmt;
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO " ITEM_TAGS_TABLE_NAME " (item_id,tag_id) VALUES (?,?);", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
-		return -1;
+static int resolve_tag_names(struct tagger_db *db, const struct item_tags *updates, size_t updates_count,
+							 struct tag_name_id *names, size_t *names_count, ON_NEW_TAGS on_new_tags) {
+	struct tag_name_id key, *found;
+	size_t distinct = 0;
+
+	qsort(names, *names_count, sizeof(struct tag_name_id), compare_tag_name_ids);
+	for (size_t i = 0; i < *names_count; i++) {
+		if (distinct == 0 || strcmp(names[distinct - 1].tag_name, names[i].tag_name)) {
+			names[distinct] = names[i];
+			if ((names[distinct].tag_id = get_tag_id(db, (char*) names[distinct].tag_name)) == -1) return -1;
+			distinct++;
+		}
 	}
+	*names_count = distinct;
 
-	char *tag_name = *tags;
-	while (tag_name != NULL) {
-		sqlite3_reset(stmt);
-		sqlite3_clear_bindings(stmt);
+	for (size_t i = 0; i < updates_count; i++) {
+		for (char **tag = updates[i].tags; tag != NULL && *tag != NULL; tag++) {
+			key.tag_name = *tag;
+			found = bsearch(&key, names, distinct, sizeof(struct tag_name_id), compare_tag_name_ids);
+			if (found->tag_id != 0) continue;
 
-		// 1 here means leftmost SQL parameter index
-		rc = sqlite3_bind_int64(stmt, 1, item_id);
-		if (rc != SQLITE_OK) {
-			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			// rollback the transaction
-			if (execute_sql_string(db, "ROLLBACK;")) {
-				fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
+			if (on_new_tags != AUTO_ADD_TAGS) {
+				fprintf(stderr, "Error tag with name %s doesn't exist and cannot be auto-added\n", *tag);
+				tag_events_unknown_tag(db, *tag); // lets subscribed indexes suggest corrections
 				return -1;
 			}
-			return -1;
-		}
-
-		tag_id = get_tag_id(db, tag_name);
-		if (tag_id == -1) {
-			fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			// rollback the transaction
-			if (execute_sql_string(db, "ROLLBACK;")) {
-				fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
+			if ((found->tag_id = add_new_tag(db, *tag)) <= 0) {
+				fprintf(stderr, "Error when auto-adding a tag with name %s, return code was %lld\n", *tag, found->tag_id);
 				return -1;
 			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Insert sorted item tag pairs, skipping the ones that already exist
+ *
+ * @param db tagger database
+ * @param pairs pairs sorted with `compare_item_tag_pairs`
+ * @param pairs_count size of the `pairs` array
+ * @return number of pairs inserted, or `-1` on error
+ */
+sqlite3_int64 insert_item_tag_pairs(struct tagger_db *db, const struct item_tag_pair *pairs, size_t pairs_count) {
+	sqlite3_stmt *stmt;
+	sqlite3_int64 added = 0;
+	size_t i = 0, rows;
+
+	while (i < pairs_count) {
+		rows = pairs_count - i >= ITEM_TAG_ROWS_BATCH ? ITEM_TAG_ROWS_BATCH : 1;
+		stmt = get_statement(db, rows == 1 ? STMT_ADD_ITEM_TAG_IF_MISSING : STMT_ADD_ITEM_TAGS_BATCH);
+		if (stmt == NULL) {
 			return -1;
 		}
-		if (tag_id == 0) { // tag not found
-			if (on_new_tags == AUTO_ADD_TAGS) {
-				if ((tag_id = add_new_tag(db, tag_name)) <= 0) {
-					fprintf(stderr, "Error when auto-adding a tag with name %s, return code was %lld\n", tag_name, tag_id);
-					sqlite3_finalize(stmt);
-					// rollback the transaction
-					if (execute_sql_string(db, "ROLLBACK;")) {
-						fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
-						return -1;
-					}
-					return -1;
-				}
-			} else {
-				sqlite3_finalize(stmt);
-				fprintf(stderr, "Error tag with name %s doesn't exist and cannot be auto-added\n", tag_name);
-				// rollback the transaction
-				if (execute_sql_string(db, "ROLLBACK;")) {
-					fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
-					return -1;
-				}
+
+		for (size_t row = 0; row < rows; row++, i++) {
+			// 1 here means leftmost SQL parameter index
+			if (sqlite3_bind_int64(stmt, 2 * row + 1, pairs[i].item_id) != SQLITE_OK ||
+				sqlite3_bind_int64(stmt, 2 * row + 2, pairs[i].tag_id) != SQLITE_OK) {
+				fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+				release_statement(stmt);
 				return -1;
 			}
 		}
 
-		rc = sqlite3_bind_int64(stmt, 2, tag_id);
-		if (rc != SQLITE_OK) {
-			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			// rollback the transaction
-			if (execute_sql_string(db, "ROLLBACK;")) {
-				fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
-				return -1;
-			}
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+			release_statement(stmt);
 			return -1;
 		}
+		added += sqlite3_changes(db->connection);
+		release_statement(stmt);
+	}
 
-		rc = sqlite3_step(stmt);
-		if (rc == SQLITE_DONE) {
-			item_tags_added++;
-		} else if (rc == SQLITE_CONSTRAINT) { // item already has this tag
-			// do nothing
-		} else {
-			fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			// rollback the transaction
-			if (execute_sql_string(db, "ROLLBACK;")) {
-				fprintf(stderr, "Error when trying to rollback a transaction: %s\n", sqlite3_errmsg(db));
-				return -1;
-			}
+	return added;
+}
+
+/**
+ * @brief Apply one chunk of updates, either all of them or none
+ *
+ * @return number of item tags added, or `-1` on error
+ */
+static sqlite3_int64 update_tags_chunk(struct tagger_db *db, const struct item_tags *updates, size_t updates_count, ON_NEW_TAGS on_new_tags) {
+	struct tag_name_id *names, key;
+	struct item_tag_pair *pairs;
+	size_t names_count = 0, pairs_count = 0;
+	sqlite3_int64 added = -1;
+
+	for (size_t i = 0; i < updates_count; i++) {
+		if (updates[i].item_id <= 0) {
+			fprintf(stderr, "Error, bad item id %lld in tags update\n", updates[i].item_id);
 			return -1;
 		}
+		for (char **tag = updates[i].tags; tag != NULL && *tag != NULL; tag++) names_count++;
+	}
+	if (names_count == 0) return 0; // no updates needed
+
+	names = malloc(names_count * sizeof(struct tag_name_id));
+	pairs = malloc(names_count * sizeof(struct item_tag_pair));
+	if (names == NULL || pairs == NULL) {
+		fputs("Could not allocate memory for tags update\n", stderr);
+		free(names);
+		free(pairs);
+		return -1;
+	}
+
+	names_count = 0;
+	for (size_t i = 0; i < updates_count; i++) {
+		for (char **tag = updates[i].tags; tag != NULL && *tag != NULL; tag++) names[names_count++].tag_name = *tag;
+	}
+
+	if (run_statement(db, STMT_SAVEPOINT)) {
+		free(names);
+		free(pairs);
+		return -1;
+	}
+
+	if (!resolve_tag_names(db, updates, updates_count, names, &names_count, on_new_tags)) {
+		for (size_t i = 0; i < updates_count; i++) {
+			for (char **tag = updates[i].tags; tag != NULL && *tag != NULL; tag++) {
+				key.tag_name = *tag;
+				pairs[pairs_count].item_id = updates[i].item_id;
+				pairs[pairs_count].tag_id = ((struct tag_name_id*) bsearch(&key, names, names_count, sizeof(struct tag_name_id), compare_tag_name_ids))->tag_id;
+				pairs_count++;
+			}
+		}
+
+		// sorted pairs are inserted in primary key order and duplicates are next to each other
+		qsort(pairs, pairs_count, sizeof(struct item_tag_pair), compare_item_tag_pairs);
+		size_t distinct = 0;
+		for (size_t i = 0; i < pairs_count; i++) {
+			if (distinct == 0 || compare_item_tag_pairs(&pairs[distinct - 1], &pairs[i])) pairs[distinct++] = pairs[i];
+		}
 
-		tags++;
-		tag_name = *tags;
+		added = insert_item_tag_pairs(db, pairs, distinct);
 	}
+	free(names);
+	free(pairs);
 
-	sqlite3_finalize(stmt);
+	if (added == -1) {
+		if (run_statement(db, STMT_ROLLBACK_TO) || run_statement(db, STMT_RELEASE)) {
+			fputs("Error when trying to rollback a tags update\n", stderr);
+		}
+		return -1;
+	}
 
-	// end a transaction
-	if (execute_sql_string(db, "END TRANSACTION;")) {
-		fprintf(stderr, "Error when trying to end a transaction: %s\n", sqlite3_errmsg(db));
+	if (run_statement(db, STMT_RELEASE)) {
+		fputs("Error when trying to commit a tags update\n", stderr);
+		run_statement(db, STMT_ROLLBACK_TO);
+		run_statement(db, STMT_RELEASE);
 		return -1;
 	}
 
-	return item_tags_added > 0 ? 1 : 0;
+	return added;
 }
 
 /**
- * Execute sql string
- * @param db SQLite3 database to execute upon
- * @param sql SQL string to execute
- * @return `0` if the string was executed successfully, otherwise `-1` on error
+ * @brief Update the tags of many items
+ *
+ * Tag names are resolved once per chunk and the new item tags are inserted
+ * sorted, many rows per statement. Each chunk is applied in its own transaction,
+ * either completely or not at all. When called inside an open transaction
+ * the chunks become savepoints of that transaction.
+ *
+ * @param db tagger database
+ * @param updates array of items with the tag names to add to them
+ * @param updates_count size of the `updates` array
+ * @param on_new_tags flag whether or not to auto-add non-existing tags
+ * @param chunk_size number of updates per transaction, `0` for a single transaction
+ * @param updates_applied where to store the number of updates in committed chunks, may be `NULL`
+ * @return number of item tags added, or `-1` on error, the chunks before the failed one stay committed
  */
-int execute_sql_string(sqlite3 *db, char *sql) {
-	char *errmsg;
+sqlite3_int64 update_tags_batch(struct tagger_db *db, const struct item_tags *updates, size_t updates_count,
+								ON_NEW_TAGS on_new_tags, size_t chunk_size, size_t *updates_applied) {
+	sqlite3_int64 added = 0, chunk_added;
+	size_t chunk;
 
-	if (sqlite3_exec(db, sql, NULL, 0, &errmsg) != SQLITE_OK) {
-		fprintf(stderr, "SQL error when executing statement \"%s\": %s\n", sql, errmsg);
-		sqlite3_free(errmsg);
-		return -1;
-	} else {
-		return 0;
+	if (updates_applied != NULL) *updates_applied = 0;
+	if (db == NULL || (updates == NULL && updates_count > 0)) return -1;
+	if (chunk_size == 0) chunk_size = updates_count;
+
+	for (size_t i = 0; i < updates_count; i += chunk) {
+		chunk = updates_count - i < chunk_size ? updates_count - i : chunk_size;
+		if ((chunk_added = update_tags_chunk(db, updates + i, chunk, on_new_tags)) == -1) return -1;
+
+		added += chunk_added;
+		if (updates_applied != NULL) *updates_applied += chunk;
+	}
+
+	return added;
+}
+
+/**
+ * @brief Update item's tags to include those supplied in the provided tag array
+ *
+ * @param db tagger database
+ * @param item_id id of the item to update
+ * @param tags array with tag names of char* ending with NULL
+ * @param on_new_tags flag whether or not to auto-add non-existing tags
+ * @return `1` if the item was updated, `0` if the item wasn't updated and `-1` on error
+ */
+int update_tags(struct tagger_db *db, sqlite3_int64 item_id, char **tags, ON_NEW_TAGS on_new_tags) {
+	if (item_id <= 0) return -1; // bad item_id
+	if (tags == NULL) return 0; // no updates needed
+
+	struct item_tags update = {item_id, tags};
+	sqlite3_int64 added = update_tags_batch(db, &update, 1, on_new_tags, 0, NULL);
+	if (added == -1) return -1;
+
+	return added > 0 ? 1 : 0;
+}
+
+// temporary tables of the set-based changes of item tags, they live as long as the connection
+#define AFFECTED_ITEMS_TABLE_NAME "temp.tagger_affected_items"
+#define COOCCURRENCE_DELTA_TABLE_NAME "temp.tagger_cooccurrence_delta"
+#define ITEM_IDS_TABLE_NAME "temp.tagger_item_ids"
+#define TAG_IDS_TABLE_NAME "temp.tagger_tag_ids"
+
+/**
+ * @brief Run a statement with up to two bound ids
+ *
+ * @return number of rows changed, or `-1` on error
+ */
+static sqlite3_int64 run_sql_with_ids(struct tagger_db *db, const char *sql, sqlite3_int64 first, sqlite3_int64 second) {
+	sqlite3_stmt *stmt;
+
+	int rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	int parameters = sqlite3_bind_parameter_count(stmt);
+	if ((parameters >= 1 && sqlite3_bind_int64(stmt, 1, first) != SQLITE_OK) ||
+		(parameters >= 2 && sqlite3_bind_int64(stmt, 2, second) != SQLITE_OK)) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return sqlite3_changes64(db->connection);
+}
+
+/**
+ * @brief Start a set-based change of the item tags in its own savepoint
+ *
+ * The co-occurrence triggers would recount the tags of an item for every changed row,
+ * so they are paused until `end_item_tags_change` and the co-occurrence table
+ * is updated once for the whole change instead. Pausing writes a row, not the schema,
+ * and no other connection sees it as it never outlives the savepoint.
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int begin_item_tags_change(struct tagger_db *db) {
+	if (run_statement(db, STMT_SAVEPOINT)) return -1;
+
+	if (execute_sql_string(db, "CREATE TABLE IF NOT EXISTS " AFFECTED_ITEMS_TABLE_NAME " (item_id INTEGER PRIMARY KEY);"
+			"CREATE TABLE IF NOT EXISTS " COOCCURRENCE_DELTA_TABLE_NAME " (tag_id INTEGER NOT NULL, related_tag_id INTEGER NOT NULL,"
+			"count INTEGER NOT NULL, PRIMARY KEY (tag_id, related_tag_id)) WITHOUT ROWID;"
+			"CREATE TABLE IF NOT EXISTS " ITEM_IDS_TABLE_NAME " (item_id INTEGER PRIMARY KEY);"
+			"CREATE TABLE IF NOT EXISTS " TAG_IDS_TABLE_NAME " (tag_id INTEGER PRIMARY KEY);"
+			"DELETE FROM " AFFECTED_ITEMS_TABLE_NAME "; DELETE FROM " COOCCURRENCE_DELTA_TABLE_NAME ";"
+			"DELETE FROM " ITEM_IDS_TABLE_NAME "; DELETE FROM " TAG_IDS_TABLE_NAME ";"
+			"INSERT OR IGNORE INTO " TAG_COOCCURRENCE_PAUSED_TABLE_NAME " (paused) VALUES (1);")) {
+		run_statement(db, STMT_ROLLBACK_TO);
+		run_statement(db, STMT_RELEASE);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Add the tag pairs of the affected items to the co-occurrence delta
+ *
+ * Called with `-1` before the change and with `1` after it, the delta then holds
+ * the difference the change makes to the co-occurrence counts.
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int count_affected_item_tags(struct tagger_db *db, int sign) {
+	return run_sql_with_ids(db, "INSERT INTO " COOCCURRENCE_DELTA_TABLE_NAME " (tag_id, related_tag_id, count) "
+		"SELECT a.tag_id, b.tag_id, ?1 * count() FROM " AFFECTED_ITEMS_TABLE_NAME " x "
+		"JOIN " ITEM_TAGS_TABLE_NAME " a ON a.item_id = x.item_id "
+		"JOIN " ITEM_TAGS_TABLE_NAME " b ON b.item_id = x.item_id AND b.tag_id <> a.tag_id "
+		"WHERE 1 GROUP BY a.tag_id, b.tag_id "
+		"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + excluded.count;", sign, 0) == -1 ? -1 : 0;
+}
+
+/**
+ * @brief Finish a set-based change of the item tags
+ *
+ * Applies the co-occurrence delta, resumes the triggers and commits the savepoint,
+ * or rolls everything back if the change failed.
+ *
+ * @param failed whether the change failed
+ * @return `0` if the change was committed, otherwise `-1`
+ */
+static int end_item_tags_change(struct tagger_db *db, int failed) {
+	if (!failed) {
+		failed = execute_sql_string(db, "INSERT INTO " TAG_COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) "
+				"SELECT tag_id, related_tag_id, count FROM " COOCCURRENCE_DELTA_TABLE_NAME " WHERE count <> 0 "
+				"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + excluded.count;"
+				"DELETE FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE count <= 0 AND (tag_id, related_tag_id) IN "
+				"(SELECT tag_id, related_tag_id FROM " COOCCURRENCE_DELTA_TABLE_NAME " WHERE count < 0);") ||
+			execute_sql_string(db, "DELETE FROM " TAG_COOCCURRENCE_PAUSED_TABLE_NAME ";") ||
+			run_statement(db, STMT_RELEASE);
+	}
+
+	if (failed) {
+		// the triggers resume with the rollback
+		if (run_statement(db, STMT_ROLLBACK_TO) || run_statement(db, STMT_RELEASE)) {
+			fputs("Error when trying to rollback an item tags change\n", stderr);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Remove the co-occurrence counts of a tag, for a tag no item has anymore
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int remove_tag_cooccurrence(struct tagger_db *db, sqlite3_int64 tag_id) {
+	// the pairs are stored both ways, so the rows pointing to the tag are found through its own rows
+	if (run_sql_with_ids(db, "DELETE FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE related_tag_id = ?1 AND tag_id IN "
+			"(SELECT related_tag_id FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE tag_id = ?1);", tag_id, 0) == -1 ||
+		run_sql_with_ids(db, "DELETE FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE tag_id = ?;", tag_id, 0) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Check whether a tag id exists
+ *
+ * @return `1` if it exists, `0` if not, `-1` on error
+ */
+static int tag_id_exists(struct tagger_db *db, sqlite3_int64 tag_id) {
+	sqlite3_stmt *stmt = get_statement(db, STMT_TAG_ID_EXISTS);
+	if (stmt == NULL) return -1;
+
+	int exists = -1;
+	if (sqlite3_bind_int64(stmt, 1, tag_id) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		exists = sqlite3_column_int(stmt, 0);
+	} else {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+	}
+	release_statement(stmt);
+	return exists;
+}
+
+/**
+ * @brief Rename a tag, its items keep it
+ *
+ * @param db tagger database
+ * @param tag_id id of the tag to rename
+ * @param new_name new name of the tag, must not be used by another tag
+ * @return `1` if the tag was renamed, `0` if the tag doesn't exist, `-1` on error
+ */
+int rename_tag(struct tagger_db *db, sqlite3_int64 tag_id, char *new_name) {
+	sqlite3_stmt *stmt;
+
+	if (new_name == NULL || new_name[0] == '\0') return -1;
+
+	stmt = get_statement(db, STMT_RENAME_TAG);
+	if (stmt == NULL) return -1;
+
+	if (sqlite3_bind_text(stmt, 1, new_name, -1, NULL) != SQLITE_OK || sqlite3_bind_int64(stmt, 2, tag_id) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
+		return -1;
+	}
+
+	int rc = sqlite3_step(stmt);
+	release_statement(stmt);
+	if (rc == SQLITE_CONSTRAINT) {
+		fprintf(stderr, "Error tag with name %s already exists\n", new_name);
+		return -1;
+	} else if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	return sqlite3_changes(db->connection) > 0 ? 1 : 0;
+}
+
+/**
+ * @brief Merge a tag into another one and delete it
+ *
+ * Every item of `from_tag_id` gets `into_tag_id` instead, items that already had
+ * both keep a single row. Runs as a few set-based statements in one transaction.
+ *
+ * Refused while listings have shards, on the catalog as on a shard: the item tags of
+ * the other shards would keep the deleted tag.
+ *
+ * @param db tagger database
+ * @param from_tag_id id of the tag to merge, it is deleted
+ * @param into_tag_id id of the tag to keep
+ * @return number of items that got `into_tag_id`, or `-1` on error
+ */
+sqlite3_int64 merge_tags(struct tagger_db *db, sqlite3_int64 from_tag_id, sqlite3_int64 into_tag_id) {
+	sqlite3_int64 merged = -1;
+
+	if (from_tag_id <= 0 || into_tag_id <= 0 || from_tag_id == into_tag_id) {
+		fputs("Error, a tag can only be merged into another existing tag\n", stderr);
+		return -1;
+	}
+	int sharded = has_listing_shards(db);
+	if (sharded != 0) {
+		if (sharded == 1) fputs("Error, tags cannot be merged while listings have shards\n", stderr);
+		return -1;
+	}
+	int exists = tag_id_exists(db, into_tag_id);
+	if (exists <= 0) {
+		if (exists == 0) fprintf(stderr, "Error, tag %lld doesn't exist\n", into_tag_id);
+		return -1;
+	}
+	if (begin_item_tags_change(db)) return -1;
+
+	int failed = run_sql_with_ids(db, "INSERT INTO " AFFECTED_ITEMS_TABLE_NAME " (item_id) "
+			"SELECT it.item_id FROM " ITEM_TAGS_TABLE_NAME " it WHERE it.tag_id = ?1 AND NOT EXISTS "
+			"(SELECT 1 FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = it.item_id AND tag_id = ?2);", from_tag_id, into_tag_id) == -1 ||
+		remove_tag_cooccurrence(db, from_tag_id) ||
+		run_sql_with_ids(db, "DELETE FROM " ITEM_TAGS_TABLE_NAME " WHERE tag_id = ?;", from_tag_id, 0) == -1 ||
+		(merged = run_sql_with_ids(db, "INSERT INTO " ITEM_TAGS_TABLE_NAME " (item_id, tag_id) "
+			"SELECT item_id, ? FROM " AFFECTED_ITEMS_TABLE_NAME ";", into_tag_id, 0)) == -1 ||
+		// only the items that newly got the tag add pairs with it
+		run_sql_with_ids(db, "INSERT INTO " COOCCURRENCE_DELTA_TABLE_NAME " (tag_id, related_tag_id, count) "
+			"SELECT ?1, it.tag_id, count() FROM " AFFECTED_ITEMS_TABLE_NAME " x JOIN " ITEM_TAGS_TABLE_NAME " it "
+			"ON it.item_id = x.item_id WHERE it.tag_id <> ?1 GROUP BY it.tag_id;", into_tag_id, 0) == -1 ||
+		run_sql_with_ids(db, "INSERT INTO " COOCCURRENCE_DELTA_TABLE_NAME " (tag_id, related_tag_id, count) "
+			"SELECT related_tag_id, tag_id, count FROM " COOCCURRENCE_DELTA_TABLE_NAME " WHERE tag_id = ?1;", into_tag_id, 0) == -1;
+
+	if (!failed) {
+		sqlite3_int64 deleted = run_sql_with_ids(db, "DELETE FROM " TAGS_TABLE_NAME " WHERE tag_id = ?;", from_tag_id, 0);
+		if (deleted == 0) fprintf(stderr, "Error, tag %lld doesn't exist\n", from_tag_id);
+		failed = deleted <= 0;
+	}
+
+	return end_item_tags_change(db, failed) ? -1 : merged;
+}
+
+/**
+ * @brief Remove a tag from every item, the tag itself stays
+ *
+ * Refused while listings have shards, like `merge_tags`, it would only reach
+ * the items of one connection.
+ *
+ * @param db tagger database
+ * @param tag_id id of the tag
+ * @return number of item tags removed, or `-1` on error
+ */
+sqlite3_int64 remove_tag_from_all_items(struct tagger_db *db, sqlite3_int64 tag_id) {
+	sqlite3_int64 removed = -1;
+
+	int sharded = has_listing_shards(db);
+	if (sharded != 0) {
+		if (sharded == 1) fputs("Error, a tag cannot be removed from all items while listings have shards\n", stderr);
+		return -1;
+	}
+	if (begin_item_tags_change(db)) return -1;
+
+	int failed = remove_tag_cooccurrence(db, tag_id) ||
+		(removed = run_sql_with_ids(db, "DELETE FROM " ITEM_TAGS_TABLE_NAME " WHERE tag_id = ?;", tag_id, 0)) == -1;
+
+	return end_item_tags_change(db, failed) ? -1 : removed;
+}
+
+/**
+ * @brief Fill a temporary id table from an array
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int fill_ids_table(struct tagger_db *db, const char *sql, const sqlite3_int64 *ids, size_t count) {
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (sqlite3_bind_int64(stmt, 1, ids[i]) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		sqlite3_reset(stmt);
+	}
+
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+/**
+ * @brief Remove every tag of a list from every item of a list
+ *
+ * The co-occurrence counts of the changed items are recounted once, before and after
+ * a single `DELETE`, all in one transaction.
+ *
+ * @param db tagger database
+ * @param item_ids array of item ids
+ * @param items_count size of the `item_ids` array
+ * @param tag_ids array of tag ids
+ * @param tags_count size of the `tag_ids` array
+ * @return number of item tags removed, or `-1` on error
+ */
+sqlite3_int64 remove_item_tags(struct tagger_db *db, const sqlite3_int64 *item_ids, size_t items_count,
+							   const sqlite3_int64 *tag_ids, size_t tags_count) {
+	sqlite3_int64 removed = -1;
+
+	if ((item_ids == NULL && items_count > 0) || (tag_ids == NULL && tags_count > 0)) return -1;
+	if (items_count == 0 || tags_count == 0) return 0;
+	if (begin_item_tags_change(db)) return -1;
+
+	int failed = fill_ids_table(db, "INSERT OR IGNORE INTO " ITEM_IDS_TABLE_NAME " (item_id) VALUES (?);", item_ids, items_count) ||
+		fill_ids_table(db, "INSERT OR IGNORE INTO " TAG_IDS_TABLE_NAME " (tag_id) VALUES (?);", tag_ids, tags_count) ||
+		run_sql_with_ids(db, "INSERT INTO " AFFECTED_ITEMS_TABLE_NAME " (item_id) SELECT DISTINCT it.item_id FROM "
+			ITEM_IDS_TABLE_NAME " i JOIN " ITEM_TAGS_TABLE_NAME " it ON it.item_id = i.item_id "
+			"WHERE it.tag_id IN (SELECT tag_id FROM " TAG_IDS_TABLE_NAME ");", 0, 0) == -1 ||
+		count_affected_item_tags(db, -1) ||
+		(removed = run_sql_with_ids(db, "DELETE FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id IN (SELECT item_id FROM " AFFECTED_ITEMS_TABLE_NAME ") "
+			"AND tag_id IN (SELECT tag_id FROM " TAG_IDS_TABLE_NAME ");", 0, 0)) == -1 ||
+		count_affected_item_tags(db, 1);
+
+	return end_item_tags_change(db, failed) ? -1 : removed;
+}
+
+/**
+ * Execute sql string
+ * @param db SQLite3 database to execute upon
+ * @param sql SQL string to execute
+ * @return `0` if the string was executed successfully, otherwise `-1` on error
+ */
+int execute_sql_string(struct tagger_db *db, char *sql) {
+	char *errmsg;
+
+	if (sqlite3_exec(db->connection, sql, NULL, 0, &errmsg) != SQLITE_OK) {
+		fprintf(stderr, "SQL error when executing statement \"%s\": %s\n", sql, errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	} else {
+		return 0;
 	}
 }
 
@@ -554,7 +1299,7 @@ int execute_sql_string(sqlite3 *db, char *sql) {
  * @param listingPath listing path, must be unique
  * @return `1` if the listing was added, `0` if listing already exists, `-1` on error
  */
-int add_new_listing(sqlite3 *db, char *listingName, LISTING_TYPE type, char *listingPath) {
+int add_new_listing(struct tagger_db *db, char *listingName, LISTING_TYPE type, char *listingPath) {
 	// check if the path exists and points to a directory
 	char *absolutePath = realpath(listingPath, NULL);
 	if (absolutePath == NULL) {
@@ -589,72 +1334,141 @@ int add_new_listing(sqlite3 *db, char *listingName, LISTING_TYPE type, char *lis
 
 	// ADDING LISTING TO THE LISTINGS TABLE
 
-	int rc = sqlite3_prepare_v2(db,
-		"INSERT INTO " LISTINGS_TABLE_NAME " (listing_name,listing_type,listing_path) VALUES(?,?,?);", -1, &stmt, NULL);
-
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_ADD_LISTING);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	// NAME
 	rc = sqlite3_bind_text(stmt, 1, listingName, -1, NULL); // 1 here means leftmost SQL parameter index
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	//TYPE
 	rc = sqlite3_bind_int(stmt, 2, (int)type);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	//PATH
 	rc = sqlite3_bind_text(stmt, 3, absolutePath, -1, NULL);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_DONE) {
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		free(absolutePath);
 		return 1;
 	} else if (rc == SQLITE_CONSTRAINT) { // Listing already exists
-		sqlite3_finalize(stmt);
+		release_statement(stmt);
 		free(absolutePath);
 		return 0;
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		free(absolutePath);
 		return -1;
 	}
 }
 
-//TODO rewrite without using recursion and with an ability to report progress
 /**
- * Helper function to recursively refresh a listing
- * @param db SQLite database
- * @param listing_id listing id
+ * @brief Add an item to a listing, unless an item with the same name or relpath exists
+ *
+ * @param db tagger database
+ * @param listing_id id of the listing
+ * @param name item name
+ * @param relpath path of the item relative to the listing root
+ * @return `0` on success, otherwise `-1` on error
+ */
+int insert_listing_item(struct tagger_db *db, sqlite3_int64 listing_id, const char *name, const char *relpath) {
+	sqlite3_stmt *stmt = get_statement(db, STMT_ADD_ITEM);
+	if (stmt == NULL) return -1;
+
+	if (sqlite3_bind_text(stmt, 1, name, -1, NULL) != SQLITE_OK || sqlite3_bind_text(stmt, 2, relpath, -1, NULL) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 3, listing_id) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
+		return -1;
+	}
+
+	int rc = sqlite3_step(stmt);
+	release_statement(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Add an item to a listing and get its id
+ *
+ * @param db tagger database
+ * @param listing_id id of the listing
+ * @param name item name
+ * @param relpath path of the item relative to the listing root
+ * @return id of the listing's item with this relpath, `0` if another item already has the name or
+ * the relpath, or `-1` on error
+ */
+sqlite3_int64 add_listing_item(struct tagger_db *db, sqlite3_int64 listing_id, const char *name, const char *relpath) {
+	sqlite3_int64 item_id = 0;
+
+	if (insert_listing_item(db, listing_id, name, relpath)) return -1;
+
+	sqlite3_stmt *stmt = get_statement(db, STMT_ITEM_ID_BY_RELPATH);
+	if (stmt == NULL) return -1;
+
+	// an item of another listing may have the relpath, it is not this one
+	if (sqlite3_bind_text(stmt, 1, relpath, -1, NULL) != SQLITE_OK || sqlite3_bind_int64(stmt, 2, listing_id) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
+		return -1;
+	}
+
+	int rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		item_id = sqlite3_column_int64(stmt, 0);
+	} else if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		item_id = -1;
+	}
+	release_statement(stmt);
+	return item_id;
+}
+
+/**
+ * @brief Scan one directory of a listing, without descending into subdirectories
+ *
+ * Every entry that is an item of the listing type is passed to `on_item`, with
+ * the file extension stripped from its name. With `FILE_AS_ITEM` every subdirectory
+ * is passed to `on_directory`, which may scan it in turn. The database is not used,
+ * so directories may be scanned from any thread.
+ *
  * @param type listing type
  * @param listing_root_path_nbytes length of the listing's root filepath in bytes
  * @param path path to scan
+ * @param on_item called with the name and relpath of each item, returning non-zero stops the scan
+ * @param on_directory called with the path of each subdirectory to scan, returning non-zero stops the scan
+ * @param user_data passed to the callbacks
  * @return `0` if the path was scanned successfully, otherwise `-1` on error
  */
-int refresh_listing_recursive(sqlite3 *db, sqlite3_int64 listing_id, LISTING_TYPE type,
-							  size_t listing_root_path_nbytes, const char *path) {
-	sqlite3_stmt *stmt;
-	int rc;
-	char name[256], *relpath, *dot, *subdir_path;
-	size_t subdir_bytes;
+int scan_listing_directory(LISTING_TYPE type, size_t listing_root_path_nbytes, const char *path,
+						   int (*on_item)(const char *name, const char *relpath, void *user_data),
+						   int (*on_directory)(const char *path, void *user_data), void *user_data) {
+	char name[256], *dot, *entry_path;
+	size_t path_nbytes = strlen(path), entry_bytes;
 	struct dirent *de;
+	int result = 0;
 	DIR *dr = opendir(path);
 
 	if (dr == NULL) {
@@ -662,42 +1476,25 @@ int refresh_listing_recursive(sqlite3 *db, sqlite3_int64 listing_id, LISTING_TYP
 		return -1;
 	}
 
-	rc = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO " ITEMS_TABLE_NAME " (item_name, item_relpath, listing_id) VALUES (?,?,?);", -1, &stmt, NULL);
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: '%s'\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
-		closedir(dr);
-		return -1;
-	}
-
-	while ((de = readdir(dr)) != NULL) {
+	while (result == 0 && (de = readdir(dr)) != NULL) {
 		if (de->d_type == DT_DIR && (strcmp(de->d_name, "..") == 0 || strcmp(de->d_name, ".") == 0)) continue; // skip .. and . dirs
-		// fprintf(stderr, "Checking entry: %s\n", de->d_name);
+		if (de->d_type == DT_REG && type == DIR_AS_ITEM) continue; // skip files when type is DIR_AS_ITEM
+
+		entry_bytes = snprintf(NULL, 0, "%s/%s", path, de->d_name) + 1;
+		entry_path = malloc(entry_bytes);
+		if (entry_path == NULL) {
+			result = -1;
+			break;
+		}
+		snprintf(entry_path, entry_bytes, "%s/%s", path, de->d_name);
+
 		if (de->d_type == DT_DIR && type == FILE_AS_ITEM) {
 			// scan all subdirs for files
-			subdir_bytes = snprintf(NULL, 0, "%s/%s", path, de->d_name) + 1;
-			subdir_path = malloc(subdir_bytes);
-			if (subdir_path == NULL) {
-				sqlite3_finalize(stmt);
-				closedir(dr);
-				return -1;
-			}
-			snprintf(subdir_path, subdir_bytes, "%s/%s", path, de->d_name);
-			if (refresh_listing_recursive(db, listing_id, type, listing_root_path_nbytes, subdir_path)) {
-				free(subdir_path);
-				sqlite3_finalize(stmt);
-				closedir(dr);
-				return -1;
-			}
-			free(subdir_path);
-			continue;
-		} else if (de->d_type == DT_REG && type == DIR_AS_ITEM) {
-			// skip files when type is DIR_AS_ITEM
+			result = on_directory(entry_path, user_data) ? -1 : 0;
+			free(entry_path);
 			continue;
 		}
 
-		// INSERTING
-
 		// get name
 		if (de->d_type == DT_DIR) {
 			memcpy(name, de->d_name, sizeof(name));
@@ -709,113 +1506,108 @@ int refresh_listing_recursive(sqlite3 *db, sqlite3_int64 listing_id, LISTING_TYP
 				name[dot - de->d_name] = '\0';
 			}
 		}
-		// fprintf(stderr, "Name will be: %s, ", name);
 
-		// get relpath
-		relpath = malloc(strlen(path) + strlen(de->d_name) - listing_root_path_nbytes + 2);
-		if (relpath == NULL) {
-			sqlite3_finalize(stmt);
-			closedir(dr);
-			return -1;
-		}
-		memcpy(relpath, path+listing_root_path_nbytes, strlen(path)-listing_root_path_nbytes);
-		relpath[strlen(path)-listing_root_path_nbytes] = '/';
-		strcpy(relpath+strlen(path)-listing_root_path_nbytes+1, de->d_name);
-		// fprintf(stderr, "Relpath will be: %s\n", relpath);
-
-		// reset sql statement
-		sqlite3_reset(stmt);
-		sqlite3_clear_bindings(stmt);
-
-		rc = sqlite3_bind_text(stmt, 1, name, -1, NULL);
-		if (rc != SQLITE_OK) {
-			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			free(relpath);
-			closedir(dr);
-			return -1;
-		}
+		// the relpath is the entry path without the listing root
+		if (path_nbytes < listing_root_path_nbytes) listing_root_path_nbytes = path_nbytes;
+		result = on_item(name, entry_path + listing_root_path_nbytes, user_data) ? -1 : 0;
+		free(entry_path);
+	}
 
-		rc = sqlite3_bind_text(stmt, 2, relpath, -1, NULL);
-		if (rc != SQLITE_OK) {
-			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			free(relpath);
-			closedir(dr);
-			return -1;
-		}
+	closedir(dr);
+	return result;
+}
 
-		rc = sqlite3_bind_int64(stmt, 3, listing_id);
-		if (rc != SQLITE_OK) {
-			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			free(relpath);
-			closedir(dr);
-			return -1;
-		}
+struct refresh_state {
+	struct tagger_db *db;
+	sqlite3_int64 listing_id;
+	LISTING_TYPE type;
+	size_t listing_root_path_nbytes;
+};
 
-		rc = sqlite3_step(stmt);
-		if (rc != SQLITE_DONE) {
-			fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			free(relpath);
-			closedir(dr);
-			return -1;
-		}
-		free(relpath);
-	}
+static int refresh_add_item(const char *name, const char *relpath, void *user_data) {
+	struct refresh_state *state = user_data;
+	return insert_listing_item(state->db, state->listing_id, name, relpath);
+}
 
-	sqlite3_finalize(stmt);
-	closedir(dr);
-	return 0;
+static int refresh_directory(const char *path, void *user_data) {
+	struct refresh_state *state = user_data;
+	return scan_listing_directory(state->type, state->listing_root_path_nbytes, path, refresh_add_item, refresh_directory, state);
 }
 
+//TODO rewrite without using recursion and with an ability to report progress
 /**
- * Refresh a listing and add new items
+ * Helper function to recursively refresh a listing
  * @param db SQLite database
- * @param listing_id id of the listing to refresh
- * @return `0` if the listing was refreshed successfully, otherwise `-1` on error
+ * @param listing_id listing id
+ * @param type listing type
+ * @param listing_root_path_nbytes length of the listing's root filepath in bytes
+ * @param path path to scan
+ * @return `0` if the path was scanned successfully, otherwise `-1` on error
  */
-int refresh_listing(sqlite3 *db, sqlite3_int64 listing_id) {
+int refresh_listing_recursive(struct tagger_db *db, sqlite3_int64 listing_id, LISTING_TYPE type,
+							  size_t listing_root_path_nbytes, const char *path) {
+	struct refresh_state state = {db, listing_id, type, listing_root_path_nbytes};
+	return refresh_directory(path, &state);
+}
+
+/**
+ * @brief Get the type and root path of a listing
+ *
+ * @param db tagger database
+ * @param listing_id id of the listing
+ * @param type where to store the listing type
+ * @param path where to store the root path, free it with `free`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int get_listing_location(struct tagger_db *db, sqlite3_int64 listing_id, LISTING_TYPE *type, char **path) {
 	sqlite3_stmt *stmt;
-	char *path;
-	LISTING_TYPE type;
 	size_t malloc_bytes;
 
-	int rc = sqlite3_prepare_v2(db,
-		"SELECT listing_type,listing_path FROM " LISTINGS_TABLE_NAME " WHERE listing_id=? LIMIT 1;", -1, &stmt, NULL);
-
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_GET_LISTING);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	rc = sqlite3_bind_int64(stmt, 1, listing_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
 	rc = sqlite3_step(stmt);
 	if (rc == SQLITE_ROW) {
-		type = (LISTING_TYPE) sqlite3_column_int(stmt, 0);
+		*type = (LISTING_TYPE) sqlite3_column_int(stmt, 0);
 
 		malloc_bytes = sqlite3_column_bytes(stmt, 1);
-		path = malloc(malloc_bytes + 1);
-		if (path == NULL) {
-			sqlite3_finalize(stmt);
+		*path = malloc(malloc_bytes + 1);
+		if (*path == NULL) {
+			release_statement(stmt);
 			return -1;
 		}
-		memcpy(path, sqlite3_column_text(stmt, 1), malloc_bytes);
-		path[malloc_bytes] = '\0';
+		memcpy(*path, sqlite3_column_text(stmt, 1), malloc_bytes);
+		(*path)[malloc_bytes] = '\0';
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
-	sqlite3_finalize(stmt);
-	// fprintf(stderr, "type: %d, path: %s\n", type, path);
+	release_statement(stmt);
+	return 0;
+}
+
+/**
+ * Refresh a listing and add new items
+ * @param db SQLite database
+ * @param listing_id id of the listing to refresh
+ * @return `0` if the listing was refreshed successfully, otherwise `-1` on error
+ */
+int refresh_listing(struct tagger_db *db, sqlite3_int64 listing_id) {
+	LISTING_TYPE type;
+	char *path;
+
+	if (get_listing_location(db, listing_id, &type, &path)) return -1;
 
 	if (refresh_listing_recursive(db, listing_id, type, strlen((const char*)path), (const char*)path)) {
 		free(path);
@@ -829,26 +1621,24 @@ int refresh_listing(sqlite3 *db, sqlite3_int64 listing_id) {
 /**
  * @brief Get the number of items in a listing
  *
- * @param db sqlite database
+ * @param db tagger database
  * @param listing_id id of the listing
  * @return the number of items in the listing, or `-1` on error
  */
-int get_listing_size(sqlite3 *db, sqlite3_int64 listing_id) {
+int get_listing_size(struct tagger_db *db, sqlite3_int64 listing_id) {
 	sqlite3_stmt *stmt;
 	int count = 0;
 
-	int rc = sqlite3_prepare_v2(db,
-		"SELECT COUNT(*) FROM " ITEMS_TABLE_NAME " WHERE listing_id=?;", -1, &stmt, NULL);
-
-	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+	int rc;
+	stmt = get_statement(db, STMT_LISTING_SIZE);
+	if (stmt == NULL) {
 		return -1;
 	}
 
 	rc = sqlite3_bind_int64(stmt, 1, listing_id);
 	if (rc != SQLITE_OK) {
-		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
 
@@ -856,22 +1646,158 @@ int get_listing_size(sqlite3 *db, sqlite3_int64 listing_id) {
 	if (rc == SQLITE_ROW) {
 		count = sqlite3_column_int(stmt, 0);
 	} else {
-		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(stmt);
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		release_statement(stmt);
 		return -1;
 	}
-	sqlite3_finalize(stmt);
+	release_statement(stmt);
 	
 	return count;
 }
 
 /**
- * Initialize all required tables in the provided database, creates them if they don't exist
+ * Check if a table exists in the main database
+ *
+ * @param db SQLite3 database
+ * @param table_name name of the table
+ * @return `1` if the table exists, `0` if not, `-1` on error
+ */
+int table_exists(struct tagger_db *db, const char *table_name) {
+	sqlite3_stmt *stmt;
+
+	int rc = sqlite3_prepare_v2(db->connection,
+		"SELECT EXISTS(SELECT 1 FROM sqlite_master WHERE type='table' AND name=? LIMIT 1);", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	rc = sqlite3_bind_text(stmt, 1, table_name, -1, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		rc = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+		return rc;
+	} else {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+}
+
+// index for lookups by tag, used by the cursors
+static const char item_tags_tag_index_sql[] = "CREATE INDEX IF NOT EXISTS " ITEM_TAGS_TABLE_NAME "_tag_id ON "
+						   ITEM_TAGS_TABLE_NAME " (tag_id, item_id)";
+
+// keeping TAG_COOCCURRENCE up to date with every change of ITEM_TAGS, unless paused
+#define TAG_COOCCURRENCE_ACTIVE_SQL "NOT EXISTS (SELECT 1 FROM " TAG_COOCCURRENCE_PAUSED_TABLE_NAME ")"
+#define TAG_COOCCURRENCE_INSERT_TRIGGER_BODY " BEGIN " \
+	"INSERT INTO " TAG_COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) " \
+	"SELECT NEW.tag_id, tag_id, 1 FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = NEW.item_id AND tag_id <> NEW.tag_id " \
+	"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + 1;" \
+	"INSERT INTO " TAG_COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) " \
+	"SELECT tag_id, NEW.tag_id, 1 FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = NEW.item_id AND tag_id <> NEW.tag_id " \
+	"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + 1;" \
+	"END"
+
+#define TAG_COOCCURRENCE_DELETE_TRIGGER_BODY " BEGIN " \
+	"UPDATE " TAG_COOCCURRENCE_TABLE_NAME " SET count = count - 1 WHERE tag_id = OLD.tag_id " \
+	"AND related_tag_id IN (SELECT tag_id FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = OLD.item_id);" \
+	"UPDATE " TAG_COOCCURRENCE_TABLE_NAME " SET count = count - 1 WHERE related_tag_id = OLD.tag_id " \
+	"AND tag_id IN (SELECT tag_id FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = OLD.item_id);" \
+	"DELETE FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE tag_id = OLD.tag_id AND count <= 0;" \
+	"DELETE FROM " TAG_COOCCURRENCE_TABLE_NAME " WHERE related_tag_id = OLD.tag_id AND count <= 0 " \
+	"AND tag_id IN (SELECT tag_id FROM " ITEM_TAGS_TABLE_NAME " WHERE item_id = OLD.item_id);" \
+	"END"
+
+/**
+ * Create the triggers keeping the tag co-occurrence table up to date
+ *
+ * While the table is being filled by a migration, the triggers must only count
+ * the items the migration has already counted, the rest are counted by the migration.
+ * The triggers skip every row while `TAG_COOCCURRENCE_PAUSED_TABLE_NAME` has one.
+ *
+ * @param db tagger database
+ * @param counted_items_sql SQL expression with the largest item id that is counted,
+ * or `NULL` to count all items
+ * @return `0` on success, otherwise `-1` on error
+ */
+int create_tag_cooccurrence_triggers(struct tagger_db *db, const char *counted_items_sql) {
+	char *insert_sql, *delete_sql;
+	int result = -1;
+
+	if (execute_sql_string(db, "CREATE TABLE IF NOT EXISTS " TAG_COOCCURRENCE_PAUSED_TABLE_NAME " (paused INTEGER PRIMARY KEY);")) {
+		return -1;
+	}
+
+	if (counted_items_sql == NULL) {
+		insert_sql = sqlite3_mprintf("CREATE TRIGGER IF NOT EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ai "
+			"AFTER INSERT ON " ITEM_TAGS_TABLE_NAME " WHEN " TAG_COOCCURRENCE_ACTIVE_SQL TAG_COOCCURRENCE_INSERT_TRIGGER_BODY);
+		delete_sql = sqlite3_mprintf("CREATE TRIGGER IF NOT EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ad "
+			"AFTER DELETE ON " ITEM_TAGS_TABLE_NAME " WHEN " TAG_COOCCURRENCE_ACTIVE_SQL TAG_COOCCURRENCE_DELETE_TRIGGER_BODY);
+	} else {
+		insert_sql = sqlite3_mprintf("CREATE TRIGGER IF NOT EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ai "
+			"AFTER INSERT ON " ITEM_TAGS_TABLE_NAME " WHEN " TAG_COOCCURRENCE_ACTIVE_SQL " AND NEW.item_id <= (%s)"
+			TAG_COOCCURRENCE_INSERT_TRIGGER_BODY, counted_items_sql);
+		delete_sql = sqlite3_mprintf("CREATE TRIGGER IF NOT EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ad "
+			"AFTER DELETE ON " ITEM_TAGS_TABLE_NAME " WHEN " TAG_COOCCURRENCE_ACTIVE_SQL " AND OLD.item_id <= (%s)"
+			TAG_COOCCURRENCE_DELETE_TRIGGER_BODY, counted_items_sql);
+	}
+
+	if (insert_sql == NULL || delete_sql == NULL) {
+		fputs("Could not allocate memory for SQL query\n", stderr);
+	} else if (!execute_sql_string(db, insert_sql) && !execute_sql_string(db, delete_sql)) {
+		result = 0;
+	}
+	sqlite3_free(insert_sql);
+	sqlite3_free(delete_sql);
+	return result;
+}
+
+/**
+ * Create the index and triggers that are maintained on every change of the item tags
+ *
+ * @param db tagger database, the item tags and tag co-occurrence tables must exist
+ * @return `0` on success, otherwise `-1` on error
+ */
+int create_item_tags_indexes(struct tagger_db *db) {
+	if (execute_sql_string(db, (char*) item_tags_tag_index_sql) || create_tag_cooccurrence_triggers(db, NULL)) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Drop the index and triggers of the item tags, so a bulk insert only writes the table itself
+ *
+ * The tag co-occurrence table is stale afterwards, recreate the index and triggers
+ * with `create_item_tags_indexes` and recount it with `rebuild_tag_cooccurrence`.
+ *
+ * @param db tagger database
+ * @return `0` on success, otherwise `-1` on error
+ */
+int drop_item_tags_indexes(struct tagger_db *db) {
+	if (execute_sql_string(db, "DROP INDEX IF EXISTS " ITEM_TAGS_TABLE_NAME "_tag_id;") ||
+		execute_sql_string(db, "DROP TRIGGER IF EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ai;") ||
+		execute_sql_string(db, "DROP TRIGGER IF EXISTS " TAG_COOCCURRENCE_TABLE_NAME "_ad;")) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Create the tables of the first schema version, see `migrate_database`
  *
  * @param db pointer to SQLite3 database
- * @return `0` if all required tables are initialized,  otherwise `-1` on error
+ * @return `0` if all tables are created,  otherwise `-1` on error
  */
-int init_tables(sqlite3 *db) {
+int create_base_tables(struct tagger_db *db) {
 	// Creating LISTINGS table
 	static const char listings_table_sql[] = "CREATE TABLE IF NOT EXISTS " LISTINGS_TABLE_NAME " ("
 							   "listing_id INTEGER PRIMARY KEY NOT NULL,"
@@ -932,26 +1858,167 @@ int init_tables(sqlite3 *db) {
 		return -1;
 	}
 
+	// Index for lookups by listing, used by the cursors
+	static const char items_listing_index_sql[] = "CREATE INDEX IF NOT EXISTS " ITEMS_TABLE_NAME "_listing_id ON "
+							   ITEMS_TABLE_NAME " (listing_id, item_id)";
+
+	if (execute_sql_string(db, (char*) items_listing_index_sql) || execute_sql_string(db, (char*) item_tags_tag_index_sql)) {
+		fputs("Indexes could not be created\n", stderr);
+		return -1;
+	}
+
 	return 0;
 }
 
 /**
- * Opens SQLite3 database in the specified location and returns the pointer to it
+ * Initialize all required tables in the provided database, creates them if they don't exist
+ * and migrates an older schema to the current one
+ *
+ * @param db pointer to SQLite3 database
+ * @return `0` if all required tables are initialized,  otherwise `-1` on error
+ */
+int init_tables(struct tagger_db *db) {
+	return migrate_database(db, SCHEMA_VERSION, 0, 0) == 1 ? 0 : -1;
+}
+
+/**
+ * Settings applied to a connection when it is opened, see `open_database`
+ */
+struct database_profile {
+	const char *name;
+	int open_flags;
+	int page_size; // only takes effect when the database file is created
+	const char *auto_vacuum; // only takes effect when the database file is created, `NULL` to keep it
+	const char *journal_mode; // `NULL` keeps the journal mode of the database file
+	sqlite3_int64 journal_size_limit; // in bytes, the WAL file is truncated to it after a checkpoint
+	const char *synchronous;
+	int cache_size; // in pages if positive, in KiB if negative
+	sqlite3_int64 mmap_size; // in bytes, `0` disables memory-mapped I/O
+	const char *temp_store;
+	int busy_timeout; // in milliseconds
+};
+
+static const struct database_profile database_profiles[] = {
+	// a single user running the CLI, every commit is synced to the WAL so it survives a power loss
+	[PROFILE_INTERACTIVE] = {"interactive", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+		4096, "INCREMENTAL", "WAL", 64LL << 20, "FULL", -16384, 64LL << 20, "MEMORY", 1000},
+	// imports that can be rerun from scratch if the machine crashes, so nothing is synced
+	[PROFILE_BULK_LOAD] = {"bulk-load", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+		16384, "INCREMENTAL", "WAL", 64LL << 20, "OFF", -262144, 256LL << 20, "MEMORY", 5000},
+	// reports and exports, the journal mode cannot be changed without write access
+	[PROFILE_READ_ONLY] = {"read-only", SQLITE_OPEN_READONLY,
+		4096, NULL, NULL, -1, "NORMAL", -65536, 1LL << 30, "MEMORY", 5000},
+	// long running process serving many reads and occasional writes
+	[PROFILE_SERVER] = {"server", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+		4096, "INCREMENTAL", "WAL", 64LL << 20, "NORMAL", -65536, 1LL << 30, "MEMORY", 5000},
+};
+
+#define DATABASE_PROFILES_COUNT (sizeof(database_profiles) / sizeof(database_profiles[0]))
+
+/**
+ * @brief Find a profile by its name, e.g. `bulk-load`
+ *
+ * @param name profile name
+ * @return the profile, or `-1` if there is no profile with that name
+ */
+int database_profile_from_name(const char *name) {
+	if (name == NULL) return -1;
+
+	for (size_t i = 0; i < DATABASE_PROFILES_COUNT; i++) {
+		if (!strcmp(database_profiles[i].name, name)) return (int) i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Get the name of a profile
+ *
+ * @return the profile name, or `NULL` for an unknown profile
+ */
+const char* database_profile_name(DATABASE_PROFILE profile) {
+	if ((size_t) profile >= DATABASE_PROFILES_COUNT) return NULL;
+	return database_profiles[profile].name;
+}
+
+/**
+ * @brief Apply the pragmas of a profile to a freshly opened connection
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int apply_database_profile(struct tagger_db *db, const struct database_profile *profile) {
+	char sql[192];
+
+	sqlite3_busy_timeout(db->connection, profile->busy_timeout);
+
+	// the page size and auto vacuum have to be set before journal_mode=WAL creates the first page,
+	// incremental auto vacuum lets `run_maintenance_slice` return free pages a few at a time
+	snprintf(sql, sizeof(sql), "PRAGMA page_size=%d;", profile->page_size);
+	if (execute_sql_string(db, sql)) return -1;
+
+	if (profile->auto_vacuum != NULL) {
+		snprintf(sql, sizeof(sql), "PRAGMA auto_vacuum=%s;", profile->auto_vacuum);
+		if (execute_sql_string(db, sql)) return -1;
+	}
+
+	if (profile->journal_mode != NULL) {
+		snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", profile->journal_mode);
+		if (execute_sql_string(db, sql)) return -1;
+	}
+
+	snprintf(sql, sizeof(sql), "PRAGMA journal_size_limit=%lld; PRAGMA synchronous=%s; PRAGMA cache_size=%d; PRAGMA mmap_size=%lld; PRAGMA temp_store=%s;",
+		profile->journal_size_limit, profile->synchronous, profile->cache_size, profile->mmap_size, profile->temp_store);
+	if (execute_sql_string(db, sql)) return -1;
+
+	if (profile->open_flags & SQLITE_OPEN_READONLY && execute_sql_string(db, "PRAGMA query_only=ON;")) return -1;
+
+	return 0;
+}
+
+/**
+ * Opens SQLite3 database in the specified location and returns a tagger database handle for it
  *
  * @param database_location location of the database to open,
  * if specified as `NULL`, `DATABASE_DEFAULT_LOCATION` is used instead
- * @return pointer to the opened database, otherwise `NULL` on error
+ * @param profile how to tune the connection, `PROFILE_READ_ONLY` requires an existing database,
+ * every writable profile switches the database file to WAL, which stays after it is closed
+ * @return pointer to the opened database, otherwise `NULL` on error, close it with `close_database`
  */
-sqlite3* open_database(char *database_location) {
-	sqlite3 *db;
+struct tagger_db* open_database(char *database_location, DATABASE_PROFILE profile) {
 	char *location = DATABASE_DEFAULT_LOCATION;
 
 	if (database_location != NULL) {
 		location = database_location;
 	}
 
-	if (sqlite3_open(location, &db)) {
-		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+	if ((size_t) profile >= DATABASE_PROFILES_COUNT) {
+		fprintf(stderr, "Unknown database profile %d\n", (int) profile);
+		return NULL;
+	}
+
+	struct tagger_db *db = calloc(1, sizeof(struct tagger_db));
+	if (db == NULL) {
+		fputs("Could not allocate memory for database\n", stderr);
+		return NULL;
+	}
+	db->statements = calloc(STMT_COUNT, sizeof(sqlite3_stmt*));
+	db->borrowed = calloc(STMT_COUNT, sizeof(unsigned char));
+	if (db->statements == NULL || db->borrowed == NULL) {
+		fputs("Could not allocate memory for database\n", stderr);
+		free(db->statements);
+		free(db->borrowed);
+		free(db);
+		return NULL;
+	}
+
+	if (sqlite3_open_v2(location, &db->connection, database_profiles[profile].open_flags, NULL)) {
+		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db->connection));
+		close_database(db);
+		return NULL;
+	}
+
+	if (apply_database_profile(db, &database_profiles[profile])) {
+		fprintf(stderr, "Could not apply the %s database profile\n", database_profiles[profile].name);
+		close_database(db);
 		return NULL;
 	}
 
@@ -959,12 +2026,22 @@ sqlite3* open_database(char *database_location) {
 }
 
 /**
- * Closes the SQLite3 database
+ * Closes the SQLite3 database and frees the handle
+ *
+ * All cursors must be closed before, and the tag tries, trigram and bitmap indexes
+ * built on the database freed, they unsubscribe from its tag events.
  *
  * @param db pointer to the database to close
  */
-void close_database(sqlite3 *db) {
+void close_database(struct tagger_db *db) {
 	if (db != NULL) {
-		sqlite3_close(db);
+		tag_events_detach(db);
+		for (int i = 0; i < STMT_COUNT; i++) {
+			sqlite3_finalize(db->statements[i]);
+		}
+		sqlite3_close(db->connection);
+		free(db->statements);
+		free(db->borrowed);
+		free(db);
 	}
 }
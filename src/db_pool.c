@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../include/database.h"
+#include "../include/db_pool.h"
+#include "../include/maintenance.h"
+
+#define DB_POOL_MAINTENANCE_INTERVAL_MS 5000
+#define DB_POOL_MAINTENANCE_RETRY_MS 100
+
+struct db_pool_write {
+	db_pool_fn fn;
+	void *arg;
+	int result;
+	int done;
+	int async; // async writes are freed by the writer thread, nobody waits for them
+	struct db_pool_write *next;
+};
+
+struct db_pool {
+	struct tagger_db **readers; // idle reader connections, used as a stack
+	int idle_readers;
+	int readers_count;
+	pthread_mutex_t readers_lock;
+	pthread_cond_t reader_available;
+
+	struct tagger_db *writer; // only ever used by the writer thread once it runs
+	pthread_t writer_thread;
+	struct db_pool_write *queue_head, *queue_tail;
+	int writing; // the writer thread is running a write taken off the queue
+	int failed_async_writes; // since the last `db_pool_flush`
+	int stopping;
+	struct timespec next_maintenance; // on the monotonic clock
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_changed; // a write was queued or the pool is closing
+	pthread_cond_t write_done; // a write finished, wakes up the waiting callers and flushes
+};
+
+/**
+ * @brief Schedule the next maintenance slice of the writer thread
+ */
+static void db_pool_schedule_maintenance(struct db_pool *pool, int delay_ms) {
+	clock_gettime(CLOCK_MONOTONIC, &pool->next_maintenance);
+	pool->next_maintenance.tv_sec += delay_ms / 1000;
+	pool->next_maintenance.tv_nsec += (delay_ms % 1000) * 1000000L;
+	if (pool->next_maintenance.tv_nsec >= 1000000000L) {
+		pool->next_maintenance.tv_sec++;
+		pool->next_maintenance.tv_nsec -= 1000000000L;
+	}
+}
+
+static int db_pool_maintenance_due(struct db_pool *pool) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > pool->next_maintenance.tv_sec ||
+		(now.tv_sec == pool->next_maintenance.tv_sec && now.tv_nsec >= pool->next_maintenance.tv_nsec);
+}
+
+/**
+ * @brief Writer thread, runs the queued writes one after another on the write connection
+ *
+ * Between writes it runs a short maintenance slice every `DB_POOL_MAINTENANCE_INTERVAL_MS`,
+ * and more often while maintenance is still due.
+ */
+static void* db_pool_writer_run(void *arg) {
+	struct db_pool *pool = arg;
+	struct db_pool_write *write;
+
+	pthread_mutex_lock(&pool->queue_lock);
+	for (;;) {
+		if (!pool->stopping && db_pool_maintenance_due(pool)) {
+			pthread_mutex_unlock(&pool->queue_lock);
+			int more = run_maintenance_slice(pool->writer, NULL, NULL);
+			pthread_mutex_lock(&pool->queue_lock);
+			db_pool_schedule_maintenance(pool, more == 1 ? DB_POOL_MAINTENANCE_RETRY_MS : DB_POOL_MAINTENANCE_INTERVAL_MS);
+		}
+
+		if (pool->queue_head == NULL && !pool->stopping) {
+			pthread_cond_timedwait(&pool->queue_changed, &pool->queue_lock, &pool->next_maintenance);
+			continue;
+		}
+		// queued writes are still run when the pool is closing
+		if (pool->queue_head == NULL) break;
+
+		write = pool->queue_head;
+		pool->queue_head = write->next;
+		if (pool->queue_head == NULL) pool->queue_tail = NULL;
+		pool->writing = 1;
+		pthread_mutex_unlock(&pool->queue_lock);
+
+		int result = write->fn(pool->writer, write->arg);
+
+		pthread_mutex_lock(&pool->queue_lock);
+		pool->writing = 0;
+		if (write->async) {
+			if (result == -1) pool->failed_async_writes++;
+			free(write);
+		} else {
+			write->result = result;
+			write->done = 1;
+		}
+		pthread_cond_broadcast(&pool->write_done);
+	}
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	return NULL;
+}
+
+/**
+ * @brief Open a pool of read-only connections and a writer thread on a database
+ *
+ * The writer connection uses the server profile, so the database is switched to WAL
+ * and readers never block the writer. Tables are initialized before the readers are opened.
+ * The writer thread also runs the database maintenance, see `run_maintenance_slice`.
+ * Tag events of the writer connection are delivered on the writer thread.
+ *
+ * @param database_location location of the database, `NULL` for the default location
+ * @param readers number of reader connections, at least `1`
+ * @return a pointer to the new pool, or `NULL` on error, close it with `db_pool_close`
+ */
+struct db_pool* db_pool_open(char *database_location, int readers) {
+	if (readers < 1) {
+		fputs("A database pool needs at least one reader\n", stderr);
+		return NULL;
+	}
+
+	struct db_pool *pool = calloc(1, sizeof(struct db_pool));
+	if (pool == NULL || (pool->readers = calloc(readers, sizeof(struct tagger_db*))) == NULL) {
+		fputs("Could not allocate memory for database pool\n", stderr);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->readers_lock, NULL);
+	pthread_cond_init(&pool->reader_available, NULL);
+	pthread_mutex_init(&pool->queue_lock, NULL);
+	pthread_condattr_t queue_changed_attr;
+	pthread_condattr_init(&queue_changed_attr);
+	pthread_condattr_setclock(&queue_changed_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->queue_changed, &queue_changed_attr);
+	pthread_condattr_destroy(&queue_changed_attr);
+	pthread_cond_init(&pool->write_done, NULL);
+	db_pool_schedule_maintenance(pool, DB_POOL_MAINTENANCE_INTERVAL_MS);
+
+	pool->writer = open_database(database_location, PROFILE_SERVER);
+	if (pool->writer == NULL || init_tables(pool->writer)) {
+		fputs("Could not open the writer connection of the database pool\n", stderr);
+		close_database(pool->writer);
+		pool->writer = NULL;
+		db_pool_close(pool);
+		return NULL;
+	}
+
+	for (int i = 0; i < readers; i++) {
+		pool->readers[i] = open_database(database_location, PROFILE_READ_ONLY);
+		if (pool->readers[i] == NULL) {
+			fputs("Could not open a reader connection of the database pool\n", stderr);
+			close_database(pool->writer);
+			pool->writer = NULL;
+			db_pool_close(pool);
+			return NULL;
+		}
+		pool->readers_count++;
+		pool->idle_readers++;
+	}
+
+	if (pthread_create(&pool->writer_thread, NULL, db_pool_writer_run, pool)) {
+		fputs("Could not start the writer thread of the database pool\n", stderr);
+		close_database(pool->writer);
+		pool->writer = NULL;
+		db_pool_close(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/**
+ * @brief Run a read on an idle reader connection in the calling thread
+ *
+ * Blocks while all readers are busy. The connection is read-only,
+ * any attempt to write on it fails.
+ *
+ * @param pool database pool
+ * @param fn function to run with the reader connection
+ * @param arg argument passed to `fn`
+ * @return the result of `fn`, or `-1` on error
+ */
+int db_pool_read(struct db_pool *pool, db_pool_fn fn, void *arg) {
+	if (pool == NULL || fn == NULL) return -1;
+
+	pthread_mutex_lock(&pool->readers_lock);
+	while (pool->idle_readers == 0) {
+		pthread_cond_wait(&pool->reader_available, &pool->readers_lock);
+	}
+	struct tagger_db *reader = pool->readers[--pool->idle_readers];
+	pthread_mutex_unlock(&pool->readers_lock);
+
+	int result = fn(reader, arg);
+
+	pthread_mutex_lock(&pool->readers_lock);
+	pool->readers[pool->idle_readers++] = reader;
+	pthread_cond_signal(&pool->reader_available);
+	pthread_mutex_unlock(&pool->readers_lock);
+
+	return result;
+}
+
+/**
+ * @brief Append a write to the queue of the writer thread
+ *
+ * @return `0` on success, otherwise `-1` if the pool is closing
+ */
+static int db_pool_enqueue(struct db_pool *pool, struct db_pool_write *write) {
+	if (pool->stopping) {
+		fputs("Database pool is closing, the write was rejected\n", stderr);
+		return -1;
+	}
+
+	write->next = NULL;
+	if (pool->queue_tail != NULL) {
+		pool->queue_tail->next = write;
+	} else {
+		pool->queue_head = write;
+	}
+	pool->queue_tail = write;
+	pthread_cond_signal(&pool->queue_changed);
+	return 0;
+}
+
+/**
+ * @brief Run a write on the writer thread and wait for it to finish
+ *
+ * Writes from all threads run one at a time in the order they were queued.
+ *
+ * @param pool database pool
+ * @param fn function to run with the writer connection
+ * @param arg argument passed to `fn`
+ * @return the result of `fn`, or `-1` on error
+ */
+int db_pool_write(struct db_pool *pool, db_pool_fn fn, void *arg) {
+	if (pool == NULL || fn == NULL) return -1;
+
+	struct db_pool_write write = {fn, arg, -1, 0, 0, NULL};
+
+	pthread_mutex_lock(&pool->queue_lock);
+	if (db_pool_enqueue(pool, &write)) {
+		pthread_mutex_unlock(&pool->queue_lock);
+		return -1;
+	}
+	while (!write.done) {
+		pthread_cond_wait(&pool->write_done, &pool->queue_lock);
+	}
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	return write.result;
+}
+
+/**
+ * @brief Queue a write on the writer thread without waiting for it
+ *
+ * `arg` must stay valid until the write has run, see `db_pool_flush`.
+ *
+ * @param pool database pool
+ * @param fn function to run with the writer connection, returning `-1` counts as a failed write
+ * @param arg argument passed to `fn`
+ * @return `0` if the write was queued, otherwise `-1` on error
+ */
+int db_pool_write_async(struct db_pool *pool, db_pool_fn fn, void *arg) {
+	if (pool == NULL || fn == NULL) return -1;
+
+	struct db_pool_write *write = malloc(sizeof(struct db_pool_write));
+	if (write == NULL) {
+		fputs("Could not allocate memory for database pool write\n", stderr);
+		return -1;
+	}
+	write->fn = fn;
+	write->arg = arg;
+	write->result = -1;
+	write->done = 0;
+	write->async = 1;
+
+	pthread_mutex_lock(&pool->queue_lock);
+	if (db_pool_enqueue(pool, write)) {
+		pthread_mutex_unlock(&pool->queue_lock);
+		free(write);
+		return -1;
+	}
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Wait until every queued write has run
+ *
+ * @param pool database pool
+ * @return `0` if all async writes since the last flush succeeded, otherwise `-1`
+ */
+int db_pool_flush(struct db_pool *pool) {
+	if (pool == NULL) return -1;
+
+	pthread_mutex_lock(&pool->queue_lock);
+	while (pool->queue_head != NULL || pool->writing) {
+		pthread_cond_wait(&pool->write_done, &pool->queue_lock);
+	}
+	int failed = pool->failed_async_writes;
+	pool->failed_async_writes = 0;
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	if (failed) {
+		fprintf(stderr, "%d queued database writes failed\n", failed);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Run the remaining queued writes, stop the writer thread and close all connections
+ *
+ * No reads may be running when the pool is closed.
+ *
+ * @param pool database pool, may be `NULL`
+ */
+void db_pool_close(struct db_pool *pool) {
+	if (pool == NULL) return;
+
+	if (pool->writer != NULL) {
+		pthread_mutex_lock(&pool->queue_lock);
+		pool->stopping = 1;
+		pthread_cond_signal(&pool->queue_changed);
+		pthread_mutex_unlock(&pool->queue_lock);
+		pthread_join(pool->writer_thread, NULL);
+		close_database(pool->writer);
+	}
+
+	for (int i = 0; i < pool->readers_count; i++) {
+		close_database(pool->readers[i]);
+	}
+	free(pool->readers);
+
+	pthread_mutex_destroy(&pool->readers_lock);
+	pthread_cond_destroy(&pool->reader_available);
+	pthread_mutex_destroy(&pool->queue_lock);
+	pthread_cond_destroy(&pool->queue_changed);
+	pthread_cond_destroy(&pool->write_done);
+	free(pool);
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/database.h"
+#include "../include/export.h"
+
+#define EXPORT_OUTPUT_BUFFER_SIZE (1 << 20)
+#define CSV_TAGS_SEPARATOR ";"
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+
+struct text_buffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+static int text_buffer_append(struct text_buffer *buffer, const char *text, size_t length) {
+	if (buffer->length + length + 1 > buffer->capacity) {
+		size_t new_capacity = buffer->capacity ? buffer->capacity : 256;
+		while (buffer->length + length + 1 > new_capacity) new_capacity *= 2;
+		char *new_data = realloc(buffer->data, new_capacity);
+		if (new_data == NULL) {
+			fputs("Could not allocate memory for export\n", stderr);
+			return -1;
+		}
+		buffer->data = new_data;
+		buffer->capacity = new_capacity;
+	}
+
+	memcpy(buffer->data + buffer->length, text, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+	return 0;
+}
+
+/**
+ * @brief Append a string as a quoted and escaped JSON string
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int append_json_string(struct text_buffer *buffer, const char *text) {
+	char escape[8];
+	const char *start = text;
+
+	if (text_buffer_append(buffer, "\"", 1)) return -1;
+	for (; *text; text++) {
+		unsigned char c = *text;
+		if (c != '"' && c != '\\' && c >= 0x20) continue;
+
+		// copy the run of characters that need no escaping at once
+		if (text_buffer_append(buffer, start, text - start)) return -1;
+		switch (c) {
+			case '"': strcpy(escape, "\\\""); break;
+			case '\\': strcpy(escape, "\\\\"); break;
+			case '\n': strcpy(escape, "\\n"); break;
+			case '\r': strcpy(escape, "\\r"); break;
+			case '\t': strcpy(escape, "\\t"); break;
+			default: snprintf(escape, sizeof(escape), "\\u%04x", c);
+		}
+		if (text_buffer_append(buffer, escape, strlen(escape))) return -1;
+		start = text + 1;
+	}
+	return text_buffer_append(buffer, start, text - start) || text_buffer_append(buffer, "\"", 1) ? -1 : 0;
+}
+
+/**
+ * @brief Append a CSV field, quoted only if it contains a separator, quote or line break
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int append_csv_field(struct text_buffer *buffer, const char *text) {
+	if (strpbrk(text, ",\"\r\n") == NULL) return text_buffer_append(buffer, text, strlen(text));
+
+	if (text_buffer_append(buffer, "\"", 1)) return -1;
+	for (const char *quote; (quote = strchr(text, '"')) != NULL; text = quote + 1) {
+		if (text_buffer_append(buffer, text, quote - text + 1) || text_buffer_append(buffer, "\"", 1)) return -1;
+	}
+	return text_buffer_append(buffer, text, strlen(text)) || text_buffer_append(buffer, "\"", 1) ? -1 : 0;
+}
+
+/**
+ * @brief Append a tag name to the joined tags of a CSV line, escaping the separator and backslashes
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int append_csv_tag(struct text_buffer *buffer, const char *tag_name) {
+	const char *special;
+
+	while ((special = strpbrk(tag_name, CSV_TAGS_SEPARATOR "\\")) != NULL) {
+		if (text_buffer_append(buffer, tag_name, special - tag_name) || text_buffer_append(buffer, "\\", 1) ||
+			text_buffer_append(buffer, special, 1)) return -1;
+		tag_name = special + 1;
+	}
+	return text_buffer_append(buffer, tag_name, strlen(tag_name));
+}
+
+/**
+ * @brief Run a query and hand every row to a callback
+ *
+ * @return number of rows, or `-1` on error
+ */
+static sqlite3_int64 export_rows(struct tagger_db *db, const char *sql, int (*write_row)(sqlite3_stmt *stmt, void *ctx), void *ctx) {
+	sqlite3_stmt *stmt;
+	sqlite3_int64 rows = 0;
+
+	int rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (write_row(stmt, ctx)) {
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		rows++;
+	}
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return rows;
+}
+
+struct export_state {
+	FILE *output;
+	EXPORT_FORMAT format;
+	struct text_buffer pending; // output not written yet, the current item's fields at its end
+	struct text_buffer tags; // joined tags of the current item
+	sqlite3_int64 item_id; // current item, `0` before the first one
+	sqlite3_int64 items;
+};
+
+/**
+ * @brief Write out the pending output
+ */
+static int flush_pending(struct export_state *state) {
+	if (state->pending.length > 0 && fwrite(state->pending.data, 1, state->pending.length, state->output) != state->pending.length) {
+		fputs("Error when writing the export\n", stderr);
+		return -1;
+	}
+	state->pending.length = 0;
+	return 0;
+}
+
+/**
+ * @brief End a line, lines are written out in large blocks
+ */
+static int write_line(struct export_state *state) {
+	if (text_buffer_append(&state->pending, "\n", 1)) return -1;
+	return state->pending.length >= EXPORT_OUTPUT_BUFFER_SIZE ? flush_pending(state) : 0;
+}
+
+static int write_listing_row(sqlite3_stmt *stmt, void *ctx) {
+	struct export_state *state = ctx;
+	char number[64];
+
+	snprintf(number, sizeof(number), "{\"type\":\"listing\",\"listing_id\":%lld,\"name\":", sqlite3_column_int64(stmt, 0));
+	if (text_buffer_append(&state->pending, number, strlen(number)) ||
+		append_json_string(&state->pending, (const char*) sqlite3_column_text(stmt, 1))) return -1;
+	snprintf(number, sizeof(number), ",\"listing_type\":%d,\"path\":", sqlite3_column_int(stmt, 2));
+	if (text_buffer_append(&state->pending, number, strlen(number)) ||
+		append_json_string(&state->pending, (const char*) sqlite3_column_text(stmt, 3)) ||
+		text_buffer_append(&state->pending, "}", 1)) return -1;
+	return write_line(state);
+}
+
+static int write_tag_row(sqlite3_stmt *stmt, void *ctx) {
+	struct export_state *state = ctx;
+	char number[64];
+
+	snprintf(number, sizeof(number), "{\"type\":\"tag\",\"tag_id\":%lld,\"name\":", sqlite3_column_int64(stmt, 0));
+	if (text_buffer_append(&state->pending, number, strlen(number)) ||
+		append_json_string(&state->pending, (const char*) sqlite3_column_text(stmt, 1)) ||
+		text_buffer_append(&state->pending, "}", 1)) return -1;
+	return write_line(state);
+}
+
+/**
+ * @brief Write the current item's line, its fields are already in `state->pending`
+ */
+static int finish_item(struct export_state *state) {
+	if (state->item_id == 0) return 0;
+
+	if (state->format == EXPORT_JSONL) {
+		if (text_buffer_append(&state->pending, ",\"tags\":[", 9) ||
+			text_buffer_append(&state->pending, state->tags.data != NULL ? state->tags.data : "", state->tags.length) ||
+			text_buffer_append(&state->pending, "]}", 2)) return -1;
+	} else {
+		if (text_buffer_append(&state->pending, ",", 1) ||
+			append_csv_field(&state->pending, state->tags.data != NULL ? state->tags.data : "")) return -1;
+	}
+
+	state->tags.length = 0;
+	state->items++;
+	return write_line(state);
+}
+
+/**
+ * @brief Handle one (item, tag) row of the ordered scan, starting a new line when the item changes
+ */
+static int write_item_tag_row(sqlite3_stmt *stmt, void *ctx) {
+	struct export_state *state = ctx;
+	sqlite3_int64 item_id = sqlite3_column_int64(stmt, 0);
+	const char *tag_name = (const char*) sqlite3_column_text(stmt, 4);
+	char number[64];
+
+	if (item_id != state->item_id) {
+		if (finish_item(state)) return -1;
+		state->item_id = item_id;
+
+		if (state->format == EXPORT_JSONL) {
+			snprintf(number, sizeof(number), "{\"type\":\"item\",\"item_id\":%lld,\"listing_id\":%lld,\"name\":",
+				item_id, sqlite3_column_int64(stmt, 1));
+			if (text_buffer_append(&state->pending, number, strlen(number)) ||
+				append_json_string(&state->pending, (const char*) sqlite3_column_text(stmt, 2)) ||
+				text_buffer_append(&state->pending, ",\"relpath\":", 11) ||
+				append_json_string(&state->pending, (const char*) sqlite3_column_text(stmt, 3))) return -1;
+		} else {
+			snprintf(number, sizeof(number), "%lld,%lld,", item_id, sqlite3_column_int64(stmt, 1));
+			if (text_buffer_append(&state->pending, number, strlen(number)) ||
+				append_csv_field(&state->pending, (const char*) sqlite3_column_text(stmt, 2)) ||
+				text_buffer_append(&state->pending, ",", 1) ||
+				append_csv_field(&state->pending, (const char*) sqlite3_column_text(stmt, 3))) return -1;
+		}
+	}
+
+	if (tag_name == NULL) return 0; // an item without tags
+
+	if (state->format == EXPORT_JSONL) {
+		if (state->tags.length > 0 && text_buffer_append(&state->tags, ",", 1)) return -1;
+		return append_json_string(&state->tags, tag_name);
+	}
+	if (state->tags.length > 0 && text_buffer_append(&state->tags, CSV_TAGS_SEPARATOR, 1)) return -1;
+	return append_csv_tag(&state->tags, tag_name);
+}
+
+/**
+ * @brief Export the whole database, one line per item with its tags
+ *
+ * All items are read in a single scan ordered by `item_id`, joined with their
+ * tags through the primary key of the item tags, so memory use does not grow
+ * with the number of items. The scan runs in one read transaction, so the export
+ * is a consistent snapshot.
+ *
+ * JSONL starts with a line per listing and per tag, followed by lines like
+ * `{"type":"item","item_id":1,"listing_id":1,"name":"...","relpath":"...","tags":["..."]}`.
+ * CSV has a header and an `item_id,listing_id,item_name,item_relpath,tags` line per item,
+ * the tags are joined with `;`, and a `;` or `\` inside a tag name is preceded by a `\`.
+ *
+ * @param db tagger database
+ * @param output where to write the export, it is flushed but not closed
+ * @param format export format
+ * @return number of items exported, or `-1` on error
+ */
+sqlite3_int64 export_database(struct tagger_db *db, FILE *output, EXPORT_FORMAT format) {
+	struct export_state state = {output, format, {NULL, 0, 0}, {NULL, 0, 0}, 0, 0};
+	int result = -1;
+
+	if (db == NULL || output == NULL) return -1;
+
+	// a savepoint works as a read transaction of its own and inside the caller's transaction
+	if (execute_sql_string(db, "SAVEPOINT tagger_export;")) return -1;
+
+	if (format == EXPORT_JSONL) {
+		if (export_rows(db, "SELECT listing_id, listing_name, listing_type, listing_path FROM listings ORDER BY listing_id;",
+				write_listing_row, &state) == -1 ||
+			export_rows(db, "SELECT tag_id, tag_name FROM tags ORDER BY tag_id;", write_tag_row, &state) == -1) {
+			goto cleanup;
+		}
+	} else if (fputs("item_id,listing_id,item_name,item_relpath,tags\n", output) == EOF) {
+		goto cleanup;
+	}
+
+	if (export_rows(db, "SELECT i.item_id, i.listing_id, i.item_name, i.item_relpath, t.tag_name FROM items i "
+			"LEFT JOIN itemtags it ON it.item_id = i.item_id LEFT JOIN tags t ON t.tag_id = it.tag_id "
+			"ORDER BY i.item_id, it.tag_id;", write_item_tag_row, &state) == -1 ||
+		finish_item(&state) || flush_pending(&state) || fflush(output)) {
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	execute_sql_string(db, "RELEASE tagger_export;");
+	free(state.pending.data);
+	free(state.tags.data);
+	return result == 0 ? state.items : -1;
+}
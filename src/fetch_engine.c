@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "../include/provider_utils.h"
+#include "../include/fetch_engine.h"
+#include "../include/rate_limiter.h"
+
+#define FETCH_ENGINE_DEFAULT_IN_FLIGHT 32
+// queued transfers looked at for one that may start, when the first ones wait for their host
+#define FETCH_ENGINE_SCHEDULE_WINDOW 64
+
+struct fetch_transfer {
+	char *url;
+	fetch_callback callback;
+	void *user_data;
+	struct provider_attempt hooks; // `start` is `NULL` when the body is buffered in `response`
+	struct response *response;
+	CURL *easy;
+	int attempts;
+	int probe; // the running attempt probes an open circuit
+	long long not_before; // milliseconds, a retried transfer waits for its backoff
+	struct fetch_transfer *prev; // previous transfer in flight
+	struct fetch_transfer *next; // next queued transfer or transfer in flight
+};
+
+struct fetch_engine {
+	CURLM *multi;
+	int max_in_flight;
+	int in_flight;
+	struct fetch_transfer *running; // transfers in flight, to drop them on destroy
+	struct fetch_transfer *queue_head; // submitted transfers waiting for a free slot, oldest first
+	struct fetch_transfer *queue_tail;
+	int queued;
+	struct rate_limiter *limiter; // `NULL` for no limit
+	long next_start_ms; // time until a queued transfer waiting for its host may start, `0` if none waits
+	struct retry_policy retry_policy;
+	int max_attempts; // `1` until a retry policy is set
+	struct circuit_breaker *breaker; // `NULL` for none
+};
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void free_transfer(struct fetch_transfer *transfer) {
+	release_easy_handle(transfer->easy);
+	free_response(transfer->response);
+	free(transfer->url);
+	free(transfer);
+}
+
+/**
+ * @brief Free a transfer whose running attempt never finished, giving back its probe
+ */
+static void drop_transfer(struct fetch_engine *engine, struct fetch_transfer *transfer) {
+	if (transfer->probe) circuit_breaker_release(engine->breaker, transfer->url);
+	free_transfer(transfer);
+}
+
+/**
+ * @brief Create a fetch engine that runs many transfers concurrently
+ *
+ * Transfers are driven from the calling thread by `fetch_engine_perform` or
+ * `fetch_engine_run`, the engine must only be used from one thread at a time.
+ *
+ * @param max_in_flight transfers running at the same time, `0` or less for the default
+ * @return the engine, or `NULL` on error
+ */
+struct fetch_engine* fetch_engine_create(int max_in_flight) {
+	struct fetch_engine *engine;
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+		fputs("curl_global_init() failed\n", stderr);
+		return NULL;
+	}
+
+	engine = calloc(1, sizeof(struct fetch_engine));
+	if (engine == NULL) {
+		fputs("calloc() failed\n", stderr);
+		curl_global_cleanup();
+		return NULL;
+	}
+
+	engine->multi = curl_multi_init();
+	if (engine->multi == NULL) {
+		fputs("curl_multi_init() failed\n", stderr);
+		free(engine);
+		curl_global_cleanup();
+		return NULL;
+	}
+	engine->max_in_flight = max_in_flight > 0 ? max_in_flight : FETCH_ENGINE_DEFAULT_IN_FLIGHT;
+	engine->max_attempts = 1;
+
+	return engine;
+}
+
+/**
+ * @brief Limit the rate of the transfers per host
+ *
+ * A queued transfer starts once a slot is free and its host has a token. Hosts that
+ * answer `429` or `503` are paused for their `Retry-After`.
+ *
+ * @param engine fetch engine
+ * @param limiter rate limiter, it must outlive the engine, `NULL` for no limit
+ */
+void fetch_engine_set_rate_limiter(struct fetch_engine *engine, struct rate_limiter *limiter) {
+	if (engine != NULL) engine->limiter = limiter;
+}
+
+/**
+ * @brief Retry the transfers that failed transiently, and fail fast on failing hosts
+ *
+ * A transfer is retried after a jittered exponential backoff while its failure is
+ * transient and attempts are left, only its last attempt reaches the callback.
+ * A transfer to a host whose circuit is open fails with `CURLE_COULDNT_CONNECT`
+ * without being attempted.
+ *
+ * @param engine fetch engine
+ * @param policy retry policy, it is copied, `NULL` for the defaults
+ * @param breaker circuit breaker, it must outlive the engine, `NULL` for none
+ */
+void fetch_engine_set_retry_policy(struct fetch_engine *engine, const struct retry_policy *policy, struct circuit_breaker *breaker) {
+	if (engine == NULL) return;
+
+	if (policy != NULL) {
+		engine->retry_policy = *policy;
+	} else {
+		memset(&engine->retry_policy, 0, sizeof(struct retry_policy));
+	}
+	engine->max_attempts = retry_attempts(policy);
+	engine->breaker = breaker;
+}
+
+/**
+ * @brief Queue a transfer, it starts once a slot is free
+ *
+ * @param engine fetch engine
+ * @param url url to get, it is copied
+ * @param callback called with the response once the transfer finished
+ * @param user_data handed to the callback
+ * @return `0` on success, otherwise `-1` on error
+ */
+int fetch_engine_submit(struct fetch_engine *engine, const char *url, fetch_callback callback, void *user_data) {
+	return fetch_engine_submit_attempt(engine, url, NULL, callback, user_data);
+}
+
+/**
+ * @brief Queue a transfer whose attempts are prepared by hooks, it starts once a slot is free
+ *
+ * `start` runs before every attempt and may take over the body with its own write
+ * callback, the response handed to `callback` is then empty. `discard` runs before
+ * a retry, a non-zero return hands the failed attempt to `callback` instead.
+ *
+ * @param engine fetch engine
+ * @param url url to get, it is copied
+ * @param hooks hooks of the attempts, they are copied, `NULL` to buffer the body
+ * @param callback called with the response once the transfer finished
+ * @param user_data handed to the callback
+ * @return `0` on success, otherwise `-1` on error
+ */
+int fetch_engine_submit_attempt(struct fetch_engine *engine, const char *url, const struct provider_attempt *hooks,
+								fetch_callback callback, void *user_data) {
+	struct fetch_transfer *transfer;
+
+	if (engine == NULL || url == NULL || callback == NULL) return -1;
+
+	transfer = calloc(1, sizeof(struct fetch_transfer));
+	if (transfer == NULL || (transfer->url = strdup(url)) == NULL) {
+		fputs("Error when allocating a transfer\n", stderr);
+		free(transfer);
+		return -1;
+	}
+	transfer->callback = callback;
+	transfer->user_data = user_data;
+	if (hooks != NULL) transfer->hooks = *hooks;
+
+	if (engine->queue_tail != NULL) {
+		engine->queue_tail->next = transfer;
+	} else {
+		engine->queue_head = transfer;
+	}
+	engine->queue_tail = transfer;
+	engine->queued++;
+
+	return 0;
+}
+
+/**
+ * @brief Take a transfer out of the queue
+ *
+ * @param previous transfer before it in the queue, `NULL` if it is the first one
+ */
+static void unlink_queued_transfer(struct fetch_engine *engine, struct fetch_transfer *previous, struct fetch_transfer *transfer) {
+	if (previous != NULL) {
+		previous->next = transfer->next;
+	} else {
+		engine->queue_head = transfer->next;
+	}
+	if (engine->queue_tail == transfer) engine->queue_tail = previous;
+	engine->queued--;
+	transfer->next = NULL;
+}
+
+/**
+ * @brief Queue many transfers at once
+ *
+ * @param engine fetch engine
+ * @param requests array of requests
+ * @param requests_count size of the `requests` array
+ * @return `0` on success, otherwise `-1` on error, the requests before the failed one stay queued
+ */
+int fetch_engine_submit_batch(struct fetch_engine *engine, const struct fetch_request *requests, size_t requests_count) {
+	if (requests == NULL && requests_count > 0) return -1;
+
+	for (size_t i = 0; i < requests_count; i++) {
+		if (fetch_engine_submit(engine, requests[i].url, requests[i].callback, requests[i].user_data)) return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Start queued transfers until every slot is used
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int start_queued_transfers(struct fetch_engine *engine) {
+	struct fetch_transfer *previous = NULL, *transfer = engine->queue_head;
+	long long now = now_ms();
+	int looked_at = 0;
+
+	engine->next_start_ms = 0;
+	while (transfer != NULL && engine->in_flight < engine->max_in_flight && looked_at++ < FETCH_ENGINE_SCHEDULE_WINDOW) {
+		// transfers waiting for a backoff or for a host out of tokens stay queued,
+		// the ones behind them go first
+		long wait = transfer->not_before > now ? (long) (transfer->not_before - now) : rate_limiter_try_acquire(engine->limiter, transfer->url);
+		if (wait > 0) {
+			if (engine->next_start_ms == 0 || wait < engine->next_start_ms) engine->next_start_ms = wait;
+			previous = transfer;
+			transfer = transfer->next;
+			continue;
+		}
+
+		struct fetch_transfer *next = transfer->next;
+		unlink_queued_transfer(engine, previous, transfer);
+
+		int allow = circuit_breaker_allow(engine->breaker, transfer->url);
+		if (!allow) {
+			// the callback may submit new transfers, `next` stays valid as only the tail changes
+			transfer->callback(transfer->url, CURLE_COULDNT_CONNECT, 0, &transfer->response, transfer->user_data);
+			free_transfer(transfer);
+			transfer = next;
+			continue;
+		}
+		transfer->attempts++;
+		transfer->probe = allow == 2;
+
+		// pooled handles come with the shared DNS, TLS session and connection caches
+		transfer->easy = acquire_easy_handle();
+		if (transfer->easy == NULL) {
+			fputs("Error when getting an easy handle\n", stderr);
+			drop_transfer(engine, transfer);
+			return -1;
+		}
+		transfer->response = init_response();
+		if (transfer->response == NULL) {
+			drop_transfer(engine, transfer);
+			return -1;
+		}
+
+		curl_easy_setopt(transfer->easy, CURLOPT_URL, transfer->url);
+		attach_response(transfer->easy, transfer->response);
+		curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer);
+		if (transfer->hooks.start != NULL && transfer->hooks.start(transfer->easy, transfer->hooks.user_data)) {
+			fputs("Error when starting a transfer\n", stderr);
+			drop_transfer(engine, transfer);
+			return -1;
+		}
+
+		CURLMcode rc = curl_multi_add_handle(engine->multi, transfer->easy);
+		if (rc != CURLM_OK) {
+			fprintf(stderr, "curl_multi_add_handle() failed: %s\n", curl_multi_strerror(rc));
+			drop_transfer(engine, transfer);
+			return -1;
+		}
+		transfer->next = engine->running;
+		if (engine->running != NULL) engine->running->prev = transfer;
+		engine->running = transfer;
+		engine->in_flight++;
+
+		transfer = next;
+	}
+	return 0;
+}
+
+/**
+ * @brief Hand the finished transfers to their callbacks
+ */
+static void complete_transfers(struct fetch_engine *engine) {
+	CURLMsg *msg;
+	int msgs_left;
+
+	while ((msg = curl_multi_info_read(engine->multi, &msgs_left)) != NULL) {
+		struct fetch_transfer *transfer;
+		long status = 0;
+
+		if (msg->msg != CURLMSG_DONE) continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+		CURLcode result = msg->data.result;
+		if (result == CURLE_OK && finish_response(transfer->response)) result = CURLE_OUT_OF_MEMORY;
+		if (status == 429 || status == 503) {
+			curl_off_t retry_after = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RETRY_AFTER, &retry_after);
+			rate_limiter_throttled(engine->limiter, transfer->url, (long) retry_after);
+		}
+		circuit_breaker_record(engine->breaker, transfer->url, result, status);
+		transfer->probe = 0;
+
+		curl_multi_remove_handle(engine->multi, transfer->easy);
+		if (transfer->prev != NULL) {
+			transfer->prev->next = transfer->next;
+		} else {
+			engine->running = transfer->next;
+		}
+		if (transfer->next != NULL) transfer->next->prev = transfer->prev;
+		engine->in_flight--;
+
+		if (transfer->attempts < engine->max_attempts && is_transient_failure(result, status) &&
+			(transfer->hooks.discard == NULL || !transfer->hooks.discard(transfer->hooks.user_data))) {
+			release_easy_handle(transfer->easy);
+			free_response(transfer->response);
+			transfer->easy = NULL;
+			transfer->response = NULL;
+			transfer->prev = NULL;
+			transfer->next = NULL;
+			transfer->not_before = now_ms() + retry_backoff_ms(&engine->retry_policy, transfer->attempts);
+
+			if (engine->queue_tail != NULL) {
+				engine->queue_tail->next = transfer;
+			} else {
+				engine->queue_head = transfer;
+			}
+			engine->queue_tail = transfer;
+			engine->queued++;
+			continue;
+		}
+
+		// the callback may submit new transfers
+		transfer->callback(transfer->url, result, status, &transfer->response, transfer->user_data);
+		free_transfer(transfer);
+	}
+}
+
+/**
+ * @brief Run the transfers for a while
+ *
+ * Starts queued transfers, waits up to `timeout_ms` for activity and calls the
+ * callbacks of the transfers that finished.
+ *
+ * @param engine fetch engine
+ * @param timeout_ms longest time to wait for activity, in milliseconds
+ * @return number of transfers not finished yet, or `-1` on error
+ */
+int fetch_engine_perform(struct fetch_engine *engine, int timeout_ms) {
+	int running;
+	CURLMcode rc;
+
+	if (engine == NULL) return -1;
+	if (start_queued_transfers(engine)) return -1;
+
+	// wake up in time for queued transfers waiting for their host
+	if (engine->next_start_ms > 0 && engine->next_start_ms < timeout_ms) timeout_ms = (int) engine->next_start_ms;
+
+	rc = curl_multi_perform(engine->multi, &running);
+	if (rc == CURLM_OK && (running > 0 || engine->next_start_ms > 0)) {
+		rc = curl_multi_poll(engine->multi, NULL, 0, timeout_ms, NULL);
+		if (rc == CURLM_OK) rc = curl_multi_perform(engine->multi, &running);
+	}
+	if (rc != CURLM_OK) {
+		fprintf(stderr, "curl_multi_perform() failed: %s\n", curl_multi_strerror(rc));
+		return -1;
+	}
+
+	complete_transfers(engine);
+
+	if (start_queued_transfers(engine)) return -1;
+	return engine->in_flight + engine->queued;
+}
+
+/**
+ * @brief Run the transfers until all of them, including those submitted by callbacks, finished
+ *
+ * @param engine fetch engine
+ * @return `0` on success, otherwise `-1` on error
+ */
+int fetch_engine_run(struct fetch_engine *engine) {
+	int pending;
+
+	while ((pending = fetch_engine_perform(engine, 1000)) > 0);
+	return pending;
+}
+
+/**
+ * @brief Destroy a fetch engine, unfinished transfers are dropped without calling their callbacks
+ *
+ * @param engine fetch engine
+ */
+void fetch_engine_destroy(struct fetch_engine *engine) {
+	if (engine == NULL) return;
+
+	while (engine->running != NULL) {
+		struct fetch_transfer *transfer = engine->running;
+		engine->running = transfer->next;
+		curl_multi_remove_handle(engine->multi, transfer->easy);
+		drop_transfer(engine, transfer);
+	}
+
+	while (engine->queue_head != NULL) {
+		struct fetch_transfer *transfer = engine->queue_head;
+		engine->queue_head = transfer->next;
+		free_transfer(transfer);
+	}
+
+	curl_multi_cleanup(engine->multi);
+	free(engine);
+	curl_global_cleanup();
+}
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "sqlite3.h"
+#include "../include/provider_utils.h"
+#include "../include/http_cache.h"
+
+#define HTTP_CACHE_DEFAULT_MAX_BYTES (64LL << 20)
+#define HTTP_CACHE_TABLE_NAME "http_cache"
+// longest validator kept, longer ones are ignored
+#define HTTP_CACHE_VALIDATOR_SIZE 256
+
+extern size_t writefunc(void *ptr, size_t size, size_t nmemb, struct response *s);
+
+typedef enum {
+	CACHE_STMT_GET,
+	CACHE_STMT_TOUCH,
+	CACHE_STMT_PUT,
+	CACHE_STMT_OLDEST,
+	CACHE_STMT_DELETE,
+	CACHE_STMT_COUNT
+} CACHE_STATEMENT;
+
+static const char *cache_statement_sqls[CACHE_STMT_COUNT] = {
+	[CACHE_STMT_GET] = "SELECT body, etag, last_modified, expires_at FROM " HTTP_CACHE_TABLE_NAME " WHERE url=?;",
+	[CACHE_STMT_TOUCH] = "UPDATE " HTTP_CACHE_TABLE_NAME " SET last_used=?, expires_at=coalesce(?, expires_at) WHERE url=?;",
+	[CACHE_STMT_PUT] = "INSERT OR REPLACE INTO " HTTP_CACHE_TABLE_NAME " (url, body, etag, last_modified, expires_at, last_used, size) "
+		"VALUES (?, ?, ?, ?, ?, ?, ?);",
+	[CACHE_STMT_OLDEST] = "SELECT url, size FROM " HTTP_CACHE_TABLE_NAME " ORDER BY last_used LIMIT 1;",
+	[CACHE_STMT_DELETE] = "DELETE FROM " HTTP_CACHE_TABLE_NAME " WHERE url=?;",
+};
+
+struct http_cache {
+	sqlite3 *connection;
+	sqlite3_stmt *statements[CACHE_STMT_COUNT];
+	sqlite3_int64 max_bytes;
+	sqlite3_int64 use_counter; // orders the entries from least to most recently used
+	struct http_cache_stats stats;
+};
+
+// caching headers of a response
+struct response_validators {
+	char etag[HTTP_CACHE_VALIDATOR_SIZE];
+	char last_modified[HTTP_CACHE_VALIDATOR_SIZE];
+	long long max_age; // seconds, `-1` if the response didn't say
+	long long expires; // unix time, `-1` if the response didn't say
+	int no_store;
+};
+
+static void reset_validators(struct response_validators *v) {
+	v->etag[0] = '\0';
+	v->last_modified[0] = '\0';
+	v->max_age = -1;
+	v->expires = -1;
+	v->no_store = 0;
+}
+
+/**
+ * @brief Copy the value of a header line without its line ending
+ */
+static void copy_header_value(char *destination, const char *value, size_t length) {
+	while (length > 0 && (*value == ' ' || *value == '\t')) {
+		value++;
+		length--;
+	}
+	while (length > 0 && (value[length - 1] == '\r' || value[length - 1] == '\n' || value[length - 1] == ' ')) length--;
+
+	if (length >= HTTP_CACHE_VALIDATOR_SIZE) length = 0;
+	memcpy(destination, value, length);
+	destination[length] = '\0';
+}
+
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+	struct response_validators *v = userdata;
+	size_t length = size * nitems;
+	char value[HTTP_CACHE_VALIDATOR_SIZE];
+
+	// a new status line starts the headers of a redirected or final response
+	if (length >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		reset_validators(v);
+	} else if (length > 5 && strncasecmp(buffer, "ETag:", 5) == 0) {
+		copy_header_value(v->etag, buffer + 5, length - 5);
+	} else if (length > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0) {
+		copy_header_value(v->last_modified, buffer + 14, length - 14);
+	} else if (length > 8 && strncasecmp(buffer, "Expires:", 8) == 0) {
+		copy_header_value(value, buffer + 8, length - 8);
+		time_t expires = curl_getdate(value, NULL);
+		v->expires = expires == -1 ? 0 : expires;
+	} else if (length > 14 && strncasecmp(buffer, "Cache-Control:", 14) == 0) {
+		copy_header_value(value, buffer + 14, length - 14);
+		char *max_age = strstr(value, "max-age=");
+		if (max_age != NULL) v->max_age = strtoll(max_age + 8, NULL, 10);
+		if (strstr(value, "no-store") != NULL) v->no_store = 1;
+		// stored, but revalidated before every use
+		if (strstr(value, "no-cache") != NULL) v->max_age = 0;
+	}
+
+	return length;
+}
+
+/**
+ * @brief Unix time until which a response may be served without revalidation
+ */
+static sqlite3_int64 expiry_time(const struct response_validators *v) {
+	if (v->max_age >= 0) return time(NULL) + v->max_age;
+	if (v->expires >= 0) return v->expires;
+	return 0;
+}
+
+static sqlite3_stmt* get_cache_statement(struct http_cache *cache, CACHE_STATEMENT statement) {
+	sqlite3_stmt *stmt = cache->statements[statement];
+	if (stmt != NULL) {
+		sqlite3_reset(stmt);
+		return stmt;
+	}
+
+	if (sqlite3_prepare_v3(cache->connection, cache_statement_sqls[statement], -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(cache->connection));
+		return NULL;
+	}
+
+	cache->statements[statement] = stmt;
+	return stmt;
+}
+
+static void release_cache_statement(sqlite3_stmt *stmt) {
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+/**
+ * @brief Get a single integer of a query
+ *
+ * @return the value, or `-1` on error
+ */
+static sqlite3_int64 query_int64(struct http_cache *cache, const char *sql) {
+	sqlite3_stmt *stmt;
+	sqlite3_int64 value = -1;
+
+	if (sqlite3_prepare_v2(cache->connection, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(cache->connection));
+		return -1;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+/**
+ * @brief Open or create an on-disk cache of HTTP responses
+ *
+ * The cache is only consulted by `http_cache_get`. `get_response_from_url`, the fetch
+ * engine, `run_tag_providers` and `scan_and_enrich_listing` always make their requests,
+ * callers that want caching get the responses through the cache themselves.
+ *
+ * A cache is not thread-safe: its connection is opened without a mutex and its
+ * prepared statements are shared, so it must only be used by one thread at a time.
+ * Threads that each need a cache open their own on the same location.
+ *
+ * @param location location of the cache database
+ * @param max_bytes size of the stored responses before the least recently used ones
+ *                  are evicted, `0` or less for the default
+ * @return the cache, or `NULL` on error
+ */
+struct http_cache* http_cache_open(const char *location, sqlite3_int64 max_bytes) {
+	struct http_cache *cache = calloc(1, sizeof(struct http_cache));
+	if (cache == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return NULL;
+	}
+	cache->max_bytes = max_bytes > 0 ? max_bytes : HTTP_CACHE_DEFAULT_MAX_BYTES;
+
+	if (sqlite3_open_v2(location, &cache->connection, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK ||
+		sqlite3_exec(cache->connection, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;"
+			"CREATE TABLE IF NOT EXISTS " HTTP_CACHE_TABLE_NAME " (url TEXT PRIMARY KEY, body BLOB NOT NULL, "
+			"etag TEXT, last_modified TEXT, expires_at INTEGER NOT NULL, last_used INTEGER NOT NULL, size INTEGER NOT NULL);"
+			"CREATE INDEX IF NOT EXISTS " HTTP_CACHE_TABLE_NAME "_last_used ON " HTTP_CACHE_TABLE_NAME " (last_used);",
+			NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when opening the HTTP cache %s: %s\n", location, sqlite3_errmsg(cache->connection));
+		http_cache_close(cache);
+		return NULL;
+	}
+
+	cache->use_counter = query_int64(cache, "SELECT coalesce(max(last_used), 0) FROM " HTTP_CACHE_TABLE_NAME ";");
+	cache->stats.stored_bytes = query_int64(cache, "SELECT coalesce(sum(size), 0) FROM " HTTP_CACHE_TABLE_NAME ";");
+	if (cache->use_counter == -1 || cache->stats.stored_bytes == -1) {
+		http_cache_close(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+/**
+ * @brief Evict the least recently used responses until the cache fits its size
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int evict_responses(struct http_cache *cache) {
+	while (cache->stats.stored_bytes > cache->max_bytes) {
+		sqlite3_stmt *oldest = get_cache_statement(cache, CACHE_STMT_OLDEST);
+		sqlite3_stmt *delete = get_cache_statement(cache, CACHE_STMT_DELETE);
+		if (oldest == NULL || delete == NULL) return -1;
+
+		if (sqlite3_step(oldest) != SQLITE_ROW) {
+			release_cache_statement(oldest);
+			cache->stats.stored_bytes = 0;
+			return 0;
+		}
+
+		sqlite3_int64 size = sqlite3_column_int64(oldest, 1);
+		int rc = sqlite3_bind_value(delete, 1, sqlite3_column_value(oldest, 0));
+		if (rc == SQLITE_OK) rc = sqlite3_step(delete);
+		release_cache_statement(delete);
+		release_cache_statement(oldest);
+		if (rc != SQLITE_DONE) {
+			fprintf(stderr, "Error when evicting from the HTTP cache: %s\n", sqlite3_errmsg(cache->connection));
+			return -1;
+		}
+
+		cache->stats.stored_bytes -= size;
+		cache->stats.evictions++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Store a full response together with its validators
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int store_response(struct http_cache *cache, const char *url, sqlite3_int64 previous_size,
+						  const struct response *response, const struct response_validators *v) {
+	sqlite3_stmt *stmt = get_cache_statement(cache, CACHE_STMT_PUT);
+	if (stmt == NULL) return -1;
+
+	sqlite3_int64 size = (sqlite3_int64) (strlen(url) + response->len);
+	if (sqlite3_bind_text(stmt, 1, url, -1, NULL) != SQLITE_OK ||
+		sqlite3_bind_blob64(stmt, 2, response->ptr, response->len, NULL) != SQLITE_OK ||
+		(v->etag[0] ? sqlite3_bind_text(stmt, 3, v->etag, -1, NULL) : sqlite3_bind_null(stmt, 3)) != SQLITE_OK ||
+		(v->last_modified[0] ? sqlite3_bind_text(stmt, 4, v->last_modified, -1, NULL) : sqlite3_bind_null(stmt, 4)) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 5, expiry_time(v)) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 6, ++cache->use_counter) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 7, size) != SQLITE_OK ||
+		sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "Error when storing in the HTTP cache: %s\n", sqlite3_errmsg(cache->connection));
+		release_cache_statement(stmt);
+		return -1;
+	}
+	release_cache_statement(stmt);
+
+	cache->stats.stored_bytes += size - previous_size;
+	return evict_responses(cache);
+}
+
+/**
+ * @brief Mark a stored response as used, and optionally fresh again
+ *
+ * @param expires_at new expiry time, `-1` to keep the stored one
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int touch_response(struct http_cache *cache, const char *url, sqlite3_int64 expires_at) {
+	sqlite3_stmt *stmt = get_cache_statement(cache, CACHE_STMT_TOUCH);
+	if (stmt == NULL) return -1;
+
+	if (sqlite3_bind_int64(stmt, 1, ++cache->use_counter) != SQLITE_OK ||
+		(expires_at >= 0 ? sqlite3_bind_int64(stmt, 2, expires_at) : sqlite3_bind_null(stmt, 2)) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 3, url, -1, NULL) != SQLITE_OK ||
+		sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "Error when updating the HTTP cache: %s\n", sqlite3_errmsg(cache->connection));
+		release_cache_statement(stmt);
+		return -1;
+	}
+	release_cache_statement(stmt);
+	return 0;
+}
+
+static struct response* response_from_blob(const void *data, size_t length) {
+	struct response *response = init_response();
+	if (response == NULL) return NULL;
+
+	if (length > 0 && (writefunc((void *) data, 1, length, response) != length || finish_response(response))) {
+		free_response(response);
+		return NULL;
+	}
+	return response;
+}
+
+// one attempt of a request revalidating or filling the cache
+struct cache_attempt {
+	struct response *response;
+	struct response_validators *validators;
+	struct curl_slist *headers; // conditional headers, `NULL` if nothing is cached
+};
+
+static int start_cache_attempt(CURL *curl, void *user_data) {
+	struct cache_attempt *r = user_data;
+
+	reset_validators(r->validators);
+	if ((r->response = init_response()) == NULL) return -1;
+	attach_response(curl, r->response);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, r->validators);
+	if (r->headers != NULL) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, r->headers);
+	return 0;
+}
+
+static int discard_cache_attempt(void *user_data) {
+	struct cache_attempt *r = user_data;
+
+	free_response(r->response);
+	r->response = NULL;
+	return 0;
+}
+
+/**
+ * @brief Get the response of an url through the cache
+ *
+ * Fresh responses are served from the cache without any request. Stale ones are
+ * revalidated with `If-None-Match` or `If-Modified-Since` and served from the
+ * cache on `304 Not Modified`. Successful full responses are stored when their
+ * headers allow it. Requests are retried and rate limited like other provider
+ * requests, an error response is an error.
+ *
+ * The request blocks until it is done, and the cache must not be used by another
+ * thread meanwhile, see `http_cache_open`.
+ *
+ * @param cache HTTP cache
+ * @param url url to get the response from
+ * @return a pointer to a response struct, or `NULL` on error
+ */
+struct response* http_cache_get(struct http_cache *cache, const char *url) {
+	struct response_validators validators;
+	struct response *cached = NULL, *response = NULL;
+	struct curl_slist *headers = NULL;
+	char header[HTTP_CACHE_VALIDATOR_SIZE + 32];
+	long status = 0;
+
+	if (cache == NULL || url == NULL) return NULL;
+
+	sqlite3_stmt *stmt = get_cache_statement(cache, CACHE_STMT_GET);
+	if (stmt == NULL || sqlite3_bind_text(stmt, 1, url, -1, NULL) != SQLITE_OK) {
+		if (stmt != NULL) release_cache_statement(stmt);
+		return NULL;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		cached = response_from_blob(sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+		if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+			snprintf(header, sizeof(header), "If-None-Match: %s", (const char *) sqlite3_column_text(stmt, 1));
+			headers = curl_slist_append(headers, header);
+		}
+		if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+			snprintf(header, sizeof(header), "If-Modified-Since: %s", (const char *) sqlite3_column_text(stmt, 2));
+			headers = curl_slist_append(headers, header);
+		}
+
+		if (cached != NULL && sqlite3_column_int64(stmt, 3) > time(NULL)) {
+			release_cache_statement(stmt);
+			curl_slist_free_all(headers);
+			cache->stats.hits++;
+			touch_response(cache, url, -1);
+			return cached;
+		}
+	}
+	release_cache_statement(stmt);
+
+	struct cache_attempt attempt = {NULL, &validators, cached != NULL ? headers : NULL};
+	const struct provider_attempt hooks = {start_cache_attempt, discard_cache_attempt, &attempt};
+	// error responses are retried and count for the circuit breaker like other provider requests
+	if (perform_provider_request(url, &hooks, &status) != PROVIDER_OK) goto cleanup;
+
+	response = attempt.response;
+	if (finish_response(response)) {
+		free_response(response);
+		response = NULL;
+		goto cleanup;
+	}
+
+	if (status == 304 && cached != NULL) {
+		cache->stats.revalidations++;
+		touch_response(cache, url, expiry_time(&validators));
+		free_response(response);
+		response = cached;
+		cached = NULL;
+		goto cleanup;
+	}
+
+	cache->stats.misses++;
+	// only responses that can be revalidated or stay fresh for a while are worth storing
+	if (status == 200 && !validators.no_store &&
+		(validators.etag[0] || validators.last_modified[0] || expiry_time(&validators) > time(NULL))) {
+		store_response(cache, url, cached != NULL ? (sqlite3_int64) (strlen(url) + cached->len) : 0, response, &validators);
+	}
+
+cleanup:
+	free_response(cached);
+	curl_slist_free_all(headers);
+	return response;
+}
+
+/**
+ * @brief Get the hit, miss and eviction counters of a cache
+ *
+ * @param cache HTTP cache
+ * @param stats where to store the counters
+ */
+void http_cache_get_stats(struct http_cache *cache, struct http_cache_stats *stats) {
+	if (cache == NULL || stats == NULL) return;
+	*stats = cache->stats;
+}
+
+/**
+ * @brief Close an HTTP cache
+ *
+ * @param cache HTTP cache
+ */
+void http_cache_close(struct http_cache *cache) {
+	if (cache == NULL) return;
+
+	for (int i = 0; i < CACHE_STMT_COUNT; i++) sqlite3_finalize(cache->statements[i]);
+	sqlite3_close(cache->connection);
+	free(cache);
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../include/id_map.h"
+
+#define ID_MAP_EMPTY 0
+#define ID_MAP_DELETED -1
+#define ID_MAP_INITIAL_CAPACITY 1024
+
+static size_t id_map_index(sqlite3_int64 key, size_t capacity) {
+	return (size_t) (((uint64_t) key * 0x9E3779B97F4A7C15ULL) >> 17) & (capacity - 1);
+}
+
+static struct id_map_slot* id_map_find(const struct id_map *map, sqlite3_int64 key) {
+	if (map->capacity == 0) return NULL;
+
+	size_t i = id_map_index(key, map->capacity);
+	while (map->slots[i].key != ID_MAP_EMPTY) {
+		if (map->slots[i].key == key) return &map->slots[i];
+		i = (i + 1) & (map->capacity - 1);
+	}
+	return NULL;
+}
+
+static int id_map_grow(struct id_map *map) {
+	size_t new_capacity = map->capacity ? map->capacity : ID_MAP_INITIAL_CAPACITY;
+	while ((map->size + 1) * 2 >= new_capacity) new_capacity *= 2;
+
+	struct id_map_slot *new_slots = calloc(new_capacity, sizeof(struct id_map_slot));
+	if (new_slots == NULL) return -1;
+
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->slots[i].key > 0) {
+			size_t j = id_map_index(map->slots[i].key, new_capacity);
+			while (new_slots[j].key != ID_MAP_EMPTY) j = (j + 1) & (new_capacity - 1);
+			new_slots[j] = map->slots[i];
+		}
+	}
+
+	free(map->slots);
+	map->slots = new_slots;
+	map->capacity = new_capacity;
+	map->used = map->size;
+	return 0;
+}
+
+/**
+ * @brief Insert or replace a value
+ *
+ * @param map id map
+ * @param key id, must be greater than `0`
+ * @param value value to store
+ * @return `0` on success, otherwise `-1` on error
+ */
+int id_map_put(struct id_map *map, sqlite3_int64 key, void *value) {
+	if (key <= 0) return -1;
+
+	struct id_map_slot *slot = id_map_find(map, key);
+	if (slot != NULL) {
+		slot->value = value;
+		return 0;
+	}
+
+	// keep the load factor (with deleted slots) under 3/4
+	if ((map->used + 1) * 4 >= map->capacity * 3 && id_map_grow(map)) {
+		return -1;
+	}
+
+	size_t i = id_map_index(key, map->capacity);
+	while (map->slots[i].key > 0) i = (i + 1) & (map->capacity - 1);
+	if (map->slots[i].key == ID_MAP_EMPTY) map->used++;
+	map->slots[i].key = key;
+	map->slots[i].value = value;
+	map->size++;
+	return 0;
+}
+
+/**
+ * @brief Get a value by id
+ *
+ * @return the stored value, or `NULL` if the id is not in the map
+ */
+void* id_map_get(const struct id_map *map, sqlite3_int64 key) {
+	struct id_map_slot *slot = id_map_find(map, key);
+	return slot != NULL ? slot->value : NULL;
+}
+
+/**
+ * @brief Remove a value by id
+ *
+ * @return `1` if the id was removed, `0` if it was not in the map
+ */
+int id_map_remove(struct id_map *map, sqlite3_int64 key) {
+	struct id_map_slot *slot = id_map_find(map, key);
+	if (slot == NULL) return 0;
+
+	slot->key = ID_MAP_DELETED;
+	slot->value = NULL;
+	map->size--;
+	return 1;
+}
+
+/**
+ * @brief Free the memory of the map, it can be reused afterwards
+ */
+void id_map_clear(struct id_map *map) {
+	free(map->slots);
+	map->slots = NULL;
+	map->capacity = 0;
+	map->used = 0;
+	map->size = 0;
+}
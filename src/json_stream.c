@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+
+#include "../include/provider_utils.h"
+#include "../include/json_stream.h"
+
+// longest string or number kept, so a single token can't take unbounded memory
+#define JSON_STREAM_MAX_TOKEN (1 << 20)
+#define JSON_STREAM_INITIAL_TOKEN 256
+
+typedef enum {
+	JSON_STATE_VALUE, // a value is expected
+	JSON_STATE_ARRAY_FIRST, // a value or the end of an empty array
+	JSON_STATE_OBJECT_FIRST, // a key or the end of an empty object
+	JSON_STATE_KEY,
+	JSON_STATE_COLON,
+	JSON_STATE_AFTER_VALUE, // a comma or the end of the container
+	JSON_STATE_STRING,
+	JSON_STATE_ESCAPE,
+	JSON_STATE_UNICODE,
+	JSON_STATE_NUMBER,
+	JSON_STATE_LITERAL,
+	JSON_STATE_DONE,
+	JSON_STATE_ERROR
+} JSON_STATE;
+
+struct json_stream {
+	const struct json_stream_handler *handler;
+	void *user_data;
+	JSON_STATE state;
+	char containers[JSON_STREAM_MAX_DEPTH]; // `{` or `[` per open container
+	int depth;
+	int string_is_key;
+	char *token; // string or number being read, it may span several chunks
+	size_t token_length;
+	size_t token_capacity;
+	unsigned int codepoint; // `\u` escape being read
+	int codepoint_digits;
+	unsigned int high_surrogate; // first half of a surrogate pair, `0` if none
+	size_t offset; // bytes fed so far, for error messages
+};
+
+/**
+ * @brief Create a streaming JSON parser
+ *
+ * The document is fed in chunks of any size with `json_stream_feed`, and the
+ * handler is called as soon as each value is complete. Only the innermost token
+ * is buffered, so memory doesn't grow with the size of the document.
+ *
+ * @param handler callbacks, may be `NULL` to only check the syntax
+ * @param user_data handed to the callbacks
+ * @return the parser, or `NULL` on error
+ */
+struct json_stream* json_stream_create(const struct json_stream_handler *handler, void *user_data) {
+	static const struct json_stream_handler no_handler = {0};
+	struct json_stream *stream = calloc(1, sizeof(struct json_stream));
+	if (stream == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return NULL;
+	}
+
+	stream->token = malloc(JSON_STREAM_INITIAL_TOKEN);
+	if (stream->token == NULL) {
+		fputs("malloc() failed\n", stderr);
+		free(stream);
+		return NULL;
+	}
+	stream->token_capacity = JSON_STREAM_INITIAL_TOKEN;
+	stream->handler = handler != NULL ? handler : &no_handler;
+	stream->user_data = user_data;
+	stream->state = JSON_STATE_VALUE;
+
+	return stream;
+}
+
+void json_stream_destroy(struct json_stream *stream) {
+	if (stream == NULL) return;
+	free(stream->token);
+	free(stream);
+}
+
+static int fail(struct json_stream *stream, const char *message) {
+	fprintf(stderr, "JSON error at byte %zu: %s\n", stream->offset, message);
+	stream->state = JSON_STATE_ERROR;
+	return -1;
+}
+
+static int token_append(struct json_stream *stream, const char *data, size_t length) {
+	if (stream->token_length + length + 1 > stream->token_capacity) {
+		size_t capacity = stream->token_capacity;
+		while (stream->token_length + length + 1 > capacity) capacity *= 2;
+		if (capacity > JSON_STREAM_MAX_TOKEN) return fail(stream, "token too long");
+
+		char *token = realloc(stream->token, capacity);
+		if (token == NULL) return fail(stream, "out of memory");
+		stream->token = token;
+		stream->token_capacity = capacity;
+	}
+
+	memcpy(stream->token + stream->token_length, data, length);
+	stream->token_length += length;
+	stream->token[stream->token_length] = '\0';
+	return 0;
+}
+
+static int token_append_utf8(struct json_stream *stream, unsigned int codepoint) {
+	char utf8[4];
+	size_t length;
+
+	if (codepoint < 0x80) {
+		utf8[0] = codepoint;
+		length = 1;
+	} else if (codepoint < 0x800) {
+		utf8[0] = 0xC0 | (codepoint >> 6);
+		utf8[1] = 0x80 | (codepoint & 0x3F);
+		length = 2;
+	} else if (codepoint < 0x10000) {
+		utf8[0] = 0xE0 | (codepoint >> 12);
+		utf8[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+		utf8[2] = 0x80 | (codepoint & 0x3F);
+		length = 3;
+	} else {
+		utf8[0] = 0xF0 | (codepoint >> 18);
+		utf8[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+		utf8[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+		utf8[3] = 0x80 | (codepoint & 0x3F);
+		length = 4;
+	}
+	return token_append(stream, utf8, length);
+}
+
+static void token_reset(struct json_stream *stream) {
+	stream->token_length = 0;
+	stream->token[0] = '\0';
+}
+
+/**
+ * @brief Move on after a complete value
+ */
+static void value_done(struct json_stream *stream) {
+	stream->state = stream->depth == 0 ? JSON_STATE_DONE : JSON_STATE_AFTER_VALUE;
+}
+
+static int is_whitespace(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int handler_result(struct json_stream *stream, int rc) {
+	return rc ? fail(stream, "stopped by handler") : 0;
+}
+
+static int open_container(struct json_stream *stream, char c) {
+	if (stream->depth >= JSON_STREAM_MAX_DEPTH) return fail(stream, "nested too deep");
+	stream->containers[stream->depth++] = c;
+
+	if (c == '{') {
+		stream->state = JSON_STATE_OBJECT_FIRST;
+		return stream->handler->start_object ? handler_result(stream, stream->handler->start_object(stream->user_data)) : 0;
+	}
+	stream->state = JSON_STATE_ARRAY_FIRST;
+	return stream->handler->start_array ? handler_result(stream, stream->handler->start_array(stream->user_data)) : 0;
+}
+
+static int close_container(struct json_stream *stream, char c) {
+	char open = c == '}' ? '{' : '[';
+	if (stream->depth == 0 || stream->containers[stream->depth - 1] != open) return fail(stream, "mismatched bracket");
+	stream->depth--;
+	value_done(stream);
+
+	if (c == '}') {
+		return stream->handler->end_object ? handler_result(stream, stream->handler->end_object(stream->user_data)) : 0;
+	}
+	return stream->handler->end_array ? handler_result(stream, stream->handler->end_array(stream->user_data)) : 0;
+}
+
+/**
+ * @brief Start reading a value at its first character
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int begin_value(struct json_stream *stream, char c) {
+	switch (c) {
+		case '{':
+		case '[':
+			return open_container(stream, c);
+		case '"':
+			token_reset(stream);
+			stream->string_is_key = 0;
+			stream->state = JSON_STATE_STRING;
+			return 0;
+		case 't':
+		case 'f':
+		case 'n':
+			token_reset(stream);
+			stream->state = JSON_STATE_LITERAL;
+			return token_append(stream, &c, 1);
+		default:
+			if (c == '-' || (c >= '0' && c <= '9')) {
+				token_reset(stream);
+				stream->state = JSON_STATE_NUMBER;
+				return token_append(stream, &c, 1);
+			}
+			return fail(stream, "unexpected character");
+	}
+}
+
+static int end_number(struct json_stream *stream) {
+	char *end;
+
+	strtod(stream->token, &end);
+	if (*end != '\0' || stream->token[stream->token_length - 1] == '.') return fail(stream, "invalid number");
+	value_done(stream);
+	return stream->handler->number ? handler_result(stream, stream->handler->number(stream->user_data, stream->token, stream->token_length)) : 0;
+}
+
+static int end_literal(struct json_stream *stream) {
+	JSON_LITERAL literal;
+
+	if (strcmp(stream->token, "true") == 0) {
+		literal = JSON_TRUE;
+	} else if (strcmp(stream->token, "false") == 0) {
+		literal = JSON_FALSE;
+	} else if (strcmp(stream->token, "null") == 0) {
+		literal = JSON_NULL;
+	} else {
+		return fail(stream, "invalid literal");
+	}
+	value_done(stream);
+	return stream->handler->literal ? handler_result(stream, stream->handler->literal(stream->user_data, literal)) : 0;
+}
+
+static int end_string(struct json_stream *stream) {
+	// a lone high surrogate can't be encoded
+	if (stream->high_surrogate && token_append_utf8(stream, 0xFFFD)) return -1;
+	stream->high_surrogate = 0;
+
+	if (stream->string_is_key) {
+		stream->state = JSON_STATE_COLON;
+		return stream->handler->key ? handler_result(stream, stream->handler->key(stream->user_data, stream->token, stream->token_length)) : 0;
+	}
+	value_done(stream);
+	return stream->handler->string ? handler_result(stream, stream->handler->string(stream->user_data, stream->token, stream->token_length)) : 0;
+}
+
+static int end_unicode_escape(struct json_stream *stream) {
+	unsigned int codepoint = stream->codepoint;
+
+	if (codepoint >= 0xDC00 && codepoint <= 0xDFFF && stream->high_surrogate) {
+		codepoint = 0x10000 + ((stream->high_surrogate - 0xD800) << 10) + (codepoint - 0xDC00);
+		stream->high_surrogate = 0;
+		return token_append_utf8(stream, codepoint);
+	}
+
+	if (stream->high_surrogate) {
+		stream->high_surrogate = 0;
+		if (token_append_utf8(stream, 0xFFFD)) return -1;
+	}
+	if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {
+		// wait for the second half
+		stream->high_surrogate = codepoint;
+		return 0;
+	}
+	return token_append_utf8(stream, codepoint >= 0xDC00 && codepoint <= 0xDFFF ? 0xFFFD : codepoint);
+}
+
+/**
+ * @brief Read a character inside a string
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int string_char(struct json_stream *stream, char c) {
+	static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+
+	switch (stream->state) {
+		case JSON_STATE_STRING:
+			if (c == '"') return end_string(stream);
+			if (c == '\\') {
+				stream->state = JSON_STATE_ESCAPE;
+				return 0;
+			}
+			if ((unsigned char) c < 0x20) return fail(stream, "control character in string");
+			if (stream->high_surrogate) {
+				stream->high_surrogate = 0;
+				if (token_append_utf8(stream, 0xFFFD)) return -1;
+			}
+			return token_append(stream, &c, 1);
+		case JSON_STATE_ESCAPE:
+			if (c == 'u') {
+				stream->codepoint = 0;
+				stream->codepoint_digits = 0;
+				stream->state = JSON_STATE_UNICODE;
+				return 0;
+			}
+			for (size_t i = 0; escapes[i] != '\0'; i += 2) {
+				if (escapes[i] == c) {
+					stream->state = JSON_STATE_STRING;
+					if (stream->high_surrogate) {
+						stream->high_surrogate = 0;
+						if (token_append_utf8(stream, 0xFFFD)) return -1;
+					}
+					return token_append(stream, &escapes[i + 1], 1);
+				}
+			}
+			return fail(stream, "invalid escape");
+		default: // JSON_STATE_UNICODE
+			if (c >= '0' && c <= '9') {
+				stream->codepoint = stream->codepoint * 16 + (c - '0');
+			} else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+				stream->codepoint = stream->codepoint * 16 + ((c | 0x20) - 'a' + 10);
+			} else {
+				return fail(stream, "invalid unicode escape");
+			}
+			if (++stream->codepoint_digits < 4) return 0;
+			stream->state = JSON_STATE_STRING;
+			return end_unicode_escape(stream);
+	}
+}
+
+/**
+ * @brief Feed the next chunk of a JSON document to the parser
+ *
+ * @param stream parser
+ * @param data chunk, it doesn't need to end on a token boundary
+ * @param length size of the chunk
+ * @return `0` on success, otherwise `-1` on a syntax error or a handler stopping the parser
+ */
+int json_stream_feed(struct json_stream *stream, const char *data, size_t length) {
+	if (stream == NULL || stream->state == JSON_STATE_ERROR) return -1;
+
+	for (size_t i = 0; i < length;) {
+		char c = data[i];
+		size_t consumed = 1;
+		int rc = 0;
+
+		switch (stream->state) {
+			case JSON_STATE_STRING:
+			case JSON_STATE_ESCAPE:
+			case JSON_STATE_UNICODE: {
+				// copy the run of plain characters at once
+				size_t run = 0;
+				if (stream->state == JSON_STATE_STRING && !stream->high_surrogate) {
+					while (i + run < length && data[i + run] != '"' && data[i + run] != '\\' && (unsigned char) data[i + run] >= 0x20) run++;
+				}
+				if (run > 0) {
+					rc = token_append(stream, data + i, run);
+					consumed = run;
+				} else {
+					rc = string_char(stream, c);
+				}
+				break;
+			}
+			case JSON_STATE_NUMBER:
+				if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+					rc = token_append(stream, &c, 1);
+					break;
+				}
+				// the character after the number is read again in the next state
+				rc = end_number(stream);
+				consumed = 0;
+				break;
+			case JSON_STATE_LITERAL:
+				if (c >= 'a' && c <= 'z') {
+					rc = token_append(stream, &c, 1);
+					break;
+				}
+				rc = end_literal(stream);
+				consumed = 0;
+				break;
+			case JSON_STATE_VALUE:
+			case JSON_STATE_ARRAY_FIRST:
+				if (is_whitespace(c)) break;
+				if (c == ']' && stream->state == JSON_STATE_ARRAY_FIRST) {
+					rc = close_container(stream, c);
+				} else {
+					rc = begin_value(stream, c);
+				}
+				break;
+			case JSON_STATE_OBJECT_FIRST:
+			case JSON_STATE_KEY:
+				if (is_whitespace(c)) break;
+				if (c == '}' && stream->state == JSON_STATE_OBJECT_FIRST) {
+					rc = close_container(stream, c);
+				} else if (c == '"') {
+					token_reset(stream);
+					stream->string_is_key = 1;
+					stream->state = JSON_STATE_STRING;
+				} else {
+					rc = fail(stream, "expected a key");
+				}
+				break;
+			case JSON_STATE_COLON:
+				if (is_whitespace(c)) break;
+				if (c == ':') {
+					stream->state = JSON_STATE_VALUE;
+				} else {
+					rc = fail(stream, "expected a colon");
+				}
+				break;
+			case JSON_STATE_AFTER_VALUE:
+				if (is_whitespace(c)) break;
+				if (c == ',') {
+					stream->state = stream->containers[stream->depth - 1] == '{' ? JSON_STATE_KEY : JSON_STATE_VALUE;
+				} else if (c == '}' || c == ']') {
+					rc = close_container(stream, c);
+				} else {
+					rc = fail(stream, "expected a comma or a closing bracket");
+				}
+				break;
+			case JSON_STATE_DONE:
+				if (!is_whitespace(c)) rc = fail(stream, "data after the document");
+				break;
+			case JSON_STATE_ERROR:
+				return -1;
+		}
+		if (rc) return -1;
+		i += consumed;
+		stream->offset += consumed;
+	}
+	return 0;
+}
+
+/**
+ * @brief End the document, checking that it was complete
+ *
+ * @param stream parser
+ * @return `0` if a complete document was fed, otherwise `-1`
+ */
+int json_stream_finish(struct json_stream *stream) {
+	if (stream == NULL || stream->state == JSON_STATE_ERROR) return -1;
+
+	// a number or literal at the top level only ends with the document
+	if (stream->depth == 0 && stream->state == JSON_STATE_NUMBER && end_number(stream)) return -1;
+	if (stream->depth == 0 && stream->state == JSON_STATE_LITERAL && end_literal(stream)) return -1;
+
+	if (stream->state != JSON_STATE_DONE) return fail(stream, "truncated document");
+	return 0;
+}
+
+/**
+ * @brief curl write callback feeding a parser, a syntax error aborts the transfer
+ */
+size_t json_stream_writefunc(void *ptr, size_t size, size_t nmemb, struct json_stream *stream) {
+	return json_stream_feed(stream, ptr, size * nmemb) ? 0 : size * nmemb;
+}
+
+static int extractor_open(struct json_tag_extractor *e, int is_array) {
+	if (e->depth >= JSON_STREAM_MAX_DEPTH) return -1;
+
+	// an array holds tags if its key is a tag key, or if it is nested in such an array
+	int in_tags = 0;
+	if (is_array && e->depth > 0) {
+		in_tags = e->is_array[e->depth - 1] ? e->in_tags[e->depth - 1] : e->key_matches;
+	}
+	e->in_tags[e->depth] = in_tags;
+	e->is_array[e->depth] = is_array;
+	e->depth++;
+	e->key_matches = 0;
+	return 0;
+}
+
+static int extractor_close(struct json_tag_extractor *e) {
+	e->depth--;
+	e->key_matches = 0;
+	return 0;
+}
+
+static int extractor_start_object(void *user_data) {
+	return extractor_open(user_data, 0);
+}
+
+static int extractor_start_array(void *user_data) {
+	return extractor_open(user_data, 1);
+}
+
+static int extractor_end(void *user_data) {
+	return extractor_close(user_data);
+}
+
+static int extractor_key(void *user_data, const char *key, size_t length) {
+	struct json_tag_extractor *e = user_data;
+
+	e->key_matches = 0;
+	for (size_t i = 0; e->keys[i] != NULL; i++) {
+		if (strlen(e->keys[i]) == length && memcmp(e->keys[i], key, length) == 0) {
+			e->key_matches = 1;
+			break;
+		}
+	}
+	return 0;
+}
+
+static int extractor_string(void *user_data, const char *value, size_t length) {
+	struct json_tag_extractor *e = user_data;
+
+	if (e->depth == 0 || length == 0) return 0;
+	int is_tag = e->is_array[e->depth - 1] ? e->in_tags[e->depth - 1] : e->key_matches;
+	return is_tag ? e->callback(value, length, e->user_data) : 0;
+}
+
+const struct json_stream_handler json_tag_extractor_handler = {
+	.start_object = extractor_start_object,
+	.end_object = extractor_end,
+	.start_array = extractor_start_array,
+	.end_array = extractor_end,
+	.key = extractor_key,
+	.string = extractor_string,
+};
+
+/**
+ * @brief Set up a tag extractor, to be used with `json_tag_extractor_handler`
+ *
+ * @param extractor extractor to set up
+ * @param keys `NULL` terminated keys whose string values are tags
+ * @param callback called for every tag as soon as it was read
+ * @param user_data handed to the callback
+ */
+void json_tag_extractor_init(struct json_tag_extractor *extractor, const char *const *keys, json_tag_callback callback, void *user_data) {
+	memset(extractor, 0, sizeof(struct json_tag_extractor));
+	extractor->keys = keys;
+	extractor->callback = callback;
+	extractor->user_data = user_data;
+}
+
+// one attempt of a streamed request
+struct stream_attempt {
+	struct json_tag_extractor *extractor;
+	struct json_stream *stream;
+	CURL *curl;
+	int fed; // the body reached the parser, so its tags were already handed out
+};
+
+/**
+ * @brief curl write callback feeding the parser with successful bodies only
+ */
+static size_t stream_attempt_writefunc(void *ptr, size_t size, size_t nmemb, struct stream_attempt *r) {
+	long status = 0;
+
+	// error bodies are skipped, the request may be retried
+	curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &status);
+	if (status >= 400) return size * nmemb;
+
+	r->fed = 1;
+	return json_stream_writefunc(ptr, size, nmemb, r->stream);
+}
+
+static int start_stream_attempt(CURL *curl, void *user_data) {
+	struct stream_attempt *r = user_data;
+
+	if ((r->stream = json_stream_create(&json_tag_extractor_handler, r->extractor)) == NULL) return -1;
+	r->curl = curl;
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_attempt_writefunc);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, r);
+	return 0;
+}
+
+static int discard_stream_attempt(void *user_data) {
+	struct stream_attempt *r = user_data;
+
+	json_stream_destroy(r->stream);
+	r->stream = NULL;
+	return r->fed ? -1 : 0;
+}
+
+/**
+ * @brief Get the tag candidates of a JSON response while it downloads
+ *
+ * The body is parsed chunk by chunk as curl receives it and never kept whole.
+ * Requests are retried and rate limited like other provider requests, until a
+ * body started to reach the callback.
+ *
+ * @param url url of a JSON document
+ * @param keys `NULL` terminated keys whose string values are tags
+ * @param callback called for every tag as soon as it was read
+ * @param user_data handed to the callback
+ * @return `0` on success, otherwise `-1` on error
+ */
+int stream_tags_from_url(const char *url, const char *const *keys, json_tag_callback callback, void *user_data) {
+	struct json_tag_extractor extractor;
+	struct stream_attempt attempt = {&extractor, NULL, NULL, 0};
+	const struct provider_attempt hooks = {start_stream_attempt, discard_stream_attempt, &attempt};
+
+	json_tag_extractor_init(&extractor, keys, callback, user_data);
+	if (perform_provider_request(url, &hooks, NULL) != PROVIDER_OK) return -1;
+
+	int result = json_stream_finish(attempt.stream) ? -1 : 0;
+	json_stream_destroy(attempt.stream);
+	return result;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../include/database.h"
+#include "../include/maintenance.h"
+
+#define MAINTENANCE_DEFAULT_CHANGES_THRESHOLD 10000
+#define MAINTENANCE_DEFAULT_FREELIST_THRESHOLD 256
+#define MAINTENANCE_DEFAULT_WAL_THRESHOLD (16LL << 20)
+#define MAINTENANCE_DEFAULT_SLICE_MS 10
+#define MAINTENANCE_DEFAULT_VACUUM_PAGES_PER_STEP 64
+// rows sampled per index by ANALYZE, keeps `PRAGMA optimize` short on large tables
+#define MAINTENANCE_ANALYSIS_LIMIT 1000
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Get the integer value of a pragma or query
+ *
+ * @return the value, or `-1` on error
+ */
+static sqlite3_int64 get_pragma_int64(struct tagger_db *db, const char *sql) {
+	sqlite3_stmt *stmt;
+	sqlite3_int64 value = -1;
+
+	int rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) {
+		value = sqlite3_column_int64(stmt, 0);
+	} else {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+	}
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+/**
+ * @brief Get the size of the WAL file of the main database
+ *
+ * @return size in bytes, `0` if the database has no WAL file
+ */
+static sqlite3_int64 get_wal_size(struct tagger_db *db) {
+	const char *location = sqlite3_db_filename(db->connection, "main");
+	char wal_location[4096];
+	struct stat st;
+
+	if (location == NULL || location[0] == '\0') return 0;
+	if ((size_t) snprintf(wal_location, sizeof(wal_location), "%s-wal", location) >= sizeof(wal_location)) return 0;
+	return stat(wal_location, &st) ? 0 : (sqlite3_int64) st.st_size;
+}
+
+/**
+ * @brief Run the database maintenance that is due, for at most one time slice
+ *
+ * Three tasks run when their threshold is reached, in this order:
+ * - `PRAGMA optimize` refreshes the query planner statistics after many rows changed,
+ *   ANALYZE samples a limited number of rows so it stays short.
+ * - `PRAGMA incremental_vacuum` returns free pages to the file system a few pages
+ *   per step, until the slice is used up. This needs a database created with
+ *   incremental auto vacuum, which all writable profiles set.
+ * - a passive WAL checkpoint, it never waits for readers or writers.
+ *
+ * Call it repeatedly while it returns `1`, for example when the application is
+ * idle, every call blocks other writers for about one slice at most.
+ *
+ * @param db tagger database, not read-only
+ * @param options thresholds, may be `NULL` for the defaults
+ * @param stats where to store what was done in this slice, may be `NULL`
+ * @return `1` if maintenance is still due, `0` if all of it is done, `-1` on error
+ */
+int run_maintenance_slice(struct tagger_db *db, const struct maintenance_options *options, struct maintenance_stats *stats) {
+	struct maintenance_options defaults = {0};
+	struct maintenance_stats slice_stats = {0};
+	char sql[64];
+	int more = 0;
+
+	if (db == NULL) return -1;
+	if (options == NULL) options = &defaults;
+	if (stats == NULL) stats = &slice_stats;
+	memset(stats, 0, sizeof(struct maintenance_stats));
+
+	sqlite3_int64 changes_threshold = options->changes_threshold != 0 ? options->changes_threshold : MAINTENANCE_DEFAULT_CHANGES_THRESHOLD;
+	sqlite3_int64 freelist_threshold = options->freelist_threshold > 0 ? options->freelist_threshold : MAINTENANCE_DEFAULT_FREELIST_THRESHOLD;
+	sqlite3_int64 wal_threshold = options->wal_threshold > 0 ? options->wal_threshold : MAINTENANCE_DEFAULT_WAL_THRESHOLD;
+	int vacuum_pages = options->vacuum_pages_per_step > 0 ? options->vacuum_pages_per_step : MAINTENANCE_DEFAULT_VACUUM_PAGES_PER_STEP;
+	long long deadline = now_ms() + (options->slice_ms > 0 ? options->slice_ms : MAINTENANCE_DEFAULT_SLICE_MS);
+
+	// statistics of the query planner
+	sqlite3_int64 total_changes = sqlite3_total_changes64(db->connection);
+	if (total_changes - db->maintained_changes >= changes_threshold) {
+		snprintf(sql, sizeof(sql), "PRAGMA analysis_limit=%d; PRAGMA optimize(0x10002);", MAINTENANCE_ANALYSIS_LIMIT);
+		if (execute_sql_string(db, sql)) return -1;
+
+		// before SQLite 3.46 optimize only refreshes statistics that exist, the first ones come from ANALYZE
+		sqlite3_int64 analyzed = get_pragma_int64(db, "SELECT EXISTS (SELECT 1 FROM sqlite_master WHERE name = 'sqlite_stat1');");
+		if (analyzed == -1 || (!analyzed && execute_sql_string(db, "ANALYZE;"))) return -1;
+		db->maintained_changes = total_changes;
+		stats->optimized = 1;
+	}
+
+	// free pages
+	sqlite3_int64 auto_vacuum = get_pragma_int64(db, "PRAGMA auto_vacuum;");
+	sqlite3_int64 freelist = get_pragma_int64(db, "PRAGMA freelist_count;");
+	if (auto_vacuum == -1 || freelist == -1) return -1;
+
+	// 2 is incremental, databases created without it keep their free pages until a full VACUUM
+	if (auto_vacuum == 2 && freelist >= freelist_threshold) {
+		while (freelist > 0 && now_ms() < deadline) {
+			snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%d);", vacuum_pages);
+			if (execute_sql_string(db, sql)) return -1;
+
+			sqlite3_int64 left = get_pragma_int64(db, "PRAGMA freelist_count;");
+			if (left == -1) return -1;
+			stats->pages_vacuumed += freelist - left;
+			freelist = left;
+		}
+		if (freelist >= freelist_threshold) more = 1;
+	}
+
+	// WAL file
+	if (now_ms() >= deadline) return 1;
+	if (get_wal_size(db) >= wal_threshold) {
+		int log_frames, checkpointed_frames;
+
+		int rc = sqlite3_wal_checkpoint_v2(db->connection, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &checkpointed_frames);
+		if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+			fprintf(stderr, "Error when checkpointing the WAL: %s\n", sqlite3_errmsg(db->connection));
+			return -1;
+		}
+		stats->checkpointed = 1;
+		stats->wal_frames_left = log_frames > checkpointed_frames ? log_frames - checkpointed_frames : 0;
+		if (stats->wal_frames_left > 0) more = 1;
+	}
+
+	return more;
+}
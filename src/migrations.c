@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/database.h"
+#include "../include/migrations.h"
+
+#define ITEMS_TABLE_NAME "items"
+#define ITEM_TAGS_TABLE_NAME "itemtags"
+#define TAG_COOCCURRENCE_TABLE_NAME "tag_cooccurrence"
+#define MIGRATIONS_TABLE_NAME "schema_migrations"
+#define MIGRATION_DEFAULT_CHUNK_SIZE 10000
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+extern int table_exists(struct tagger_db *db, const char *table_name);
+extern int create_base_tables(struct tagger_db *db);
+extern int create_tag_cooccurrence_triggers(struct tagger_db *db, const char *counted_items_sql);
+
+/**
+ * One step of the schema, migrating from `version - 1` to `version`
+ *
+ * `prepare`, `finish` and the version bump run in a single transaction when there is
+ * no `chunk_sql`. Otherwise `prepare` commits on its own, the rows are rewritten
+ * in chunks of keys, one transaction each, and `finish` commits together with
+ * the version bump. The last rewritten key is stored in `MIGRATIONS_TABLE_NAME`,
+ * so an interrupted migration continues where it stopped.
+ */
+struct migration {
+	int version;
+	const char *description;
+	int (*prepare)(struct tagger_db *db); // may be `NULL`
+	const char *next_key_sql; // selects the last of the next ?2 keys after ?1, `NULL` if there are none
+	const char *chunk_sql; // rewrites the rows with keys in (?1, ?2], may be `NULL`
+	int (*finish)(struct tagger_db *db); // may be `NULL`
+};
+
+// largest item id counted in the tag co-occurrence table while it is being filled
+static const char cooccurrence_counted_items_sql[] = "SELECT last_key FROM " MIGRATIONS_TABLE_NAME " WHERE version = 2";
+
+static int prepare_tag_cooccurrence(struct tagger_db *db) {
+	// both (a,b) and (b,a) are stored so lookups only need the primary key
+	static const char tag_cooccurrence_table_sql[] = "CREATE TABLE IF NOT EXISTS " TAG_COOCCURRENCE_TABLE_NAME " ("
+							   "tag_id INTEGER NOT NULL,"
+							   "related_tag_id INTEGER NOT NULL,"
+							   "count INTEGER NOT NULL,"
+							   "PRIMARY KEY (tag_id, related_tag_id)"
+							   ") WITHOUT ROWID";
+
+	if (execute_sql_string(db, (char*) tag_cooccurrence_table_sql) ||
+		create_tag_cooccurrence_triggers(db, cooccurrence_counted_items_sql)) {
+		fputs("Tag_cooccurrence table could not be created\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+static int finish_tag_cooccurrence(struct tagger_db *db) {
+	// from now on the triggers count every item
+	if (execute_sql_string(db, "DROP TRIGGER " TAG_COOCCURRENCE_TABLE_NAME "_ai;") ||
+		execute_sql_string(db, "DROP TRIGGER " TAG_COOCCURRENCE_TABLE_NAME "_ad;") ||
+		create_tag_cooccurrence_triggers(db, NULL)) {
+		fputs("Tag_cooccurrence triggers could not be created\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+static const struct migration migrations[] = {
+	{1, "listings, tags, items and item tags", create_base_tables, NULL, NULL, NULL},
+	{2, "tag co-occurrence counts", prepare_tag_cooccurrence,
+		"SELECT max(item_id) FROM (SELECT item_id FROM " ITEMS_TABLE_NAME " WHERE item_id > ?1 ORDER BY item_id LIMIT ?2)",
+		"INSERT INTO " TAG_COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) "
+		"SELECT a.tag_id, b.tag_id, count() FROM " ITEM_TAGS_TABLE_NAME " a "
+		"JOIN " ITEM_TAGS_TABLE_NAME " b ON a.item_id = b.item_id AND a.tag_id <> b.tag_id "
+		"WHERE a.item_id > ?1 AND a.item_id <= ?2 GROUP BY a.tag_id, b.tag_id "
+		"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + excluded.count",
+		finish_tag_cooccurrence},
+};
+
+#define MIGRATIONS_COUNT (sizeof(migrations) / sizeof(migrations[0]))
+
+/**
+ * @brief Run a statement with up to two integer parameters
+ *
+ * @param value where to store the first column of the first row, `NULL` if no row is expected
+ * @return `1` if a non-NULL value was stored, `0` if there was none, `-1` on error
+ */
+static int run_sql(struct tagger_db *db, const char *sql, sqlite3_int64 first, sqlite3_int64 second, sqlite3_int64 *value) {
+	sqlite3_stmt *stmt;
+	int found = 0;
+
+	int rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	int parameters = sqlite3_bind_parameter_count(stmt);
+	if ((parameters >= 1 && sqlite3_bind_int64(stmt, 1, first) != SQLITE_OK) ||
+		(parameters >= 2 && sqlite3_bind_int64(stmt, 2, second) != SQLITE_OK)) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW && value != NULL && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+		*value = sqlite3_column_int64(stmt, 0);
+		found = 1;
+	}
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return found;
+}
+
+static int begin_migration_step(struct tagger_db *db) {
+	return execute_sql_string(db, "SAVEPOINT tagger_migration;");
+}
+
+/**
+ * @brief Commit a migration step, or roll it back if it failed
+ *
+ * @param failed whether the step failed
+ * @return `0` if the step was committed, otherwise `-1`
+ */
+static int end_migration_step(struct tagger_db *db, int failed) {
+	if (!failed && !execute_sql_string(db, "RELEASE tagger_migration;")) return 0;
+
+	execute_sql_string(db, "ROLLBACK TO tagger_migration;");
+	execute_sql_string(db, "RELEASE tagger_migration;");
+	return -1;
+}
+
+static int set_user_version(struct tagger_db *db, int version) {
+	char sql[64];
+
+	snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", version);
+	return execute_sql_string(db, sql);
+}
+
+/**
+ * @brief Get the schema version of the database
+ *
+ * Databases created before the schema was versioned have `user_version` 0,
+ * their version is recognized from their tables.
+ *
+ * @param db tagger database
+ * @return schema version, `0` for an empty database, or `-1` on error
+ */
+int get_schema_version(struct tagger_db *db) {
+	sqlite3_int64 version = 0;
+
+	if (db == NULL || run_sql(db, "PRAGMA user_version;", 0, 0, &version) == -1) return -1;
+	if (version > 0) return (int) version;
+
+	int has_items = table_exists(db, ITEMS_TABLE_NAME);
+	int has_cooccurrence = table_exists(db, TAG_COOCCURRENCE_TABLE_NAME);
+	if (has_items == -1 || has_cooccurrence == -1) return -1;
+
+	return has_cooccurrence ? 2 : has_items ? 1 : 0;
+}
+
+/**
+ * @brief Apply one migration, or continue it if it was interrupted
+ *
+ * @param chunks_left remaining chunk budget, `NULL` for no limit
+ * @return `1` if the migration is done, `0` if the chunk budget ran out, `-1` on error
+ */
+static int apply_migration(struct tagger_db *db, const struct migration *migration, size_t chunk_size, size_t *chunks_left) {
+	sqlite3_int64 last_key = 0, next_key;
+	int in_progress, failed;
+
+	if (migration->chunk_sql == NULL) {
+		if (begin_migration_step(db)) return -1;
+		failed = (migration->prepare != NULL && migration->prepare(db)) ||
+			(migration->finish != NULL && migration->finish(db)) ||
+			set_user_version(db, migration->version);
+		return end_migration_step(db, failed) ? -1 : 1;
+	}
+
+	if (execute_sql_string(db, "CREATE TABLE IF NOT EXISTS " MIGRATIONS_TABLE_NAME " ("
+			"version INTEGER PRIMARY KEY NOT NULL,"
+			"last_key INTEGER NOT NULL"
+			")")) {
+		return -1;
+	}
+
+	in_progress = run_sql(db, "SELECT last_key FROM " MIGRATIONS_TABLE_NAME " WHERE version = ?;", migration->version, 0, &last_key);
+	if (in_progress == -1) return -1;
+
+	if (!in_progress) {
+		if (begin_migration_step(db)) return -1;
+		failed = (migration->prepare != NULL && migration->prepare(db)) ||
+			run_sql(db, "INSERT INTO " MIGRATIONS_TABLE_NAME " (version, last_key) VALUES (?, 0);", migration->version, 0, NULL) == -1;
+		if (end_migration_step(db, failed)) return -1;
+	}
+
+	for (;;) {
+		if (chunks_left != NULL && *chunks_left == 0) return 0;
+		if (begin_migration_step(db)) return -1;
+
+		int found = run_sql(db, migration->next_key_sql, last_key, (sqlite3_int64) chunk_size, &next_key);
+		if (found == 0) {
+			if (end_migration_step(db, 0)) return -1;
+			break;
+		}
+
+		failed = found == -1 ||
+			run_sql(db, migration->chunk_sql, last_key, next_key, NULL) == -1 ||
+			run_sql(db, "UPDATE " MIGRATIONS_TABLE_NAME " SET last_key = ?2 WHERE version = ?1;", migration->version, next_key, NULL) == -1;
+		if (end_migration_step(db, failed)) return -1;
+
+		last_key = next_key;
+		if (chunks_left != NULL) (*chunks_left)--;
+	}
+
+	if (begin_migration_step(db)) return -1;
+	failed = (migration->finish != NULL && migration->finish(db)) ||
+		run_sql(db, "DELETE FROM " MIGRATIONS_TABLE_NAME " WHERE version = ?;", migration->version, 0, NULL) == -1 ||
+		set_user_version(db, migration->version);
+	return end_migration_step(db, failed) ? -1 : 1;
+}
+
+/**
+ * @brief Migrate the database schema to a newer version
+ *
+ * Migrations are applied in order, each one is committed together with the new
+ * `user_version`. Migrations rewriting existing rows do it in chunks of keys,
+ * one short transaction each, so other connections can write in between and
+ * a large database is never locked for the whole rewrite. With a chunk budget
+ * the migration can be spread over many calls, every call continues where
+ * the previous one stopped, also after a crash.
+ *
+ * @param db tagger database
+ * @param target_version schema version to migrate to, at most `SCHEMA_VERSION`
+ * @param chunk_size number of keys rewritten per transaction, `0` for the default
+ * @param max_chunks number of chunks to rewrite in this call, `0` for no limit
+ * @return `1` if the database is at the target version, `0` if the chunk budget
+ * ran out before, otherwise `-1` on error
+ */
+int migrate_database(struct tagger_db *db, int target_version, size_t chunk_size, size_t max_chunks) {
+	size_t chunks_left = max_chunks;
+	sqlite3_int64 user_version = 0;
+	int version = get_schema_version(db);
+
+	if (version == -1 || run_sql(db, "PRAGMA user_version;", 0, 0, &user_version) == -1) return -1;
+	if (target_version < 0 || target_version > (int) MIGRATIONS_COUNT) {
+		fprintf(stderr, "Error, unknown schema version %d\n", target_version);
+		return -1;
+	}
+	if (version > (int) MIGRATIONS_COUNT) {
+		fprintf(stderr, "Error, the database schema version %d is newer than the supported %d\n", version, (int) MIGRATIONS_COUNT);
+		return -1;
+	}
+	if (version > target_version) {
+		fprintf(stderr, "Error, the database schema version %d cannot be downgraded to %d\n", version, target_version);
+		return -1;
+	}
+
+	// a database from before the schema was versioned gets its version recorded
+	if (user_version == 0 && version > 0 && set_user_version(db, version)) return -1;
+
+	if (chunk_size == 0) chunk_size = MIGRATION_DEFAULT_CHUNK_SIZE;
+
+	for (; version < target_version; version++) {
+		const struct migration *migration = &migrations[version];
+
+		int result = apply_migration(db, migration, chunk_size, max_chunks > 0 ? &chunks_left : NULL);
+		if (result == -1) {
+			fprintf(stderr, "Could not migrate the database to schema version %d: %s\n", migration->version, migration->description);
+			return -1;
+		}
+		if (result == 0) return 0;
+	}
+
+	return 1;
+}
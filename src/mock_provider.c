@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../include/mock_provider.h"
+
+#define MOCK_PROVIDER_MAX_CONNECTIONS 256
+#define MOCK_PROVIDER_REQUEST_SIZE 8192
+
+static const char default_body[] = "{\"id\": 1, \"tags\": [\"mock\", \"provider\"], \"meta\": {\"genres\": [\"test\"]}}";
+
+/**
+ * Local HTTP server standing in for a provider, it answers every `GET` with a canned
+ * response after a delay, failing and throttling some of them on purpose
+ */
+struct mock_provider {
+	struct mock_provider_options options;
+	int fd;
+	int port;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t idle; // signalled when a connection closes
+	int stopping;
+	int clients[MOCK_PROVIDER_MAX_CONNECTIONS]; // open connections, `-1` for free slots
+	int active;
+	struct mock_provider_stats stats;
+	double tokens; // throttling bucket, holding one second worth of requests
+	double refilled_at; // milliseconds
+	unsigned int seed;
+};
+
+struct mock_connection {
+	struct mock_provider *server;
+	int fd;
+	int slot;
+};
+
+typedef enum {MOCK_OK, MOCK_ERROR, MOCK_THROTTLED} MOCK_OUTCOME;
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * @brief Decide how to answer a request and count it
+ *
+ * @param latency_ms where to store the delay before answering
+ */
+static MOCK_OUTCOME next_outcome(struct mock_provider *server, int *latency_ms) {
+	const struct mock_provider_options *options = &server->options;
+	MOCK_OUTCOME outcome = MOCK_OK;
+
+	pthread_mutex_lock(&server->lock);
+	server->stats.requests++;
+
+	if (options->requests_per_second > 0) {
+		double now = now_ms(), burst = options->requests_per_second >= 1 ? options->requests_per_second : 1;
+
+		server->tokens += (now - server->refilled_at) * options->requests_per_second / 1000.0;
+		if (server->tokens > burst) server->tokens = burst;
+		server->refilled_at = now;
+
+		if (server->tokens < 1) {
+			outcome = MOCK_THROTTLED;
+		} else {
+			server->tokens -= 1;
+		}
+	}
+	if (outcome == MOCK_OK && options->error_rate > 0 && rand_r(&server->seed) < options->error_rate * RAND_MAX) {
+		outcome = MOCK_ERROR;
+	}
+
+	// throttled requests are answered at once, like a real rate limiter would
+	*latency_ms = 0;
+	if (outcome != MOCK_THROTTLED) {
+		*latency_ms = options->latency_ms;
+		if (options->latency_jitter_ms > 0) *latency_ms += rand_r(&server->seed) % (options->latency_jitter_ms + 1);
+	}
+
+	if (outcome == MOCK_ERROR) server->stats.errors++;
+	if (outcome == MOCK_THROTTLED) server->stats.throttled++;
+	pthread_mutex_unlock(&server->lock);
+
+	return outcome;
+}
+
+/**
+ * @brief Send a whole buffer
+ *
+ * @return `0` on success, otherwise `-1` if the client went away
+ */
+static int send_all(int fd, const char *data, size_t length) {
+	while (length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if (sent <= 0) return -1;
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+static int answer_request(struct mock_provider *server, int fd, int close_after) {
+	const char *body = server->options.body != NULL ? server->options.body : default_body;
+	const char *connection = close_after ? "close" : "keep-alive";
+	char header[256];
+	int latency_ms, length;
+
+	MOCK_OUTCOME outcome = next_outcome(server, &latency_ms);
+	if (latency_ms > 0) {
+		struct timespec ts = {latency_ms / 1000, (latency_ms % 1000) * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+
+	switch (outcome) {
+		case MOCK_THROTTLED:
+			length = snprintf(header, sizeof(header), "HTTP/1.1 429 Too Many Requests\r\nRetry-After: %d\r\n"
+				"Content-Length: 0\r\nConnection: %s\r\n\r\n", server->options.retry_after, connection);
+			return send_all(fd, header, length);
+		case MOCK_ERROR:
+			length = snprintf(header, sizeof(header), "HTTP/1.1 500 Internal Server Error\r\n"
+				"Content-Length: 0\r\nConnection: %s\r\n\r\n", connection);
+			return send_all(fd, header, length);
+		default:
+			length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+				"Content-Length: %zu\r\nConnection: %s\r\n\r\n", strlen(body), connection);
+			return send_all(fd, header, length) || send_all(fd, body, strlen(body)) ? -1 : 0;
+	}
+}
+
+/**
+ * @brief Answer the requests of one connection until the client closes it
+ */
+static void* mock_connection_run(void *arg) {
+	struct mock_connection *connection = arg;
+	struct mock_provider *server = connection->server;
+	char request[MOCK_PROVIDER_REQUEST_SIZE];
+	size_t length = 0;
+	char *end;
+
+	request[0] = '\0';
+	for (;;) {
+		// requests have no body, they end with an empty line
+		while ((end = strstr(request, "\r\n\r\n")) == NULL) {
+			ssize_t n;
+			if (length == sizeof(request) - 1 || (n = read(connection->fd, request + length, sizeof(request) - 1 - length)) <= 0) {
+				goto done;
+			}
+			length += n;
+			request[length] = '\0';
+		}
+
+		size_t request_length = end + 4 - request;
+		end[2] = '\0';
+		int close_after = strstr(request, "Connection: close") != NULL;
+
+		if (answer_request(server, connection->fd, close_after) || close_after) break;
+
+		memmove(request, request + request_length, length - request_length + 1);
+		length -= request_length;
+	}
+
+done:
+	// the slot is freed before closing, so a stopping server never shuts down a reused descriptor
+	pthread_mutex_lock(&server->lock);
+	server->clients[connection->slot] = -1;
+	server->active--;
+	pthread_cond_signal(&server->idle);
+	pthread_mutex_unlock(&server->lock);
+
+	close(connection->fd);
+	free(connection);
+	return NULL;
+}
+
+static void* mock_provider_run(void *arg) {
+	struct mock_provider *server = arg;
+	pthread_attr_t attributes;
+	pthread_t thread;
+	int fd;
+
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	while ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+		struct mock_connection *connection = malloc(sizeof(struct mock_connection));
+		int slot = -1;
+
+		pthread_mutex_lock(&server->lock);
+		for (int i = 0; i < MOCK_PROVIDER_MAX_CONNECTIONS && !server->stopping && connection != NULL; i++) {
+			if (server->clients[i] == -1) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot != -1) {
+			server->clients[slot] = fd;
+			server->active++;
+			server->stats.connections++;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		if (slot == -1) {
+			close(fd);
+			free(connection);
+			continue;
+		}
+
+		// header and body are separate writes, which must not wait for delayed acknowledgements
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		*connection = (struct mock_connection) {server, fd, slot};
+		if (pthread_create(&thread, &attributes, mock_connection_run, connection)) {
+			pthread_mutex_lock(&server->lock);
+			server->clients[slot] = -1;
+			server->active--;
+			pthread_mutex_unlock(&server->lock);
+			close(fd);
+			free(connection);
+		}
+	}
+
+	pthread_attr_destroy(&attributes);
+	return NULL;
+}
+
+/**
+ * @brief Start a mock provider on a free port of the loopback interface
+ *
+ * Every connection gets its own thread and is kept alive between requests,
+ * so the server keeps up with the concurrency of the client.
+ *
+ * @param options behaviour of the server, `NULL` for immediate successful responses
+ * @return the server, or `NULL` on error
+ */
+struct mock_provider* mock_provider_start(const struct mock_provider_options *options) {
+	struct sockaddr_in address = {0};
+	socklen_t address_length = sizeof(address);
+
+	struct mock_provider *server = calloc(1, sizeof(struct mock_provider));
+	if (server == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return NULL;
+	}
+
+	if (options != NULL) server->options = *options;
+	for (int i = 0; i < MOCK_PROVIDER_MAX_CONNECTIONS; i++) server->clients[i] = -1;
+	server->tokens = server->options.requests_per_second >= 1 ? server->options.requests_per_second : 1;
+	server->refilled_at = now_ms();
+	server->seed = (unsigned int) time(NULL);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		goto error;
+	}
+	if (bind(server->fd, (struct sockaddr *) &address, sizeof(address)) || listen(server->fd, 128) ||
+		getsockname(server->fd, (struct sockaddr *) &address, &address_length)) {
+		perror("Could not listen for the mock provider");
+		close(server->fd);
+		goto error;
+	}
+	server->port = ntohs(address.sin_port);
+
+	if (pthread_create(&server->thread, NULL, mock_provider_run, server)) {
+		fputs("Could not start the mock provider thread\n", stderr);
+		close(server->fd);
+		goto error;
+	}
+	return server;
+
+error:
+	pthread_cond_destroy(&server->idle);
+	pthread_mutex_destroy(&server->lock);
+	free(server);
+	return NULL;
+}
+
+int mock_provider_port(const struct mock_provider *server) {
+	return server != NULL ? server->port : -1;
+}
+
+void mock_provider_get_stats(struct mock_provider *server, struct mock_provider_stats *stats) {
+	pthread_mutex_lock(&server->lock);
+	*stats = server->stats;
+	pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * @brief Stop a mock provider, closing the connections still open
+ *
+ * @param server mock provider, may be `NULL`
+ */
+void mock_provider_stop(struct mock_provider *server) {
+	if (server == NULL) return;
+
+	pthread_mutex_lock(&server->lock);
+	server->stopping = 1;
+	pthread_mutex_unlock(&server->lock);
+
+	// wakes the accept call of the server thread
+	shutdown(server->fd, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+
+	pthread_mutex_lock(&server->lock);
+	for (int i = 0; i < MOCK_PROVIDER_MAX_CONNECTIONS; i++) {
+		if (server->clients[i] != -1) shutdown(server->clients[i], SHUT_RDWR);
+	}
+	while (server->active > 0) pthread_cond_wait(&server->idle, &server->lock);
+	pthread_mutex_unlock(&server->lock);
+
+	close(server->fd);
+	pthread_cond_destroy(&server->idle);
+	pthread_mutex_destroy(&server->lock);
+	free(server);
+}
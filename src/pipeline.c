@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "../include/database.h"
+#include "../include/provider_utils.h"
+#include "../include/fetch_engine.h"
+#include "../include/tag_provider.h"
+#include "../include/pipeline.h"
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+extern int get_listing_location(struct tagger_db *db, sqlite3_int64 listing_id, LISTING_TYPE *type, char **path);
+extern sqlite3_int64 add_listing_item(struct tagger_db *db, sqlite3_int64 listing_id, const char *name, const char *relpath);
+extern int scan_listing_directory(LISTING_TYPE type, size_t listing_root_path_nbytes, const char *path,
+								  int (*on_item)(const char *name, const char *relpath, void *user_data),
+								  int (*on_directory)(const char *path, void *user_data), void *user_data);
+extern struct fetch_engine* create_provider_engine(const struct provider_options *options, int max_in_flight);
+extern int build_item_url(const struct tag_provider *provider, const struct item_row *item, char *url, size_t size);
+extern int submit_provider_request(struct fetch_engine *engine, const char *url, struct provider_request *request,
+								   fetch_callback callback, void *user_data);
+extern void collect_provider_request(struct provider_request *request, const char *url, CURLcode result, long status,
+									 const struct response *response);
+extern void clear_provider_request(struct provider_request *request);
+extern void clear_provider_tags(struct provider_tags *found);
+extern int write_provider_tags(struct tagger_db *db, struct provider_tags *const *found, size_t providers_count,
+							   const struct item_row *items, size_t items_count, const struct provider_options *options,
+							   struct provider_stats *stats);
+
+#define PIPELINE_DEFAULT_SCAN_WORKERS 2
+#define PIPELINE_DEFAULT_LOOKUP_WORKERS 2
+#define PIPELINE_DEFAULT_QUEUE_CAPACITY 256
+#define PIPELINE_DEFAULT_IN_FLIGHT 16
+#define PIPELINE_DEFAULT_ITEMS_PER_TRANSACTION 256
+// longest wait of a lookup worker for its transfers before it looks for new items again
+#define PIPELINE_POLL_MS 10
+
+/**
+ * Bounded queue between two stages, producers wait while it is full and consumers while it is empty
+ */
+struct pipeline_queue {
+	void **entries; // ring buffer
+	size_t capacity;
+	size_t head;
+	size_t count;
+	int closed; // the producers are done, consumers get the rest and then nothing
+	int aborted; // the run failed, nobody waits anymore
+	size_t waits; // times a producer found the queue full
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+struct pipeline_request;
+
+struct pipeline_item {
+	char *name;
+	char *relpath;
+	int remaining; // provider requests still running
+	struct provider_tags *found; // one per provider
+	struct pipeline_request *requests; // one per provider
+	struct pipeline_item *prev; // in the in-flight list of a lookup worker
+	struct pipeline_item *next;
+};
+
+struct lookup_worker;
+
+struct pipeline_request {
+	struct pipeline_item *item;
+	struct lookup_worker *worker;
+	struct provider_request request;
+};
+
+struct pipeline_directory {
+	char *path;
+	struct pipeline_directory *next;
+};
+
+struct pipeline {
+	const struct tag_provider *providers;
+	size_t providers_count;
+	const struct provider_options *provider_options;
+	LISTING_TYPE type;
+	size_t listing_root_path_nbytes;
+	struct pipeline_queue scanned; // scan stage to lookup stage
+	struct pipeline_queue enriched; // lookup stage to write stage
+	pthread_mutex_t lock;
+	pthread_cond_t directories_changed;
+	struct pipeline_directory *directories; // waiting to be scanned
+	size_t directories_pending; // waiting or being scanned
+	int scan_running; // workers of each stage still running, the last one closes the stage's output
+	int lookup_running;
+	int failed;
+	struct provider_stats lookup_stats; // of the lookup workers that finished
+	double start;
+	double scan_done;
+	double lookup_done;
+};
+
+struct lookup_worker {
+	struct pipeline *pipeline;
+	pthread_t thread;
+	struct fetch_engine *engine;
+	struct provider_stats stats;
+	struct pipeline_item *in_flight; // items with requests still running
+	size_t items_in_flight;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int queue_init(struct pipeline_queue *queue, size_t capacity) {
+	memset(queue, 0, sizeof(struct pipeline_queue));
+	if ((queue->entries = malloc(capacity * sizeof(void*))) == NULL) {
+		fputs("malloc() failed\n", stderr);
+		return -1;
+	}
+	queue->capacity = capacity;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	return 0;
+}
+
+/**
+ * @brief Add an entry, waiting while the queue is full
+ *
+ * @return `0` on success, otherwise `-1` if the run was aborted, the entry stays with the caller
+ */
+static int queue_push(struct pipeline_queue *queue, void *entry) {
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity && !queue->aborted) queue->waits++;
+	while (queue->count == queue->capacity && !queue->aborted) pthread_cond_wait(&queue->not_full, &queue->lock);
+
+	int aborted = queue->aborted;
+	if (!aborted) {
+		queue->entries[(queue->head + queue->count++) % queue->capacity] = entry;
+		pthread_cond_signal(&queue->not_empty);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return aborted ? -1 : 0;
+}
+
+/**
+ * @brief Take the oldest entry
+ *
+ * @param wait whether to wait while the queue is empty
+ * @return `1` if an entry was taken, `0` if the queue is empty and `wait` is not set,
+ *         `-1` if the queue is closed and empty or the run was aborted
+ */
+static int queue_pop(struct pipeline_queue *queue, void **entry, int wait) {
+	int result = 1;
+
+	pthread_mutex_lock(&queue->lock);
+	while (wait && queue->count == 0 && !queue->closed && !queue->aborted) pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+	if (queue->aborted || (queue->count == 0 && queue->closed)) {
+		result = -1;
+	} else if (queue->count == 0) {
+		result = 0;
+	} else {
+		*entry = queue->entries[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return result;
+}
+
+/**
+ * @brief Mark the queue as finished, or as aborted, waking everyone waiting on it
+ */
+static void queue_finish(struct pipeline_queue *queue, int aborted) {
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	if (aborted) queue->aborted = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void free_item(struct pipeline *pipeline, struct pipeline_item *item) {
+	if (item == NULL) return;
+
+	if (item->found != NULL) {
+		for (size_t p = 0; p < pipeline->providers_count; p++) clear_provider_tags(item->found + p);
+	}
+	free(item->found);
+	if (item->requests != NULL) {
+		for (size_t p = 0; p < pipeline->providers_count; p++) clear_provider_request(&item->requests[p].request);
+	}
+	free(item->requests);
+	free(item->name);
+	free(item->relpath);
+	free(item);
+}
+
+/**
+ * @brief Free the entries left in a queue and the queue itself
+ */
+static void queue_destroy(struct pipeline *pipeline, struct pipeline_queue *queue) {
+	if (queue->entries == NULL) return;
+
+	for (size_t i = 0; i < queue->count; i++) free_item(pipeline, queue->entries[(queue->head + i) % queue->capacity]);
+	free(queue->entries);
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/**
+ * @brief Stop every stage after an error, the workers finish without waiting on each other
+ */
+static void pipeline_fail(struct pipeline *pipeline) {
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->failed = 1;
+	pthread_cond_broadcast(&pipeline->directories_changed);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	queue_finish(&pipeline->scanned, 1);
+	queue_finish(&pipeline->enriched, 1);
+}
+
+static int add_directory(struct pipeline *pipeline, const char *path) {
+	struct pipeline_directory *directory = malloc(sizeof(struct pipeline_directory));
+
+	if (directory == NULL || (directory->path = strdup(path)) == NULL) {
+		fputs("malloc() failed\n", stderr);
+		free(directory);
+		return -1;
+	}
+
+	// depth first, like the recursive refresh, so the list stays short
+	pthread_mutex_lock(&pipeline->lock);
+	directory->next = pipeline->directories;
+	pipeline->directories = directory;
+	pipeline->directories_pending++;
+	pthread_cond_signal(&pipeline->directories_changed);
+	pthread_mutex_unlock(&pipeline->lock);
+	return 0;
+}
+
+static int pipeline_scan_directory(const char *path, void *user_data) {
+	return add_directory(user_data, path);
+}
+
+static int pipeline_scan_item(const char *name, const char *relpath, void *user_data) {
+	struct pipeline *pipeline = user_data;
+	size_t providers = pipeline->providers_count > 0 ? pipeline->providers_count : 1;
+	struct pipeline_item *item = calloc(1, sizeof(struct pipeline_item));
+
+	if (item == NULL || (item->name = strdup(name)) == NULL || (item->relpath = strdup(relpath)) == NULL ||
+		(item->found = calloc(providers, sizeof(struct provider_tags))) == NULL ||
+		(item->requests = calloc(providers, sizeof(struct pipeline_request))) == NULL) {
+		fputs("malloc() failed\n", stderr);
+		free_item(pipeline, item);
+		return -1;
+	}
+
+	// waits while the lookups are behind
+	if (queue_push(&pipeline->scanned, item)) {
+		free_item(pipeline, item);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Scan stage worker, takes directories until none is waiting or being scanned
+ */
+static void* pipeline_scan_run(void *arg) {
+	struct pipeline *pipeline = arg;
+	struct pipeline_directory *directory;
+
+	for (;;) {
+		pthread_mutex_lock(&pipeline->lock);
+		while (!pipeline->failed && pipeline->directories == NULL && pipeline->directories_pending > 0) {
+			pthread_cond_wait(&pipeline->directories_changed, &pipeline->lock);
+		}
+		if (pipeline->failed || pipeline->directories == NULL) {
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+		directory = pipeline->directories;
+		pipeline->directories = directory->next;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		int rc = scan_listing_directory(pipeline->type, pipeline->listing_root_path_nbytes, directory->path,
+										pipeline_scan_item, pipeline_scan_directory, pipeline);
+		free(directory->path);
+		free(directory);
+
+		pthread_mutex_lock(&pipeline->lock);
+		// the last directory wakes the workers waiting for more
+		if (--pipeline->directories_pending == 0) pthread_cond_broadcast(&pipeline->directories_changed);
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if (rc) {
+			pipeline_fail(pipeline);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&pipeline->lock);
+	int last = --pipeline->scan_running == 0;
+	if (last) pipeline->scan_done = now();
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if (last) queue_finish(&pipeline->scanned, 0);
+	return NULL;
+}
+
+/**
+ * @brief Hand an item whose requests all finished to the write stage
+ */
+static void finish_lookup(struct lookup_worker *worker, struct pipeline_item *item) {
+	if (item->prev != NULL) {
+		item->prev->next = item->next;
+	} else {
+		worker->in_flight = item->next;
+	}
+	if (item->next != NULL) item->next->prev = item->prev;
+	worker->items_in_flight--;
+
+	// waits while the writes are behind, which holds back this worker's transfers too
+	if (queue_push(&worker->pipeline->enriched, item)) free_item(worker->pipeline, item);
+}
+
+static void pipeline_lookup_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	struct pipeline_request *request = user_data;
+	struct pipeline_item *item = request->item;
+	struct lookup_worker *worker = request->worker;
+
+	collect_provider_request(&request->request, url, result, status, *response);
+	if (--item->remaining == 0) finish_lookup(worker, item);
+}
+
+/**
+ * @brief Submit the requests of every provider for an item
+ *
+ * @return `0` on success, otherwise `-1` on error, the item then stays in the in-flight list
+ */
+static int lookup_item(struct lookup_worker *worker, struct pipeline_item *item) {
+	struct pipeline *pipeline = worker->pipeline;
+	struct item_row row = {0, item->name, item->relpath, 0};
+	char url[PROVIDER_URL_SIZE];
+
+	item->next = worker->in_flight;
+	if (worker->in_flight != NULL) worker->in_flight->prev = item;
+	worker->in_flight = item;
+	worker->items_in_flight++;
+	worker->stats.items++;
+
+	// callbacks only run in `fetch_engine_perform`, so none finishes the item while it is submitted
+	for (size_t p = 0; p < pipeline->providers_count; p++) {
+		int built = build_item_url(pipeline->providers + p, &row, url, sizeof(url));
+		if (built == 1) continue;
+		if (built) {
+			// an item whose url can't be built, like an overlong one, fails alone
+			worker->stats.requests++;
+			worker->stats.failed_requests++;
+			continue;
+		}
+
+		item->requests[p] = (struct pipeline_request) {item, worker, {pipeline->providers + p, item->found + p, &worker->stats, NULL}};
+		if (submit_provider_request(worker->engine, url, &item->requests[p].request, pipeline_lookup_callback, item->requests + p)) return -1;
+		item->remaining++;
+		worker->stats.requests++;
+	}
+
+	if (item->remaining == 0) finish_lookup(worker, item);
+	return 0;
+}
+
+/**
+ * @brief Lookup stage worker, keeps its fetch engine busy with the items of the scan stage
+ */
+static void* pipeline_lookup_run(void *arg) {
+	struct lookup_worker *worker = arg;
+	struct pipeline *pipeline = worker->pipeline;
+	const struct provider_options *options = pipeline->provider_options;
+	size_t max_in_flight = options->max_in_flight > 0 ? (size_t) options->max_in_flight : PIPELINE_DEFAULT_IN_FLIGHT;
+	size_t requests_per_item = pipeline->providers_count > 0 ? pipeline->providers_count : 1;
+	int input_done = 0, failed = 0;
+	void *entry;
+
+	if ((worker->engine = create_provider_engine(options, (int) max_in_flight)) == NULL) failed = 1;
+
+	while (!failed) {
+		// take new items while the engine has room, waiting for one only when nothing is in flight
+		while (!input_done && (worker->items_in_flight == 0 || (worker->items_in_flight + 1) * requests_per_item <= max_in_flight)) {
+			int rc = queue_pop(&pipeline->scanned, &entry, worker->items_in_flight == 0);
+			if (rc == 0) break;
+			if (rc == -1) {
+				input_done = 1;
+				break;
+			}
+			if (lookup_item(worker, entry)) {
+				failed = 1;
+				break;
+			}
+		}
+		if (failed || (input_done && worker->items_in_flight == 0)) break;
+
+		if (worker->items_in_flight > 0 && fetch_engine_perform(worker->engine, PIPELINE_POLL_MS) == -1) failed = 1;
+	}
+
+	// unfinished transfers are dropped without their callbacks, their items are freed here
+	fetch_engine_destroy(worker->engine);
+	while (worker->in_flight != NULL) {
+		struct pipeline_item *item = worker->in_flight;
+		worker->in_flight = item->next;
+		free_item(pipeline, item);
+	}
+	if (failed) pipeline_fail(pipeline);
+
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->lookup_stats.items += worker->stats.items;
+	pipeline->lookup_stats.requests += worker->stats.requests;
+	pipeline->lookup_stats.failed_requests += worker->stats.failed_requests;
+	pipeline->lookup_stats.tags_found += worker->stats.tags_found;
+	int last = --pipeline->lookup_running == 0;
+	if (last) pipeline->lookup_done = now();
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if (last) queue_finish(&pipeline->enriched, 0);
+	return NULL;
+}
+
+/**
+ * @brief Add a batch of items with their merged tags in one transaction
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int write_items(struct tagger_db *db, sqlite3_int64 listing_id, struct pipeline *pipeline,
+					   struct pipeline_item **items, size_t items_count, struct item_row *rows,
+					   struct provider_tags **found, struct provider_stats *provider_stats, struct pipeline_stats *stats) {
+	size_t rows_count = 0;
+
+	if (execute_sql_string(db, "SAVEPOINT tagger_pipeline;")) return -1;
+
+	for (size_t i = 0; i < items_count; i++) {
+		sqlite3_int64 item_id = add_listing_item(db, listing_id, items[i]->name, items[i]->relpath);
+		if (item_id == -1) goto rollback;
+		if (item_id == 0) {
+			stats->items_skipped++;
+			continue;
+		}
+
+		rows[rows_count] = (struct item_row) {item_id, items[i]->name, items[i]->relpath, listing_id};
+		found[rows_count++] = items[i]->found;
+	}
+
+	if (write_provider_tags(db, found, pipeline->providers_count, rows, rows_count, pipeline->provider_options, provider_stats) ||
+		execute_sql_string(db, "RELEASE tagger_pipeline;")) {
+		goto rollback;
+	}
+	stats->transactions++;
+	return 0;
+
+rollback:
+	if (execute_sql_string(db, "ROLLBACK TO tagger_pipeline; RELEASE tagger_pipeline;")) {
+		fputs("Error when trying to rollback a pipeline write\n", stderr);
+	}
+	return -1;
+}
+
+/**
+ * @brief Write stage, takes the enriched items in batches until the lookups are done
+ *
+ * A batch is whatever arrived while the previous one was written, up to
+ * `items_per_batch`, so transactions grow when the writes fall behind.
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int pipeline_write(struct tagger_db *db, sqlite3_int64 listing_id, struct pipeline *pipeline,
+						  struct provider_stats *provider_stats, struct pipeline_stats *stats) {
+	const struct provider_options *options = pipeline->provider_options;
+	size_t batch = options->items_per_batch > 0 ? options->items_per_batch : PIPELINE_DEFAULT_ITEMS_PER_TRANSACTION;
+	struct pipeline_item **items = calloc(batch, sizeof(struct pipeline_item*));
+	struct item_row *rows = calloc(batch, sizeof(struct item_row));
+	struct provider_tags **found = calloc(batch, sizeof(struct provider_tags*));
+	void *entry;
+	int result = 0;
+
+	if (items == NULL || rows == NULL || found == NULL) {
+		fputs("calloc() failed\n", stderr);
+		result = -1;
+	}
+
+	while (result == 0 && queue_pop(&pipeline->enriched, &entry, 1) == 1) {
+		size_t items_count = 0;
+
+		items[items_count++] = entry;
+		while (items_count < batch && queue_pop(&pipeline->enriched, &entry, 0) == 1) items[items_count++] = entry;
+
+		stats->items_scanned += items_count;
+		result = write_items(db, listing_id, pipeline, items, items_count, rows, found, provider_stats, stats);
+		for (size_t i = 0; i < items_count; i++) free_item(pipeline, items[i]);
+	}
+
+	free(items);
+	free(rows);
+	free(found);
+	return result;
+}
+
+/**
+ * @brief Scan a listing for new items and tag them with the tags providers find, in one pipeline
+ *
+ * The scan, the provider lookups and the writes run at the same time, connected by
+ * bounded queues. Scan workers walk the directories of the listing, lookup workers
+ * ask every provider about each item, and the calling thread adds the items with
+ * their merged tags, many per transaction. A full queue makes the stage before it
+ * wait, so memory stays bounded and the run takes about as long as its slowest stage.
+ * Writes stay on the calling thread, as SQLite allows a single writer.
+ *
+ * Failed requests are counted in `provider_stats` and don't fail the run, the item is
+ * still added. Items already in the listing get the tags found for them, and items
+ * whose name another item already has are skipped, like in `refresh_listing`.
+ *
+ * @param db tagger database, only used from the calling thread
+ * @param listing_id id of the listing
+ * @param providers array of providers, in order of preference
+ * @param providers_count size of the `providers` array
+ * @param provider_options merge policy, requests in flight per lookup worker and items
+ *                         per transaction, `NULL` for the defaults
+ * @param options workers and queue sizes, `NULL` for the defaults
+ * @param provider_stats where to store the provider statistics of the run, may be `NULL`
+ * @param stats where to store the pipeline statistics of the run, may be `NULL`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int scan_and_enrich_listing(struct tagger_db *db, sqlite3_int64 listing_id, const struct tag_provider *providers,
+							size_t providers_count, const struct provider_options *provider_options,
+							const struct pipeline_options *options, struct provider_stats *provider_stats,
+							struct pipeline_stats *stats) {
+	static const struct provider_options default_provider_options = {PROVIDER_MERGE_ALL, 0, 0, 0, NULL, NULL, NULL};
+	static const struct pipeline_options default_options = {0, 0, 0};
+	struct provider_stats ignored_provider_stats, write_stats = {0};
+	struct pipeline_stats ignored_stats;
+	struct lookup_worker *lookup_workers = NULL;
+	pthread_t *scan_threads = NULL;
+	struct pipeline pipeline = {0};
+	char *path = NULL;
+	int scan_started = 0, lookup_started = 0, result = -1;
+
+	if (provider_stats == NULL) provider_stats = &ignored_provider_stats;
+	if (stats == NULL) stats = &ignored_stats;
+	memset(provider_stats, 0, sizeof(struct provider_stats));
+	memset(stats, 0, sizeof(struct pipeline_stats));
+	if (db == NULL || (providers == NULL && providers_count > 0)) return -1;
+	if (provider_options == NULL) provider_options = &default_provider_options;
+	if (options == NULL) options = &default_options;
+
+	int scan_workers = options->scan_workers > 0 ? options->scan_workers : PIPELINE_DEFAULT_SCAN_WORKERS;
+	int lookup_count = options->lookup_workers > 0 ? options->lookup_workers : PIPELINE_DEFAULT_LOOKUP_WORKERS;
+	size_t capacity = options->queue_capacity > 0 ? options->queue_capacity : PIPELINE_DEFAULT_QUEUE_CAPACITY;
+
+	pipeline.providers = providers;
+	pipeline.providers_count = providers_count;
+	pipeline.provider_options = provider_options;
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.directories_changed, NULL);
+
+	if (get_listing_location(db, listing_id, &pipeline.type, &path)) goto cleanup;
+	pipeline.listing_root_path_nbytes = strlen(path);
+	if (queue_init(&pipeline.scanned, capacity) || queue_init(&pipeline.enriched, capacity) || add_directory(&pipeline, path)) {
+		goto cleanup;
+	}
+
+	if ((scan_threads = calloc(scan_workers, sizeof(pthread_t))) == NULL ||
+		(lookup_workers = calloc(lookup_count, sizeof(struct lookup_worker))) == NULL) {
+		fputs("calloc() failed\n", stderr);
+		goto cleanup;
+	}
+
+	// a stage's output is closed by its last worker, so every worker is counted before any starts
+	pipeline.start = now();
+	pipeline.scan_running = scan_workers;
+	pipeline.lookup_running = lookup_count;
+	for (; scan_started < scan_workers; scan_started++) {
+		if (pthread_create(&scan_threads[scan_started], NULL, pipeline_scan_run, &pipeline)) break;
+	}
+	for (; lookup_started < lookup_count; lookup_started++) {
+		lookup_workers[lookup_started].pipeline = &pipeline;
+		if (pthread_create(&lookup_workers[lookup_started].thread, NULL, pipeline_lookup_run, &lookup_workers[lookup_started])) break;
+	}
+	if (scan_started < scan_workers || lookup_started < lookup_count) {
+		fputs("Could not start the pipeline workers\n", stderr);
+		pipeline_fail(&pipeline);
+		pthread_mutex_lock(&pipeline.lock);
+		pipeline.scan_running -= scan_workers - scan_started;
+		pipeline.lookup_running -= lookup_count - lookup_started;
+		pthread_mutex_unlock(&pipeline.lock);
+	}
+
+	int written = pipeline_write(db, listing_id, &pipeline, &write_stats, stats);
+	if (written) pipeline_fail(&pipeline);
+
+	for (int i = 0; i < scan_started; i++) pthread_join(scan_threads[i], NULL);
+	for (int i = 0; i < lookup_started; i++) pthread_join(lookup_workers[i].thread, NULL);
+
+	stats->write_seconds = now() - pipeline.start;
+	stats->scan_seconds = pipeline.scan_done > 0 ? pipeline.scan_done - pipeline.start : stats->write_seconds;
+	stats->lookup_seconds = pipeline.lookup_done > 0 ? pipeline.lookup_done - pipeline.start : stats->write_seconds;
+	stats->scan_waits = pipeline.scanned.waits;
+	stats->lookup_waits = pipeline.enriched.waits;
+
+	*provider_stats = pipeline.lookup_stats;
+	provider_stats->unknown_tags = write_stats.unknown_tags;
+	provider_stats->items_tagged = write_stats.items_tagged;
+	provider_stats->item_tags_added = write_stats.item_tags_added;
+	result = pipeline.failed ? -1 : 0;
+
+cleanup:
+	while (pipeline.directories != NULL) {
+		struct pipeline_directory *directory = pipeline.directories;
+		pipeline.directories = directory->next;
+		free(directory->path);
+		free(directory);
+	}
+	queue_destroy(&pipeline, &pipeline.scanned);
+	queue_destroy(&pipeline, &pipeline.enriched);
+	pthread_cond_destroy(&pipeline.directories_changed);
+	pthread_mutex_destroy(&pipeline.lock);
+	free(scan_threads);
+	free(lookup_workers);
+	free(path);
+	return result;
+}
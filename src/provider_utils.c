@@ -1,23 +1,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include "../include/provider_utils.h"
+#include "../include/rate_limiter.h"
 
+#define RESPONSE_INITIAL_CAPACITY 4096
+
+// idle easy handles kept for reuse, each keeps its own warm connections
+#define EASY_HANDLE_POOL_SIZE 16
+
+// DNS, TLS session and connection caches shared by every provider transfer
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static CURL *easy_handle_pool[EASY_HANDLE_POOL_SIZE];
+static int easy_handle_pool_count = 0;
+static size_t spill_threshold = 0;
+static struct rate_limiter *provider_rate_limiter = NULL;
+static struct retry_policy provider_retry_policy = {0};
+static struct circuit_breaker *provider_circuit_breaker = NULL;
+
+/**
+ * @brief Create an empty response buffer
+ *
+ * @return the response, or `NULL` if it couldn't be allocated
+ */
 struct response* init_response(void) {
 	struct response* r;
-	r = malloc(sizeof(struct response));
+	r = calloc(1, sizeof(struct response));
 	if (r == NULL) {
-		fprintf(stderr, "malloc() failed\n");
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "calloc() failed\n");
+		return NULL;
 	}
 
-	r->len = 0;
-
-	r->ptr = malloc(r->len+1);
+	r->capacity = RESPONSE_INITIAL_CAPACITY;
+	r->ptr = malloc(r->capacity);
 	if (r->ptr == NULL) {
 		fprintf(stderr, "malloc() failed\n");
-		exit(EXIT_FAILURE);
+		free(r);
+		return NULL;
 	}
 	r->ptr[0] = '\0';
 
@@ -26,59 +53,474 @@ struct response* init_response(void) {
 
 void free_response(struct response *r) {
 	if (r == NULL) return;
-	
-	if (r->ptr != NULL) {
+
+	if (r->spill != NULL) fclose(r->spill);
+	if (r->mapped) {
+		munmap(r->ptr, r->len + 1);
+	} else {
 		free(r->ptr);
-		r->ptr = NULL;
 	}
+	r->ptr = NULL;
 
 	free(r);
-	r = NULL;
 }
 
+/**
+ * @brief Set the size from which response bodies are kept in a temporary file instead of memory
+ *
+ * Spilled bodies are mapped back into memory once the transfer finished, so they
+ * are read through `ptr` like any other response. Set it before starting transfers.
+ *
+ * @param bytes body size from which to spill, `0` to keep every body in memory
+ */
+void set_response_spill_threshold(size_t bytes) {
+	spill_threshold = bytes;
+}
+
+/**
+ * @brief Move the body of a response to a temporary file
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int spill_response(struct response *s) {
+	s->spill = tmpfile();
+	if (s->spill == NULL || fwrite(s->ptr, 1, s->len, s->spill) != s->len) {
+		fputs("Error when spilling a response to a temporary file\n", stderr);
+		if (s->spill != NULL) fclose(s->spill);
+		s->spill = NULL;
+		return -1;
+	}
+
+	free(s->ptr);
+	s->ptr = NULL;
+	s->capacity = 0;
+	return 0;
+}
+
+/**
+ * @brief Make room for a body of at least `size` bytes and its terminating null
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int reserve_response(struct response *s, size_t size) {
+	if (size < s->capacity) return 0;
+
+	// geometric growth keeps the copies of a growing body linear in its size
+	size_t capacity = s->capacity > 0 ? s->capacity : RESPONSE_INITIAL_CAPACITY;
+	while (capacity <= size) {
+		if (capacity > SIZE_MAX / 2) return -1;
+		capacity *= 2;
+	}
+
+	char *ptr = realloc(s->ptr, capacity);
+	if (ptr == NULL) {
+		fprintf(stderr, "Error when allocating %zu bytes for a response\n", capacity);
+		return -1;
+	}
+	s->ptr = ptr;
+	s->capacity = capacity;
+	return 0;
+}
+
+/**
+ * @brief curl write callback appending to a response
+ *
+ * Returning less than the chunk size aborts the transfer with `CURLE_WRITE_ERROR`,
+ * which is how an allocation failure ends the transfer.
+ */
 size_t writefunc(void *ptr, size_t size, size_t nmemb, struct response *s) {
-	size_t new_len = s->len + size*nmemb;
-	s->ptr = realloc(s->ptr, new_len+1);
-	if (s->ptr == NULL) {
-		fprintf(stderr, "realloc() failed\n");
-		exit(EXIT_FAILURE);
-	}
-	memcpy(s->ptr+s->len, ptr, size*nmemb);
-	s->ptr[new_len] = '\0';
+	size_t chunk = size*nmemb;
+	size_t new_len = s->len + chunk;
+
+	if (s->spill == NULL && s->len == 0 && s->curl != NULL) {
+		curl_off_t content_length = -1;
+
+		// the announced size is the size on the wire, compressed bodies still grow past it
+		if (curl_easy_getinfo(s->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) == CURLE_OK && content_length > 0) {
+			if (spill_threshold > 0 && (size_t) content_length >= spill_threshold) {
+				if (spill_response(s)) return 0;
+			} else if ((size_t) content_length > chunk && reserve_response(s, (size_t) content_length)) {
+				return 0;
+			}
+		}
+	}
+
+	if (s->spill == NULL && spill_threshold > 0 && new_len >= spill_threshold && spill_response(s)) return 0;
+
+	if (s->spill != NULL) {
+		if (fwrite(ptr, 1, chunk, s->spill) != chunk) {
+			fputs("Error when writing a response to its temporary file\n", stderr);
+			return 0;
+		}
+	} else {
+		if (reserve_response(s, new_len)) return 0;
+		memcpy(s->ptr+s->len, ptr, chunk);
+		s->ptr[new_len] = '\0';
+	}
 	s->len = new_len;
 
-	return size*nmemb;
+	return chunk;
 }
 
 /**
- * @brief Get response from url
+ * @brief Make a response write its body to `r`, with `curl` giving the expected size
  *
- * @param url url to get the response from
- * @return a pointer to a response struct, or `NULL` on error
+ * @param curl transfer of the response
+ * @param r response to write to
  */
-struct response* get_response_from_url(char* url) {
-	CURL *curl;
-	CURLcode res;
+void attach_response(CURL *curl, struct response *r) {
+	r->curl = curl;
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, r);
+}
+
+/**
+ * @brief Finish the body of a response after its transfer ended
+ *
+ * A body spilled to a temporary file is mapped into memory, with a terminating
+ * null like the bodies kept in memory.
+ *
+ * @param r response
+ * @return `0` on success, otherwise `-1` on error
+ */
+int finish_response(struct response *r) {
+	r->curl = NULL;
+	if (r->spill == NULL) return 0;
+
+	int fd = fileno(r->spill);
+	if (fflush(r->spill) || ftruncate(fd, (off_t) r->len + 1)) {
+		fputs("Error when finishing a spilled response\n", stderr);
+		return -1;
+	}
+
+	// the file is extended with a zero byte, which terminates the body
+	void *mapping = mmap(NULL, r->len + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+		fputs("Error when mapping a spilled response\n", stderr);
+		return -1;
+	}
+
+	fclose(r->spill);
+	r->spill = NULL;
+	r->ptr = mapping;
+	r->mapped = 1;
+	return 0;
+}
+
+static void lock_share(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+	(void) handle;
+	(void) access;
+	(void) userptr;
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void unlock_share(CURL *handle, curl_lock_data data, void *userptr) {
+	(void) handle;
+	(void) userptr;
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+/**
+ * @brief Create the shared caches, must be called with `pool_lock` held
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int init_share(void) {
+	if (share != NULL) return 0;
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK || (share = curl_share_init()) == NULL) {
+		fputs("curl_share_init() failed\n", stderr);
+		return -1;
+	}
+
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&share_locks[i], NULL);
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	return 0;
+}
+
+/**
+ * @brief Take an easy handle from the pool, set up for a provider transfer
+ *
+ * The handle uses the shared caches and asks for compressed responses.
+ * Give it back with `release_easy_handle`, not `curl_easy_cleanup`.
+ *
+ * @return the handle, or `NULL` on error
+ */
+CURL* acquire_easy_handle(void) {
+	CURL *curl = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (init_share() == 0) {
+		if (easy_handle_pool_count > 0) {
+			curl = easy_handle_pool[--easy_handle_pool_count];
+		} else {
+			curl = curl_easy_init();
+		}
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (curl == NULL) return NULL;
+
+	curl_easy_setopt(curl, CURLOPT_SHARE, share);
+	// an empty string accepts every encoding libcurl was built with
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	// signals can't be used to time out name resolution outside of the main thread
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+
+	return curl;
+}
+
+/**
+ * @brief Give an easy handle back to the pool
+ *
+ * The options are reset, the connections and caches of the handle stay warm.
+ *
+ * @param curl handle from `acquire_easy_handle`
+ */
+void release_easy_handle(CURL *curl) {
+	if (curl == NULL) return;
+
+	curl_easy_reset(curl);
+
+	pthread_mutex_lock(&pool_lock);
+	if (easy_handle_pool_count < EASY_HANDLE_POOL_SIZE) {
+		easy_handle_pool[easy_handle_pool_count++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (curl != NULL) curl_easy_cleanup(curl);
+}
+
+/**
+ * @brief Free the pooled easy handles and the shared caches
+ *
+ * No handle from `acquire_easy_handle` may be in use anymore.
+ */
+void cleanup_provider_connections(void) {
+	pthread_mutex_lock(&pool_lock);
+	while (easy_handle_pool_count > 0) curl_easy_cleanup(easy_handle_pool[--easy_handle_pool_count]);
+
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+		for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_destroy(&share_locks[i]);
+		curl_global_cleanup();
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Get the host of an url
+ *
+ * @param url url
+ * @param host where to store the host
+ * @param size size of `host`
+ * @return `0` on success, otherwise `-1` if the url has no host
+ */
+int url_host(const char *url, char *host, size_t size) {
+	CURLU *parsed = curl_url();
+	char *part = NULL;
+	int result = -1;
+
+	if (parsed == NULL) return -1;
+	if (curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK &&
+		curl_url_get(parsed, CURLUPART_HOST, &part, 0) == CURLUE_OK && strlen(part) < size) {
+		strcpy(host, part);
+		result = 0;
+	}
 
-	curl = curl_easy_init();
+	curl_free(part);
+	curl_url_cleanup(parsed);
+	return result;
+}
 
-	if(curl) {
-		struct response* response = init_response();
+/**
+ * @brief Limit the rate of the blocking provider requests per host
+ *
+ * @param limiter rate limiter, it must outlive the requests, `NULL` for no limit
+ */
+void set_provider_rate_limiter(struct rate_limiter *limiter) {
+	provider_rate_limiter = limiter;
+}
+
+/**
+ * @brief Wait until a blocking request to an url may start
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+int wait_for_provider_rate_limit(const char *url) {
+	return provider_rate_limiter != NULL ? rate_limiter_acquire(provider_rate_limiter, url) : 0;
+}
+
+/**
+ * @brief Pause the host of a finished request if it throttled us
+ *
+ * @param curl handle of the finished request
+ * @param url url of the request
+ */
+void report_provider_response(CURL *curl, const char *url) {
+	long status = 0;
+	curl_off_t retry_after = 0;
+
+	if (provider_rate_limiter == NULL) return;
+
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	if (status == 429 || status == 503) {
+		curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+		rate_limiter_throttled(provider_rate_limiter, url, (long) retry_after);
+	}
+}
+
+/**
+ * @brief Set how blocking provider requests are retried
+ *
+ * @param policy retry policy, it is copied, `NULL` for the defaults
+ * @param breaker circuit breaker, it must outlive the requests, `NULL` for none
+ */
+void set_provider_retry_policy(const struct retry_policy *policy, struct circuit_breaker *breaker) {
+	if (policy != NULL) {
+		provider_retry_policy = *policy;
+	} else {
+		memset(&provider_retry_policy, 0, sizeof(struct retry_policy));
+	}
+	provider_circuit_breaker = breaker;
+}
+
+static void sleep_ms(long ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Perform a blocking provider request, retrying transient failures
+ *
+ * Failed attempts are retried with a jittered exponential backoff while they are
+ * transient, and while the circuit of the host is closed. Every attempt goes through
+ * the rate limiter and its outcome is recorded by the circuit breaker.
+ *
+ * @param url url to request
+ * @param hooks hooks preparing every attempt and dropping the failed ones
+ * @param status where to store the status of the last response, `0` if there was none, may be `NULL`
+ * @return outcome of the request, the data of the last attempt is kept on `PROVIDER_OK`
+ */
+PROVIDER_RESULT perform_provider_request(const char *url, const struct provider_attempt *hooks, long *status) {
+	PROVIDER_RESULT result = PROVIDER_TRANSPORT_ERROR;
+	int attempts = retry_attempts(&provider_retry_policy);
+	long response_status = 0;
+
+	for (int attempt = 1; attempt <= attempts; attempt++) {
+		int allow = circuit_breaker_allow(provider_circuit_breaker, url);
+		if (!allow) {
+			fprintf(stderr, "Error, %s is not requested while its host is failing\n", url);
+			result = PROVIDER_CIRCUIT_OPEN;
+			break;
+		}
+
+		CURL *curl = acquire_easy_handle();
+		if (curl == NULL || hooks->start(curl, hooks->user_data)) {
+			release_easy_handle(curl);
+			if (allow == 2) circuit_breaker_release(provider_circuit_breaker, url);
+			result = PROVIDER_INTERNAL_ERROR;
+			break;
+		}
 
 		curl_easy_setopt(curl, CURLOPT_URL, url);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
-		res = curl_easy_perform(curl);
+		if (wait_for_provider_rate_limit(url)) {
+			release_easy_handle(curl);
+			hooks->discard(hooks->user_data);
+			if (allow == 2) circuit_breaker_release(provider_circuit_breaker, url);
+			result = PROVIDER_INTERNAL_ERROR;
+			break;
+		}
+
+		response_status = 0;
+		CURLcode res = curl_easy_perform(curl);
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_status);
+		report_provider_response(curl, url);
+		release_easy_handle(curl);
+		circuit_breaker_record(provider_circuit_breaker, url, res, response_status);
 
-		if(res != CURLE_OK) {
-			fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-			free_response(response);
+		// protocols without status codes, like file, report `0`
+		if (res == CURLE_OK && response_status < 400) {
+			result = PROVIDER_OK;
+			break;
 		}
+		int repeatable = hooks->discard(hooks->user_data) == 0;
+
+		// a write error means the received data couldn't be kept
+		result = res == CURLE_WRITE_ERROR ? PROVIDER_INTERNAL_ERROR : res == CURLE_OK ? PROVIDER_HTTP_ERROR : PROVIDER_TRANSPORT_ERROR;
+		if (!repeatable || !is_transient_failure(res, response_status) || attempt == attempts) {
+			if (res != CURLE_OK) {
+				fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+			} else {
+				fprintf(stderr, "Error, %s answered with status %ld\n", url, response_status);
+			}
+			break;
+		}
+		sleep_ms(retry_backoff_ms(&provider_retry_policy, attempt));
+	}
+
+	if (status != NULL) *status = response_status;
+	return result;
+}
 
-		curl_easy_cleanup(curl);
+static int start_response_attempt(CURL *curl, void *user_data) {
+	struct response **r = user_data;
 
-		return response;
+	if ((*r = init_response()) == NULL) return -1;
+	attach_response(curl, *r);
+	return 0;
+}
+
+static int discard_response_attempt(void *user_data) {
+	struct response **r = user_data;
+
+	free_response(*r);
+	*r = NULL;
+	return 0;
+}
+
+/**
+ * @brief Get the response of a provider url, retrying transient failures
+ *
+ * @param url url to get the response from
+ * @param response where to store the response, only set on `PROVIDER_OK`
+ * @param status where to store the status of the last response, `0` if there was none, may be `NULL`
+ * @return outcome of the request
+ */
+PROVIDER_RESULT get_provider_response(const char *url, struct response **response, long *status) {
+	struct response *r = NULL;
+	const struct provider_attempt hooks = {start_response_attempt, discard_response_attempt, &r};
+
+	*response = NULL;
+	PROVIDER_RESULT result = perform_provider_request(url, &hooks, status);
+	if (result != PROVIDER_OK) return result;
+
+	if (finish_response(r)) {
+		free_response(r);
+		return PROVIDER_INTERNAL_ERROR;
 	}
+	*response = r;
+	return PROVIDER_OK;
+}
+
+/**
+ * @brief Get response from url
+ *
+ * Same as `get_provider_response`, for callers that only need the body.
+ *
+ * @param url url to get the response from
+ * @return a pointer to a response struct, or `NULL` if there was no successful response
+ */
+struct response* get_response_from_url(char* url) {
+	struct response *response;
 
-	return NULL;
+	return get_provider_response(url, &response, NULL) == PROVIDER_OK ? response : NULL;
 }
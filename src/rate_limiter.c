@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "../include/provider_utils.h"
+#include "../include/rate_limiter.h"
+
+// pause of a throttled host that didn't say for how long
+#define RATE_LIMITER_DEFAULT_PAUSE_MS 1000
+
+struct host_bucket {
+	char host[PROVIDER_HOST_SIZE];
+	double rate; // tokens per second
+	double burst; // most tokens the bucket holds
+	double tokens;
+	double refilled_at; // milliseconds
+	double paused_until; // milliseconds, after a 429 or 503 response
+	struct host_bucket *next;
+};
+
+struct rate_limiter {
+	pthread_mutex_t lock;
+	double rate;
+	double burst;
+	struct host_bucket *hosts;
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * @brief Create a rate limiter with one token bucket per host
+ *
+ * Every request to a host takes a token, the bucket of the host refills at `rate`
+ * tokens per second and holds at most `burst` tokens. It is safe to use from
+ * several threads.
+ *
+ * @param rate requests per second per host
+ * @param burst requests a host may get at once after being idle, at least `1`
+ * @return the rate limiter, or `NULL` on error
+ */
+struct rate_limiter* rate_limiter_create(double rate, double burst) {
+	if (rate <= 0) {
+		fputs("Error, the rate of a rate limiter must be positive\n", stderr);
+		return NULL;
+	}
+
+	struct rate_limiter *limiter = calloc(1, sizeof(struct rate_limiter));
+	if (limiter == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return NULL;
+	}
+
+	pthread_mutex_init(&limiter->lock, NULL);
+	limiter->rate = rate;
+	limiter->burst = burst >= 1 ? burst : 1;
+	return limiter;
+}
+
+/**
+ * @brief Find or add the bucket of a host, must be called with the lock held
+ *
+ * @return the bucket, or `NULL` on error
+ */
+static struct host_bucket* get_bucket(struct rate_limiter *limiter, const char *host) {
+	struct host_bucket *bucket;
+
+	for (bucket = limiter->hosts; bucket != NULL; bucket = bucket->next) {
+		if (strcmp(bucket->host, host) == 0) return bucket;
+	}
+
+	if (strlen(host) >= PROVIDER_HOST_SIZE || (bucket = calloc(1, sizeof(struct host_bucket))) == NULL) return NULL;
+	strcpy(bucket->host, host);
+	bucket->rate = limiter->rate;
+	bucket->burst = limiter->burst;
+	bucket->tokens = bucket->burst;
+	bucket->refilled_at = now_ms();
+	bucket->next = limiter->hosts;
+	limiter->hosts = bucket;
+	return bucket;
+}
+
+static void refill(struct host_bucket *bucket, double now) {
+	// nothing refills while the host is paused
+	if (now <= bucket->refilled_at) return;
+	bucket->tokens += (now - bucket->refilled_at) * bucket->rate / 1000.0;
+	if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+	bucket->refilled_at = now;
+}
+
+/**
+ * @brief Set the rate and burst of one host, overriding the defaults
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+int rate_limiter_set_host(struct rate_limiter *limiter, const char *host, double rate, double burst) {
+	if (limiter == NULL || host == NULL || rate <= 0) return -1;
+
+	pthread_mutex_lock(&limiter->lock);
+	struct host_bucket *bucket = get_bucket(limiter, host);
+	if (bucket != NULL) {
+		refill(bucket, now_ms());
+		bucket->rate = rate;
+		bucket->burst = burst >= 1 ? burst : 1;
+		if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+
+	return bucket != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Take a token for a request without waiting
+ *
+ * @param limiter rate limiter
+ * @param url url of the request
+ * @return `0` if the request may start now, otherwise milliseconds until it may,
+ *         `-1` on error
+ */
+long rate_limiter_try_acquire(struct rate_limiter *limiter, const char *url) {
+	char host[PROVIDER_HOST_SIZE];
+	long wait = -1;
+
+	if (limiter == NULL) return 0;
+	// urls without a host, like file urls, are never limited
+	if (url_host(url, host, sizeof(host))) return 0;
+
+	pthread_mutex_lock(&limiter->lock);
+	struct host_bucket *bucket = get_bucket(limiter, host);
+	if (bucket != NULL) {
+		double now = now_ms();
+		refill(bucket, now);
+
+		if (bucket->paused_until > now) {
+			wait = (long) (bucket->paused_until - now) + 1;
+		} else if (bucket->tokens >= 1) {
+			bucket->tokens -= 1;
+			wait = 0;
+		} else {
+			wait = (long) ((1 - bucket->tokens) * 1000.0 / bucket->rate) + 1;
+		}
+	}
+	pthread_mutex_unlock(&limiter->lock);
+
+	return wait;
+}
+
+/**
+ * @brief Take a token for a request, sleeping until one is available
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+int rate_limiter_acquire(struct rate_limiter *limiter, const char *url) {
+	long wait;
+
+	while ((wait = rate_limiter_try_acquire(limiter, url)) > 0) {
+		struct timespec ts = {wait / 1000, (wait % 1000) * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+	return wait == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Pause a host that answered with `429 Too Many Requests` or `503 Service Unavailable`
+ *
+ * The bucket of the host is also emptied, so requests resume at the steady rate
+ * instead of with a burst that would be throttled again.
+ *
+ * @param limiter rate limiter
+ * @param url url of the throttled request
+ * @param retry_after seconds from the `Retry-After` header, `0` or less if there was none
+ */
+void rate_limiter_throttled(struct rate_limiter *limiter, const char *url, long retry_after) {
+	char host[PROVIDER_HOST_SIZE];
+
+	if (limiter == NULL || url_host(url, host, sizeof(host))) return;
+
+	pthread_mutex_lock(&limiter->lock);
+	struct host_bucket *bucket = get_bucket(limiter, host);
+	if (bucket != NULL) {
+		double now = now_ms();
+		double pause = retry_after > 0 ? retry_after * 1000.0 : RATE_LIMITER_DEFAULT_PAUSE_MS;
+
+		if (now + pause > bucket->paused_until) bucket->paused_until = now + pause;
+		bucket->tokens = 0;
+		bucket->refilled_at = bucket->paused_until;
+	}
+	pthread_mutex_unlock(&limiter->lock);
+}
+
+void rate_limiter_destroy(struct rate_limiter *limiter) {
+	if (limiter == NULL) return;
+
+	while (limiter->hosts != NULL) {
+		struct host_bucket *bucket = limiter->hosts;
+		limiter->hosts = bucket->next;
+		free(bucket);
+	}
+	pthread_mutex_destroy(&limiter->lock);
+	free(limiter);
+}
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "../include/provider_utils.h"
+
+#define RETRY_DEFAULT_MAX_ATTEMPTS 3
+#define RETRY_DEFAULT_BASE_DELAY_MS 200
+#define RETRY_DEFAULT_MAX_DELAY_MS 10000
+
+struct host_circuit {
+	char host[PROVIDER_HOST_SIZE];
+	int consecutive_failures;
+	long long open_until; // milliseconds, requests fail fast before it once the threshold is reached
+	int probing; // a single request is testing whether the host is back
+	struct host_circuit *next;
+};
+
+struct circuit_breaker {
+	pthread_mutex_t lock;
+	int failure_threshold;
+	long cooldown_ms;
+	struct host_circuit *hosts;
+};
+
+static long long now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Check whether a failed request may succeed when retried
+ *
+ * Network failures, timeouts, `408`, `429` and `5xx` responses are transient,
+ * invalid urls and other client errors are not.
+ *
+ * @param result curl result of the request
+ * @param status response status, `0` if there was no response
+ * @return `1` if the request should be retried, otherwise `0`
+ */
+int is_transient_failure(CURLcode result, long status) {
+	switch (result) {
+		case CURLE_OK:
+			return status == 408 || status == 429 || status >= 500;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_GOT_NOTHING:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_HTTP2:
+		case CURLE_HTTP2_STREAM:
+		case CURLE_SSL_CONNECT_ERROR:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Get the number of attempts of a policy
+ *
+ * @param policy retry policy, `NULL` for the defaults
+ */
+int retry_attempts(const struct retry_policy *policy) {
+	return policy != NULL && policy->max_attempts > 0 ? policy->max_attempts : RETRY_DEFAULT_MAX_ATTEMPTS;
+}
+
+/**
+ * @brief Get the time to wait before retrying
+ *
+ * The delay grows exponentially and is jittered between half and all of it, so
+ * the retries of many requests that failed together don't hit the host together.
+ *
+ * @param policy retry policy, `NULL` for the defaults
+ * @param attempt number of the attempt that failed, starting at `1`
+ * @return delay in milliseconds
+ */
+long retry_backoff_ms(const struct retry_policy *policy, int attempt) {
+	long base = policy != NULL && policy->base_delay_ms > 0 ? policy->base_delay_ms : RETRY_DEFAULT_BASE_DELAY_MS;
+	long max = policy != NULL && policy->max_delay_ms > 0 ? policy->max_delay_ms : RETRY_DEFAULT_MAX_DELAY_MS;
+
+	long delay = base;
+	for (int i = 1; i < attempt && delay < max; i++) delay *= 2;
+	if (delay > max) delay = max;
+
+	return delay / 2 + random() % (delay / 2 + 1);
+}
+
+/**
+ * @brief Create a circuit breaker with one circuit per host
+ *
+ * After `failure_threshold` failures in a row, requests to a host fail fast for
+ * `cooldown_ms`. A single request then probes the host, closing the circuit if it
+ * succeeds and opening it again if it fails. It is safe to use from several threads.
+ *
+ * @param failure_threshold failures in a row that open the circuit of a host
+ * @param cooldown_ms time requests fail fast before a probe
+ * @return the circuit breaker, or `NULL` on error
+ */
+struct circuit_breaker* circuit_breaker_create(int failure_threshold, long cooldown_ms) {
+	if (failure_threshold <= 0 || cooldown_ms < 0) {
+		fputs("Error, a circuit breaker needs a positive failure threshold\n", stderr);
+		return NULL;
+	}
+
+	struct circuit_breaker *breaker = calloc(1, sizeof(struct circuit_breaker));
+	if (breaker == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return NULL;
+	}
+
+	pthread_mutex_init(&breaker->lock, NULL);
+	breaker->failure_threshold = failure_threshold;
+	breaker->cooldown_ms = cooldown_ms;
+	return breaker;
+}
+
+/**
+ * @brief Find or add the circuit of a host, must be called with the lock held
+ *
+ * @return the circuit, or `NULL` on error
+ */
+static struct host_circuit* get_circuit(struct circuit_breaker *breaker, const char *host) {
+	struct host_circuit *circuit;
+
+	for (circuit = breaker->hosts; circuit != NULL; circuit = circuit->next) {
+		if (strcmp(circuit->host, host) == 0) return circuit;
+	}
+
+	if ((circuit = calloc(1, sizeof(struct host_circuit))) == NULL) return NULL;
+	strcpy(circuit->host, host);
+	circuit->next = breaker->hosts;
+	breaker->hosts = circuit;
+	return circuit;
+}
+
+/**
+ * @brief Check whether a request may be attempted
+ *
+ * A request allowed as the probe of an open circuit must either record its outcome
+ * with `circuit_breaker_record`, or give the probe back with `circuit_breaker_release`.
+ *
+ * @param breaker circuit breaker, `NULL` to allow everything
+ * @param url url of the request
+ * @return `1` if the request may be attempted, `2` if it may be attempted as the probe
+ * of an open circuit, `0` if it should fail fast
+ */
+int circuit_breaker_allow(struct circuit_breaker *breaker, const char *url) {
+	char host[PROVIDER_HOST_SIZE];
+	int allow = 1;
+
+	if (breaker == NULL || url_host(url, host, sizeof(host))) return 1;
+
+	pthread_mutex_lock(&breaker->lock);
+	struct host_circuit *circuit = get_circuit(breaker, host);
+	if (circuit != NULL && circuit->consecutive_failures >= breaker->failure_threshold) {
+		if (circuit->probing || now_ms() < circuit->open_until) {
+			allow = 0;
+		} else {
+			circuit->probing = 1;
+			allow = 2;
+		}
+	}
+	pthread_mutex_unlock(&breaker->lock);
+
+	return allow;
+}
+
+/**
+ * @brief Record the outcome of an attempted request
+ *
+ * Only transient failures count, a host answering `404` is up.
+ *
+ * @param breaker circuit breaker, may be `NULL`
+ * @param url url of the request
+ * @param result curl result of the request
+ * @param status response status, `0` if there was no response
+ */
+void circuit_breaker_record(struct circuit_breaker *breaker, const char *url, CURLcode result, long status) {
+	char host[PROVIDER_HOST_SIZE];
+
+	if (breaker == NULL || url_host(url, host, sizeof(host))) return;
+
+	pthread_mutex_lock(&breaker->lock);
+	struct host_circuit *circuit = get_circuit(breaker, host);
+	if (circuit != NULL) {
+		// throttling is left to the rate limiter, the host is up
+		if (!is_transient_failure(result, status) || status == 429) {
+			circuit->consecutive_failures = 0;
+		} else if (++circuit->consecutive_failures >= breaker->failure_threshold) {
+			circuit->open_until = now_ms() + breaker->cooldown_ms;
+		}
+		circuit->probing = 0;
+	}
+	pthread_mutex_unlock(&breaker->lock);
+}
+
+/**
+ * @brief Give back the probe of a request that was never attempted
+ *
+ * The circuit stays open, the next allowed request probes the host instead.
+ *
+ * @param breaker circuit breaker, may be `NULL`
+ * @param url url of the request allowed as the probe
+ */
+void circuit_breaker_release(struct circuit_breaker *breaker, const char *url) {
+	char host[PROVIDER_HOST_SIZE];
+
+	if (breaker == NULL || url_host(url, host, sizeof(host))) return;
+
+	pthread_mutex_lock(&breaker->lock);
+	struct host_circuit *circuit = get_circuit(breaker, host);
+	if (circuit != NULL) circuit->probing = 0;
+	pthread_mutex_unlock(&breaker->lock);
+}
+
+void circuit_breaker_destroy(struct circuit_breaker *breaker) {
+	if (breaker == NULL) return;
+
+	while (breaker->hosts != NULL) {
+		struct host_circuit *circuit = breaker->hosts;
+		breaker->hosts = circuit->next;
+		free(circuit);
+	}
+	pthread_mutex_destroy(&breaker->lock);
+	free(breaker);
+}
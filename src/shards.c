@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/database.h"
+#include "../include/shards.h"
+
+#define LISTINGS_TABLE_NAME "listings"
+#define ITEMS_TABLE_NAME "items"
+#define ITEM_TAGS_TABLE_NAME "itemtags"
+#define TAG_COOCCURRENCE_TABLE_NAME "tag_cooccurrence"
+#define CATALOG_SCHEMA_NAME "catalog"
+#define SHARD_SCHEMA_PREFIX "shard_"
+// item ids of all shards fit into 32 bits, as the tag bitmap index needs, with up to 16M items per listing
+#define SHARD_ITEM_ID_BITS 24
+#define SHARD_MAX_LISTING_ID ((1LL << (32 - SHARD_ITEM_ID_BITS)) - 1)
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+extern int create_item_tags_indexes(struct tagger_db *db);
+
+/**
+ * @brief Get the location of the database file with the items of a listing
+ *
+ * The shard lies next to the catalog, `tags.tdb` keeps the items of listing 3 in `tags-listing3.tdb`.
+ *
+ * @param catalog tagger database with the listings and tags
+ * @param listing_id id of the listing
+ * @param location where to store the location
+ * @param size size of the `location` buffer
+ * @return `0` on success, otherwise `-1` on error
+ */
+int listing_shard_location(struct tagger_db *catalog, sqlite3_int64 listing_id, char *location, size_t size) {
+	const char *catalog_location = sqlite3_db_filename(catalog->connection, "main");
+
+	if (catalog_location == NULL || catalog_location[0] == '\0') {
+		fputs("Error, only a catalog stored in a file can have listing shards\n", stderr);
+		return -1;
+	}
+
+	size_t length = strlen(catalog_location);
+	if (length >= 4 && !strcmp(catalog_location + length - 4, ".tdb")) length -= 4;
+
+	if ((size_t) snprintf(location, size, "%.*s-listing%lld.tdb", (int) length, catalog_location, listing_id) >= size) {
+		fputs("Error, listing shard location is too long\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Attach a database under a schema name
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int attach_database(struct tagger_db *db, const char *location, const char *schema) {
+	sqlite3_stmt *stmt;
+
+	int rc = sqlite3_prepare_v2(db->connection, "ATTACH DATABASE ? AS ?;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	if (sqlite3_bind_text(stmt, 1, location, -1, NULL) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 2, schema, -1, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Could not attach %s: %s\n", location, sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Create the tables of a listing shard if they don't exist
+ *
+ * Item ids of a shard start at `listing_id << SHARD_ITEM_ID_BITS`, so they are unique
+ * over all shards and the views of `attach_listing_shards` can use them as they are.
+ * A check keeps a full shard from running into the ids of the next listing.
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int create_shard_tables(struct tagger_db *shard, sqlite3_int64 listing_id) {
+	// the tags live in the catalog, foreign keys cannot point to another database
+	static const char shard_tables_sql[] = "CREATE TABLE IF NOT EXISTS main." ITEMS_TABLE_NAME " ("
+							   "item_id INTEGER PRIMARY KEY AUTOINCREMENT NOT NULL,"
+							   "item_name TEXT NOT NULL UNIQUE,"
+							   "item_relpath TEXT NOT NULL UNIQUE,"
+							   "listing_id INTEGER NOT NULL,"
+							   "CHECK (item_id >> " TO_STRING(SHARD_ITEM_ID_BITS) " = listing_id)"
+							   ");"
+							   "CREATE TABLE IF NOT EXISTS main." ITEM_TAGS_TABLE_NAME " ("
+							   "item_id INTEGER NOT NULL,"
+							   "tag_id INTEGER NOT NULL,"
+							   "FOREIGN KEY (item_id) REFERENCES " ITEMS_TABLE_NAME "(item_id) ON UPDATE CASCADE ON DELETE CASCADE,"
+							   "PRIMARY KEY (item_id, tag_id)"
+							   ");"
+							   "CREATE INDEX IF NOT EXISTS main." ITEMS_TABLE_NAME "_listing_id ON "
+							   ITEMS_TABLE_NAME " (listing_id, item_id);"
+							   "CREATE TABLE IF NOT EXISTS main." TAG_COOCCURRENCE_TABLE_NAME " ("
+							   "tag_id INTEGER NOT NULL,"
+							   "related_tag_id INTEGER NOT NULL,"
+							   "count INTEGER NOT NULL,"
+							   "PRIMARY KEY (tag_id, related_tag_id)"
+							   ") WITHOUT ROWID;";
+	sqlite3_stmt *stmt;
+	int failed;
+
+	if (execute_sql_string(shard, "SAVEPOINT tagger_shard;")) return -1;
+
+	failed = execute_sql_string(shard, (char*) shard_tables_sql) || create_item_tags_indexes(shard);
+
+	if (!failed) {
+		int rc = sqlite3_prepare_v2(shard->connection, "INSERT INTO main.sqlite_sequence (name, seq) SELECT '" ITEMS_TABLE_NAME "', ? "
+			"WHERE NOT EXISTS (SELECT 1 FROM main.sqlite_sequence WHERE name = '" ITEMS_TABLE_NAME "');", -1, &stmt, NULL);
+		failed = rc != SQLITE_OK ||
+			sqlite3_bind_int64(stmt, 1, listing_id << SHARD_ITEM_ID_BITS) != SQLITE_OK ||
+			sqlite3_step(stmt) != SQLITE_DONE;
+		if (failed) fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(shard->connection));
+		sqlite3_finalize(stmt);
+	}
+
+	if (failed || execute_sql_string(shard, "RELEASE tagger_shard;")) {
+		execute_sql_string(shard, "ROLLBACK TO tagger_shard;");
+		execute_sql_string(shard, "RELEASE tagger_shard;");
+		fprintf(stderr, "Could not create the tables of listing shard %lld\n", listing_id);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Open the database file with the items of a listing, creating it if needed
+ *
+ * The shard has its own items, item tags and tag co-occurrence tables, and the catalog
+ * attached for the listings and tags. Tables missing in the shard are looked up
+ * in the catalog, so every function of a tagger database works on the shard
+ * as well, with the items of that listing only. Shards of different listings
+ * lock separately, so their refreshes and tag updates run concurrently and
+ * only adding new tags writes to the catalog.
+ *
+ * Tag indexes built on the shard connection follow its changes, indexes of other
+ * connections only see them once they are built again.
+ *
+ * Listing ids above 255 cannot have a shard, their item ids would not fit into 32 bits.
+ *
+ * @param catalog tagger database with the listings and tags, initialized with `init_tables`
+ * @param listing_id id of the listing
+ * @param profile `DATABASE_PROFILE` of the shard connection, `PROFILE_READ_ONLY` requires an existing shard
+ * @return pointer to the opened shard, otherwise `NULL` on error, close it with `close_database`
+ */
+struct tagger_db* open_listing_shard(struct tagger_db *catalog, sqlite3_int64 listing_id, int profile) {
+	char location[4096];
+	const char *catalog_location;
+	struct tagger_db *shard;
+
+	if (catalog == NULL || listing_id <= 0) return NULL;
+	if (listing_id > SHARD_MAX_LISTING_ID) {
+		fprintf(stderr, "Error, listing %lld cannot have a shard, the largest listing id with one is %lld\n", listing_id, SHARD_MAX_LISTING_ID);
+		return NULL;
+	}
+	if (listing_shard_location(catalog, listing_id, location, sizeof(location))) return NULL;
+	catalog_location = sqlite3_db_filename(catalog->connection, "main");
+
+	shard = open_database(location, (DATABASE_PROFILE) profile);
+	if (shard == NULL) return NULL;
+
+	if ((profile != PROFILE_READ_ONLY && create_shard_tables(shard, listing_id)) ||
+		attach_database(shard, catalog_location, CATALOG_SCHEMA_NAME)) {
+		close_database(shard);
+		return NULL;
+	}
+
+	return shard;
+}
+
+/**
+ * @brief Check whether a schema name is in use on a connection
+ *
+ * @return `1` if it is, `0` if not, `-1` on error
+ */
+static int schema_attached(struct tagger_db *db, const char *schema) {
+	sqlite3_stmt *stmt;
+
+	int rc = sqlite3_prepare_v2(db->connection, "SELECT 1 FROM pragma_database_list WHERE name = ?;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	if (sqlite3_bind_text(stmt, 1, schema, -1, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return rc == SQLITE_ROW;
+}
+
+/**
+ * @brief Check whether a tagger database is a listing shard or a catalog with listing shards
+ *
+ * Used by the changes of a tag over every item, which would only reach the items
+ * of the connection they run on. A catalog kept in memory has no shards.
+ *
+ * @param db tagger database
+ * @return `1` if listing shards exist, `0` if not, `-1` on error
+ */
+int has_listing_shards(struct tagger_db *db) {
+	char location[4096];
+	const char *catalog_location = sqlite3_db_filename(db->connection, "main");
+	sqlite3_stmt *stmt;
+	int found = 0;
+
+	int attached = schema_attached(db, CATALOG_SCHEMA_NAME);
+	if (attached != 0) return attached;
+	if (catalog_location == NULL || catalog_location[0] == '\0') return 0;
+
+	int rc = sqlite3_prepare_v2(db->connection, "SELECT listing_id FROM main." LISTINGS_TABLE_NAME ";", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	while (!found && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (listing_shard_location(db, sqlite3_column_int64(stmt, 0), location, sizeof(location))) {
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		found = !access(location, F_OK);
+	}
+	sqlite3_finalize(stmt);
+
+	if (!found && rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+	return found;
+}
+
+/**
+ * @brief Create a temporary view over a table of the catalog and all attached shards
+ *
+ * @param prefix SQL before the union of the shard tables, wrapping it
+ * @param suffix SQL after the union of the shard tables
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int create_shard_view(struct tagger_db *catalog, const sqlite3_int64 *listing_ids, size_t count,
+							 const char *table, const char *columns, const char *prefix, const char *suffix) {
+	char *sql = sqlite3_mprintf("CREATE TEMP VIEW %s AS %sSELECT %s FROM main.%s", table, prefix, columns, table), *extended;
+	int result;
+
+	for (size_t i = 0; i < count && sql != NULL; i++) {
+		extended = sqlite3_mprintf("%s UNION ALL SELECT %s FROM " SHARD_SCHEMA_PREFIX "%lld.%s", sql,
+			columns, listing_ids[i], table);
+		sqlite3_free(sql);
+		sql = extended;
+	}
+	if (sql != NULL) {
+		extended = sqlite3_mprintf("%s%s;", sql, suffix);
+		sqlite3_free(sql);
+		sql = extended;
+	}
+	if (sql == NULL) {
+		fputs("Could not allocate memory for SQL query\n", stderr);
+		return -1;
+	}
+
+	result = execute_sql_string(catalog, sql);
+	sqlite3_free(sql);
+	return result;
+}
+
+/**
+ * @brief Attach the shards of all listings to the catalog for queries over every listing
+ *
+ * Temporary views named like the items, item tags and tag co-occurrence tables join
+ * the tables of the catalog and of all shards with `UNION ALL`, the co-occurrence
+ * counts are summed. Temporary objects are looked up first, so all reading functions
+ * of the catalog see the items of every listing, and so do the tag indexes built
+ * on the catalog afterwards. Listings without a shard file keep their items in the
+ * catalog tables, so a catalog may mix both layouts.
+ *
+ * The views are read-only, writing items goes through `open_listing_shard` or a
+ * connection without the shards attached. Shards created later are attached
+ * by calling the function again.
+ *
+ * SQLite limits the number of attached databases per connection, 10 by default.
+ *
+ * @param catalog tagger database with the listings and tags
+ * @return number of shards attached, or `-1` on error
+ */
+int attach_listing_shards(struct tagger_db *catalog) {
+	char location[4096], schema[64];
+	sqlite3_int64 *listing_ids;
+	sqlite3_stmt *stmt;
+	size_t count = 0;
+	int limit = sqlite3_limit(catalog->connection, SQLITE_LIMIT_ATTACHED, -1);
+
+	listing_ids = malloc((limit + 1) * sizeof(sqlite3_int64));
+	if (listing_ids == NULL) {
+		fputs("Could not allocate memory for listing shards\n", stderr);
+		return -1;
+	}
+
+	int rc = sqlite3_prepare_v2(catalog->connection, "SELECT listing_id FROM main." LISTINGS_TABLE_NAME " ORDER BY listing_id;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(catalog->connection));
+		free(listing_ids);
+		return -1;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		sqlite3_int64 listing_id = sqlite3_column_int64(stmt, 0);
+
+		if (listing_shard_location(catalog, listing_id, location, sizeof(location))) break;
+		if (access(location, F_OK)) continue; // never opened as a shard
+
+		if ((int) count == limit) {
+			fprintf(stderr, "Error, more than %d listing shards cannot be attached\n", limit);
+			break;
+		}
+		listing_ids[count++] = listing_id;
+	}
+	sqlite3_finalize(stmt);
+
+	if (rc != SQLITE_DONE) {
+		if (rc != SQLITE_ROW) fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(catalog->connection));
+		free(listing_ids);
+		return -1;
+	}
+
+	// attaching is not possible while the listings are read
+	for (size_t i = 0; i < count; i++) {
+		snprintf(schema, sizeof(schema), SHARD_SCHEMA_PREFIX "%lld", listing_ids[i]);
+		int attached = schema_attached(catalog, schema);
+		if (attached == -1 || (!attached && (listing_shard_location(catalog, listing_ids[i], location, sizeof(location)) ||
+				attach_database(catalog, location, schema)))) {
+			free(listing_ids);
+			return -1;
+		}
+	}
+
+	if (execute_sql_string(catalog, "DROP VIEW IF EXISTS temp." ITEMS_TABLE_NAME ";"
+			"DROP VIEW IF EXISTS temp." ITEM_TAGS_TABLE_NAME ";"
+			"DROP VIEW IF EXISTS temp." TAG_COOCCURRENCE_TABLE_NAME ";") ||
+		(count > 0 && (
+			create_shard_view(catalog, listing_ids, count, ITEMS_TABLE_NAME, "item_id, item_name, item_relpath, listing_id", "", "") ||
+			create_shard_view(catalog, listing_ids, count, ITEM_TAGS_TABLE_NAME, "item_id, tag_id", "", "") ||
+			create_shard_view(catalog, listing_ids, count, TAG_COOCCURRENCE_TABLE_NAME, "tag_id, related_tag_id, count",
+				"SELECT tag_id, related_tag_id, sum(count) AS count FROM (", ") GROUP BY tag_id, related_tag_id")))) {
+		free(listing_ids);
+		return -1;
+	}
+
+	free(listing_ids);
+	return (int) count;
+}
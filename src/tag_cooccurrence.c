@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../include/database.h"
+#include "../include/tag_cooccurrence.h"
+
+#define COOCCURRENCE_TABLE_NAME "tag_cooccurrence"
+#define COOCCURRENCE_MAX_THREADS 64
+
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+extern char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_size);
+
+struct pair_count {
+	sqlite3_int64 tag_id; // `0` marks an empty slot
+	sqlite3_int64 related_tag_id;
+	sqlite3_int64 count;
+};
+
+struct pair_counts {
+	struct pair_count *slots;
+	size_t capacity;
+	size_t size;
+};
+
+struct cooccurrence_worker {
+	pthread_t thread;
+	const char *filename;
+	sqlite3_int64 from_item_id; // inclusive
+	sqlite3_int64 to_item_id; // exclusive
+	struct pair_counts counts;
+	int started;
+	int result;
+};
+
+/**
+ * @brief Get the tags that appear together with the given tags most often
+ *
+ * With more than one tag the counts are summed over all of them,
+ * and the queried tags themselves are never returned.
+ *
+ * @param db tagger database
+ * @param tag_ids array of tag ids
+ * @param tag_ids_count size of the `tag_ids` array
+ * @param related array where to store the related tags, most related first
+ * @param max_related size of the `related` array
+ * @return number of related tags stored, or `-1` on error
+ */
+int get_related_tags(struct tagger_db *db, sqlite3_int64 *tag_ids, int tag_ids_count, struct related_tag *related, int max_related) {
+	if (tag_ids == NULL || tag_ids_count < 1 || related == NULL || max_related < 0) return -1;
+
+	static const char related_sql[] = "SELECT related_tag_id, sum(count) AS score FROM " COOCCURRENCE_TABLE_NAME
+		" WHERE tag_id IN (?) AND related_tag_id NOT IN (?) GROUP BY related_tag_id ORDER BY score DESC, related_tag_id LIMIT ?;";
+	sqlite3_stmt *stmt;
+	char *sql, *expanded_sql;
+	int rc, found = 0;
+
+	// expanding the second array first keeps the position of the first one
+	expanded_sql = sql_expand_param_into_array((char*) related_sql, 2, tag_ids_count);
+	if (expanded_sql == NULL) return -1;
+	sql = sql_expand_param_into_array(expanded_sql, 1, tag_ids_count);
+	free(expanded_sql);
+	if (sql == NULL) return -1;
+
+	rc = sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL);
+	free(sql);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		return -1;
+	}
+
+	for (int i = 0; i < tag_ids_count; i++) {
+		if (sqlite3_bind_int64(stmt, i + 1, tag_ids[i]) != SQLITE_OK ||
+			sqlite3_bind_int64(stmt, tag_ids_count + i + 1, tag_ids[i]) != SQLITE_OK) {
+			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+	}
+	if (sqlite3_bind_int(stmt, 2 * tag_ids_count + 1, max_related) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW && found < max_related) {
+		related[found].tag_id = sqlite3_column_int64(stmt, 0);
+		related[found].count = sqlite3_column_int64(stmt, 1);
+		found++;
+	}
+
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	sqlite3_finalize(stmt);
+	return found;
+}
+
+static size_t pair_index(sqlite3_int64 tag_id, sqlite3_int64 related_tag_id, size_t capacity) {
+	uint64_t h = (uint64_t) tag_id * 0x9E3779B97F4A7C15ULL ^ (uint64_t) related_tag_id * 0xC2B2AE3D27D4EB4FULL;
+	return (size_t) (h >> 17) & (capacity - 1);
+}
+
+static int pair_counts_add(struct pair_counts *counts, sqlite3_int64 tag_id, sqlite3_int64 related_tag_id) {
+	size_t i;
+
+	if ((counts->size + 1) * 4 >= counts->capacity * 3) {
+		size_t new_capacity = counts->capacity ? counts->capacity * 2 : 4096;
+		struct pair_count *new_slots = calloc(new_capacity, sizeof(struct pair_count));
+		if (new_slots == NULL) return -1;
+
+		for (size_t j = 0; j < counts->capacity; j++) {
+			if (counts->slots[j].tag_id != 0) {
+				i = pair_index(counts->slots[j].tag_id, counts->slots[j].related_tag_id, new_capacity);
+				while (new_slots[i].tag_id != 0) i = (i + 1) & (new_capacity - 1);
+				new_slots[i] = counts->slots[j];
+			}
+		}
+		free(counts->slots);
+		counts->slots = new_slots;
+		counts->capacity = new_capacity;
+	}
+
+	i = pair_index(tag_id, related_tag_id, counts->capacity);
+	while (counts->slots[i].tag_id != 0) {
+		if (counts->slots[i].tag_id == tag_id && counts->slots[i].related_tag_id == related_tag_id) {
+			counts->slots[i].count++;
+			return 0;
+		}
+		i = (i + 1) & (counts->capacity - 1);
+	}
+	counts->slots[i].tag_id = tag_id;
+	counts->slots[i].related_tag_id = related_tag_id;
+	counts->slots[i].count = 1;
+	counts->size++;
+	return 0;
+}
+
+static int add_item_pairs(struct pair_counts *counts, const sqlite3_int64 *tags, size_t tags_count) {
+	for (size_t i = 0; i < tags_count; i++) {
+		for (size_t j = 0; j < tags_count; j++) {
+			if (i != j && pair_counts_add(counts, tags[i], tags[j])) return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Count tag pairs of the items in a range of item ids on its own read-only connection
+ */
+static void* cooccurrence_worker_run(void *arg) {
+	struct cooccurrence_worker *worker = arg;
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	sqlite3_int64 *tags = NULL, item_id, current_item_id = 0;
+	size_t tags_count = 0, tags_capacity = 0;
+	int rc;
+
+	worker->result = -1;
+
+	if (sqlite3_open_v2(worker->filename, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	rc = sqlite3_prepare_v2(db, "SELECT item_id, tag_id FROM itemtags WHERE item_id >= ? AND item_id < ? ORDER BY item_id;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	if (sqlite3_bind_int64(stmt, 1, worker->from_item_id) != SQLITE_OK ||
+		sqlite3_bind_int64(stmt, 2, worker->to_item_id) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		return NULL;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		item_id = sqlite3_column_int64(stmt, 0);
+		if (item_id != current_item_id) {
+			if (add_item_pairs(&worker->counts, tags, tags_count)) break;
+			tags_count = 0;
+			current_item_id = item_id;
+		}
+
+		if (tags_count == tags_capacity) {
+			size_t new_capacity = tags_capacity ? tags_capacity * 2 : 16;
+			sqlite3_int64 *new_tags = realloc(tags, new_capacity * sizeof(sqlite3_int64));
+			if (new_tags == NULL) break;
+			tags = new_tags;
+			tags_capacity = new_capacity;
+		}
+		tags[tags_count++] = sqlite3_column_int64(stmt, 1);
+	}
+
+	if (rc == SQLITE_DONE && !add_item_pairs(&worker->counts, tags, tags_count)) {
+		worker->result = 0;
+	} else if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
+	} else {
+		fputs("Could not allocate memory for tag pair counts\n", stderr);
+	}
+
+	free(tags);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return NULL;
+}
+
+static int compare_pair_counts(const void *a, const void *b) {
+	const struct pair_count *x = a, *y = b;
+	if (x->tag_id != y->tag_id) return (x->tag_id > y->tag_id) - (x->tag_id < y->tag_id);
+	return (x->related_tag_id > y->related_tag_id) - (x->related_tag_id < y->related_tag_id);
+}
+
+/**
+ * @brief Write the pair counts of a worker, merging with the counts already written
+ */
+static int write_pair_counts(sqlite3 *db, sqlite3_stmt *stmt, struct pair_counts *counts) {
+	size_t used = 0;
+
+	// sorting lets the inserts walk the primary key in order
+	for (size_t i = 0; i < counts->capacity; i++) {
+		if (counts->slots[i].tag_id != 0) counts->slots[used++] = counts->slots[i];
+	}
+	qsort(counts->slots, used, sizeof(struct pair_count), compare_pair_counts);
+
+	for (size_t i = 0; i < used; i++) {
+		sqlite3_reset(stmt);
+		if (sqlite3_bind_int64(stmt, 1, counts->slots[i].tag_id) != SQLITE_OK ||
+			sqlite3_bind_int64(stmt, 2, counts->slots[i].related_tag_id) != SQLITE_OK ||
+			sqlite3_bind_int64(stmt, 3, counts->slots[i].count) != SQLITE_OK) {
+			fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(db));
+			return -1;
+		}
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get the smallest and the largest item id that has tags
+ *
+ * @return `1` if there are item tags, `0` if there are none, `-1` on error
+ */
+static int get_item_id_range(sqlite3 *db, sqlite3_int64 *min_item_id, sqlite3_int64 *max_item_id) {
+	sqlite3_stmt *stmt;
+	int rc = sqlite3_prepare_v2(db, "SELECT min(item_id), max(item_id) FROM itemtags;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
+		sqlite3_finalize(stmt);
+		return 0;
+	}
+
+	*min_item_id = sqlite3_column_int64(stmt, 0);
+	*max_item_id = sqlite3_column_int64(stmt, 1);
+	sqlite3_finalize(stmt);
+	return 1;
+}
+
+/**
+ * @brief Recompute the tag co-occurrence table from scratch
+ *
+ * The item id range is split between worker threads that count tag pairs on their own
+ * read-only connections, while this connection holds the write lock so nothing changes
+ * underneath them. In-memory databases are rebuilt with a single query instead.
+ * Must not be called inside a transaction.
+ *
+ * @param db tagger database
+ * @param threads number of worker threads
+ * @return `0` on success, otherwise `-1` on error
+ */
+int rebuild_tag_cooccurrence(struct tagger_db *db, int threads) {
+	const char *filename = sqlite3_db_filename(db->connection, "main");
+	struct cooccurrence_worker *workers;
+	sqlite3_stmt *stmt;
+	sqlite3_int64 min_item_id, max_item_id, range;
+	int rc, result = 0;
+
+	if (threads < 1) threads = 1;
+	if (threads > COOCCURRENCE_MAX_THREADS) threads = COOCCURRENCE_MAX_THREADS;
+
+	if (filename == NULL || filename[0] == '\0') {
+		if (execute_sql_string(db, "BEGIN IMMEDIATE TRANSACTION;")) return -1;
+		if (execute_sql_string(db, "DELETE FROM " COOCCURRENCE_TABLE_NAME ";") ||
+			execute_sql_string(db, "INSERT INTO " COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) "
+				"SELECT a.tag_id, b.tag_id, count() FROM itemtags a JOIN itemtags b ON a.item_id = b.item_id AND a.tag_id <> b.tag_id "
+				"GROUP BY a.tag_id, b.tag_id;")) {
+			execute_sql_string(db, "ROLLBACK;");
+			return -1;
+		}
+		return execute_sql_string(db, "END TRANSACTION;");
+	}
+
+	// the write lock keeps other writers out while the workers read
+	if (execute_sql_string(db, "BEGIN IMMEDIATE TRANSACTION;")) return -1;
+
+	rc = get_item_id_range(db->connection, &min_item_id, &max_item_id);
+	if (rc == -1) {
+		execute_sql_string(db, "ROLLBACK;");
+		return -1;
+	}
+	if (rc == 0) {
+		if (execute_sql_string(db, "DELETE FROM " COOCCURRENCE_TABLE_NAME ";")) {
+			execute_sql_string(db, "ROLLBACK;");
+			return -1;
+		}
+		return execute_sql_string(db, "END TRANSACTION;");
+	}
+
+	workers = calloc(threads, sizeof(struct cooccurrence_worker));
+	if (workers == NULL) {
+		fputs("Could not allocate memory for co-occurrence workers\n", stderr);
+		execute_sql_string(db, "ROLLBACK;");
+		return -1;
+	}
+
+	range = (max_item_id - min_item_id) / threads + 1;
+	for (int i = 0; i < threads; i++) {
+		workers[i].filename = filename;
+		workers[i].from_item_id = min_item_id + range * i;
+		workers[i].to_item_id = i == threads - 1 ? max_item_id + 1 : min_item_id + range * (i + 1);
+		if (pthread_create(&workers[i].thread, NULL, cooccurrence_worker_run, &workers[i])) {
+			fputs("Could not start a co-occurrence worker, counting on this thread\n", stderr);
+			cooccurrence_worker_run(&workers[i]);
+		} else {
+			workers[i].started = 1;
+		}
+	}
+
+	for (int i = 0; i < threads; i++) {
+		if (workers[i].started) pthread_join(workers[i].thread, NULL);
+		if (workers[i].result) result = -1;
+	}
+
+	if (!result && execute_sql_string(db, "DELETE FROM " COOCCURRENCE_TABLE_NAME ";")) {
+		result = -1;
+	}
+
+	if (!result) {
+		rc = sqlite3_prepare_v2(db->connection, "INSERT INTO " COOCCURRENCE_TABLE_NAME " (tag_id, related_tag_id, count) VALUES (?,?,?) "
+			"ON CONFLICT (tag_id, related_tag_id) DO UPDATE SET count = count + excluded.count;", -1, &stmt, NULL);
+		if (rc != SQLITE_OK) {
+			fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+			result = -1;
+		} else {
+			for (int i = 0; i < threads && !result; i++) {
+				result = write_pair_counts(db->connection, stmt, &workers[i].counts);
+			}
+			sqlite3_finalize(stmt);
+		}
+	}
+
+	for (int i = 0; i < threads; i++) {
+		free(workers[i].counts.slots);
+	}
+	free(workers);
+
+	if (result) {
+		execute_sql_string(db, "ROLLBACK;");
+		return -1;
+	}
+
+	return execute_sql_string(db, "END TRANSACTION;");
+}
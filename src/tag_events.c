@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../include/database.h"
+#include "../include/tag_events.h"
+
+#define TAG_EVENTS_FUNCTION_NAME "tagger_tag_event"
+// longer savepoint names are truncated, which only matters if two of them share the prefix
+#define TAG_EVENTS_SAVEPOINT_NAME_SIZE 64
+
+typedef enum {TAG_ADDED = 1, TAG_REMOVED = 2, ITEM_TAG_ADDED = 3, ITEM_TAG_REMOVED = 4} TAG_EVENT_KIND;
+
+struct tag_event {
+	TAG_EVENT_KIND kind;
+	sqlite3_int64 a;
+	sqlite3_int64 b;
+	char *name;
+};
+
+struct tag_savepoint {
+	char name[TAG_EVENTS_SAVEPOINT_NAME_SIZE];
+	size_t pending_count; // events queued before the savepoint
+};
+
+struct tag_events {
+	sqlite3 *connection;
+	const struct tag_events_listener **listeners;
+	size_t listeners_count;
+	size_t listeners_capacity;
+	struct tag_event *pending; // events of the currently open transaction
+	size_t pending_count;
+	size_t pending_capacity;
+	struct tag_savepoint *savepoints; // open savepoints, innermost last
+	size_t savepoints_count;
+	size_t savepoints_capacity;
+	int committing; // the commit hook ran, the events are delivered once the commit is done
+};
+
+struct tag_events_trigger {
+	const char *table;
+	const char *sql; // formatted with the schema of the table
+};
+
+// temp triggers only live as long as the connection, so they never end up in the database file
+static const struct tag_events_trigger triggers[] = {
+	{"tags", "CREATE TEMP TRIGGER IF NOT EXISTS tagger_events_tags_ai AFTER INSERT ON \"%w\".tags BEGIN "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(1, NEW.tag_id, NEW.tag_name); END;"},
+	{"tags", "CREATE TEMP TRIGGER IF NOT EXISTS tagger_events_tags_ad AFTER DELETE ON \"%w\".tags BEGIN "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(2, OLD.tag_id, OLD.tag_name); END;"},
+	// a renamed tag is removed under its old name and added under the new one
+	{"tags", "CREATE TEMP TRIGGER IF NOT EXISTS tagger_events_tags_au AFTER UPDATE OF tag_name ON \"%w\".tags BEGIN "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(2, OLD.tag_id, OLD.tag_name); "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(1, NEW.tag_id, NEW.tag_name); END;"},
+	{"itemtags", "CREATE TEMP TRIGGER IF NOT EXISTS tagger_events_itemtags_ai AFTER INSERT ON \"%w\".itemtags BEGIN "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(3, NEW.item_id, NEW.tag_id); END;"},
+	{"itemtags", "CREATE TEMP TRIGGER IF NOT EXISTS tagger_events_itemtags_ad AFTER DELETE ON \"%w\".itemtags BEGIN "
+		"SELECT " TAG_EVENTS_FUNCTION_NAME "(4, OLD.item_id, OLD.tag_id); END;"},
+	{NULL, NULL}
+};
+
+static const char *drop_trigger_sqls[] = {
+	"DROP TRIGGER IF EXISTS temp.tagger_events_tags_ai;",
+	"DROP TRIGGER IF EXISTS temp.tagger_events_tags_ad;",
+	"DROP TRIGGER IF EXISTS temp.tagger_events_tags_au;",
+	"DROP TRIGGER IF EXISTS temp.tagger_events_itemtags_ai;",
+	"DROP TRIGGER IF EXISTS temp.tagger_events_itemtags_ad;",
+	NULL
+};
+
+/**
+ * @brief Drop the queued events after the first `count`
+ */
+static void truncate_pending(struct tag_events *e, size_t count) {
+	for (size_t i = count; i < e->pending_count; i++) {
+		free(e->pending[i].name);
+	}
+	if (count < e->pending_count) e->pending_count = count;
+}
+
+static void clear_pending(struct tag_events *e) {
+	truncate_pending(e, 0);
+	e->savepoints_count = 0;
+	e->committing = 0;
+}
+
+/**
+ * @brief SQL function called by the temp triggers, queues an event until the transaction ends
+ */
+static void tag_event_sql_function(sqlite3_context *context, int argc, sqlite3_value **argv) {
+	struct tag_events *e = sqlite3_user_data(context);
+	(void) argc;
+
+	if (e->pending_count == e->pending_capacity) {
+		size_t new_capacity = e->pending_capacity ? e->pending_capacity * 2 : 64;
+		struct tag_event *new_pending = realloc(e->pending, new_capacity * sizeof(struct tag_event));
+		if (new_pending == NULL) {
+			sqlite3_result_error_nomem(context);
+			return;
+		}
+		e->pending = new_pending;
+		e->pending_capacity = new_capacity;
+	}
+
+	struct tag_event *event = &e->pending[e->pending_count];
+	event->kind = (TAG_EVENT_KIND) sqlite3_value_int(argv[0]);
+	event->a = sqlite3_value_int64(argv[1]);
+	event->b = 0;
+	event->name = NULL;
+
+	if (event->kind == TAG_ADDED || event->kind == TAG_REMOVED) {
+		const unsigned char *name = sqlite3_value_text(argv[2]);
+		int name_bytes = sqlite3_value_bytes(argv[2]);
+		event->name = malloc(name_bytes + 1);
+		if (event->name == NULL) {
+			sqlite3_result_error_nomem(context);
+			return;
+		}
+		memcpy(event->name, name, name_bytes);
+		event->name[name_bytes] = '\0';
+	} else {
+		event->b = sqlite3_value_int64(argv[2]);
+	}
+
+	e->pending_count++;
+	sqlite3_result_null(context);
+}
+
+/**
+ * @brief Deliver the queued events to the listeners
+ */
+static void deliver_pending(struct tag_events *e) {
+	const struct tag_events_listener *l;
+
+	for (size_t i = 0; i < e->pending_count; i++) {
+		struct tag_event *event = &e->pending[i];
+		for (size_t j = 0; j < e->listeners_count; j++) {
+			l = e->listeners[j];
+			switch (event->kind) {
+				case TAG_ADDED:
+					if (l->tag_added) l->tag_added(l->ctx, event->a, event->name);
+					break;
+				case TAG_REMOVED:
+					if (l->tag_removed) l->tag_removed(l->ctx, event->a, event->name);
+					break;
+				case ITEM_TAG_ADDED:
+					if (l->item_tag_added) l->item_tag_added(l->ctx, event->a, event->b);
+					break;
+				case ITEM_TAG_REMOVED:
+					if (l->item_tag_removed) l->item_tag_removed(l->ctx, event->a, event->b);
+					break;
+			}
+		}
+	}
+	clear_pending(e);
+}
+
+/**
+ * @brief Deliver the events of a transaction once its commit went through
+ *
+ * A failed commit either rolls the transaction back, which drops the events,
+ * or leaves it open, in which case the connection is not in autocommit mode.
+ */
+static void deliver_committed(struct tag_events *e) {
+	if (e->committing && sqlite3_get_autocommit(e->connection)) deliver_pending(e);
+}
+
+/**
+ * @brief Commit hook, marks the queued events for delivery after the commit
+ *
+ * The commit can still fail after this hook, so nothing is delivered yet.
+ */
+static int tag_events_commit_hook(void *arg) {
+	struct tag_events *e = arg;
+
+	e->committing = 1;
+	e->savepoints_count = 0;
+	return 0; // 0 lets the commit proceed
+}
+
+/**
+ * @brief Rollback hook, drops the events of the rolled back transaction
+ */
+static void tag_events_rollback_hook(void *arg) {
+	clear_pending((struct tag_events*) arg);
+}
+
+/**
+ * @brief Read the next keyword or identifier of an SQL statement, skipping whitespace and comments
+ *
+ * @return `0` if a token was read, otherwise `-1` at the end of the statement
+ */
+static int next_sql_token(const char **sql, char *token, size_t size) {
+	const char *p = *sql;
+	size_t length = 0;
+
+	for (;;) {
+		while (isspace((unsigned char) *p)) p++;
+		if (p[0] == '-' && p[1] == '-') {
+			while (*p != '\0' && *p != '\n') p++;
+		} else if (p[0] == '/' && p[1] == '*') {
+			const char *end = strstr(p + 2, "*/");
+			p = end != NULL ? end + 2 : p + strlen(p);
+		} else {
+			break;
+		}
+	}
+
+	if (*p == '"' || *p == '`' || *p == '[' || *p == '\'') {
+		char quote = *p == '[' ? ']' : *p;
+		for (p++; *p != '\0'; p++) {
+			if (*p == quote) {
+				if (p[1] != quote || quote == ']') {
+					p++;
+					break;
+				}
+				p++; // doubled quote
+			}
+			if (length + 1 < size) token[length++] = *p;
+		}
+	} else {
+		for (; isalnum((unsigned char) *p) || *p == '_' || *p == '$' || (unsigned char) *p >= 0x80; p++) {
+			if (length + 1 < size) token[length++] = *p;
+		}
+	}
+
+	*sql = p;
+	token[length] = '\0';
+	return length > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Find the innermost open savepoint with a name, savepoint names are case insensitive
+ *
+ * @return index of the savepoint, or `-1` if there is none
+ */
+static long find_savepoint(struct tag_events *e, const char *name) {
+	for (size_t i = e->savepoints_count; i > 0; i--) {
+		if (!sqlite3_stricmp(e->savepoints[i - 1].name, name)) return (long) i - 1;
+	}
+	return -1;
+}
+
+/**
+ * @brief Follow the savepoints of a statement about to run
+ *
+ * SQLite has no hook for savepoints and `ROLLBACK TO` does not call the rollback
+ * hook, so the events queued after a savepoint are dropped here when it is rolled back.
+ */
+static void track_savepoints(struct tag_events *e, const char *sql) {
+	char token[TAG_EVENTS_SAVEPOINT_NAME_SIZE], name[TAG_EVENTS_SAVEPOINT_NAME_SIZE];
+	long index;
+
+	if (next_sql_token(&sql, token, sizeof(token))) return;
+
+	if (!sqlite3_stricmp(token, "SAVEPOINT")) {
+		if (next_sql_token(&sql, name, sizeof(name))) return;
+		if (e->savepoints_count == e->savepoints_capacity) {
+			size_t new_capacity = e->savepoints_capacity ? e->savepoints_capacity * 2 : 4;
+			struct tag_savepoint *new_savepoints = realloc(e->savepoints, new_capacity * sizeof(struct tag_savepoint));
+			if (new_savepoints == NULL) {
+				fputs("Could not allocate memory for a tag events savepoint\n", stderr);
+				return;
+			}
+			e->savepoints = new_savepoints;
+			e->savepoints_capacity = new_capacity;
+		}
+		strcpy(e->savepoints[e->savepoints_count].name, name);
+		e->savepoints[e->savepoints_count++].pending_count = e->pending_count;
+	} else if (!sqlite3_stricmp(token, "RELEASE")) {
+		// RELEASE [SAVEPOINT] name
+		if (next_sql_token(&sql, name, sizeof(name))) return;
+		if (!sqlite3_stricmp(name, "SAVEPOINT") && next_sql_token(&sql, token, sizeof(token)) == 0) strcpy(name, token);
+		if ((index = find_savepoint(e, name)) != -1) e->savepoints_count = index;
+	} else if (!sqlite3_stricmp(token, "ROLLBACK")) {
+		// ROLLBACK [TRANSACTION] TO [SAVEPOINT] name, a plain ROLLBACK calls the rollback hook
+		if (next_sql_token(&sql, token, sizeof(token))) return;
+		if (!sqlite3_stricmp(token, "TRANSACTION") && next_sql_token(&sql, token, sizeof(token))) return;
+		if (sqlite3_stricmp(token, "TO") || next_sql_token(&sql, name, sizeof(name))) return;
+		if (!sqlite3_stricmp(name, "SAVEPOINT") && next_sql_token(&sql, token, sizeof(token)) == 0) strcpy(name, token);
+
+		// the savepoint stays open after ROLLBACK TO
+		if ((index = find_savepoint(e, name)) != -1) {
+			truncate_pending(e, e->savepoints[index].pending_count);
+			e->savepoints_count = index + 1;
+		}
+	}
+}
+
+/**
+ * @brief Trace callback, follows savepoints before a statement runs and delivers committed events after it
+ */
+static int tag_events_trace(unsigned type, void *arg, void *p, void *x) {
+	struct tag_events *e = arg;
+	(void) p;
+
+	deliver_committed(e);
+	// statements of triggers are traced as comments, which have no tokens
+	if (type == SQLITE_TRACE_STMT) track_savepoints(e, x);
+	return 0;
+}
+
+/**
+ * @brief Find the attached database holding a table, `main` first
+ *
+ * A listing shard keeps its item tags in `main` and reads the tags from the attached catalog.
+ *
+ * @param schema where to store the schema name
+ * @return `0` on success, otherwise `-1` if no database has the table
+ */
+static int find_table_schema(sqlite3 *connection, const char *table, char *schema, size_t size) {
+	sqlite3_stmt *stmt;
+
+	int rc = sqlite3_prepare_v2(connection, "SELECT schema FROM pragma_table_list WHERE name = ? AND type = 'table' "
+		"AND schema != 'temp' ORDER BY schema != 'main' LIMIT 1;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(connection));
+		return -1;
+	}
+
+	if (sqlite3_bind_text(stmt, 1, table, -1, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Error when binding value with SQL query: %s\n", sqlite3_errmsg(connection));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW) snprintf(schema, size, "%s", (const char*) sqlite3_column_text(stmt, 0));
+	else if (rc == SQLITE_DONE) fprintf(stderr, "Error, no attached database has a %s table\n", table);
+	else fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(connection));
+	sqlite3_finalize(stmt);
+
+	return rc == SQLITE_ROW ? 0 : -1;
+}
+
+/**
+ * @brief Drop the temp triggers of a connection
+ */
+static void drop_triggers(sqlite3 *connection) {
+	for (const char **drop = drop_trigger_sqls; *drop != NULL; drop++) {
+		sqlite3_exec(connection, *drop, NULL, 0, NULL);
+	}
+}
+
+/**
+ * @brief Create the temp triggers and hooks for a connection
+ *
+ * @param db tagger database, tables must be initialized
+ * @return a pointer to the new tag events state, or `NULL` on error
+ */
+static struct tag_events* attach_tag_events(struct tagger_db *db) {
+	sqlite3 *connection = db->connection;
+	struct tag_events *e = calloc(1, sizeof(struct tag_events));
+	if (e == NULL) {
+		fputs("Could not allocate memory for tag events\n", stderr);
+		return NULL;
+	}
+
+	if (sqlite3_create_function(connection, TAG_EVENTS_FUNCTION_NAME, 3, SQLITE_UTF8, e, tag_event_sql_function, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Could not register tag events function: %s\n", sqlite3_errmsg(connection));
+		free(e);
+		return NULL;
+	}
+
+	char schema[256], *sql, *errmsg = NULL;
+	int failed = 0;
+
+	for (const struct tag_events_trigger *trigger = triggers; trigger->sql != NULL && !failed; trigger++) {
+		if (find_table_schema(connection, trigger->table, schema, sizeof(schema))) {
+			failed = 1;
+			break;
+		}
+
+		sql = sqlite3_mprintf(trigger->sql, schema);
+		if (sql == NULL || sqlite3_exec(connection, sql, NULL, 0, &errmsg) != SQLITE_OK) {
+			fprintf(stderr, "Could not create tag events trigger: %s\n", errmsg != NULL ? errmsg : "out of memory");
+			failed = 1;
+		}
+		sqlite3_free(errmsg);
+		sqlite3_free(sql);
+	}
+
+	if (failed) {
+		drop_triggers(connection);
+		sqlite3_create_function(connection, TAG_EVENTS_FUNCTION_NAME, 3, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+		free(e);
+		return NULL;
+	}
+
+	// SQLite hands back only the argument of a replaced hook, not its function, so they cannot be chained
+	sqlite3_commit_hook(connection, tag_events_commit_hook, e);
+	sqlite3_rollback_hook(connection, tag_events_rollback_hook, e);
+	sqlite3_trace_v2(connection, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, tag_events_trace, e);
+
+	e->connection = connection;
+	db->events = e;
+	return e;
+}
+
+/**
+ * @brief Subscribe to committed changes of tags and item tags
+ *
+ * The listener must stay valid until it is unsubscribed or the database is closed.
+ *
+ * While any listener is subscribed the module owns the commit hook, the rollback hook
+ * and the `sqlite3_trace_v2` callback of the connection: the first subscription
+ * replaces hooks installed before, and they are cleared, not restored, once the last
+ * listener is gone. Other code must not install these hooks on a connection with listeners.
+ *
+ * @param db tagger database, tables must be initialized
+ * @param listener listener to subscribe
+ * @return `0` on success, otherwise `-1` on error
+ */
+int tag_events_subscribe(struct tagger_db *db, const struct tag_events_listener *listener) {
+	if (db == NULL || listener == NULL) return -1;
+
+	struct tag_events *e = db->events;
+	if (e == NULL && (e = attach_tag_events(db)) == NULL) {
+		return -1;
+	}
+
+	if (e->listeners_count == e->listeners_capacity) {
+		size_t new_capacity = e->listeners_capacity ? e->listeners_capacity * 2 : 4;
+		const struct tag_events_listener **new_listeners = realloc(e->listeners, new_capacity * sizeof(*new_listeners));
+		if (new_listeners == NULL) {
+			fputs("Could not allocate memory for tag events listener\n", stderr);
+			return -1;
+		}
+		e->listeners = new_listeners;
+		e->listeners_capacity = new_capacity;
+	}
+
+	e->listeners[e->listeners_count++] = listener;
+	return 0;
+}
+
+/**
+ * @brief Unsubscribe a listener, the triggers are dropped once the last listener is gone
+ *
+ * @param db tagger database
+ * @param listener previously subscribed listener
+ * @return `0` on success, otherwise `-1` if the listener was not subscribed
+ */
+int tag_events_unsubscribe(struct tagger_db *db, const struct tag_events_listener *listener) {
+	struct tag_events *e = db->events;
+	if (e == NULL) return -1;
+
+	for (size_t i = 0; i < e->listeners_count; i++) {
+		if (e->listeners[i] == listener) {
+			memmove(e->listeners + i, e->listeners + i + 1, (e->listeners_count - i - 1) * sizeof(*e->listeners));
+			e->listeners_count--;
+			if (e->listeners_count == 0) {
+				tag_events_detach(db);
+			}
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Notify the listeners that a tag name could not be resolved
+ *
+ * @param db tagger database
+ * @param tag_name the tag name that does not exist
+ */
+void tag_events_unknown_tag(struct tagger_db *db, const char *tag_name) {
+	struct tag_events *e = db->events;
+	if (e == NULL) return;
+
+	for (size_t i = 0; i < e->listeners_count; i++) {
+		if (e->listeners[i]->unknown_tag) e->listeners[i]->unknown_tag(e->listeners[i]->ctx, tag_name);
+	}
+}
+
+/**
+ * @brief Remove all listeners, triggers and hooks of a connection
+ *
+ * The commit hook, rollback hook and trace callback are cleared, whoever installed them.
+ *
+ * @param db tagger database
+ */
+void tag_events_detach(struct tagger_db *db) {
+	struct tag_events *e = db->events;
+	if (e == NULL) return;
+	db->events = NULL;
+
+	drop_triggers(db->connection);
+	sqlite3_commit_hook(db->connection, NULL, NULL);
+	sqlite3_rollback_hook(db->connection, NULL, NULL);
+	sqlite3_trace_v2(db->connection, 0, NULL, NULL);
+	sqlite3_create_function(db->connection, TAG_EVENTS_FUNCTION_NAME, 3, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+
+	deliver_committed(e);
+	clear_pending(e);
+	free(e->savepoints);
+	free(e->pending);
+	free(e->listeners);
+	free(e);
+}
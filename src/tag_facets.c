@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "../include/database.h"
+#include "../include/tag_facets.h"
+#include "../include/tag_events.h"
+#include "../include/id_map.h"
+
+struct tag_bitmap_index {
+	struct tagger_db *db;
+	struct id_map bitmaps; // tag_id -> bitmap of item ids
+	struct tag_events_listener listener;
+};
+
+/**
+ * @brief Add an item to the bitmap of a tag, creating the bitmap if needed
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int index_add(struct tag_bitmap_index *index, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+	if (item_id <= 0 || item_id > UINT32_MAX) {
+		fprintf(stderr, "Item id %lld does not fit into a tag bitmap\n", item_id);
+		return -1;
+	}
+
+	struct bitmap *items = id_map_get(&index->bitmaps, tag_id);
+	if (items == NULL) {
+		items = bitmap_new();
+		if (items == NULL || id_map_put(&index->bitmaps, tag_id, items)) {
+			bitmap_free(items);
+			return -1;
+		}
+	}
+
+	return bitmap_add(items, (uint32_t) item_id) < 0 ? -1 : 0;
+}
+
+static void bitmap_index_on_tag_removed(void *ctx, sqlite3_int64 tag_id, const char *tag_name) {
+	struct tag_bitmap_index *index = ctx;
+	(void) tag_name;
+
+	bitmap_free(id_map_get(&index->bitmaps, tag_id));
+	id_map_remove(&index->bitmaps, tag_id);
+}
+
+static void bitmap_index_on_item_tag_added(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+	if (index_add((struct tag_bitmap_index*) ctx, item_id, tag_id)) {
+		fprintf(stderr, "Could not add item %lld to the bitmap of tag %lld\n", item_id, tag_id);
+	}
+}
+
+static void bitmap_index_on_item_tag_removed(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+	struct bitmap *items = id_map_get(&((struct tag_bitmap_index*) ctx)->bitmaps, tag_id);
+	if (items != NULL && item_id > 0 && item_id <= UINT32_MAX) {
+		bitmap_remove(items, (uint32_t) item_id);
+	}
+}
+
+/**
+ * @brief Build a bitmap of item ids for every tag in the database
+ *
+ * The index subscribes to tag events, so it follows every committed change
+ * of the item tags on this connection. Item ids must fit into 32 bits.
+ *
+ * @param db tagger database, tables must be initialized
+ * @return a pointer to the new index, or `NULL` on error, free it with `tag_bitmap_index_free`
+ */
+struct tag_bitmap_index* tag_bitmap_index_build(struct tagger_db *db) {
+	sqlite3_stmt *stmt;
+	struct tag_bitmap_index *index = calloc(1, sizeof(struct tag_bitmap_index));
+	if (index == NULL) {
+		fputs("Could not allocate memory for tag bitmap index\n", stderr);
+		return NULL;
+	}
+
+	// walking the primary key adds the item ids of every tag in increasing order
+	int rc = sqlite3_prepare_v2(db->connection, "SELECT item_id, tag_id FROM itemtags ORDER BY item_id, tag_id;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		tag_bitmap_index_free(index);
+		return NULL;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (index_add(index, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1))) {
+			fputs("Could not build tag bitmap index\n", stderr);
+			sqlite3_finalize(stmt);
+			tag_bitmap_index_free(index);
+			return NULL;
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		tag_bitmap_index_free(index);
+		return NULL;
+	}
+	sqlite3_finalize(stmt);
+
+	index->listener.ctx = index;
+	index->listener.tag_removed = bitmap_index_on_tag_removed;
+	index->listener.item_tag_added = bitmap_index_on_item_tag_added;
+	index->listener.item_tag_removed = bitmap_index_on_item_tag_removed;
+	if (tag_events_subscribe(db, &index->listener)) {
+		fputs("Could not subscribe tag bitmap index to tag events\n", stderr);
+		tag_bitmap_index_free(index);
+		return NULL;
+	}
+	index->db = db;
+
+	return index;
+}
+
+static int compare_bitmap_cardinality(const void *a, const void *b) {
+	uint64_t x = bitmap_cardinality(*(struct bitmap * const *) a), y = bitmap_cardinality(*(struct bitmap * const *) b);
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get the items that have all of the given tags
+ *
+ * @param index tag bitmap index
+ * @param tag_ids array of tag ids
+ * @param tag_ids_count size of the `tag_ids` array
+ * @param items where to store a pointer to the new bitmap of item ids, free it with `bitmap_free`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int tag_bitmap_index_query(struct tag_bitmap_index *index, const sqlite3_int64 *tag_ids, int tag_ids_count, struct bitmap **items) {
+	if (index == NULL || tag_ids == NULL || tag_ids_count < 1 || items == NULL) return -1;
+
+	struct bitmap **bitmaps = malloc(tag_ids_count * sizeof(struct bitmap*));
+	struct bitmap *result, *next;
+	if (bitmaps == NULL) {
+		fputs("Could not allocate memory for tag query\n", stderr);
+		return -1;
+	}
+
+	for (int i = 0; i < tag_ids_count; i++) {
+		bitmaps[i] = id_map_get(&index->bitmaps, tag_ids[i]);
+		if (bitmaps[i] == NULL) {
+			// a tag without items, nothing can match
+			free(bitmaps);
+			*items = bitmap_new();
+			return *items == NULL ? -1 : 0;
+		}
+	}
+
+	// intersecting the smallest bitmaps first keeps the intermediate results small
+	qsort(bitmaps, tag_ids_count, sizeof(struct bitmap*), compare_bitmap_cardinality);
+
+	result = bitmap_and(bitmaps[0], bitmaps[0]);
+	for (int i = 1; i < tag_ids_count && result != NULL && result->count > 0; i++) {
+		next = bitmap_and(result, bitmaps[i]);
+		bitmap_free(result);
+		result = next;
+	}
+	free(bitmaps);
+
+	if (result == NULL) {
+		fputs("Could not allocate memory for tag query\n", stderr);
+		return -1;
+	}
+
+	*items = result;
+	return 0;
+}
+
+static void facet_heap_sift_down(struct tag_facet *heap, int count, int i) {
+	struct tag_facet value = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < count) {
+		if (child + 1 < count && heap[child + 1].count < heap[child].count) child++;
+		if (heap[child].count >= value.count) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = value;
+}
+
+static int compare_facets(const void *a, const void *b) {
+	const struct tag_facet *x = a, *y = b;
+	if (x->count != y->count) return (x->count < y->count) - (x->count > y->count);
+	return (x->tag_id > y->tag_id) - (x->tag_id < y->tag_id);
+}
+
+/**
+ * @brief Get the most common tags among a set of items
+ *
+ * Every tag's count is the cardinality of its bitmap intersected with the set.
+ * A tag is skipped without intersecting when it has fewer items in total than
+ * the smallest count kept so far, so only a few large tags are ever intersected.
+ *
+ * @param index tag bitmap index
+ * @param items set of item ids, e.g. from `tag_bitmap_index_query`
+ * @param facets array where to store the tags with their counts, most common first
+ * @param max_facets size of the `facets` array
+ * @return number of facets stored, or `-1` on error
+ */
+int tag_facets_top_k(struct tag_bitmap_index *index, const struct bitmap *items, struct tag_facet *facets, int max_facets) {
+	if (index == NULL || items == NULL || facets == NULL || max_facets < 0) return -1;
+	if (max_facets == 0 || items->count == 0) return 0;
+
+	int found = 0;
+	const struct id_map *bitmaps = &index->bitmaps;
+
+	// `facets` is used as a min-heap on the count until all tags are seen
+	for (size_t i = 0; i < bitmaps->capacity; i++) {
+		if (bitmaps->slots[i].key <= 0) continue;
+
+		const struct bitmap *tag_items = bitmaps->slots[i].value;
+		if (found == max_facets && bitmap_cardinality(tag_items) <= (uint64_t) facets[0].count) continue;
+
+		sqlite3_int64 count = (sqlite3_int64) bitmap_and_cardinality(tag_items, items);
+		if (count == 0) continue;
+
+		if (found < max_facets) {
+			facets[found].tag_id = bitmaps->slots[i].key;
+			facets[found].count = count;
+			found++;
+			if (found == max_facets) {
+				for (int j = found / 2 - 1; j >= 0; j--) facet_heap_sift_down(facets, found, j);
+			}
+		} else if (count > facets[0].count) {
+			facets[0].tag_id = bitmaps->slots[i].key;
+			facets[0].count = count;
+			facet_heap_sift_down(facets, found, 0);
+		}
+	}
+
+	qsort(facets, found, sizeof(struct tag_facet), compare_facets);
+	return found;
+}
+
+/**
+ * @brief Unsubscribe the index from tag events and free it
+ *
+ * Must be called before `close_database` of the database the index was built on.
+ *
+ * @param index tag bitmap index, may be `NULL`
+ */
+void tag_bitmap_index_free(struct tag_bitmap_index *index) {
+	if (index == NULL) return;
+
+	if (index->db != NULL) {
+		tag_events_unsubscribe(index->db, &index->listener);
+	}
+	for (size_t i = 0; i < index->bitmaps.capacity; i++) {
+		if (index->bitmaps.slots[i].key > 0) bitmap_free(index->bitmaps.slots[i].value);
+	}
+	id_map_clear(&index->bitmaps);
+	free(index);
+}
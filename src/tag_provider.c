@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+
+#include "../include/database.h"
+#include "../include/provider_utils.h"
+#include "../include/fetch_engine.h"
+#include "../include/json_stream.h"
+#include "../include/tag_provider.h"
+
+extern sqlite3_int64 get_tag_id(struct tagger_db *db, char *tag_name);
+
+#define PROVIDER_DEFAULT_IN_FLIGHT 16
+#define PROVIDER_DEFAULT_ITEMS_PER_BATCH 256
+
+// default JSON parser of a response, fed by the write callback of its transfer
+struct provider_stream {
+	struct json_tag_extractor extractor;
+	struct json_stream *stream;
+	CURL *curl;
+	int failed; // the body didn't parse, the rest of it is skipped
+};
+
+/**
+ * @brief Append a percent-encoded value to an url
+ *
+ * @param keep_slashes whether `/` stays as it is, for paths
+ * @return new length of the url, or `size` if it doesn't fit
+ */
+static size_t append_escaped(char *url, size_t length, size_t size, const char *value, int keep_slashes) {
+	static const char hex[] = "0123456789ABCDEF";
+
+	for (const unsigned char *c = (const unsigned char*) value; *c != '\0'; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+			*c == '-' || *c == '.' || *c == '_' || *c == '~' || (keep_slashes && *c == '/')) {
+			if (length + 1 >= size) return size;
+			url[length++] = *c;
+		} else {
+			if (length + 3 >= size) return size;
+			url[length++] = '%';
+			url[length++] = hex[*c >> 4];
+			url[length++] = hex[*c & 15];
+		}
+	}
+	return length;
+}
+
+/**
+ * @brief Build the url of an item from a template
+ *
+ * `{name}` is replaced by the item name and `{path}` by its relpath, both percent-encoded,
+ * the slashes of the relpath are kept.
+ *
+ * @param url_template url with placeholders
+ * @param item item the url is for
+ * @param url where to store the url
+ * @param size size of the `url` buffer
+ * @return `0` on success, otherwise `-1` on error
+ */
+int build_provider_url(const char *url_template, const struct item_row *item, char *url, size_t size) {
+	size_t length = 0;
+
+	if (url_template == NULL || item == NULL || size == 0) return -1;
+
+	for (const char *c = url_template; *c != '\0' && length < size;) {
+		if (!strncmp(c, "{name}", 6)) {
+			length = append_escaped(url, length, size, item->item_name != NULL ? item->item_name : "", 0);
+			c += 6;
+		} else if (!strncmp(c, "{path}", 6)) {
+			// relpaths start with a slash, the template has its own
+			const char *path = item->item_relpath != NULL ? item->item_relpath : "";
+			length = append_escaped(url, length, size, path[0] == '/' ? path + 1 : path, 1);
+			c += 6;
+		} else if (length + 1 < size) {
+			url[length++] = *c++;
+		} else {
+			length = size;
+		}
+	}
+
+	if (length >= size) {
+		fprintf(stderr, "Error, the url of %s is longer than %zu bytes\n", item->item_name, size - 1);
+		return -1;
+	}
+	url[length] = '\0';
+	return 0;
+}
+
+static int add_found_tag(const char *tag, size_t length, void *user_data) {
+	struct provider_tags *found = user_data;
+
+	if (length == 0) return 0;
+
+	if (found->count == found->capacity) {
+		size_t capacity = found->capacity > 0 ? found->capacity * 2 : 8;
+		char **tags = realloc(found->tags, capacity * sizeof(char*));
+		if (tags == NULL) {
+			fputs("realloc() failed\n", stderr);
+			return -1;
+		}
+		found->tags = tags;
+		found->capacity = capacity;
+	}
+
+	char *copy = malloc(length + 1);
+	if (copy == NULL) {
+		fputs("malloc() failed\n", stderr);
+		return -1;
+	}
+	memcpy(copy, tag, length);
+	copy[length] = '\0';
+	found->tags[found->count++] = copy;
+	return 0;
+}
+
+void clear_provider_tags(struct provider_tags *found) {
+	for (size_t i = 0; i < found->count; i++) free(found->tags[i]);
+	free(found->tags);
+	memset(found, 0, sizeof(struct provider_tags));
+}
+
+/**
+ * @brief Default response parser, emits the strings under the tag keys of the provider
+ */
+static int parse_json_tags(const struct tag_provider *provider, const struct response *response,
+						   provider_tag_callback callback, void *user_data) {
+	struct json_tag_extractor extractor;
+
+	if (provider->tag_keys == NULL) {
+		fprintf(stderr, "Error, provider %s has neither tag keys nor a response parser\n", provider->name);
+		return -1;
+	}
+
+	json_tag_extractor_init(&extractor, provider->tag_keys, callback, user_data);
+	struct json_stream *stream = json_stream_create(&json_tag_extractor_handler, &extractor);
+	if (stream == NULL) return -1;
+
+	int result = json_stream_feed(stream, response->ptr, response->len) || json_stream_finish(stream) ? -1 : 0;
+	json_stream_destroy(stream);
+	return result;
+}
+
+/**
+ * @brief Build the url a provider asks about an item
+ *
+ * @return `0` on success, `1` if the provider skips the item, otherwise `-1` on error
+ */
+int build_item_url(const struct tag_provider *provider, const struct item_row *item, char *url, size_t size) {
+	return provider->build_url != NULL
+		? provider->build_url(provider, item, url, size)
+		: build_provider_url(provider->url_template, item, url, size);
+}
+
+/**
+ * @brief Create the fetch engine of provider requests, with the limits of the options
+ *
+ * @param options rate limiter, retry policy and circuit breaker of the requests
+ * @param max_in_flight transfers running at the same time
+ * @return the engine, or `NULL` on error
+ */
+struct fetch_engine* create_provider_engine(const struct provider_options *options, int max_in_flight) {
+	static const struct retry_policy single_attempt = {1, 0, 0};
+
+	struct fetch_engine *engine = fetch_engine_create(max_in_flight);
+	if (engine == NULL) return NULL;
+
+	fetch_engine_set_rate_limiter(engine, options->limiter);
+	fetch_engine_set_retry_policy(engine, options->retry_policy != NULL ? options->retry_policy : &single_attempt, options->breaker);
+	return engine;
+}
+
+/**
+ * @brief Parse the tags of a finished provider request
+ *
+ * @param provider provider of the request
+ * @param url url of the request
+ * @param result curl result of the request
+ * @param status response status
+ * @param response response of the request
+ * @param found where to add the tags, left empty if the request failed
+ * @param stats statistics to update
+ */
+static void collect_provider_tags(const struct tag_provider *provider, const char *url, CURLcode result, long status,
+						   const struct response *response, struct provider_tags *found, struct provider_stats *stats) {
+	// protocols without status codes, like file, report `0`
+	if (result != CURLE_OK || status >= 400) {
+		fprintf(stderr, "Error, provider %s got no response for %s\n", provider->name, url);
+		stats->failed_requests++;
+		return;
+	}
+
+	int parsed = provider->parse_response != NULL
+		? provider->parse_response(provider, response, add_found_tag, found)
+		: parse_json_tags(provider, response, add_found_tag, found);
+	if (parsed) {
+		// tags of a response that didn't parse completely are not trusted
+		fprintf(stderr, "Error, provider %s could not parse the response of %s\n", provider->name, url);
+		clear_provider_tags(found);
+		stats->failed_requests++;
+		return;
+	}
+	stats->tags_found += found->count;
+}
+
+/**
+ * @brief curl write callback parsing a successful body as it arrives
+ */
+static size_t provider_stream_writefunc(void *ptr, size_t size, size_t nmemb, struct provider_stream *s) {
+	long status = 0;
+
+	// error bodies are skipped, the request may be retried
+	curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &status);
+	if (status < 400 && !s->failed && json_stream_feed(s->stream, ptr, size * nmemb)) s->failed = 1;
+	return size * nmemb;
+}
+
+static int start_provider_stream(CURL *curl, void *user_data) {
+	struct provider_request *request = user_data;
+	struct provider_stream *s = request->stream;
+
+	json_tag_extractor_init(&s->extractor, request->provider->tag_keys, add_found_tag, request->found);
+	if ((s->stream = json_stream_create(&json_tag_extractor_handler, &s->extractor)) == NULL) return -1;
+	s->curl = curl;
+	s->failed = 0;
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, provider_stream_writefunc);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
+	return 0;
+}
+
+static int discard_provider_stream(void *user_data) {
+	struct provider_request *request = user_data;
+
+	// the tags of a failed attempt are only kept in `found`, so it can always be retried
+	json_stream_destroy(request->stream->stream);
+	request->stream->stream = NULL;
+	clear_provider_tags(request->found);
+	return 0;
+}
+
+/**
+ * @brief Submit a provider request to a fetch engine
+ *
+ * Responses of providers parsed as JSON with their tag keys are parsed while
+ * they download, the body is never kept whole. Other responses are buffered
+ * for the parser of their provider.
+ *
+ * @param engine fetch engine
+ * @param url url of the request
+ * @param request provider, tags and statistics of the request, it must stay valid until the
+ *                request is collected with `collect_provider_request` or cleared with `clear_provider_request`
+ * @param callback called once the transfer finished, it collects the request
+ * @param user_data handed to the callback
+ * @return `0` on success, otherwise `-1` on error
+ */
+int submit_provider_request(struct fetch_engine *engine, const char *url, struct provider_request *request,
+							fetch_callback callback, void *user_data) {
+	if (request->provider->parse_response != NULL || request->provider->tag_keys == NULL) {
+		return fetch_engine_submit(engine, url, callback, user_data);
+	}
+
+	if (request->stream == NULL && (request->stream = calloc(1, sizeof(struct provider_stream))) == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return -1;
+	}
+	const struct provider_attempt hooks = {start_provider_stream, discard_provider_stream, request};
+	return fetch_engine_submit_attempt(engine, url, &hooks, callback, user_data);
+}
+
+/**
+ * @brief Free the parser of a provider request, for requests whose transfer was dropped
+ *
+ * @param request provider request, may be `NULL`
+ */
+void clear_provider_request(struct provider_request *request) {
+	if (request == NULL || request->stream == NULL) return;
+
+	json_stream_destroy(request->stream->stream);
+	free(request->stream);
+	request->stream = NULL;
+}
+
+/**
+ * @brief Add the tags of a finished provider request to its `found` tags
+ *
+ * @param request provider request
+ * @param url url of the request
+ * @param result curl result of the request
+ * @param status response status
+ * @param response response of the request, empty if it was parsed while it downloaded
+ */
+void collect_provider_request(struct provider_request *request, const char *url, CURLcode result, long status,
+							  const struct response *response) {
+	struct provider_stream *s = request->stream;
+
+	if (s == NULL) {
+		collect_provider_tags(request->provider, url, result, status, response, request->found, request->stats);
+		return;
+	}
+
+	// a transfer failing fast on an open circuit never started its parser
+	if (result != CURLE_OK || status >= 400 || s->stream == NULL) {
+		fprintf(stderr, "Error, provider %s got no response for %s\n", request->provider->name, url);
+		clear_provider_tags(request->found);
+		request->stats->failed_requests++;
+	} else if (s->failed || json_stream_finish(s->stream)) {
+		// tags of a response that didn't parse completely are not trusted
+		fprintf(stderr, "Error, provider %s could not parse the response of %s\n", request->provider->name, url);
+		clear_provider_tags(request->found);
+		request->stats->failed_requests++;
+	} else {
+		request->stats->tags_found += request->found->count;
+	}
+	clear_provider_request(request);
+}
+
+static void provider_fetch_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	collect_provider_request(user_data, url, result, status, *response);
+}
+
+/**
+ * @brief Merge the tags the providers found for every item and add them in one transaction
+ *
+ * @param found tags per item, `providers_count` entries each, in provider order
+ * @return `0` on success, otherwise `-1` on error
+ */
+int write_provider_tags(struct tagger_db *db, struct provider_tags *const *found, size_t providers_count,
+							   const struct item_row *items, size_t items_count, const struct provider_options *options,
+							   struct provider_stats *stats) {
+	struct item_tags *updates = calloc(items_count, sizeof(struct item_tags));
+	size_t updates_count = 0;
+	int result = -1;
+
+	if (updates == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return -1;
+	}
+
+	for (size_t i = 0; i < items_count; i++) {
+		const struct provider_tags *item_found = found[i];
+		size_t total = 0, merged = 0;
+
+		for (size_t p = 0; p < providers_count; p++) total += item_found[p].count;
+		if (total == 0) continue;
+
+		char **tags = malloc((total + 1) * sizeof(char*));
+		if (tags == NULL) {
+			fputs("malloc() failed\n", stderr);
+			goto cleanup;
+		}
+
+		// the names are borrowed from `found`, with `PROVIDER_MERGE_FIRST` a provider whose tags are all unknown doesn't count
+		for (size_t p = 0; p < providers_count && !(options->merge == PROVIDER_MERGE_FIRST && merged > 0); p++) {
+			for (size_t t = 0; t < item_found[p].count; t++) {
+				char *tag = item_found[p].tags[t];
+				size_t k = 0;
+
+				while (k < merged && strcmp(tags[k], tag)) k++;
+				if (k < merged) continue;
+
+				if (!options->auto_add_tags) {
+					sqlite3_int64 tag_id = get_tag_id(db, tag);
+					if (tag_id == -1) {
+						free(tags);
+						goto cleanup;
+					}
+					if (tag_id == 0) {
+						stats->unknown_tags++;
+						continue;
+					}
+				}
+				tags[merged++] = tag;
+			}
+		}
+		tags[merged] = NULL;
+
+		if (merged == 0) {
+			free(tags);
+			continue;
+		}
+		updates[updates_count].item_id = items[i].item_id;
+		updates[updates_count++].tags = tags;
+	}
+
+	stats->items_tagged += updates_count;
+	if (updates_count > 0) {
+		sqlite3_int64 added = update_tags_batch(db, updates, updates_count,
+												options->auto_add_tags ? AUTO_ADD_TAGS : DONT_AUTO_ADD_TAGS, 0, NULL);
+		if (added == -1) goto cleanup;
+		stats->item_tags_added += added;
+	}
+	result = 0;
+
+cleanup:
+	for (size_t i = 0; i < updates_count; i++) free(updates[i].tags);
+	free(updates);
+	return result;
+}
+
+/**
+ * @brief Fetch the tags of a batch of items from every provider and add them in one transaction
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int run_provider_batch(struct tagger_db *db, const struct tag_provider *providers, size_t providers_count,
+							  const struct item_row *items, size_t items_count, const struct provider_options *options,
+							  struct provider_stats *stats) {
+	size_t slots = items_count * providers_count;
+	struct provider_tags *found = calloc(slots > 0 ? slots : 1, sizeof(struct provider_tags));
+	struct provider_tags **found_items = calloc(items_count > 0 ? items_count : 1, sizeof(struct provider_tags*));
+	struct provider_request *requests = calloc(slots > 0 ? slots : 1, sizeof(struct provider_request));
+	struct fetch_engine *engine = NULL;
+	char url[PROVIDER_URL_SIZE];
+	int result = -1;
+
+	if (found == NULL || found_items == NULL || requests == NULL) {
+		fputs("calloc() failed\n", stderr);
+		goto cleanup;
+	}
+	if ((engine = create_provider_engine(options, options->max_in_flight > 0 ? options->max_in_flight : PROVIDER_DEFAULT_IN_FLIGHT)) == NULL) {
+		goto cleanup;
+	}
+
+	stats->items += items_count;
+	for (size_t i = 0; i < items_count; i++) {
+		for (size_t p = 0; p < providers_count; p++) {
+			const struct tag_provider *provider = providers + p;
+			struct provider_request *request = requests + i * providers_count + p;
+
+			int built = build_item_url(provider, items + i, url, sizeof(url));
+			if (built == 1) continue;
+			if (built) {
+				// an item whose url can't be built, like an overlong one, fails alone
+				stats->requests++;
+				stats->failed_requests++;
+				continue;
+			}
+
+			request->provider = provider;
+			request->found = found + i * providers_count + p;
+			request->stats = stats;
+			if (submit_provider_request(engine, url, request, provider_fetch_callback, request)) goto cleanup;
+			stats->requests++;
+		}
+	}
+
+	if (fetch_engine_run(engine)) goto cleanup;
+	for (size_t i = 0; i < items_count; i++) found_items[i] = found + i * providers_count;
+	result = write_provider_tags(db, found_items, providers_count, items, items_count, options, stats);
+
+cleanup:
+	fetch_engine_destroy(engine);
+	if (requests != NULL) {
+		for (size_t i = 0; i < slots; i++) clear_provider_request(requests + i);
+	}
+	if (found != NULL) {
+		for (size_t i = 0; i < slots; i++) clear_provider_tags(found + i);
+	}
+	free(found);
+	free(found_items);
+	free(requests);
+	return result;
+}
+
+/**
+ * @brief Tag items with the tags providers find for them
+ *
+ * Every provider is asked about every item concurrently, the tags they find are merged
+ * per item and added with a single bulk update, in one transaction. Failed requests
+ * are counted in the statistics and don't fail the run.
+ *
+ * @param db tagger database
+ * @param providers array of providers, in order of preference
+ * @param providers_count size of the `providers` array
+ * @param items array of items to tag
+ * @param items_count size of the `items` array
+ * @param options merge policy and limits, `NULL` for the defaults
+ * @param stats where to store the statistics of the run, may be `NULL`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int run_tag_providers(struct tagger_db *db, const struct tag_provider *providers, size_t providers_count,
+					  const struct item_row *items, size_t items_count, const struct provider_options *options,
+					  struct provider_stats *stats) {
+	static const struct provider_options default_options = {PROVIDER_MERGE_ALL, 0, 0, 0, NULL, NULL, NULL};
+	struct provider_stats ignored_stats;
+
+	if (stats == NULL) stats = &ignored_stats;
+	memset(stats, 0, sizeof(struct provider_stats));
+	if (db == NULL || (providers == NULL && providers_count > 0) || (items == NULL && items_count > 0)) return -1;
+	if (options == NULL) options = &default_options;
+
+	return run_provider_batch(db, providers, providers_count, items, items_count, options, stats);
+}
+
+/**
+ * @brief Tag every item of a listing with the tags providers find for them
+ *
+ * The items are read in batches of `items_per_batch`, each batch is fetched and
+ * then added in its own transaction, so a failure keeps the earlier batches.
+ *
+ * @param db tagger database
+ * @param listing_id id of the listing
+ * @param providers array of providers, in order of preference
+ * @param providers_count size of the `providers` array
+ * @param options merge policy and limits, `NULL` for the defaults
+ * @param stats where to store the statistics of the run, may be `NULL`
+ * @return `0` on success, otherwise `-1` on error
+ */
+int run_tag_providers_on_listing(struct tagger_db *db, sqlite3_int64 listing_id, const struct tag_provider *providers,
+								 size_t providers_count, const struct provider_options *options, struct provider_stats *stats) {
+	static const struct provider_options default_options = {PROVIDER_MERGE_ALL, 0, 0, 0, NULL, NULL, NULL};
+	struct provider_stats ignored_stats;
+	struct item_row row, *items;
+	sqlite3_int64 after_item_id = 0;
+	int result = 0;
+
+	if (stats == NULL) stats = &ignored_stats;
+	memset(stats, 0, sizeof(struct provider_stats));
+	if (db == NULL || (providers == NULL && providers_count > 0)) return -1;
+	if (options == NULL) options = &default_options;
+
+	size_t batch = options->items_per_batch > 0 ? options->items_per_batch : PROVIDER_DEFAULT_ITEMS_PER_BATCH;
+	if ((items = calloc(batch, sizeof(struct item_row))) == NULL) {
+		fputs("calloc() failed\n", stderr);
+		return -1;
+	}
+
+	for (;;) {
+		size_t items_count = 0;
+		int rc;
+
+		// the names are copied, the cursor is closed before the batch writes
+		struct tagger_cursor *cursor = open_listing_items_cursor(db, listing_id, after_item_id, (int) batch);
+		if (cursor == NULL) {
+			result = -1;
+			break;
+		}
+		while ((rc = cursor_next_item(cursor, &row)) == 1) {
+			struct item_row *item = items + items_count++;
+			*item = row;
+			item->item_name = strdup(row.item_name);
+			item->item_relpath = strdup(row.item_relpath);
+			if (item->item_name == NULL || item->item_relpath == NULL) {
+				fputs("strdup() failed\n", stderr);
+				rc = -1;
+				break;
+			}
+			after_item_id = row.item_id;
+		}
+		close_cursor(cursor);
+
+		if (rc != -1 && items_count > 0) rc = run_provider_batch(db, providers, providers_count, items, items_count, options, stats);
+		for (size_t i = 0; i < items_count; i++) {
+			free((char*) items[i].item_name);
+			free((char*) items[i].item_relpath);
+		}
+
+		if (rc == -1) {
+			result = -1;
+			break;
+		}
+		if (items_count < batch) break;
+	}
+
+	free(items);
+	return result;
+}
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/database.h"
+#include "../include/tag_trie.h"
+#include "../include/tag_events.h"
+#include "../include/id_map.h"
+
+/**
+ * Node of a compressed (radix) trie, every edge holds a run of bytes
+ * and every node knows the highest usage count found in its subtree,
+ * which lets a completion query visit the best branches first.
+ */
+struct trie_node {
+	char *label; // bytes on the edge from the parent, not NUL-terminated
+	size_t label_len;
+	struct trie_node *parent;
+	struct trie_node **children; // sorted by the first byte of their labels
+	size_t children_count;
+	size_t children_capacity;
+	char *tag_name; // full tag name if a tag ends at this node, otherwise `NULL`
+	sqlite3_int64 tag_id;
+	sqlite3_int64 usage_count;
+	sqlite3_int64 best; // highest usage count in the subtree, `-1` if there are no tags in it
+};
+
+struct tag_trie {
+	struct tagger_db *db;
+	struct trie_node *root;
+	struct id_map nodes; // tag_id -> node
+	size_t size;
+	struct tag_events_listener listener;
+};
+
+struct trie_heap_entry {
+	sqlite3_int64 key;
+	struct trie_node *node;
+	int is_result;
+};
+
+struct trie_heap {
+	struct trie_heap_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+static struct trie_node* trie_node_new(const char *label, size_t label_len) {
+	struct trie_node *node = calloc(1, sizeof(struct trie_node));
+	if (node == NULL) return NULL;
+
+	if (label_len > 0) {
+		node->label = malloc(label_len);
+		if (node->label == NULL) {
+			free(node);
+			return NULL;
+		}
+		memcpy(node->label, label, label_len);
+	}
+	node->label_len = label_len;
+	node->best = -1;
+
+	return node;
+}
+
+static void trie_node_free(struct trie_node *node) {
+	for (size_t i = 0; i < node->children_count; i++) {
+		trie_node_free(node->children[i]);
+	}
+	free(node->children);
+	free(node->tag_name);
+	free(node->label);
+	free(node);
+}
+
+/**
+ * @brief Binary search for a child by the first byte of its label
+ *
+ * @return index of the child, or `-(insert_position + 1)` if there is no such child
+ */
+static long trie_find_child(struct trie_node *node, unsigned char c) {
+	size_t low = 0, high = node->children_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		unsigned char mid_c = (unsigned char) node->children[mid]->label[0];
+		if (mid_c == c) return (long) mid;
+		if (mid_c < c) low = mid + 1;
+		else high = mid;
+	}
+	return -((long) low + 1);
+}
+
+static int trie_insert_child(struct trie_node *node, size_t position, struct trie_node *child) {
+	if (node->children_count == node->children_capacity) {
+		size_t new_capacity = node->children_capacity ? node->children_capacity * 2 : 2;
+		struct trie_node **new_children = realloc(node->children, new_capacity * sizeof(struct trie_node*));
+		if (new_children == NULL) return -1;
+		node->children = new_children;
+		node->children_capacity = new_capacity;
+	}
+	memmove(node->children + position + 1, node->children + position, (node->children_count - position) * sizeof(struct trie_node*));
+	node->children[position] = child;
+	node->children_count++;
+	child->parent = node;
+	return 0;
+}
+
+static void trie_remove_child(struct trie_node *node, size_t position) {
+	memmove(node->children + position, node->children + position + 1, (node->children_count - position - 1) * sizeof(struct trie_node*));
+	node->children_count--;
+}
+
+/**
+ * @brief Recompute `best` from a node up to the root, stops as soon as nothing changes
+ */
+static void trie_update_best(struct trie_node *node) {
+	while (node != NULL) {
+		sqlite3_int64 best = node->tag_name != NULL ? node->usage_count : -1;
+		for (size_t i = 0; i < node->children_count; i++) {
+			if (node->children[i]->best > best) best = node->children[i]->best;
+		}
+		if (best == node->best) return;
+		node->best = best;
+		node = node->parent;
+	}
+}
+
+/**
+ * @brief Insert a tag into the trie
+ *
+ * @param trie tag trie
+ * @param tag_id id of the tag
+ * @param tag_name name of the tag
+ * @param usage_count number of items tagged with the tag
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int trie_insert(struct tag_trie *trie, sqlite3_int64 tag_id, const char *tag_name, sqlite3_int64 usage_count) {
+	struct trie_node *node = trie->root, *child, *middle;
+	const char *p = tag_name;
+	size_t rest, common;
+	long position;
+
+	while (*p != '\0') {
+		position = trie_find_child(node, (unsigned char) *p);
+		rest = strlen(p);
+
+		if (position < 0) {
+			// no edge starts with this byte, the rest of the name becomes a new leaf
+			child = trie_node_new(p, rest);
+			if (child == NULL || trie_insert_child(node, (size_t) (-position - 1), child)) {
+				if (child != NULL) trie_node_free(child);
+				return -1;
+			}
+			node = child;
+			break;
+		}
+
+		child = node->children[position];
+		common = 0;
+		while (common < child->label_len && common < rest && child->label[common] == p[common]) {
+			common++;
+		}
+
+		if (common < child->label_len) {
+			// the name diverges in the middle of an edge, split it, the trie only changes once nothing can fail
+			middle = trie_node_new(child->label, common);
+			if (middle == NULL) return -1;
+			if (trie_insert_child(middle, 0, child)) {
+				trie_node_free(middle);
+				return -1;
+			}
+			memmove(child->label, child->label + common, child->label_len - common);
+			child->label_len -= common;
+			node->children[position] = middle;
+			middle->parent = node;
+			middle->best = child->best;
+			child = middle;
+		}
+
+		node = child;
+		p += common;
+	}
+
+	if (node->tag_name == NULL) {
+		node->tag_name = malloc(strlen(tag_name) + 1);
+		if (node->tag_name == NULL) return -1;
+		strcpy(node->tag_name, tag_name);
+		trie->size++;
+	} else {
+		// same name under a different id, forget the old one
+		id_map_remove(&trie->nodes, node->tag_id);
+	}
+	node->tag_id = tag_id;
+	node->usage_count = usage_count;
+
+	if (id_map_put(&trie->nodes, tag_id, node)) return -1;
+	trie_update_best(node);
+
+	return 0;
+}
+
+/**
+ * @brief Remove a tag from the trie, merging nodes that are no longer needed
+ */
+static void trie_remove(struct tag_trie *trie, sqlite3_int64 tag_id) {
+	struct trie_node *node = id_map_get(&trie->nodes, tag_id), *parent, *child;
+	if (node == NULL) return;
+
+	id_map_remove(&trie->nodes, tag_id);
+	free(node->tag_name);
+	node->tag_name = NULL;
+	trie->size--;
+
+	// drop empty leaves
+	while (node != trie->root && node->tag_name == NULL && node->children_count == 0) {
+		parent = node->parent;
+		trie_remove_child(parent, (size_t) trie_find_child(parent, (unsigned char) node->label[0]));
+		trie_node_free(node);
+		node = parent;
+	}
+
+	// merge a pass-through node into its only child
+	if (node != trie->root && node->tag_name == NULL && node->children_count == 1) {
+		child = node->children[0];
+		char *label = malloc(node->label_len + child->label_len);
+		if (label != NULL) {
+			parent = node->parent;
+			memcpy(label, node->label, node->label_len);
+			memcpy(label + node->label_len, child->label, child->label_len);
+			free(child->label);
+			child->label = label;
+			child->label_len += node->label_len;
+			parent->children[trie_find_child(parent, (unsigned char) node->label[0])] = child;
+			child->parent = parent;
+			node->children_count = 0;
+			trie_node_free(node);
+			node = parent;
+		}
+	}
+
+	trie_update_best(node);
+}
+
+static void trie_add_usage(struct tag_trie *trie, sqlite3_int64 tag_id, sqlite3_int64 delta) {
+	struct trie_node *node = id_map_get(&trie->nodes, tag_id);
+	if (node == NULL) return;
+
+	node->usage_count += delta;
+	trie_update_best(node);
+}
+
+static void trie_on_tag_added(void *ctx, sqlite3_int64 tag_id, const char *tag_name) {
+	if (trie_insert((struct tag_trie*) ctx, tag_id, tag_name, 0)) {
+		fprintf(stderr, "Could not add tag %s to the tag trie\n", tag_name);
+	}
+}
+
+static void trie_on_tag_removed(void *ctx, sqlite3_int64 tag_id, const char *tag_name) {
+	(void) tag_name;
+	trie_remove((struct tag_trie*) ctx, tag_id);
+}
+
+static void trie_on_item_tag_added(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+	(void) item_id;
+	trie_add_usage((struct tag_trie*) ctx, tag_id, 1);
+}
+
+static void trie_on_item_tag_removed(void *ctx, sqlite3_int64 item_id, sqlite3_int64 tag_id) {
+	(void) item_id;
+	trie_add_usage((struct tag_trie*) ctx, tag_id, -1);
+}
+
+/**
+ * @brief Build a trie of all tags in the database
+ *
+ * The trie subscribes to tag events, so it follows every committed
+ * `add_new_tag`, `update_tags` and `add_tag_to_item` on this connection.
+ *
+ * @param db tagger database, tables must be initialized
+ * @return a pointer to the new trie, or `NULL` on error, free it with `tag_trie_free`
+ */
+struct tag_trie* tag_trie_build(struct tagger_db *db) {
+	sqlite3_stmt *stmt;
+	struct tag_trie *trie = calloc(1, sizeof(struct tag_trie));
+	if (trie == NULL) {
+		fputs("Could not allocate memory for tag trie\n", stderr);
+		return NULL;
+	}
+
+	trie->db = db;
+	trie->root = trie_node_new(NULL, 0);
+	if (trie->root == NULL) {
+		fputs("Could not allocate memory for tag trie\n", stderr);
+		free(trie);
+		return NULL;
+	}
+
+	int rc = sqlite3_prepare_v2(db->connection,
+		"SELECT t.tag_id, t.tag_name, IFNULL(u.usage_count, 0) FROM tags t "
+		"LEFT JOIN (SELECT tag_id, count() AS usage_count FROM itemtags GROUP BY tag_id) u ON u.tag_id = t.tag_id;",
+		-1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		tag_trie_free(trie);
+		return NULL;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (trie_insert(trie, sqlite3_column_int64(stmt, 0), (const char*) sqlite3_column_text(stmt, 1),
+						sqlite3_column_int64(stmt, 2))) {
+			fputs("Could not allocate memory for tag trie\n", stderr);
+			sqlite3_finalize(stmt);
+			tag_trie_free(trie);
+			return NULL;
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		tag_trie_free(trie);
+		return NULL;
+	}
+	sqlite3_finalize(stmt);
+
+	trie->listener.ctx = trie;
+	trie->listener.tag_added = trie_on_tag_added;
+	trie->listener.tag_removed = trie_on_tag_removed;
+	trie->listener.item_tag_added = trie_on_item_tag_added;
+	trie->listener.item_tag_removed = trie_on_item_tag_removed;
+	if (tag_events_subscribe(db, &trie->listener)) {
+		fputs("Could not subscribe tag trie to tag events\n", stderr);
+		trie->db = NULL;
+		tag_trie_free(trie);
+		return NULL;
+	}
+
+	return trie;
+}
+
+static int trie_heap_push(struct trie_heap *heap, sqlite3_int64 key, struct trie_node *node, int is_result) {
+	if (heap->count == heap->capacity) {
+		size_t new_capacity = heap->capacity ? heap->capacity * 2 : 64;
+		struct trie_heap_entry *new_entries = realloc(heap->entries, new_capacity * sizeof(struct trie_heap_entry));
+		if (new_entries == NULL) return -1;
+		heap->entries = new_entries;
+		heap->capacity = new_capacity;
+	}
+
+	size_t i = heap->count++;
+	while (i > 0 && heap->entries[(i - 1) / 2].key < key) {
+		heap->entries[i] = heap->entries[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->entries[i].key = key;
+	heap->entries[i].node = node;
+	heap->entries[i].is_result = is_result;
+	return 0;
+}
+
+static struct trie_heap_entry trie_heap_pop(struct trie_heap *heap) {
+	struct trie_heap_entry top = heap->entries[0];
+	struct trie_heap_entry last = heap->entries[--heap->count];
+	size_t i = 0, child;
+
+	while ((child = 2 * i + 1) < heap->count) {
+		if (child + 1 < heap->count && heap->entries[child + 1].key > heap->entries[child].key) child++;
+		if (heap->entries[child].key <= last.key) break;
+		heap->entries[i] = heap->entries[child];
+		i = child;
+	}
+	if (heap->count > 0) heap->entries[i] = last;
+
+	return top;
+}
+
+/**
+ * @brief Get the most used tags starting with a prefix
+ *
+ * Completions are ordered by usage count, highest first.
+ *
+ * @param trie tag trie
+ * @param prefix prefix to complete, an empty string matches every tag
+ * @param completions array where to store the completions
+ * @param max_completions size of the `completions` array
+ * @return number of completions stored, or `-1` on error
+ */
+int tag_trie_complete(struct tag_trie *trie, const char *prefix, struct tag_completion *completions, int max_completions) {
+	if (trie == NULL || prefix == NULL || completions == NULL || max_completions < 0) return -1;
+
+	struct trie_node *node = trie->root, *child;
+	const char *p = prefix;
+	size_t rest;
+	long position;
+
+	// walk down to the node whose subtree holds all names with this prefix
+	while (*p != '\0') {
+		position = trie_find_child(node, (unsigned char) *p);
+		if (position < 0) return 0;
+
+		child = node->children[position];
+		rest = strlen(p);
+		if (memcmp(child->label, p, rest < child->label_len ? rest : child->label_len) != 0) return 0;
+
+		node = child;
+		if (rest <= child->label_len) break;
+		p += child->label_len;
+	}
+
+	if (node->best < 0 || max_completions == 0) return 0;
+
+	struct trie_heap heap = {NULL, 0, 0};
+	struct trie_heap_entry top;
+	int found = 0;
+
+	if (trie_heap_push(&heap, node->best, node, 0)) {
+		fputs("Could not allocate memory for tag completion\n", stderr);
+		return -1;
+	}
+
+	// best-first search, a subtree is only expanded when it can still beat what is already found
+	while (heap.count > 0 && found < max_completions) {
+		top = trie_heap_pop(&heap);
+
+		if (top.is_result) {
+			completions[found].tag_id = top.node->tag_id;
+			completions[found].usage_count = top.node->usage_count;
+			completions[found].tag_name = top.node->tag_name;
+			found++;
+			continue;
+		}
+
+		if (top.node->tag_name != NULL && trie_heap_push(&heap, top.node->usage_count, top.node, 1)) {
+			free(heap.entries);
+			fputs("Could not allocate memory for tag completion\n", stderr);
+			return -1;
+		}
+		for (size_t i = 0; i < top.node->children_count; i++) {
+			child = top.node->children[i];
+			if (child->best >= 0 && trie_heap_push(&heap, child->best, child, 0)) {
+				free(heap.entries);
+				fputs("Could not allocate memory for tag completion\n", stderr);
+				return -1;
+			}
+		}
+	}
+
+	free(heap.entries);
+	return found;
+}
+
+/**
+ * @brief Get the number of tags in the trie
+ */
+size_t tag_trie_size(struct tag_trie *trie) {
+	return trie != NULL ? trie->size : 0;
+}
+
+/**
+ * @brief Unsubscribe the trie from tag events and free it
+ *
+ * Must be called before `close_database` of the database the trie was built on.
+ *
+ * @param trie tag trie, may be `NULL`
+ */
+void tag_trie_free(struct tag_trie *trie) {
+	if (trie == NULL) return;
+
+	if (trie->db != NULL && trie->listener.ctx != NULL) {
+		tag_events_unsubscribe(trie->db, &trie->listener);
+	}
+	if (trie->root != NULL) {
+		trie_node_free(trie->root);
+	}
+	id_map_clear(&trie->nodes);
+	free(trie);
+}
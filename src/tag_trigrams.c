@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../include/database.h"
+#include "../include/tag_trigrams.h"
+#include "../include/tag_events.h"
+#include "../include/id_map.h"
+
+#define TRIGRAM_KEY_FLAG (1u << 24) // keeps a valid key from ever being 0, the empty slot marker
+#define TRIGRAMS_COMPACT_MIN_DEAD 1024
+#define UNKNOWN_TAG_MAX_DISTANCE 2
+#define UNKNOWN_TAG_MAX_SUGGESTIONS 5
+
+struct trigram_tag {
+	sqlite3_int64 tag_id;
+	char *tag_name; // `NULL` once the tag is removed
+	size_t len;
+};
+
+/**
+ * Posting list of a trigram, slots are appended in increasing order so the list stays sorted
+ */
+struct trigram_postings {
+	uint32_t key;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t *slots;
+};
+
+struct tag_trigrams {
+	struct tagger_db *db;
+	struct trigram_tag *tags; // indexed by slot
+	size_t tags_count;
+	size_t tags_capacity;
+	size_t dead_count;
+	struct trigram_postings *postings; // open addressing by trigram key
+	size_t postings_capacity;
+	size_t postings_count;
+	struct id_map slots; // tag_id -> slot + 1
+	uint16_t *counts; // per slot scratch counters used while searching
+	size_t counts_capacity;
+	int *distance_rows; // scratch rows for the edit distance
+	size_t distance_rows_capacity;
+	struct tag_events_listener listener;
+	tag_suggestions_callback on_unknown_tag; // `NULL` to print the suggestions
+	void *on_unknown_tag_ctx;
+};
+
+static unsigned char fold_char(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static int compare_uint32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Get the distinct trigrams of a name padded with two leading and one trailing space
+ *
+ * @param name the name
+ * @param len length of the name in bytes
+ * @param keys array of at least `len + 1` elements where to store the trigrams
+ * @return number of distinct trigrams stored
+ */
+static size_t name_trigrams(const char *name, size_t len, uint32_t *keys) {
+	unsigned char window[3] = {' ', ' ', ' '};
+	size_t count = 0;
+
+	for (size_t i = 0; i <= len; i++) {
+		window[0] = window[1];
+		window[1] = window[2];
+		window[2] = i < len ? fold_char((unsigned char) name[i]) : ' ';
+		keys[count++] = TRIGRAM_KEY_FLAG | ((uint32_t) window[0] << 16) | ((uint32_t) window[1] << 8) | window[2];
+	}
+
+	qsort(keys, count, sizeof(uint32_t), compare_uint32);
+	size_t distinct = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (distinct == 0 || keys[distinct - 1] != keys[i]) keys[distinct++] = keys[i];
+	}
+	return distinct;
+}
+
+static size_t postings_index(uint32_t key, size_t capacity) {
+	return (size_t) ((key * 0x9E3779B1u) >> 7) & (capacity - 1);
+}
+
+static struct trigram_postings* find_postings(struct tag_trigrams *index, uint32_t key) {
+	if (index->postings_capacity == 0) return NULL;
+
+	size_t i = postings_index(key, index->postings_capacity);
+	while (index->postings[i].key != 0) {
+		if (index->postings[i].key == key) return &index->postings[i];
+		i = (i + 1) & (index->postings_capacity - 1);
+	}
+	return NULL;
+}
+
+static struct trigram_postings* get_or_add_postings(struct tag_trigrams *index, uint32_t key) {
+	struct trigram_postings *postings = find_postings(index, key);
+	if (postings != NULL) return postings;
+
+	if ((index->postings_count + 1) * 4 >= index->postings_capacity * 3) {
+		size_t new_capacity = index->postings_capacity ? index->postings_capacity * 2 : 4096;
+		struct trigram_postings *new_postings = calloc(new_capacity, sizeof(struct trigram_postings));
+		if (new_postings == NULL) return NULL;
+
+		for (size_t i = 0; i < index->postings_capacity; i++) {
+			if (index->postings[i].key != 0) {
+				size_t j = postings_index(index->postings[i].key, new_capacity);
+				while (new_postings[j].key != 0) j = (j + 1) & (new_capacity - 1);
+				new_postings[j] = index->postings[i];
+			}
+		}
+		free(index->postings);
+		index->postings = new_postings;
+		index->postings_capacity = new_capacity;
+	}
+
+	size_t i = postings_index(key, index->postings_capacity);
+	while (index->postings[i].key != 0) i = (i + 1) & (index->postings_capacity - 1);
+	index->postings[i].key = key;
+	index->postings_count++;
+	return &index->postings[i];
+}
+
+static int postings_append(struct trigram_postings *postings, uint32_t slot) {
+	if (postings->count == postings->capacity) {
+		uint32_t new_capacity = postings->capacity ? postings->capacity * 2 : 4;
+		uint32_t *new_slots = realloc(postings->slots, new_capacity * sizeof(uint32_t));
+		if (new_slots == NULL) return -1;
+		postings->slots = new_slots;
+		postings->capacity = new_capacity;
+	}
+	postings->slots[postings->count++] = slot;
+	return 0;
+}
+
+static int postings_contain(const struct trigram_postings *postings, uint32_t slot) {
+	size_t low = 0, high = postings->count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (postings->slots[mid] == slot) return 1;
+		if (postings->slots[mid] < slot) low = mid + 1;
+		else high = mid;
+	}
+	return 0;
+}
+
+/**
+ * @brief Add the trigrams of an already stored tag to the posting lists
+ */
+static int index_slot(struct tag_trigrams *index, uint32_t slot) {
+	struct trigram_tag *tag = &index->tags[slot];
+	uint32_t *keys = malloc((tag->len + 1) * sizeof(uint32_t));
+	if (keys == NULL) return -1;
+
+	size_t count = name_trigrams(tag->tag_name, tag->len, keys);
+	for (size_t i = 0; i < count; i++) {
+		struct trigram_postings *postings = get_or_add_postings(index, keys[i]);
+		if (postings == NULL || postings_append(postings, slot)) {
+			free(keys);
+			return -1;
+		}
+	}
+
+	free(keys);
+	return 0;
+}
+
+static int trigrams_insert(struct tag_trigrams *index, sqlite3_int64 tag_id, const char *tag_name) {
+	if (index->tags_count == index->tags_capacity) {
+		size_t new_capacity = index->tags_capacity ? index->tags_capacity * 2 : 1024;
+		struct trigram_tag *new_tags = realloc(index->tags, new_capacity * sizeof(struct trigram_tag));
+		if (new_tags == NULL) return -1;
+		index->tags = new_tags;
+		index->tags_capacity = new_capacity;
+	}
+
+	uint32_t slot = (uint32_t) index->tags_count;
+	struct trigram_tag *tag = &index->tags[slot];
+	tag->tag_id = tag_id;
+	tag->len = strlen(tag_name);
+	tag->tag_name = malloc(tag->len + 1);
+	if (tag->tag_name == NULL) return -1;
+	memcpy(tag->tag_name, tag_name, tag->len + 1);
+	index->tags_count++;
+
+	if (index_slot(index, slot) || id_map_put(&index->slots, tag_id, (void*) (uintptr_t) (slot + 1))) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Drop removed tags and renumber the slots of the remaining ones
+ */
+static int trigrams_compact(struct tag_trigrams *index) {
+	size_t live = 0;
+
+	for (size_t i = 0; i < index->postings_capacity; i++) {
+		free(index->postings[i].slots);
+	}
+	free(index->postings);
+	index->postings = NULL;
+	index->postings_capacity = 0;
+	index->postings_count = 0;
+	id_map_clear(&index->slots);
+
+	for (size_t i = 0; i < index->tags_count; i++) {
+		if (index->tags[i].tag_name != NULL) index->tags[live++] = index->tags[i];
+	}
+	index->tags_count = live;
+	index->dead_count = 0;
+
+	for (uint32_t slot = 0; slot < live; slot++) {
+		if (index_slot(index, slot) || id_map_put(&index->slots, index->tags[slot].tag_id, (void*) (uintptr_t) (slot + 1))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void trigrams_remove(struct tag_trigrams *index, sqlite3_int64 tag_id) {
+	uintptr_t slot = (uintptr_t) id_map_get(&index->slots, tag_id);
+	if (slot == 0) return;
+
+	id_map_remove(&index->slots, tag_id);
+	free(index->tags[slot - 1].tag_name);
+	index->tags[slot - 1].tag_name = NULL;
+	index->dead_count++;
+
+	// removed tags stay in the posting lists until there are enough of them to be worth a rebuild
+	if (index->dead_count >= TRIGRAMS_COMPACT_MIN_DEAD && index->dead_count * 2 > index->tags_count) {
+		if (trigrams_compact(index)) {
+			fputs("Could not compact the tag trigram index\n", stderr);
+		}
+	}
+}
+
+/**
+ * @brief Levenshtein distance ignoring ASCII case, gives up once it exceeds `max_distance`
+ *
+ * @return the distance, or `max_distance + 1` if it is larger than `max_distance` (or on error)
+ */
+static int bounded_edit_distance(struct tag_trigrams *index, const char *a, size_t a_len,
+								 const char *b, size_t b_len, int max_distance) {
+	if ((a_len > b_len ? a_len - b_len : b_len - a_len) > (size_t) max_distance) return max_distance + 1;
+
+	if (index->distance_rows_capacity < 2 * (b_len + 1)) {
+		int *new_rows = realloc(index->distance_rows, 2 * (b_len + 1) * sizeof(int));
+		if (new_rows == NULL) return max_distance + 1;
+		index->distance_rows = new_rows;
+		index->distance_rows_capacity = 2 * (b_len + 1);
+	}
+
+	int *previous = index->distance_rows, *current = index->distance_rows + b_len + 1, *swap;
+	for (size_t j = 0; j <= b_len; j++) previous[j] = (int) j;
+
+	for (size_t i = 1; i <= a_len; i++) {
+		int row_min;
+		current[0] = row_min = (int) i;
+		for (size_t j = 1; j <= b_len; j++) {
+			int cost = fold_char((unsigned char) a[i - 1]) == fold_char((unsigned char) b[j - 1]) ? 0 : 1;
+			int value = previous[j - 1] + cost;
+			if (previous[j] + 1 < value) value = previous[j] + 1;
+			if (current[j - 1] + 1 < value) value = current[j - 1] + 1;
+			current[j] = value;
+			if (value < row_min) row_min = value;
+		}
+		if (row_min > max_distance) return max_distance + 1;
+		swap = previous;
+		previous = current;
+		current = swap;
+	}
+
+	return previous[b_len] > max_distance ? max_distance + 1 : previous[b_len];
+}
+
+static int compare_postings_length(const void *a, const void *b) {
+	const struct trigram_postings *x = *(struct trigram_postings * const *) a, *y = *(struct trigram_postings * const *) b;
+	uint32_t x_count = x ? x->count : 0, y_count = y ? y->count : 0;
+	return (x_count > y_count) - (x_count < y_count);
+}
+
+/**
+ * @brief Insert a suggestion keeping the array sorted by distance and name
+ */
+static void add_suggestion(struct tag_suggestion *suggestions, int *found, int max_suggestions,
+						   const struct trigram_tag *tag, int distance) {
+	int i = *found;
+	if (i == max_suggestions) {
+		struct tag_suggestion *last = &suggestions[i - 1];
+		if (last->distance < distance || (last->distance == distance && strcmp(last->tag_name, tag->tag_name) <= 0)) return;
+		i--;
+	} else {
+		(*found)++;
+	}
+
+	while (i > 0 && (suggestions[i - 1].distance > distance ||
+					 (suggestions[i - 1].distance == distance && strcmp(suggestions[i - 1].tag_name, tag->tag_name) > 0))) {
+		suggestions[i] = suggestions[i - 1];
+		i--;
+	}
+	suggestions[i].tag_id = tag->tag_id;
+	suggestions[i].distance = distance;
+	suggestions[i].tag_name = tag->tag_name;
+}
+
+/**
+ * @brief Find the existing tags closest to a (possibly misspelled) name
+ *
+ * A name within `max_distance` edits shares at least `trigrams - 3 * max_distance`
+ * trigrams with the query, so candidates are only collected from the shortest posting
+ * lists that can still reach that threshold and then re-ranked by edit distance.
+ *
+ * @param index tag trigram index
+ * @param query the name to search for
+ * @param max_distance maximum edit distance of a suggestion
+ * @param suggestions array where to store the suggestions, closest first
+ * @param max_suggestions size of the `suggestions` array
+ * @return number of suggestions stored, or `-1` on error
+ */
+int tag_trigrams_suggest(struct tag_trigrams *index, const char *query, int max_distance,
+						 struct tag_suggestion *suggestions, int max_suggestions) {
+	if (index == NULL || query == NULL || suggestions == NULL || max_distance < 0 || max_suggestions < 0) return -1;
+
+	size_t query_len = strlen(query);
+	if (query_len == 0 || max_suggestions == 0 || index->tags_count == 0) return 0;
+
+	uint32_t *keys = malloc((query_len + 1) * sizeof(uint32_t));
+	struct trigram_postings **lists = malloc((query_len + 1) * sizeof(struct trigram_postings*));
+	uint32_t *touched = NULL;
+	size_t touched_count = 0, touched_capacity = 0;
+	int found = 0;
+
+	if (keys == NULL || lists == NULL) {
+		fputs("Could not allocate memory for tag suggestions\n", stderr);
+		free(keys);
+		free(lists);
+		return -1;
+	}
+
+	if (index->counts_capacity < index->tags_count) {
+		uint16_t *new_counts = realloc(index->counts, index->tags_capacity * sizeof(uint16_t));
+		if (new_counts == NULL) {
+			fputs("Could not allocate memory for tag suggestions\n", stderr);
+			free(keys);
+			free(lists);
+			return -1;
+		}
+		memset(new_counts + index->counts_capacity, 0, (index->tags_capacity - index->counts_capacity) * sizeof(uint16_t));
+		index->counts = new_counts;
+		index->counts_capacity = index->tags_capacity;
+	}
+
+	size_t trigrams = name_trigrams(query, query_len, keys);
+	long min_shared = (long) trigrams - 3L * max_distance;
+	if (min_shared < 1) min_shared = 1;
+
+	for (size_t i = 0; i < trigrams; i++) {
+		lists[i] = find_postings(index, keys[i]);
+	}
+	qsort(lists, trigrams, sizeof(struct trigram_postings*), compare_postings_length);
+
+	// a candidate has to appear in at least one of the shortest `trigrams - min_shared + 1` lists
+	size_t probe_lists = trigrams - (size_t) min_shared + 1;
+	for (size_t i = 0; i < probe_lists; i++) {
+		if (lists[i] == NULL) continue;
+		for (uint32_t j = 0; j < lists[i]->count; j++) {
+			uint32_t slot = lists[i]->slots[j];
+			if (index->counts[slot]++ == 0) {
+				if (touched_count == touched_capacity) {
+					size_t new_capacity = touched_capacity ? touched_capacity * 2 : 256;
+					uint32_t *new_touched = realloc(touched, new_capacity * sizeof(uint32_t));
+					if (new_touched == NULL) {
+						fputs("Could not allocate memory for tag suggestions\n", stderr);
+						for (size_t k = 0; k < touched_count; k++) index->counts[touched[k]] = 0;
+						index->counts[slot] = 0;
+						free(touched);
+						free(keys);
+						free(lists);
+						return -1;
+					}
+					touched = new_touched;
+					touched_capacity = new_capacity;
+				}
+				touched[touched_count++] = slot;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < touched_count; i++) {
+		uint32_t slot = touched[i];
+		long shared = index->counts[slot];
+		index->counts[slot] = 0;
+
+		const struct trigram_tag *tag = &index->tags[slot];
+		if (tag->tag_name == NULL) continue;
+
+		// the remaining (long) lists are only probed until the threshold is reached
+		for (size_t j = probe_lists; j < trigrams && shared < min_shared; j++) {
+			if (shared + (long) (trigrams - j) < min_shared) break;
+			if (lists[j] != NULL && postings_contain(lists[j], slot)) shared++;
+		}
+		if (shared < min_shared) continue;
+
+		int distance = bounded_edit_distance(index, query, query_len, tag->tag_name, tag->len, max_distance);
+		if (distance <= max_distance) {
+			add_suggestion(suggestions, &found, max_suggestions, tag, distance);
+		}
+	}
+
+	free(touched);
+	free(keys);
+	free(lists);
+	return found;
+}
+
+static void trigrams_on_tag_added(void *ctx, sqlite3_int64 tag_id, const char *tag_name) {
+	if (trigrams_insert((struct tag_trigrams*) ctx, tag_id, tag_name)) {
+		fprintf(stderr, "Could not add tag %s to the tag trigram index\n", tag_name);
+	}
+}
+
+static void trigrams_on_tag_removed(void *ctx, sqlite3_int64 tag_id, const char *tag_name) {
+	(void) tag_name;
+	trigrams_remove((struct tag_trigrams*) ctx, tag_id);
+}
+
+/**
+ * @brief Suggest the closest existing tags when `update_tags` cannot resolve a tag name
+ */
+static void trigrams_on_unknown_tag(void *ctx, const char *tag_name) {
+	struct tag_trigrams *index = ctx;
+	struct tag_suggestion suggestions[UNKNOWN_TAG_MAX_SUGGESTIONS];
+	int found = tag_trigrams_suggest(index, tag_name, UNKNOWN_TAG_MAX_DISTANCE, suggestions, UNKNOWN_TAG_MAX_SUGGESTIONS);
+	if (found < 0) return;
+
+	if (index->on_unknown_tag != NULL) {
+		index->on_unknown_tag(index->on_unknown_tag_ctx, tag_name, suggestions, found);
+		return;
+	}
+	if (found == 0) return;
+
+	fputs("Did you mean:", stderr);
+	for (int i = 0; i < found; i++) {
+		fprintf(stderr, "%s %s", i ? "," : "", suggestions[i].tag_name);
+	}
+	fputs("?\n", stderr);
+}
+
+/**
+ * @brief Get the suggestions for unknown tag names through a callback instead of stderr
+ *
+ * The callback runs inside `update_tags` and must not use the database connection.
+ *
+ * @param index tag trigram index
+ * @param callback called with the unknown name and its suggestions, closest first,
+ *                 also when there are none, `NULL` to print them again
+ * @param ctx passed to the callback
+ */
+void tag_trigrams_on_unknown_tag(struct tag_trigrams *index, tag_suggestions_callback callback, void *ctx) {
+	index->on_unknown_tag = callback;
+	index->on_unknown_tag_ctx = ctx;
+}
+
+/**
+ * @brief Build a trigram index of all tag names in the database
+ *
+ * The index subscribes to tag events, so it follows every committed change of the tags
+ * on this connection and suggests corrections when `update_tags` is given an unknown tag.
+ *
+ * @param db tagger database, tables must be initialized
+ * @return a pointer to the new index, or `NULL` on error, free it with `tag_trigrams_free`
+ */
+struct tag_trigrams* tag_trigrams_build(struct tagger_db *db) {
+	sqlite3_stmt *stmt;
+	struct tag_trigrams *index = calloc(1, sizeof(struct tag_trigrams));
+	if (index == NULL) {
+		fputs("Could not allocate memory for tag trigram index\n", stderr);
+		return NULL;
+	}
+
+	int rc = sqlite3_prepare_v2(db->connection, "SELECT tag_id, tag_name FROM tags ORDER BY tag_id;", -1, &stmt, NULL);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "Error when preparing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		tag_trigrams_free(index);
+		return NULL;
+	}
+
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (trigrams_insert(index, sqlite3_column_int64(stmt, 0), (const char*) sqlite3_column_text(stmt, 1))) {
+			fputs("Could not allocate memory for tag trigram index\n", stderr);
+			sqlite3_finalize(stmt);
+			tag_trigrams_free(index);
+			return NULL;
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Error when executing SQL query: %s\n", sqlite3_errmsg(db->connection));
+		sqlite3_finalize(stmt);
+		tag_trigrams_free(index);
+		return NULL;
+	}
+	sqlite3_finalize(stmt);
+
+	index->listener.ctx = index;
+	index->listener.tag_added = trigrams_on_tag_added;
+	index->listener.tag_removed = trigrams_on_tag_removed;
+	index->listener.unknown_tag = trigrams_on_unknown_tag;
+	if (tag_events_subscribe(db, &index->listener)) {
+		fputs("Could not subscribe tag trigram index to tag events\n", stderr);
+		tag_trigrams_free(index);
+		return NULL;
+	}
+	index->db = db;
+
+	return index;
+}
+
+/**
+ * @brief Get the number of tags in the index
+ */
+size_t tag_trigrams_size(struct tag_trigrams *index) {
+	return index != NULL ? index->tags_count - index->dead_count : 0;
+}
+
+/**
+ * @brief Unsubscribe the index from tag events and free it
+ *
+ * Must be called before `close_database` of the database the index was built on.
+ *
+ * @param index tag trigram index, may be `NULL`
+ */
+void tag_trigrams_free(struct tag_trigrams *index) {
+	if (index == NULL) return;
+
+	if (index->db != NULL) {
+		tag_events_unsubscribe(index->db, &index->listener);
+	}
+	for (size_t i = 0; i < index->tags_count; i++) {
+		free(index->tags[i].tag_name);
+	}
+	for (size_t i = 0; i < index->postings_capacity; i++) {
+		free(index->postings[i].slots);
+	}
+	free(index->tags);
+	free(index->postings);
+	free(index->counts);
+	free(index->distance_rows);
+	id_map_clear(&index->slots);
+	free(index);
+}
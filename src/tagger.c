@@ -1,28 +1,177 @@
-#include "../include/tagger.h"
-
-/**
- * Main function
- *
- * @param argc argument count
- * @param argv arguments vector
- * @return
- */
-int main(void) {
-	sqlite3 *database;
-	database = open_database(NULL);
-
-	if (database == NULL) {
-		fputs("Could not open database\n", stderr);
-		return -1;
-	}
-
-	if (init_tables(database)) {
-		// something went wrong when initializing tables
-		fputs("Could not initialize tables\n", stderr);
-		close_database(database);
-		return -1;
-	}
-
-	close_database(database);
-	return 0;
-}
+#include "../include/tagger.h"
+
+/**
+ * @brief Print the command line usage
+ *
+ * @param program name the program was started with
+ */
+static void print_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-d database] [-p profile] [-i file [-a]] [-e file] [-m]\n"
+		"  -d database  location of the database file\n"
+		"  -p profile   connection profile: interactive (default), bulk-load, read-only or server\n"
+		"  -i file      import relpath,tag rows from a CSV file, or from JSONL if the name ends with .jsonl\n"
+		"  -a           add tags that don't exist yet when importing\n"
+		"  -e file      export all items with their tags as CSV, or as JSONL if the name ends with .jsonl, - for stdout\n"
+		"  -m           run the database maintenance that is due\n", program);
+}
+
+/**
+ * @brief Check whether a file name ends with `.jsonl`
+ */
+static int is_jsonl_location(const char *location) {
+	size_t length = strlen(location);
+	return length >= 6 && !strcmp(location + length - 6, ".jsonl");
+}
+
+/**
+ * @brief Import item tags from a file and print the import statistics
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int import_item_tags(struct tagger_db *database, const char *location, int auto_add_tags) {
+	struct import_options options = {IMPORT_CSV, auto_add_tags, IMPORT_INDEXES_AUTO, 0};
+	struct import_stats stats;
+
+	if (is_jsonl_location(location)) options.format = IMPORT_JSONL;
+
+	FILE *input = fopen(location, "r");
+	if (input == NULL) {
+		fprintf(stderr, "Could not open %s\n", location);
+		return -1;
+	}
+
+	int result = bulk_import_item_tags(database, input, &options, &stats);
+	fclose(input);
+
+	fprintf(stderr, "Imported %zu rows: %lld item tags and %lld tags added, %zu malformed, %zu unknown items, %zu unknown tags\n",
+		stats.rows, stats.item_tags_added, stats.tags_added, stats.malformed_rows, stats.unknown_items, stats.unknown_tags);
+	return result;
+}
+
+/**
+ * @brief Export all items with their tags to a file
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int export_items(struct tagger_db *database, const char *location) {
+	int to_stdout = !strcmp(location, "-");
+	FILE *output = to_stdout ? stdout : fopen(location, "w");
+	if (output == NULL) {
+		fprintf(stderr, "Could not open %s\n", location);
+		return -1;
+	}
+
+	sqlite3_int64 items = export_database(database, output, is_jsonl_location(location) ? EXPORT_JSONL : EXPORT_CSV);
+	if (!to_stdout && fclose(output)) items = -1;
+	if (items == -1) {
+		fprintf(stderr, "Could not export to %s\n", location);
+		return -1;
+	}
+
+	fprintf(stderr, "Exported %lld items\n", items);
+	return 0;
+}
+
+/**
+ * @brief Run the database maintenance in slices until none is due
+ *
+ * @return `0` on success, otherwise `-1` on error
+ */
+static int run_maintenance(struct tagger_db *database) {
+	struct maintenance_stats stats;
+	sqlite3_int64 pages_vacuumed = 0;
+	int optimized = 0, checkpointed = 0, result;
+
+	// changes of earlier runs are not known, so the statistics are refreshed once
+	struct maintenance_options options = {-1, 1, 1, 0, 0};
+
+	do {
+		result = run_maintenance_slice(database, &options, &stats);
+		options.changes_threshold = 1;
+		optimized |= stats.optimized;
+		checkpointed |= stats.checkpointed;
+		pages_vacuumed += stats.pages_vacuumed;
+	} while (result == 1 && stats.wal_frames_left == 0);
+
+	fprintf(stderr, "Maintenance %s: statistics %s, %lld free pages vacuumed, WAL %s\n", result == -1 ? "failed" : "done",
+		optimized ? "refreshed" : "kept", pages_vacuumed, checkpointed ? "checkpointed" : "kept");
+	return result == -1 ? -1 : 0;
+}
+
+/**
+ * Main function
+ *
+ * @param argc argument count
+ * @param argv arguments vector
+ * @return
+ */
+int main(int argc, char **argv) {
+	struct tagger_db *database;
+	char *database_location = NULL, *import_location = NULL, *export_location = NULL;
+	int profile = PROFILE_INTERACTIVE;
+	int opt, auto_add_tags = 0, maintenance = 0;
+
+	while ((opt = getopt(argc, argv, "d:p:i:ae:mh")) != -1) {
+		switch (opt) {
+			case 'i':
+				import_location = optarg;
+				break;
+			case 'a':
+				auto_add_tags = 1;
+				break;
+			case 'e':
+				export_location = optarg;
+				break;
+			case 'm':
+				maintenance = 1;
+				break;
+			case 'd':
+				database_location = optarg;
+				break;
+			case 'p':
+				profile = database_profile_from_name(optarg);
+				if (profile == -1) {
+					fprintf(stderr, "Unknown database profile: %s\n", optarg);
+					print_usage(argv[0]);
+					return -1;
+				}
+				break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	database = open_database(database_location, (DATABASE_PROFILE) profile);
+
+	if (database == NULL) {
+		fputs("Could not open database\n", stderr);
+		return -1;
+	}
+
+	// a read-only connection cannot create tables, the database must already be initialized
+	if (profile != PROFILE_READ_ONLY && init_tables(database)) {
+		// something went wrong when initializing tables
+		fputs("Could not initialize tables\n", stderr);
+		close_database(database);
+		return -1;
+	}
+
+	if (import_location != NULL && import_item_tags(database, import_location, auto_add_tags)) {
+		close_database(database);
+		return -1;
+	}
+
+	if (export_location != NULL && export_items(database, export_location)) {
+		close_database(database);
+		return -1;
+	}
+
+	if (maintenance && run_maintenance(database)) {
+		close_database(database);
+		return -1;
+	}
+
+	close_database(database);
+	return 0;
+}
@@ -1,9 +1,32 @@
 #include <stdio.h>
 #include "../include/database.h"
+#include "../include/tag_trie.h"
+#include "../include/tag_trigrams.h"
+#include "../include/tag_cooccurrence.h"
+#include "../include/tag_facets.h"
+#include "../include/db_pool.h"
+#include "../include/bulk_import.h"
+#include "../include/export.h"
+#include "../include/migrations.h"
+#include "../include/shards.h"
+#include "../include/maintenance.h"
+#include "../include/provider_utils.h"
+#include "../include/fetch_engine.h"
+#include "../include/http_cache.h"
+#include "../include/json_stream.h"
+#include "../include/rate_limiter.h"
+#include "../include/tag_provider.h"
+#include "../include/mock_provider.h"
+#include "../include/pipeline.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 extern char * sql_expand_param_into_array(char *sql, size_t param_num, size_t array_size);
 int test_sql_expand_param_into_array(void) {
@@ -29,7 +52,7 @@ int test_sql_expand_param_into_array(void) {
 	return 0;
 }
 
-int test_listing_refresh(sqlite3 *database) {
+int test_listing_refresh(struct tagger_db *database) {
 	// Testing listing addition
 	char pattern[] = "/tmp/tmp.XXXXXX";
 	char* temp_dir = mkdtemp(pattern);
@@ -103,8 +126,8 @@ int test_listing_refresh(sqlite3 *database) {
 	return 0;
 }
 
-extern sqlite3_int64 get_tag_id(sqlite3 *db, char *tag_name);
-int test_add_tag(sqlite3 *database) {
+extern sqlite3_int64 get_tag_id(struct tagger_db *db, char *tag_name);
+int test_add_tag(struct tagger_db *database) {
 	if (get_tag_id(database, "tag1") != 0) {
 		fputs("Error when getting tag id or tag exists already\n", stderr);
 		return -1;
@@ -124,9 +147,9 @@ int test_add_tag(sqlite3 *database) {
 	return 0;
 }
 
-extern int get_item_tags_count(sqlite3 *db, sqlite3_int64 item_id);
-extern int get_total_tags_count(sqlite3 *db);
-int test_update_tags(sqlite3 *database) {
+extern int get_item_tags_count(struct tagger_db *db, sqlite3_int64 item_id);
+extern int get_total_tags_count(struct tagger_db *db);
+int test_update_tags(struct tagger_db *database) {
 	const sqlite3_int64 item_id = 1;
 	int total_number_of_tags = 1; // tags already in the database: tag1
 	const char tag2_name[] = "tag2";
@@ -189,7 +212,7 @@ int test_update_tags(sqlite3 *database) {
 	return 0;
 }
 
-int test_get_item_tag_ids(sqlite3 *database) {
+int test_get_item_tag_ids(struct tagger_db *database) {
 	const sqlite3_int64 item_id = 1;
 	const int item_tag_ids[] = {2, 3, 4};
 	const int item_tag_ids_size = sizeof(item_tag_ids) / sizeof(int);
@@ -232,7 +255,7 @@ int test_get_item_tag_ids(sqlite3 *database) {
 	return 0;
 }
 
-int test_add_tag_to_item(sqlite3 *database) {
+int test_add_tag_to_item(struct tagger_db *database) {
 	const sqlite3_int64 item_id = 2;
 	const sqlite3_int64 tag_id = 1;
 
@@ -270,6 +293,1894 @@ int test_add_tag_to_item(sqlite3 *database) {
 	return 0;
 }
 
+extern int execute_sql_string(struct tagger_db *db, char *sql);
+int test_tag_trie(struct tagger_db *database) {
+	struct tag_completion completions[4];
+	int found;
+
+	// tags already in the database: tag1 (item 2), tag2, tag3, tag4 (item 1)
+	struct tag_trie *trie = tag_trie_build(database);
+	if (trie == NULL) {
+		fputs("Error, expected the tag trie to be built\n", stderr);
+		return -1;
+	}
+
+	if (tag_trie_size(trie) != 4) {
+		fputs("Error, expected the tag trie to contain 4 tags\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	if (tag_trie_complete(trie, "x", completions, 4) != 0) {
+		fputs("Error, expected no completions for a prefix without tags\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	// make tag3 the most used tag, the trie should follow without a rebuild
+	if (add_tag_to_item(database, 2, 3) != 1 || add_tag_to_item(database, 3, 3) != 1) {
+		fputs("Error, expected the tag to be successfully added to the items\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	found = tag_trie_complete(trie, "ta", completions, 2);
+	if (found != 2 || completions[0].tag_id != 3 || completions[0].usage_count != 3) {
+		fputs("Error, expected tag3 to be the first completion\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	if (add_new_tag(database, "tagalong") <= 0) {
+		fputs("Could not add new tag\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	found = tag_trie_complete(trie, "taga", completions, 4);
+	if (found != 1 || strcmp(completions[0].tag_name, "tagalong") || completions[0].usage_count != 0) {
+		fputs("Error, expected the new tag to be the only completion\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	// tags added in a rolled back transaction should not show up
+	if (execute_sql_string(database, "BEGIN TRANSACTION;") || add_new_tag(database, "tagrolledback") <= 0 ||
+		execute_sql_string(database, "ROLLBACK;")) {
+		fputs("Error when adding a tag in a rolled back transaction\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	if (tag_trie_complete(trie, "tagr", completions, 4) != 0 || tag_trie_complete(trie, "tag", completions, 4) != 4) {
+		fputs("Error, expected the rolled back tag not to be in the trie\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	// a savepoint rolled back inside a committed transaction drops its tags as well
+	if (execute_sql_string(database, "BEGIN; SAVEPOINT s;") || add_new_tag(database, "ghost") <= 0 ||
+		execute_sql_string(database, "ROLLBACK TO s; RELEASE s; COMMIT;")) {
+		fputs("Error when adding a tag in a rolled back savepoint\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	if (tag_trie_complete(trie, "gh", completions, 4) != 0 || get_tag_id(database, "ghost") != 0) {
+		fputs("Error, expected the tag of the rolled back savepoint not to be in the trie\n", stderr);
+		tag_trie_free(trie);
+		return -1;
+	}
+
+	tag_trie_free(trie);
+	return 0;
+}
+
+struct unknown_tag_suggestions {
+	int calls;
+	char first[32];
+};
+
+static void record_unknown_tag_suggestion(void *ctx, const char *tag_name, const struct tag_suggestion *suggestions, int count) {
+	struct unknown_tag_suggestions *unknown = ctx;
+	(void) tag_name;
+
+	unknown->calls++;
+	if (count > 0) snprintf(unknown->first, sizeof(unknown->first), "%s", suggestions[0].tag_name);
+}
+
+int test_tag_trigrams(struct tagger_db *database) {
+	struct tag_suggestion suggestions[4];
+	int found;
+	const char *misspelled_tags[] = {"tagalnog", NULL};
+
+	// tags already in the database: tag1, tag2, tag3, tag4, tagalong
+	struct tag_trigrams *index = tag_trigrams_build(database);
+	if (index == NULL) {
+		fputs("Error, expected the tag trigram index to be built\n", stderr);
+		return -1;
+	}
+
+	if (tag_trigrams_size(index) != 5) {
+		fputs("Error, expected the tag trigram index to contain 5 tags\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	found = tag_trigrams_suggest(index, "TAG3", 0, suggestions, 4);
+	if (found != 1 || suggestions[0].tag_id != 3 || suggestions[0].distance != 0) {
+		fputs("Error, expected an exact match ignoring case\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	found = tag_trigrams_suggest(index, "tagalnog", 2, suggestions, 4);
+	if (found != 1 || strcmp(suggestions[0].tag_name, "tagalong") || suggestions[0].distance != 2) {
+		fputs("Error, expected tagalong to be suggested for a misspelled name\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	found = tag_trigrams_suggest(index, "tag9", 1, suggestions, 2);
+	if (found != 2 || suggestions[0].distance != 1 || strcmp(suggestions[0].tag_name, "tag1")) {
+		fputs("Error, expected the two closest tags sorted by distance and name\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	if (add_new_tag(database, "photography") <= 0) {
+		fputs("Could not add new tag\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	found = tag_trigrams_suggest(index, "fotography", 2, suggestions, 4);
+	if (found != 1 || strcmp(suggestions[0].tag_name, "photography")) {
+		fputs("Error, expected the new tag to be suggested\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	// the index should suggest a correction instead of the tag being silently dropped
+	struct unknown_tag_suggestions unknown = {0, ""};
+	tag_trigrams_on_unknown_tag(index, record_unknown_tag_suggestion, &unknown);
+	if (update_tags(database, 4, (char**) misspelled_tags, DONT_AUTO_ADD_TAGS) != -1) {
+		fputs("Error, expected the update_tags() function to return -1\n", stderr);
+		tag_trigrams_free(index);
+		return -1;
+	}
+	if (unknown.calls != 1 || strcmp(unknown.first, "tagalong")) {
+		fprintf(stderr, "Error, expected tagalong to be suggested for the unknown tag, got '%s'\n", unknown.first);
+		tag_trigrams_free(index);
+		return -1;
+	}
+
+	tag_trigrams_free(index);
+	return 0;
+}
+int test_tag_cooccurrence(struct tagger_db *database) {
+	struct related_tag related[4];
+	sqlite3_int64 tag_ids[] = {3, 1};
+	int found;
+
+	// items already tagged: item 1 with tag2, tag3, tag4, item 2 with tag1, tag3, item 3 with tag3
+	if (add_tag_to_item(database, 1, 1) != 1) {
+		fputs("Error, expected the tag to be successfully added to the item\n", stderr);
+		return -1;
+	}
+
+	for (int rebuild = 0; rebuild < 2; rebuild++) {
+		if (rebuild && rebuild_tag_cooccurrence(database, 2)) {
+			fputs("Error, expected the co-occurrence table to be rebuilt\n", stderr);
+			return -1;
+		}
+
+		found = get_related_tags(database, tag_ids, 1, related, 4);
+		if (found != 3 || related[0].tag_id != 1 || related[0].count != 2 || related[1].count != 1) {
+			fprintf(stderr, "Error, expected tag1 to be the most related tag to tag3 (rebuild: %d)\n", rebuild);
+			return -1;
+		}
+
+		found = get_related_tags(database, tag_ids, 2, related, 4);
+		if (found != 2 || related[0].tag_id != 2 || related[0].count != 2 || related[1].tag_id != 4) {
+			fprintf(stderr, "Error, expected tag2 and tag4 to be related to tag3 and tag1 (rebuild: %d)\n", rebuild);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+int test_tag_facets(struct tagger_db *database) {
+	struct tag_facet facets[4];
+	struct bitmap *items;
+	sqlite3_int64 tag_ids[] = {1, 3};
+	int found;
+
+	// items already tagged: item 1 with tag1, tag2, tag3, tag4, item 2 with tag1, tag3, item 3 with tag3
+	struct tag_bitmap_index *index = tag_bitmap_index_build(database);
+	if (index == NULL) {
+		fputs("Error, expected the tag bitmap index to be built\n", stderr);
+		return -1;
+	}
+
+	if (tag_bitmap_index_query(index, tag_ids, 2, &items) || bitmap_cardinality(items) != 2 ||
+		!bitmap_contains(items, 1) || !bitmap_contains(items, 2)) {
+		fputs("Error, expected items 1 and 2 to have both tag1 and tag3\n", stderr);
+		tag_bitmap_index_free(index);
+		return -1;
+	}
+
+	found = tag_facets_top_k(index, items, facets, 2);
+	if (found != 2 || facets[0].tag_id != 1 || facets[0].count != 2 || facets[1].tag_id != 3 || facets[1].count != 2) {
+		fputs("Error, expected tag1 and tag3 to be the top facets\n", stderr);
+		bitmap_free(items);
+		tag_bitmap_index_free(index);
+		return -1;
+	}
+
+	// the index should follow new item tags
+	if (add_tag_to_item(database, 2, 2) != 1) {
+		fputs("Error, expected the tag to be successfully added to the item\n", stderr);
+		bitmap_free(items);
+		tag_bitmap_index_free(index);
+		return -1;
+	}
+
+	found = tag_facets_top_k(index, items, facets, 4);
+	if (found != 4 || facets[1].tag_id != 2 || facets[1].count != 2 || facets[3].tag_id != 4 || facets[3].count != 1) {
+		fputs("Error, expected tag2 to be counted twice after it was added to item 2\n", stderr);
+		bitmap_free(items);
+		tag_bitmap_index_free(index);
+		return -1;
+	}
+
+	bitmap_free(items);
+	tag_bitmap_index_free(index);
+	return 0;
+}
+int test_cursors(struct tagger_db *database) {
+	struct tagger_cursor *cursor;
+	struct item_row item;
+	struct tag_row tag;
+	sqlite3_int64 after_item_id = 0, expected_item_id = 1;
+	int rc, pages = 0;
+
+	// the listing has 5 items, read them 2 at a time with keyset pagination
+	do {
+		cursor = open_listing_items_cursor(database, 1, after_item_id, 2);
+		if (cursor == NULL) {
+			fputs("Error, expected the listing items cursor to be opened\n", stderr);
+			return -1;
+		}
+		while ((rc = cursor_next_item(cursor, &item)) == 1) {
+			if (item.item_id != expected_item_id++ || item.listing_id != 1 || item.item_relpath == NULL) {
+				fprintf(stderr, "Error, unexpected item %lld in listing items cursor\n", item.item_id);
+				close_cursor(cursor);
+				return -1;
+			}
+		}
+		after_item_id = cursor_last_key(cursor);
+		close_cursor(cursor);
+		pages++;
+	} while (rc == 0 && after_item_id < 5);
+
+	if (rc != 0 || pages != 3 || expected_item_id != 6) {
+		fputs("Error, expected 5 items on 3 pages\n", stderr);
+		return -1;
+	}
+
+	// items already tagged with tag3: 1, 2, 3
+	cursor = open_tag_items_cursor(database, 3, 1, 0);
+	if (cursor == NULL || cursor_next_item(cursor, &item) != 1 || item.item_id != 2 ||
+		cursor_next_item(cursor, &item) != 1 || item.item_id != 3 || cursor_next_item(cursor, &item) != 0) {
+		fputs("Error, expected items 2 and 3 after item 1 in tag items cursor\n", stderr);
+		close_cursor(cursor);
+		return -1;
+	}
+	close_cursor(cursor);
+
+	// item 1 already has tag1, tag2, tag3, tag4
+	cursor = open_item_tags_cursor(database, 1, 0, 0);
+	if (cursor == NULL || cursor_next_tag(cursor, &tag) != 1 || tag.tag_id != 1 || strcmp(tag.tag_name, "tag1")) {
+		fputs("Error, expected tag1 to be the first tag of item 1\n", stderr);
+		close_cursor(cursor);
+		return -1;
+	}
+	while ((rc = cursor_next_tag(cursor, &tag)) == 1);
+	if (rc != 0 || cursor_last_key(cursor) != 4) {
+		fputs("Error, expected tag4 to be the last tag of item 1\n", stderr);
+		close_cursor(cursor);
+		return -1;
+	}
+	close_cursor(cursor);
+
+	return 0;
+}
+
+static int count_prepared_statements(struct tagger_db *database) {
+	int count = 0;
+	for (sqlite3_stmt *stmt = sqlite3_next_stmt(database->connection, NULL); stmt != NULL; stmt = sqlite3_next_stmt(database->connection, stmt)) {
+		count++;
+	}
+	return count;
+}
+
+int test_statement_cache(struct tagger_db *database) {
+	struct tagger_cursor *first, *second;
+	struct tag_row first_tag, second_tag;
+	char *tags[] = {"tag1", "tag2", NULL};
+
+	// warm up the cache, after that repeated calls must not prepare anything new
+	if (get_tag_id(database, "tag1") != 1 || update_tags(database, 1, tags, DONT_AUTO_ADD_TAGS) != 0) {
+		fputs("Error, expected tag1 to exist and item 1 to already have tag1 and tag2\n", stderr);
+		return -1;
+	}
+	int prepared = count_prepared_statements(database);
+
+	for (int i = 0; i < 100; i++) {
+		if (get_tag_id(database, "tag2") != 2 || get_item_tags_count(database, 1) != 4 ||
+			update_tags(database, 1, tags, DONT_AUTO_ADD_TAGS) != 0 || add_tag_to_item(database, 1, 1) != 0) {
+			fputs("Error, unexpected result from a cached statement\n", stderr);
+			return -1;
+		}
+	}
+	if (count_prepared_statements(database) != prepared) {
+		fprintf(stderr, "Error, expected %d prepared statements, got %d\n", prepared, count_prepared_statements(database));
+		return -1;
+	}
+
+	// two cursors of the same kind at once, the second one cannot borrow the cached statement
+	first = open_tags_cursor(database, 0, 0);
+	second = open_tags_cursor(database, 1, 0);
+	if (first == NULL || second == NULL || cursor_next_tag(first, &first_tag) != 1 || cursor_next_tag(second, &second_tag) != 1 ||
+		first_tag.tag_id != 1 || second_tag.tag_id != 2 || cursor_next_tag(first, &first_tag) != 1 || first_tag.tag_id != 2) {
+		fputs("Error, expected two independent tag cursors\n", stderr);
+		close_cursor(first);
+		close_cursor(second);
+		return -1;
+	}
+	close_cursor(first);
+	close_cursor(second);
+
+	if (count_prepared_statements(database) != prepared + 1) {
+		fputs("Error, expected only the borrowed cursor statement to stay prepared\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+int test_database_profiles(struct tagger_db *database) {
+	sqlite3_stmt *stmt;
+	int wal = 0;
+
+	for (int profile = PROFILE_INTERACTIVE; profile <= PROFILE_SERVER; profile++) {
+		if (database_profile_from_name(database_profile_name(profile)) != profile) {
+			fprintf(stderr, "Error, profile %d is not found by its name\n", profile);
+			return -1;
+		}
+	}
+	if (database_profile_from_name("fast") != -1 || database_profile_name(42) != NULL) {
+		fputs("Error, expected unknown profiles to be rejected\n", stderr);
+		return -1;
+	}
+
+	// the interactive profile switched the database file to WAL
+	if (sqlite3_prepare_v2(database->connection, "PRAGMA journal_mode;", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		wal = !strcmp((const char*) sqlite3_column_text(stmt, 0), "wal");
+	}
+	sqlite3_finalize(stmt);
+	if (!wal) {
+		fputs("Error, expected the database to be in WAL mode\n", stderr);
+		return -1;
+	}
+
+	// and syncs every commit
+	if (sqlite3_prepare_v2(database->connection, "PRAGMA synchronous;", -1, &stmt, NULL) != SQLITE_OK ||
+		sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) != 2) {
+		sqlite3_finalize(stmt);
+		fputs("Error, expected the interactive profile to use synchronous=FULL\n", stderr);
+		return -1;
+	}
+	sqlite3_finalize(stmt);
+
+	// a read-only connection sees the data of the writer but cannot change it
+	struct tagger_db *reader = open_database(NULL, PROFILE_READ_ONLY);
+	if (reader == NULL) {
+		fputs("Error, expected the database to be opened read-only\n", stderr);
+		return -1;
+	}
+	if (get_tag_id(reader, "tag1") != 1 || add_new_tag(reader, "readonlytag") != -1) {
+		fputs("Error, expected reads to work and writes to fail on a read-only connection\n", stderr);
+		close_database(reader);
+		return -1;
+	}
+	close_database(reader);
+
+	return 0;
+}
+
+#define POOL_TEST_THREADS 4
+#define POOL_TEST_WRITES 10
+
+static int pool_read_tag_count(struct tagger_db *db, void *arg) {
+	(void) arg;
+	return get_total_tags_count(db);
+}
+
+static int pool_add_tag(struct tagger_db *db, void *arg) {
+	return add_new_tag(db, (char*) arg) > 0 ? 0 : -1;
+}
+
+struct pool_test_thread {
+	pthread_t thread;
+	struct db_pool *pool;
+	int index;
+};
+
+static void* pool_test_thread_run(void *arg) {
+	struct pool_test_thread *t = arg;
+	char tag_name[32];
+	int previous_count = 0, count;
+
+	for (int i = 0; i < POOL_TEST_WRITES; i++) {
+		snprintf(tag_name, sizeof(tag_name), "pool%d_%d", t->index, i);
+		if (db_pool_write(t->pool, pool_add_tag, tag_name)) return (void*) 1;
+
+		// readers see every committed write, the number of tags never goes down
+		for (int j = 0; j < 5; j++) {
+			count = db_pool_read(t->pool, pool_read_tag_count, NULL);
+			if (count < previous_count) return (void*) 1;
+			previous_count = count;
+		}
+	}
+	return NULL;
+}
+
+int test_db_pool(struct tagger_db *database) {
+	struct pool_test_thread threads[POOL_TEST_THREADS];
+	void *thread_result;
+	int failed = 0;
+	int initial_count = get_total_tags_count(database);
+
+	struct db_pool *pool = db_pool_open(NULL, 2);
+	if (pool == NULL) {
+		fputs("Error, expected the database pool to be opened\n", stderr);
+		return -1;
+	}
+
+	for (int i = 0; i < POOL_TEST_THREADS; i++) {
+		threads[i].pool = pool;
+		threads[i].index = i;
+		pthread_create(&threads[i].thread, NULL, pool_test_thread_run, &threads[i]);
+	}
+	for (int i = 0; i < POOL_TEST_THREADS; i++) {
+		pthread_join(threads[i].thread, &thread_result);
+		if (thread_result != NULL) failed = 1;
+	}
+	if (failed || db_pool_read(pool, pool_read_tag_count, NULL) != initial_count + POOL_TEST_THREADS * POOL_TEST_WRITES) {
+		fputs("Error, expected every pooled write to be visible to the readers\n", stderr);
+		db_pool_close(pool);
+		return -1;
+	}
+
+	// the second async write adds an existing tag and fails, flush reports it
+	if (db_pool_write_async(pool, pool_add_tag, "poolasync") || db_pool_write_async(pool, pool_add_tag, "poolasync") ||
+		db_pool_flush(pool) != -1 || db_pool_flush(pool) != 0) {
+		fputs("Error, expected flush to report the failed async write once\n", stderr);
+		db_pool_close(pool);
+		return -1;
+	}
+
+	// reader connections are read-only
+	if (db_pool_read(pool, pool_add_tag, "poolreader") != -1) {
+		fputs("Error, expected a write on a reader connection to fail\n", stderr);
+		db_pool_close(pool);
+		return -1;
+	}
+
+	db_pool_close(pool);
+
+	// the main connection sees the writes of the pool too
+	if (get_total_tags_count(database) != initial_count + POOL_TEST_THREADS * POOL_TEST_WRITES + 1) {
+		fputs("Error, expected the pooled writes to be in the database\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+int test_update_tags_batch(struct tagger_db *database) {
+	char *tags_a[] = {"batch1", "batch2", "batch1", NULL};
+	char *tags_b[] = {"batch2", NULL};
+	char *tags_unknown[] = {"batch1", "batchmissing", NULL};
+	struct item_tags updates[] = {{4, tags_a}, {5, tags_b}, {5, tags_a}};
+	struct item_tags failing_updates[] = {{4, tags_b}, {5, tags_unknown}};
+	size_t applied;
+	int tags_count_4 = get_item_tags_count(database, 4), tags_count_5 = get_item_tags_count(database, 5);
+
+	// duplicates within and across updates are only added once
+	if (update_tags_batch(database, updates, 3, AUTO_ADD_TAGS, 2, &applied) != 4 || applied != 3 ||
+		get_item_tags_count(database, 4) != tags_count_4 + 2 || get_item_tags_count(database, 5) != tags_count_5 + 2) {
+		fputs("Error, expected the batch to add batch1 and batch2 to items 4 and 5\n", stderr);
+		return -1;
+	}
+	tags_count_4 += 2;
+	tags_count_5 += 2;
+
+	if (update_tags_batch(database, updates, 3, DONT_AUTO_ADD_TAGS, 0, NULL) != 0) {
+		fputs("Error, expected a repeated batch to add nothing\n", stderr);
+		return -1;
+	}
+
+	// the first chunk is committed, the failing second chunk is rolled back
+	if (execute_sql_string(database, "DELETE FROM itemtags WHERE item_id=4 AND tag_id=(SELECT tag_id FROM tags WHERE tag_name='batch2');")) {
+		return -1;
+	}
+	if (update_tags_batch(database, failing_updates, 2, DONT_AUTO_ADD_TAGS, 1, &applied) != -1 || applied != 1 ||
+		get_item_tags_count(database, 4) != tags_count_4 || get_tag_id(database, "batchmissing") != 0) {
+		fputs("Error, expected only the first chunk of the failing batch to be committed\n", stderr);
+		return -1;
+	}
+
+	// updates without a tag list are skipped among the others
+	char *tags_c[] = {"batch3", NULL};
+	struct item_tags mixed_updates[] = {{4, tags_c}, {5, NULL}};
+	if (update_tags_batch(database, mixed_updates, 2, AUTO_ADD_TAGS, 0, &applied) != 1 || applied != 2 ||
+		get_item_tags_count(database, 4) != tags_count_4 + 1 || get_item_tags_count(database, 5) != tags_count_5) {
+		fputs("Error, expected a batch with an update without tags to add only the other update\n", stderr);
+		return -1;
+	}
+	tags_count_4++;
+
+	// a batch inside a transaction is rolled back with it
+	if (execute_sql_string(database, "BEGIN;") || update_tags_batch(database, updates, 1, AUTO_ADD_TAGS, 0, NULL) != 0 ||
+		update_tags(database, 5, tags_unknown, AUTO_ADD_TAGS) != 1 || execute_sql_string(database, "ROLLBACK;") ||
+		get_tag_id(database, "batchmissing") != 0 || get_item_tags_count(database, 5) != tags_count_5) {
+		fputs("Error, expected the nested batch to be rolled back with the transaction\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+int test_bulk_import(struct tagger_db *database) {
+	struct import_options options = {IMPORT_CSV, 1, IMPORT_REBUILD_INDEXES, 2};
+	struct import_stats stats;
+	sqlite3_stmt *stmt;
+	int derived_objects = 0;
+	FILE *input;
+
+	// relpaths of the test listing are /f0, /f1, /f2, /d1/f3 and /d1/f4
+	static const char csv[] = "relpath,tag\n"
+		"/f0,imported1\n"
+		"\"/d1/f3\",\"imported,2\"\r\n"
+		"/missing,imported1\n"
+		"no separator\n"
+		"/f0,imported1\n";
+	static const char jsonl[] = "{\"tag\": \"imported1\", \"relpath\": \"/f1\", \"extra\": [1, {\"a\": \"}\"}]}\n"
+		"{\"relpath\": \"\\/d1\\/f4\", \"tag\": \"imported\\u002c2\"}\n"
+		"{\"relpath\": \"/f2\", \"tag\": \"notimported\"}\n"
+		"{\"relpath\": \"/f2\"}\n";
+
+	if ((input = tmpfile()) == NULL) return -1;
+	fputs(csv, input);
+	rewind(input);
+	if (bulk_import_item_tags(database, input, &options, &stats) || stats.rows != 5 || stats.malformed_rows != 1 ||
+		stats.unknown_items != 1 || stats.tags_added != 2 || stats.item_tags_added != 2) {
+		fputs("Error, expected the CSV import to add 2 tags to 2 items\n", stderr);
+		fclose(input);
+		return -1;
+	}
+	fclose(input);
+
+	// the index and triggers dropped for the import are back
+	if (sqlite3_prepare_v2(database->connection, "SELECT count() FROM sqlite_master WHERE name IN "
+		"('itemtags_tag_id', 'tag_cooccurrence_ai', 'tag_cooccurrence_ad');", -1, &stmt, NULL) == SQLITE_OK &&
+		sqlite3_step(stmt) == SQLITE_ROW) {
+		derived_objects = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	if (derived_objects != 3) {
+		fputs("Error, expected the item tags index and triggers to be recreated\n", stderr);
+		return -1;
+	}
+
+	options.format = IMPORT_JSONL;
+	options.auto_add_tags = 0;
+	options.indexes = IMPORT_KEEP_INDEXES;
+	options.rows_per_transaction = 0;
+	if ((input = tmpfile()) == NULL) return -1;
+	fputs(jsonl, input);
+	rewind(input);
+	if (bulk_import_item_tags(database, input, &options, &stats) || stats.rows != 4 || stats.malformed_rows != 1 ||
+		stats.unknown_tags != 1 || stats.tags_added != 0 || stats.item_tags_added != 2 || get_tag_id(database, "notimported") != 0) {
+		fputs("Error, expected the JSONL import to add the existing tags to 2 items\n", stderr);
+		fclose(input);
+		return -1;
+	}
+	fclose(input);
+
+	return 0;
+}
+
+int test_export(struct tagger_db *database) {
+	char line[1024];
+	int lines = 0, found = 0;
+	sqlite3_int64 items;
+	FILE *output;
+
+	// the import test tagged /f1 with imported1 and /d1/f3 with "imported,2", separators in tag names of /f2 (item 5) are escaped
+	sqlite3_int64 tag_id = add_new_tag(database, "semi;colon\\");
+	if (tag_id <= 0 || add_tag_to_item(database, 5, tag_id) != 1) {
+		fputs("Error, could not tag an item with a tag containing the separator\n", stderr);
+		return -1;
+	}
+
+	if ((output = tmpfile()) == NULL) return -1;
+	items = export_database(database, output, EXPORT_CSV);
+	rewind(output);
+	while (fgets(line, sizeof(line), output) != NULL) {
+		lines++;
+		if (strstr(line, ",/d1/f3,\"") != NULL && strstr(line, ";imported,2\"\n") != NULL) found++;
+		if (strstr(line, ",/f2,") != NULL && strstr(line, ";semi\\;colon\\\\\n") != NULL) found++;
+	}
+	fclose(output);
+	if (items != 5 || lines != 6 || found != 2) {
+		fprintf(stderr, "Error, expected a CSV header and 5 items, got %lld items on %d lines\n", items, lines);
+		return -1;
+	}
+
+	lines = 0;
+	found = 0;
+	if ((output = tmpfile()) == NULL) return -1;
+	items = export_database(database, output, EXPORT_JSONL);
+	rewind(output);
+	while (fgets(line, sizeof(line), output) != NULL) {
+		lines++;
+		if (strstr(line, "\"relpath\":\"/f1\",\"tags\":[") != NULL && strstr(line, "\"imported1\"]}\n") != NULL) found++;
+	}
+	fclose(output);
+	if (items != 5 || lines != 1 + get_total_tags_count(database) + 5 || found != 1) {
+		fprintf(stderr, "Error, expected a listing, every tag and 5 items in JSONL, got %lld items on %d lines\n", items, lines);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Remove a database file together with its WAL files
+ */
+static void remove_database_files(const char *location) {
+	char path[4096];
+
+	remove(location);
+	snprintf(path, sizeof(path), "%s-wal", location);
+	remove(path);
+	snprintf(path, sizeof(path), "%s-shm", location);
+	remove(path);
+}
+
+/**
+ * @brief Count the rows the tag co-occurrence table has differently than a full recount
+ */
+static int count_cooccurrence_differences(struct tagger_db *db) {
+	static const char sql[] = "SELECT count() FROM ("
+		"SELECT * FROM (SELECT a.tag_id, b.tag_id, count() FROM itemtags a JOIN itemtags b "
+		"ON a.item_id = b.item_id AND a.tag_id <> b.tag_id GROUP BY a.tag_id, b.tag_id "
+		"EXCEPT SELECT tag_id, related_tag_id, count FROM tag_cooccurrence) "
+		"UNION ALL SELECT * FROM (SELECT tag_id, related_tag_id, count FROM tag_cooccurrence "
+		"EXCEPT SELECT a.tag_id, b.tag_id, count() FROM itemtags a JOIN itemtags b "
+		"ON a.item_id = b.item_id AND a.tag_id <> b.tag_id GROUP BY a.tag_id, b.tag_id));";
+	sqlite3_stmt *stmt;
+	int differences = -1;
+
+	if (sqlite3_prepare_v2(db->connection, sql, -1, &stmt, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW) differences = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	return differences;
+}
+
+int test_migrations(struct tagger_db *database) {
+	static const char data_sql[] = "INSERT INTO listings VALUES (1, 'l', 0, '/l');"
+		"INSERT INTO tags VALUES (1, 'a'), (2, 'b'), (3, 'c'), (4, 'd');"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 20) "
+		"INSERT INTO items SELECT i, 'item' || i, '/item' || i, 1 FROM n;"
+		"INSERT INTO itemtags SELECT item_id, tag_id FROM items, tags WHERE (item_id + tag_id) % 3 <> 0;";
+	struct tagger_db *db;
+	int result = -1;
+
+	if (get_schema_version(database) != SCHEMA_VERSION) {
+		fputs("Error, the initialized database is not at the current schema version\n", stderr);
+		return -1;
+	}
+
+	remove("migration_test.tdb");
+	if ((db = open_database("migration_test.tdb", PROFILE_INTERACTIVE)) == NULL) return -1;
+
+	if (get_schema_version(db) != 0 || migrate_database(db, 1, 0, 0) != 1 || get_schema_version(db) != 1 ||
+		sqlite3_exec(db->connection, data_sql, NULL, NULL, NULL) != SQLITE_OK) {
+		fputs("Error, could not create a database at schema version 1\n", stderr);
+		goto cleanup;
+	}
+
+	// three items per chunk, stopping after two chunks with items 1 to 6 counted
+	if (migrate_database(db, 2, 3, 2) != 0 || get_schema_version(db) != 1) {
+		fputs("Error, the migration should stop when its chunk budget runs out\n", stderr);
+		goto cleanup;
+	}
+
+	// changes while the migration is interrupted, both in the counted items and in the rest
+	if (sqlite3_exec(db->connection, "INSERT INTO itemtags VALUES (3, 3), (12, 3);"
+			"DELETE FROM itemtags WHERE item_id IN (1, 15) AND tag_id = 1;", NULL, NULL, NULL) != SQLITE_OK) {
+		goto cleanup;
+	}
+
+	if (migrate_database(db, 2, 3, 0) != 1 || get_schema_version(db) != 2) {
+		fputs("Error, the interrupted migration did not finish\n", stderr);
+		goto cleanup;
+	}
+
+	// the triggers count every item after the migration
+	if (sqlite3_exec(db->connection, "INSERT INTO itemtags VALUES (19, 2);", NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+
+	if (count_cooccurrence_differences(db) != 0) {
+		fputs("Error, the migrated tag co-occurrence counts are wrong\n", stderr);
+		goto cleanup;
+	}
+
+	if (migrate_database(db, 1, 0, 0) != -1) {
+		fputs("Error, a schema downgrade should fail\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	close_database(db);
+	remove_database_files("migration_test.tdb");
+	return result;
+}
+
+int test_listing_shards(void) {
+	char pattern[] = "/tmp/tmp.XXXXXX", path[sizeof(pattern) + 8], location[4096];
+	char *temp_dir = mkdtemp(pattern);
+	char *tags_a[] = {"shared", "only_a", NULL}, *tags_b[] = {"shared", "only_b", NULL}, *tags_c[] = {"shared", NULL};
+	struct tagger_db *catalog = NULL, *shards[2] = {NULL, NULL};
+	struct tagger_cursor *cursor;
+	struct item_row item;
+	struct related_tag related[4];
+	struct tag_bitmap_index *shard_index = NULL, *catalog_index = NULL;
+	struct bitmap *tagged = NULL;
+	sqlite3_int64 item_ids[3], tag_id;
+	int result = -1, items = 0;
+
+	if (temp_dir == NULL) return -1;
+
+	// three listings with two files each
+	for (int i = 0; i < 3; i++) {
+		sprintf(path, "%s/%c", temp_dir, 'a' + i);
+		mkdir(path, 0700);
+		for (int j = 0; j < 2; j++) {
+			sprintf(path, "%s/%c/%c%d", temp_dir, 'a' + i, 'a' + i, j);
+			FILE *f = fopen(path, "w");
+			if (f != NULL) fclose(f);
+		}
+	}
+
+	remove_database_files("shard_test.tdb");
+	if ((catalog = open_database("shard_test.tdb", PROFILE_INTERACTIVE)) == NULL || init_tables(catalog)) goto cleanup;
+
+	for (int i = 0; i < 2; i++) {
+		sprintf(path, "%s/%c", temp_dir, 'a' + i);
+		if (add_new_listing(catalog, i ? "shardb" : "sharda", FILE_AS_ITEM, path) != 1 ||
+			(shards[i] = open_listing_shard(catalog, i + 1, PROFILE_INTERACTIVE)) == NULL) {
+			fputs("Error, could not open a listing shard\n", stderr);
+			goto cleanup;
+		}
+	}
+
+	// the third listing has no shard and keeps its items in the catalog
+	sprintf(path, "%s/c", temp_dir);
+	if (add_new_listing(catalog, "shardc", FILE_AS_ITEM, path) != 1 || refresh_listing(catalog, 3) ||
+		(cursor = open_listing_items_cursor(catalog, 3, 0, 1)) == NULL) {
+		fputs("Error, could not add a listing without a shard\n", stderr);
+		goto cleanup;
+	}
+	if (cursor_next_item(cursor, &item) != 1) item.item_id = 0;
+	item_ids[2] = item.item_id;
+	close_cursor(cursor);
+	if (update_tags(catalog, item_ids[2], tags_c, AUTO_ADD_TAGS) != 1) goto cleanup;
+
+	// a write transaction on one shard doesn't block the refresh of another one
+	if (sqlite3_exec(shards[0]->connection, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK ||
+		refresh_listing(shards[1], 2) || refresh_listing(shards[0], 1) ||
+		sqlite3_exec(shards[0]->connection, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+		fputs("Error, could not refresh the listing shards concurrently\n", stderr);
+		goto cleanup;
+	}
+
+	// an index on a shard connection follows the tags written through it
+	if ((shard_index = tag_bitmap_index_build(shards[0])) == NULL) {
+		fputs("Error, could not build a tag bitmap index on a listing shard\n", stderr);
+		goto cleanup;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (get_listing_size(shards[i], i + 1) != 2 || (cursor = open_listing_items_cursor(shards[i], i + 1, 0, 1)) == NULL) goto cleanup;
+		int found = cursor_next_item(cursor, &item);
+		item_ids[i] = item.item_id;
+		close_cursor(cursor);
+
+		// item ids of every shard have their own range
+		if (found != 1 || item_ids[i] >> 24 != i + 1) {
+			fputs("Error, listing shard item ids are not in the range of their listing\n", stderr);
+			goto cleanup;
+		}
+		if (update_tags(shards[i], item_ids[i], i ? tags_b : tags_a, AUTO_ADD_TAGS) != 1) goto cleanup;
+	}
+
+	tag_id = get_tag_id(catalog, "only_a");
+	if (tag_bitmap_index_query(shard_index, &tag_id, 1, &tagged) || bitmap_cardinality(tagged) != 1 ||
+		!bitmap_contains(tagged, (uint32_t) item_ids[0])) {
+		fputs("Error, the tag bitmap index of a listing shard missed a tag written through the shard\n", stderr);
+		goto cleanup;
+	}
+	bitmap_free(tagged);
+	tagged = NULL;
+
+	// the tags added through the shards are shared in the catalog
+	if (get_total_tags_count(catalog) != 3 || attach_listing_shards(catalog) != 2) {
+		fputs("Error, could not attach the listing shards\n", stderr);
+		goto cleanup;
+	}
+
+	// the items of the listing without a shard stay visible next to the shards
+	tag_id = get_tag_id(catalog, "shared");
+	if (get_listing_size(catalog, 1) != 2 || get_listing_size(catalog, 2) != 2 || get_listing_size(catalog, 3) != 2 ||
+		(cursor = open_tag_items_cursor(catalog, tag_id, 0, 10)) == NULL) {
+		fputs("Error, the attached listing shards are not visible in the catalog\n", stderr);
+		goto cleanup;
+	}
+	while (cursor_next_item(cursor, &item) == 1) {
+		for (int i = 0; i < 3; i++) {
+			if (item.item_id == item_ids[i]) items++;
+		}
+	}
+	close_cursor(cursor);
+
+	if (items != 3 || get_related_tags(catalog, &tag_id, 1, related, 4) != 2 || related[0].count != 1 || related[1].count != 1) {
+		fputs("Error, queries over the attached listing shards are wrong\n", stderr);
+		goto cleanup;
+	}
+
+	// the item ids of every shard fit into the bitmaps of a facet index over all listings
+	if ((catalog_index = tag_bitmap_index_build(catalog)) == NULL ||
+		tag_bitmap_index_query(catalog_index, &tag_id, 1, &tagged) || bitmap_cardinality(tagged) != 3 ||
+		!bitmap_contains(tagged, (uint32_t) item_ids[0]) || !bitmap_contains(tagged, (uint32_t) item_ids[1]) ||
+		!bitmap_contains(tagged, (uint32_t) item_ids[2])) {
+		fputs("Error, the tag bitmap index over the attached listing shards is wrong\n", stderr);
+		goto cleanup;
+	}
+
+	// changes of a tag over every item are refused on the catalog and on the shards
+	if (merge_tags(catalog, get_tag_id(catalog, "only_a"), tag_id) != -1 || merge_tags(shards[1], get_tag_id(catalog, "only_b"), tag_id) != -1 ||
+		remove_tag_from_all_items(shards[0], tag_id) != -1 || get_tag_id(catalog, "only_a") <= 0 || get_tag_id(catalog, "only_b") <= 0 ||
+		get_total_tags_count(catalog) != 3 || get_item_tags_count(shards[0], item_ids[0]) != 2) {
+		fputs("Error, a tag was changed over every item while listings have shards\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	bitmap_free(tagged);
+	tag_bitmap_index_free(catalog_index);
+	tag_bitmap_index_free(shard_index);
+	for (int i = 0; i < 3; i++) {
+		if (i < 2) close_database(shards[i]);
+		if (i < 2 && catalog != NULL && !listing_shard_location(catalog, i + 1, location, sizeof(location))) remove_database_files(location);
+		for (int j = 0; j < 2; j++) {
+			sprintf(path, "%s/%c/%c%d", temp_dir, 'a' + i, 'a' + i, j);
+			remove(path);
+		}
+		sprintf(path, "%s/%c", temp_dir, 'a' + i);
+		remove(path);
+	}
+	close_database(catalog);
+	remove_database_files("shard_test.tdb");
+	remove(temp_dir);
+	return result;
+}
+
+int test_maintenance(void) {
+	// leaves most of the pages of a large table free
+	static const char fill_sql[] = "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000) "
+		"INSERT INTO tags (tag_name) SELECT printf('maintenance%d-%.*c', i, 200, 'x') FROM n;"
+		"DELETE FROM tags WHERE tag_id > 200;";
+	struct maintenance_options options = {1000, 1, 1, 1000, 16};
+	struct maintenance_stats stats;
+	struct tagger_db *db;
+	sqlite3_int64 pages_vacuumed = 0;
+	sqlite3_stmt *stmt;
+	int optimized = 0, checkpointed = 0, result = -1, more, slices = 0;
+
+	remove_database_files("maintenance_test.tdb");
+	if ((db = open_database("maintenance_test.tdb", PROFILE_INTERACTIVE)) == NULL) return -1;
+	if (init_tables(db) || sqlite3_exec(db->connection, fill_sql, NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+
+	do {
+		if ((more = run_maintenance_slice(db, &options, &stats)) == -1) goto cleanup;
+		optimized += stats.optimized;
+		checkpointed |= stats.checkpointed;
+		pages_vacuumed += stats.pages_vacuumed;
+	} while (more == 1 && ++slices < 100);
+
+	// nothing is due right after the maintenance
+	if (more != 0 || optimized != 1 || !checkpointed || pages_vacuumed == 0 ||
+		run_maintenance_slice(db, &options, &stats) != 0 || stats.optimized || stats.pages_vacuumed) {
+		fprintf(stderr, "Error, maintenance did not run as expected: optimized %d times, %lld pages vacuumed\n", optimized, pages_vacuumed);
+		goto cleanup;
+	}
+
+	if (sqlite3_prepare_v2(db->connection, "SELECT (SELECT freelist_count FROM pragma_freelist_count), "
+			"EXISTS (SELECT 1 FROM sqlite_master WHERE name = 'sqlite_stat1');", -1, &stmt, NULL) != SQLITE_OK) {
+		goto cleanup;
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) == 0 && sqlite3_column_int(stmt, 1) == 1) result = 0;
+	sqlite3_finalize(stmt);
+	if (result) fputs("Error, maintenance left free pages or no statistics\n", stderr);
+
+cleanup:
+	close_database(db);
+	remove_database_files("maintenance_test.tdb");
+	return result;
+}
+
+static int get_schema_cookie(struct tagger_db *db) {
+	sqlite3_stmt *stmt;
+	int cookie = -1;
+
+	if (sqlite3_prepare_v2(db->connection, "PRAGMA main.schema_version;", -1, &stmt, NULL) == SQLITE_OK &&
+		sqlite3_step(stmt) == SQLITE_ROW) {
+		cookie = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return cookie;
+}
+
+int test_tag_set_operations(void) {
+	// items 1 to 6 with tags a to e, item 6 has both b and c
+	static const char data_sql[] = "INSERT INTO listings VALUES (1, 'l', 0, '/l');"
+		"INSERT INTO tags VALUES (1, 'a'), (2, 'b'), (3, 'c'), (4, 'd'), (5, 'e');"
+		"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 6) "
+		"INSERT INTO items SELECT i, 'item' || i, '/item' || i, 1 FROM n;"
+		"INSERT INTO itemtags VALUES (1, 1), (1, 2), (2, 2), (2, 4), (3, 3), (3, 4), (4, 3), (4, 5), (5, 1), (6, 2), (6, 3);";
+	sqlite3_int64 item_ids[] = {1, 3, 4}, tag_ids[] = {1, 4};
+	struct tagger_db *db;
+	int result = -1, schema_cookie;
+
+	remove_database_files("tag_set_test.tdb");
+	if ((db = open_database("tag_set_test.tdb", PROFILE_INTERACTIVE)) == NULL) return -1;
+	if (init_tables(db) || sqlite3_exec(db->connection, data_sql, NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+	schema_cookie = get_schema_cookie(db);
+
+	// c is merged into b, items 3 and 4 get b while item 6 already has it
+	if (merge_tags(db, 3, 2) != 2 || get_tag_id(db, "c") != 0 || get_item_tags_count(db, 6) != 1 ||
+		count_cooccurrence_differences(db) != 0) {
+		fputs("Error, merging tags gave wrong item tags or co-occurrence counts\n", stderr);
+		goto cleanup;
+	}
+	if (merge_tags(db, 2, 2) != -1 || merge_tags(db, 1, 3) != -1 || get_tag_id(db, "a") != 1) {
+		fputs("Error, merging into the same or a missing tag should fail\n", stderr);
+		goto cleanup;
+	}
+
+	if (rename_tag(db, 2, "renamed") != 1 || get_tag_id(db, "renamed") != 2 || get_tag_id(db, "b") != 0 ||
+		rename_tag(db, 2, "a") != -1 || rename_tag(db, 3, "c") != 0) {
+		fputs("Error, renaming tags did not work as expected\n", stderr);
+		goto cleanup;
+	}
+
+	// a from items 1 and 5, d from item 3, item 4 has neither
+	if (remove_item_tags(db, item_ids, 3, tag_ids, 2) != 2 || get_item_tags_count(db, 1) != 1 ||
+		get_item_tags_count(db, 5) != 1 || get_item_tags_count(db, 3) != 1 || count_cooccurrence_differences(db) != 0) {
+		fputs("Error, removing item tags gave wrong item tags or co-occurrence counts\n", stderr);
+		goto cleanup;
+	}
+
+	if (remove_tag_from_all_items(db, 2) != 5 || get_tag_id(db, "renamed") != 2 || get_item_tags_count(db, 4) != 1 ||
+		count_cooccurrence_differences(db) != 0) {
+		fputs("Error, removing a tag from all items gave wrong item tags or co-occurrence counts\n", stderr);
+		goto cleanup;
+	}
+
+	// the co-occurrence triggers were paused without changing the schema, and count again
+	if (get_schema_cookie(db) != schema_cookie ||
+		sqlite3_exec(db->connection, "INSERT INTO itemtags VALUES (2, 5), (6, 4), (6, 5);", NULL, NULL, NULL) != SQLITE_OK ||
+		count_cooccurrence_differences(db) != 0) {
+		fputs("Error, the co-occurrence triggers changed the schema or were not resumed\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	close_database(db);
+	remove_database_files("tag_set_test.tdb");
+	return result;
+}
+
+struct fetch_test_state {
+	struct fetch_engine *engine;
+	char follow_up_url[4096];
+	int succeeded;
+	int failed;
+	int follow_ups;
+};
+
+static void fetch_test_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	struct fetch_test_state *state = user_data;
+	(void) status;
+
+	if (result != CURLE_OK) {
+		state->failed++;
+		return;
+	}
+
+	// every file holds its own url
+	if (strcmp((*response)->ptr, url) != 0) {
+		state->failed++;
+		return;
+	}
+	state->succeeded++;
+
+	// transfers submitted from a callback run in the same loop
+	if (state->follow_ups++ == 0) fetch_engine_submit(state->engine, state->follow_up_url, fetch_test_callback, state);
+}
+
+int test_fetch_engine(void) {
+	char pattern[] = "/tmp/tmp.XXXXXX", urls[8][128], path[64];
+	char *temp_dir = mkdtemp(pattern);
+	struct fetch_request requests[8];
+	struct fetch_test_state state = {0};
+	int result = -1;
+
+	if (temp_dir == NULL) return -1;
+
+	for (int i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "%s/%d", temp_dir, i);
+		snprintf(urls[i], sizeof(urls[i]), "file://%s", path);
+		requests[i] = (struct fetch_request) {urls[i], fetch_test_callback, &state};
+
+		// the last url points to a missing file
+		if (i == 7) continue;
+		FILE *f = fopen(path, "w");
+		if (f == NULL) goto cleanup;
+		fputs(urls[i], f);
+		fclose(f);
+	}
+	strcpy(state.follow_up_url, urls[0]);
+
+	// fewer slots than transfers, so most of them wait in the queue
+	if ((state.engine = fetch_engine_create(3)) == NULL) goto cleanup;
+	if (fetch_engine_submit_batch(state.engine, requests, 8) || fetch_engine_run(state.engine)) goto cleanup;
+
+	if (state.succeeded != 8 || state.failed != 1) {
+		fprintf(stderr, "Error, fetch engine finished %d transfers and failed %d\n", state.succeeded, state.failed);
+		goto cleanup;
+	}
+
+	// blocking transfers take their handles from the same pool
+	struct response *response = get_response_from_url(urls[1]);
+	if (response == NULL || strcmp(response->ptr, urls[1]) != 0 || get_response_from_url(urls[7]) != NULL) {
+		fputs("Error, blocking transfers with pooled handles failed\n", stderr);
+		free_response(response);
+		goto cleanup;
+	}
+	free_response(response);
+	result = 0;
+
+cleanup:
+	fetch_engine_destroy(state.engine);
+	cleanup_provider_connections();
+	for (int i = 0; i < 7; i++) {
+		snprintf(path, sizeof(path), "%s/%d", temp_dir, i);
+		remove(path);
+	}
+	remove(temp_dir);
+	return result;
+}
+
+// HTTP server on the loopback interface, answering one request per connection
+struct test_http_server {
+	int fd;
+	int port;
+	int requests;
+	int failures; // `/flaky` answers `503` until this many requests failed
+	pthread_t thread;
+};
+
+static void* test_http_server_run(void *arg) {
+	struct test_http_server *server = arg;
+	char request[4096], path[256], response[1024];
+	int client;
+
+	while ((client = accept(server->fd, NULL, NULL)) >= 0) {
+		size_t length = 0;
+		ssize_t n;
+
+		while (length < sizeof(request) - 1 && (n = read(client, request + length, sizeof(request) - 1 - length)) > 0) {
+			length += n;
+			request[length] = '\0';
+			if (strstr(request, "\r\n\r\n") != NULL) break;
+		}
+		request[length] = '\0';
+		if (sscanf(request, "GET %255s", path) != 1) strcpy(path, "/");
+		server->requests++;
+
+		// `/slow` keeps its client waiting
+		if (strcmp(path, "/slow") == 0) {
+			struct timespec delay = {0, 100 * 1000000L};
+			nanosleep(&delay, NULL);
+		}
+		// `/fresh` paths may be cached for an hour, the others are revalidated every time
+		const char *cache_control = strncmp(path, "/fresh", 6) == 0 ? "max-age=3600" : "no-cache";
+		if (strcmp(path, "/down") == 0 || (strcmp(path, "/flaky") == 0 && server->failures > 0)) {
+			if (strcmp(path, "/flaky") == 0) server->failures--;
+			length = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+				strcmp(path, "/down") == 0 ? "500 Internal Server Error" : "503 Service Unavailable");
+		} else if (strcmp(path, "/busy") == 0) {
+			length = snprintf(response, sizeof(response), "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 2\r\n"
+				"Content-Length: 0\r\nConnection: close\r\n\r\n");
+		} else if (strstr(request, "If-None-Match: \"v1\"") != NULL) {
+			length = snprintf(response, sizeof(response), "HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n"
+				"Cache-Control: %s\r\nConnection: close\r\n\r\n", cache_control);
+		} else {
+			length = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nETag: \"v1\"\r\nCache-Control: %s\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\nbody of %s", cache_control, strlen(path) + 8, path);
+		}
+		// the client may already be gone, which must not raise `SIGPIPE`
+		if (send(client, response, length, MSG_NOSIGNAL) < 0) perror("send");
+		close(client);
+	}
+	return NULL;
+}
+
+static int start_test_http_server(struct test_http_server *server) {
+	struct sockaddr_in address = {0};
+	socklen_t address_length = sizeof(address);
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->requests = 0;
+	server->failures = 0;
+
+	if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+	if (bind(server->fd, (struct sockaddr *) &address, sizeof(address)) || listen(server->fd, 16) ||
+		getsockname(server->fd, (struct sockaddr *) &address, &address_length) ||
+		pthread_create(&server->thread, NULL, test_http_server_run, server)) {
+		close(server->fd);
+		return -1;
+	}
+	server->port = ntohs(address.sin_port);
+	return 0;
+}
+
+static void stop_test_http_server(struct test_http_server *server) {
+	// wakes the accept call of the server thread
+	shutdown(server->fd, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+	close(server->fd);
+}
+
+/**
+ * @brief Get an url through the cache and check its body
+ *
+ * @return number of requests the server got for it, or `-1` on error
+ */
+static int http_cache_test_get(struct http_cache *cache, struct test_http_server *server, const char *path) {
+	char url[128], body[128];
+	int requests = server->requests;
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", server->port, path);
+	snprintf(body, sizeof(body), "body of %s", path);
+
+	struct response *response = http_cache_get(cache, url);
+	int matches = response != NULL && strcmp(response->ptr, body) == 0;
+	free_response(response);
+	return matches ? server->requests - requests : -1;
+}
+
+int test_response_buffer(void) {
+	char location[] = "/tmp/tmp.XXXXXX", url[64];
+	size_t size = 1 << 20;
+	struct response *responses[2] = {NULL, NULL};
+	int fd = mkstemp(location), result = -1;
+
+	if (fd < 0) return -1;
+	snprintf(url, sizeof(url), "file://%s", location);
+
+	// a body far larger than the chunks curl delivers
+	char *body = malloc(size);
+	if (body == NULL) goto cleanup;
+	for (size_t i = 0; i < size; i++) body[i] = 'a' + i % 26;
+	if (write(fd, body, size) != (ssize_t) size) goto cleanup;
+
+	responses[0] = get_response_from_url(url);
+	set_response_spill_threshold(size / 4);
+	responses[1] = get_response_from_url(url);
+	set_response_spill_threshold(0);
+
+	for (int i = 0; i < 2; i++) {
+		if (responses[i] == NULL || responses[i]->len != size || memcmp(responses[i]->ptr, body, size) != 0 ||
+			responses[i]->ptr[size] != '\0' || responses[i]->mapped != i) {
+			fprintf(stderr, "Error, wrong %s response body\n", i ? "spilled" : "in memory");
+			goto cleanup;
+		}
+	}
+	result = 0;
+
+cleanup:
+	free_response(responses[0]);
+	free_response(responses[1]);
+	free(body);
+	close(fd);
+	remove(location);
+	return result;
+}
+
+static int collect_json_tag(const char *tag, size_t length, void *user_data) {
+	char *tags = user_data;
+	size_t used = strlen(tags);
+
+	if (used + length + 2 > 256) return -1;
+	memcpy(tags + used, tag, length);
+	tags[used + length] = '|';
+	tags[used + length + 1] = '\0';
+	return 0;
+}
+
+int test_json_stream(void) {
+	static const char document[] = "{\"id\": 1, \"tags\": [\"rock\", \"caf\\u00e9\", \"\\ud83c\\udfb8\"], "
+		"\"meta\": {\"genres\": [\"a\", [\"b\"]], \"tags\": \"single\", \"title\": \"not \\\"a\\\" tag\", "
+		"\"items\": [{\"tags\": [\"nested\"], \"name\": \"x\"}]}, \"other\": [true, false, null, -1.5e3, {}, []]}";
+	static const char expected[] = "rock|caf\xc3\xa9|\xf0\x9f\x8e\xb8|a|b|single|nested|";
+	static const char *const keys[] = {"tags", "genres", NULL};
+	static const char *const invalid[] = {"{\"a\": [1, 2}", "{\"a\" 1}", "[1, 2,]", "{\"a\": tru}", "[\"\\x\"]", "{} {}", NULL};
+	struct json_tag_extractor extractor;
+	struct json_stream *stream;
+	char tags[256], location[] = "/tmp/tmp.XXXXXX", url[64];
+	size_t document_length = sizeof(document) - 1;
+
+	// chunk boundaries may fall anywhere, even inside escapes
+	for (size_t chunk = 1; chunk <= document_length; chunk = chunk * 3 + 1) {
+		tags[0] = '\0';
+		json_tag_extractor_init(&extractor, keys, collect_json_tag, tags);
+		if ((stream = json_stream_create(&json_tag_extractor_handler, &extractor)) == NULL) return -1;
+
+		int rc = 0;
+		for (size_t offset = 0; offset < document_length && rc == 0; offset += chunk) {
+			size_t length = document_length - offset < chunk ? document_length - offset : chunk;
+			rc = json_stream_feed(stream, document + offset, length);
+		}
+		rc = rc || json_stream_finish(stream);
+		json_stream_destroy(stream);
+
+		if (rc || strcmp(tags, expected) != 0) {
+			fprintf(stderr, "Error, wrong tags with chunks of %zu bytes: %s\n", chunk, tags);
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; invalid[i] != NULL; i++) {
+		if ((stream = json_stream_create(NULL, NULL)) == NULL) return -1;
+		int rc = json_stream_feed(stream, invalid[i], strlen(invalid[i])) || json_stream_finish(stream);
+		json_stream_destroy(stream);
+		if (!rc) {
+			fprintf(stderr, "Error, invalid JSON was accepted: %s\n", invalid[i]);
+			return -1;
+		}
+	}
+
+	// a top level number only ends with the document, a truncated document is an error
+	if ((stream = json_stream_create(NULL, NULL)) == NULL) return -1;
+	int rc = json_stream_feed(stream, "42", 2) || json_stream_finish(stream);
+	json_stream_destroy(stream);
+	if ((stream = json_stream_create(NULL, NULL)) == NULL) return -1;
+	rc = rc || json_stream_feed(stream, "{\"a\": 1", 7) || !json_stream_finish(stream);
+	json_stream_destroy(stream);
+	if (rc) {
+		fputs("Error, complete and truncated documents were not told apart\n", stderr);
+		return -1;
+	}
+
+	// tags are extracted while curl downloads the document
+	int fd = mkstemp(location);
+	if (fd < 0) return -1;
+	snprintf(url, sizeof(url), "file://%s", location);
+	tags[0] = '\0';
+	rc = write(fd, document, document_length) != (ssize_t) document_length ||
+		stream_tags_from_url(url, keys, collect_json_tag, tags) || strcmp(tags, expected) != 0;
+	close(fd);
+	remove(location);
+	cleanup_provider_connections();
+	if (rc) {
+		fprintf(stderr, "Error, wrong tags streamed from %s: %s\n", url, tags);
+		return -1;
+	}
+
+	return 0;
+}
+
+int test_http_cache(void) {
+	struct test_http_server server;
+	struct http_cache_stats stats;
+	struct http_cache *cache = NULL;
+	int result = -1;
+
+	remove_database_files("http_cache_test.db");
+	if (start_test_http_server(&server)) return -1;
+
+	// room for two responses
+	if ((cache = http_cache_open("http_cache_test.db", 100)) == NULL) goto cleanup;
+
+	// a fresh response is served without a request, a stale one is revalidated
+	if (http_cache_test_get(cache, &server, "/fresh1") != 1 || http_cache_test_get(cache, &server, "/fresh1") != 0 ||
+		http_cache_test_get(cache, &server, "/stale") != 1 || http_cache_test_get(cache, &server, "/stale") != 1) {
+		fputs("Error, the HTTP cache did not serve or revalidate its responses\n", stderr);
+		goto cleanup;
+	}
+
+	// the third response evicts the least recently used one
+	if (http_cache_test_get(cache, &server, "/fresh2") != 1 || http_cache_test_get(cache, &server, "/fresh1") != 1) {
+		fputs("Error, the HTTP cache did not evict the least recently used response\n", stderr);
+		goto cleanup;
+	}
+
+	http_cache_get_stats(cache, &stats);
+	if (stats.hits != 1 || stats.revalidations != 1 || stats.misses != 4 || stats.evictions != 2 || stats.stored_bytes > 100) {
+		fprintf(stderr, "Error, wrong HTTP cache counters: %lld hits, %lld revalidations, %lld misses, %lld evictions\n",
+				stats.hits, stats.revalidations, stats.misses, stats.evictions);
+		goto cleanup;
+	}
+
+	// responses outlive the cache connection
+	http_cache_close(cache);
+	if ((cache = http_cache_open("http_cache_test.db", 100)) == NULL || http_cache_test_get(cache, &server, "/fresh2") != 0) {
+		fputs("Error, the HTTP cache did not keep its responses\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	http_cache_close(cache);
+	stop_test_http_server(&server);
+	cleanup_provider_connections();
+	remove_database_files("http_cache_test.db");
+	return result;
+}
+
+static void rate_limit_test_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	int *statuses = user_data;
+	(void) url;
+	(void) response;
+
+	if (result == CURLE_OK) statuses[status == 429]++;
+}
+
+static long long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int test_rate_limiter(void) {
+	struct test_http_server server;
+	struct rate_limiter *limiter = NULL;
+	struct fetch_engine *engine = NULL;
+	struct timespec start;
+	char url[128];
+	int statuses[2] = {0, 0}, result = -1;
+
+	if (start_test_http_server(&server)) return -1;
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/fresh", server.port);
+
+	// a burst of two, then one request every 50 ms
+	if ((limiter = rate_limiter_create(20, 2)) == NULL) goto cleanup;
+	long waits[3] = {rate_limiter_try_acquire(limiter, url), rate_limiter_try_acquire(limiter, url), rate_limiter_try_acquire(limiter, url)};
+	if (waits[0] != 0 || waits[1] != 0 || waits[2] <= 0 || waits[2] > 51 || rate_limiter_try_acquire(limiter, "file:///tmp") != 0) {
+		fprintf(stderr, "Error, wrong rate limiter waits: %ld %ld %ld\n", waits[0], waits[1], waits[2]);
+		goto cleanup;
+	}
+	rate_limiter_destroy(limiter);
+
+	// ten transfers at 20 per second with a burst of one take at least 450 ms
+	if ((limiter = rate_limiter_create(20, 1)) == NULL || (engine = fetch_engine_create(8)) == NULL) goto cleanup;
+	fetch_engine_set_rate_limiter(engine, limiter);
+	for (int i = 0; i < 10; i++) {
+		if (fetch_engine_submit(engine, url, rate_limit_test_callback, statuses)) goto cleanup;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (fetch_engine_run(engine) || statuses[0] != 10 || elapsed_ms(&start) < 400) {
+		fprintf(stderr, "Error, rate limited transfers took %lld ms\n", elapsed_ms(&start));
+		goto cleanup;
+	}
+
+	// the host is paused for the Retry-After of a 429
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/busy", server.port);
+	if (fetch_engine_submit(engine, url, rate_limit_test_callback, statuses) || fetch_engine_run(engine) ||
+		statuses[1] != 1 || rate_limiter_try_acquire(limiter, url) < 1500) {
+		fputs("Error, a 429 response did not pause its host\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	fetch_engine_destroy(engine);
+	rate_limiter_destroy(limiter);
+	stop_test_http_server(&server);
+	cleanup_provider_connections();
+	return result;
+}
+
+static void retry_test_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	long *statuses = user_data;
+	(void) url;
+	(void) response;
+
+	// the first slot counts the callbacks, the second keeps the last status
+	statuses[0]++;
+	statuses[1] = result == CURLE_OK ? status : -1;
+}
+
+int test_retry_policy(void) {
+	static const char *const keys[] = {"tags", NULL};
+	struct test_http_server server;
+	struct circuit_breaker *breaker = NULL;
+	struct http_cache *cache = NULL;
+	struct fetch_engine *engine = NULL;
+	struct response *response = NULL;
+	struct retry_policy policy = {3, 10, 50};
+	char flaky_url[128], down_url[128], url[128], tags[256] = "";
+	long status, statuses[2] = {0, 0};
+	int requests, result = -1;
+
+	if (start_test_http_server(&server)) return -1;
+	snprintf(flaky_url, sizeof(flaky_url), "http://127.0.0.1:%d/flaky", server.port);
+	snprintf(down_url, sizeof(down_url), "http://127.0.0.1:%d/down", server.port);
+
+	if ((breaker = circuit_breaker_create(3, 200)) == NULL) goto cleanup;
+	set_provider_retry_policy(&policy, breaker);
+
+	// two failures are retried, and the success closes the circuit again
+	server.failures = 2;
+	if (get_provider_response(flaky_url, &response, &status) != PROVIDER_OK || status != 200 || server.requests != 3) {
+		fprintf(stderr, "Error, a flaky url was not retried: %d requests\n", server.requests);
+		goto cleanup;
+	}
+	free_response(response);
+	response = NULL;
+
+	// a failing host opens its circuit, requests then fail without reaching it
+	if (get_provider_response(down_url, &response, &status) != PROVIDER_HTTP_ERROR || status != 500 || server.requests != 6) {
+		fputs("Error, a failing url did not fail after its retries\n", stderr);
+		goto cleanup;
+	}
+	if (get_provider_response(flaky_url, &response, &status) != PROVIDER_CIRCUIT_OPEN || server.requests != 6) {
+		fputs("Error, an open circuit let a request through\n", stderr);
+		goto cleanup;
+	}
+
+	// after the cooldown a probe goes through and closes the circuit
+	struct timespec cooldown = {0, 250 * 1000000L};
+	nanosleep(&cooldown, NULL);
+	if (get_provider_response(flaky_url, &response, &status) != PROVIDER_OK || server.requests != 7) {
+		fputs("Error, the probe after the cooldown failed\n", stderr);
+		goto cleanup;
+	}
+	free_response(response);
+	response = NULL;
+
+	// cached and streamed requests retry error responses, which count for the circuit
+	server.failures = 1;
+	if ((cache = http_cache_open("retry_test.db", 0)) == NULL || http_cache_test_get(cache, &server, "/flaky") != 2) {
+		fputs("Error, the HTTP cache did not retry an error response\n", stderr);
+		goto cleanup;
+	}
+	requests = server.requests;
+	if (!stream_tags_from_url(down_url, keys, collect_json_tag, tags) || server.requests != requests + 3 ||
+		get_provider_response(flaky_url, &response, &status) != PROVIDER_CIRCUIT_OPEN) {
+		fputs("Error, a streamed error response was not retried or did not open the circuit\n", stderr);
+		goto cleanup;
+	}
+
+	// a probe dropped with its engine is given back, so the next request probes instead
+	nanosleep(&cooldown, NULL);
+	if ((engine = fetch_engine_create(4)) == NULL) goto cleanup;
+	fetch_engine_set_retry_policy(engine, &policy, breaker);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow", server.port);
+	if (fetch_engine_submit(engine, url, retry_test_callback, statuses) || fetch_engine_perform(engine, 0) != 1) goto cleanup;
+	fetch_engine_destroy(engine);
+	engine = NULL;
+	if (get_provider_response(flaky_url, &response, &status) != PROVIDER_OK) {
+		fputs("Error, a dropped probe kept the circuit open\n", stderr);
+		goto cleanup;
+	}
+	free_response(response);
+	response = NULL;
+
+	// the fetch engine requeues transient failures, only the last attempt reaches the callback
+	if ((engine = fetch_engine_create(4)) == NULL) goto cleanup;
+	fetch_engine_set_retry_policy(engine, &policy, NULL);
+	server.failures = 2;
+	requests = server.requests;
+	if (fetch_engine_submit(engine, flaky_url, retry_test_callback, statuses) || fetch_engine_run(engine) ||
+		statuses[0] != 1 || statuses[1] != 200 || server.requests != requests + 3) {
+		fprintf(stderr, "Error, the fetch engine did not retry: %ld callbacks, status %ld\n", statuses[0], statuses[1]);
+		goto cleanup;
+	}
+	if (fetch_engine_submit(engine, down_url, retry_test_callback, statuses) || fetch_engine_run(engine) ||
+		statuses[0] != 2 || statuses[1] != 500 || server.requests != requests + 6) {
+		fputs("Error, the fetch engine did not give up on a failing url\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	set_provider_retry_policy(NULL, NULL);
+	http_cache_close(cache);
+	remove_database_files("retry_test.db");
+	fetch_engine_destroy(engine);
+	circuit_breaker_destroy(breaker);
+	stop_test_http_server(&server);
+	cleanup_provider_connections();
+	return result;
+}
+
+// provider with a custom url builder and parser, the response has one tag per line
+static int lines_provider_url(const struct tag_provider *provider, const struct item_row *item, char *url, size_t size) {
+	if (!strcmp(item->item_name, "item2")) return 1;
+	return build_provider_url(provider->data, item, url, size);
+}
+
+static int lines_provider_parse(const struct tag_provider *provider, const struct response *response,
+								provider_tag_callback callback, void *user_data) {
+	(void) provider;
+	for (const char *line = response->ptr, *end; *line != '\0'; line = *end != '\0' ? end + 1 : end) {
+		if ((end = strchr(line, '\n')) == NULL) end = line + strlen(line);
+		if (callback(line, end - line, user_data)) return -1;
+	}
+	return 0;
+}
+
+extern int submit_provider_request(struct fetch_engine *engine, const char *url, struct provider_request *request,
+								   fetch_callback callback, void *user_data);
+extern void collect_provider_request(struct provider_request *request, const char *url, CURLcode result, long status,
+									 const struct response *response);
+extern void clear_provider_tags(struct provider_tags *found);
+
+struct streamed_test_request {
+	struct provider_request request;
+	size_t buffered; // bytes of the response handed to the callback
+};
+
+static void streamed_test_callback(const char *url, CURLcode result, long status, struct response **response, void *user_data) {
+	struct streamed_test_request *r = user_data;
+
+	r->buffered += (*response)->len;
+	collect_provider_request(&r->request, url, result, status, *response);
+}
+
+static int write_test_file(const char *directory, const char *name, const char *content) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+	FILE *file = fopen(path, "w");
+	if (file == NULL) return -1;
+	fputs(content, file);
+	return fclose(file) ? -1 : 0;
+}
+
+int test_tag_providers(void) {
+	static const char data_sql[] = "INSERT INTO listings VALUES (1, 'l', 0, '/l');"
+		"INSERT INTO tags VALUES (1, 'rock');"
+		"INSERT INTO items VALUES (1, 'item1', '/item1', 1), (2, 'item2', '/item2', 1), (3, 'item3', '/item3', 1);";
+	static const char *const tag_keys[] = {"tags", NULL};
+	static const char *const files[][2] = {{"item1.json", "{\"tags\": [\"rock\", \"jazz\"]}"}, {"item2.json", "{\"tags\": [\"pop\"]}"},
+		{"item1.txt", "jazz\nblues\n"}, {"item3.txt", "folk"}, {"truncated.json", "{\"tags\": [\"rock\""}};
+	char pattern[] = "/tmp/tmp.XXXXXX", json_template[128], lines_template[128], url[64], path[128];
+	char *temp_dir = mkdtemp(pattern);
+	struct item_row escaped_item = {1, "a b/c", "/dir/x y.txt", 1};
+	struct item_row items[] = {{1, "item1", "/item1", 1}, {3, "item3", "/item3", 1}};
+	struct provider_options options = {PROVIDER_MERGE_FIRST, 0, 4, 2, NULL, NULL, NULL};
+	struct mock_provider_options mock_options = {NULL, 0, 0, 1, 0, 0};
+	struct retry_policy policy = {2, 1, 1};
+	struct mock_provider_stats mock_stats;
+	struct provider_stats stats;
+	struct mock_provider *server = NULL;
+	struct fetch_engine *engine = NULL;
+	struct provider_tags streamed[2] = {{NULL, 0, 0}, {NULL, 0, 0}};
+	struct streamed_test_request streamed_requests[2];
+	struct circuit_breaker *breaker = NULL;
+	struct rate_limiter *limiter = NULL;
+	struct tagger_db *db = NULL;
+	struct timespec start;
+	char mock_template[PROVIDER_URL_SIZE + 64];
+	int result = -1;
+
+	if (temp_dir == NULL) return -1;
+	snprintf(json_template, sizeof(json_template), "file://%s/{name}.json", temp_dir);
+	snprintf(lines_template, sizeof(lines_template), "file://%s/{name}.txt", temp_dir);
+	struct tag_provider providers[] = {
+		{"json", json_template, tag_keys, NULL, NULL, NULL},
+		{"lines", NULL, NULL, lines_provider_url, lines_provider_parse, lines_template}
+	};
+
+	if (build_provider_url("http://h/{name}?p={path}", &escaped_item, url, sizeof(url)) ||
+		strcmp(url, "http://h/a%20b%2Fc?p=dir/x%20y.txt") || build_provider_url("http://h/{name}", &escaped_item, url, 12) != -1) {
+		fprintf(stderr, "Error, wrong provider url: %s\n", url);
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		if (write_test_file(temp_dir, files[i][0], files[i][1])) goto cleanup;
+	}
+
+	remove_database_files("provider_test.tdb");
+	if ((db = open_database("provider_test.tdb", PROFILE_INTERACTIVE)) == NULL) goto cleanup;
+	if (init_tables(db) || sqlite3_exec(db->connection, data_sql, NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+
+	// the first provider wins, only known tags are added, item3 has no json and item2 is skipped by the lines provider
+	if (run_tag_providers_on_listing(db, 1, providers, 2, &options, &stats) || stats.items != 3 || stats.requests != 5 ||
+		stats.failed_requests != 1 || stats.tags_found != 6 || stats.unknown_tags != 3 || stats.items_tagged != 1 || stats.item_tags_added != 1 ||
+		get_item_tags_count(db, 1) != 1 || get_tag_id(db, "jazz") != 0) {
+		fprintf(stderr, "Error, wrong provider run: %zu items, %zu requests, %zu failed, %zu tags, %lld added\n",
+			stats.items, stats.requests, stats.failed_requests, stats.tags_found, stats.item_tags_added);
+		goto cleanup;
+	}
+
+	// tags of every provider are merged and new tags are added
+	options.merge = PROVIDER_MERGE_ALL;
+	options.auto_add_tags = 1;
+	if (run_tag_providers(db, providers, 2, items, 2, &options, &stats) || stats.item_tags_added != 3 ||
+		get_item_tags_count(db, 1) != 3 || get_item_tags_count(db, 3) != 1 || get_item_tags_count(db, 2) != 0) {
+		fputs("Error, merged provider tags were not added\n", stderr);
+		goto cleanup;
+	}
+
+	// JSON responses are parsed while they download, a truncated one fails alone
+	memset(&stats, 0, sizeof(stats));
+	if ((engine = fetch_engine_create(2)) == NULL) goto cleanup;
+	for (int i = 0; i < 2; i++) {
+		snprintf(url, sizeof(url), "file://%s/%s", temp_dir, i ? "truncated.json" : "item1.json");
+		streamed_requests[i] = (struct streamed_test_request) {{providers, streamed + i, &stats, NULL}, 0};
+		if (submit_provider_request(engine, url, &streamed_requests[i].request, streamed_test_callback, streamed_requests + i)) goto cleanup;
+	}
+	if (fetch_engine_run(engine) || streamed[0].count != 2 || streamed[1].count != 0 || stats.tags_found != 2 || stats.failed_requests != 1 ||
+		streamed_requests[0].buffered != 0 || streamed_requests[1].buffered != 0) {
+		fprintf(stderr, "Error, wrong streamed provider responses: %zu and %zu tags, %zu failed\n",
+			streamed[0].count, streamed[1].count, stats.failed_requests);
+		goto cleanup;
+	}
+
+	// requests follow the rate limiter, retry policy and circuit breaker of the options:
+	// three failed attempts open the circuit, the retry of the second item then fails fast
+	if ((server = mock_provider_start(&mock_options)) == NULL || (breaker = circuit_breaker_create(3, 60000)) == NULL ||
+		(limiter = rate_limiter_create(20, 1)) == NULL) {
+		goto cleanup;
+	}
+	snprintf(mock_template, sizeof(mock_template), "http://127.0.0.1:%d/{name}", mock_provider_port(server));
+	struct tag_provider mock = {"mock", mock_template, tag_keys, NULL, NULL, NULL};
+	options.max_in_flight = 1;
+	options.limiter = limiter;
+	options.retry_policy = &policy;
+	options.breaker = breaker;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (run_tag_providers(db, &mock, 1, items, 2, &options, &stats) || stats.requests != 2 || stats.failed_requests != 2) goto cleanup;
+	mock_provider_get_stats(server, &mock_stats);
+	if (mock_stats.requests != 3 || elapsed_ms(&start) < 100) {
+		fprintf(stderr, "Error, provider requests ignored their options: %zu requests in %lld ms\n", mock_stats.requests, elapsed_ms(&start));
+		goto cleanup;
+	}
+
+	// an item whose url is too long fails its request without failing the run
+	memset(mock_template, 'x', PROVIDER_URL_SIZE);
+	strcpy(mock_template + PROVIDER_URL_SIZE, "{name}");
+	options.limiter = NULL;
+	options.retry_policy = NULL;
+	options.breaker = NULL;
+	if (run_tag_providers(db, &mock, 1, items, 2, &options, &stats) || stats.requests != 2 || stats.failed_requests != 2) {
+		fputs("Error, an overlong provider url failed the run\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	fetch_engine_destroy(engine);
+	clear_provider_tags(streamed);
+	clear_provider_tags(streamed + 1);
+	close_database(db);
+	mock_provider_stop(server);
+	circuit_breaker_destroy(breaker);
+	rate_limiter_destroy(limiter);
+	remove_database_files("provider_test.tdb");
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", temp_dir, files[i][0]);
+		remove(path);
+	}
+	remove(temp_dir);
+	cleanup_provider_connections();
+	return result;
+}
+
+int test_mock_provider(void) {
+	struct mock_provider_options options = {"{\"tags\": [\"canned\"]}", 50, 0, 0, 1, 7};
+	struct retry_policy policy = {1, 1, 1};
+	struct mock_provider_stats stats;
+	struct mock_provider *server;
+	struct response *response = NULL;
+	struct timespec start;
+	char url[64];
+	long status;
+	int result = -1;
+
+	// one request per second, answered after 50 ms
+	if ((server = mock_provider_start(&options)) == NULL) return -1;
+	set_provider_retry_policy(&policy, NULL);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/item", mock_provider_port(server));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (get_provider_response(url, &response, &status) != PROVIDER_OK || strcmp(response->ptr, options.body) ||
+		elapsed_ms(&start) < 50) {
+		fputs("Error, the mock provider did not answer with its canned body after its latency\n", stderr);
+		goto cleanup;
+	}
+	free_response(response);
+	response = NULL;
+
+	// the second request within the second is throttled, without the latency
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (get_provider_response(url, &response, &status) != PROVIDER_HTTP_ERROR || status != 429 || elapsed_ms(&start) >= 50) {
+		fputs("Error, the mock provider did not throttle\n", stderr);
+		goto cleanup;
+	}
+	mock_provider_stop(server);
+	server = NULL;
+
+	// every request fails, both attempts reach the server over one kept-alive connection
+	options.latency_ms = 0;
+	options.error_rate = 1;
+	options.requests_per_second = 0;
+	if ((server = mock_provider_start(&options)) == NULL) goto cleanup;
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/item", mock_provider_port(server));
+	policy.max_attempts = 2;
+	set_provider_retry_policy(&policy, NULL);
+	if (get_provider_response(url, &response, &status) != PROVIDER_HTTP_ERROR || status != 500) {
+		fputs("Error, the mock provider did not fail\n", stderr);
+		goto cleanup;
+	}
+	mock_provider_get_stats(server, &stats);
+	if (stats.requests != 2 || stats.errors != 2 || stats.throttled != 0 || stats.connections != 1) {
+		fprintf(stderr, "Error, wrong mock provider statistics: %zu requests, %zu errors, %zu connections\n",
+			stats.requests, stats.errors, stats.connections);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	set_provider_retry_policy(NULL, NULL);
+	mock_provider_stop(server);
+	cleanup_provider_connections();
+	return result;
+}
+
+int test_pipeline(void) {
+	static const char *const tag_keys[] = {"tags", NULL};
+	static const char *const files[] = {"a.txt", "b.txt", "c.txt", "d.txt", "e.txt", "sub/a.txt", "sub/f.txt", "sub/g.txt"};
+	struct mock_provider_options mock_options = {NULL, 5, 5, 0, 0, 1};
+	struct provider_options provider_options = {PROVIDER_MERGE_ALL, 1, 2, 2, NULL, NULL, NULL};
+	struct pipeline_options options = {2, 2, 2};
+	struct provider_stats provider_stats;
+	struct pipeline_stats stats;
+	struct mock_provider *server = NULL;
+	struct tagger_db *db = NULL;
+	sqlite3_stmt *stmt = NULL;
+	char pattern[] = "/tmp/tmp.XXXXXX", url_template[64], long_template[PROVIDER_URL_SIZE + 8], sql[128], path[128];
+	char other_patterns[2][16] = {"/tmp/tmp.XXXXXX", "/tmp/tmp.XXXXXX"};
+	char *temp_dir = mkdtemp(pattern), *other_dirs[2] = {NULL, NULL};
+	int result = -1;
+
+	if (temp_dir == NULL) return -1;
+	snprintf(path, sizeof(path), "%s/sub", temp_dir);
+	if (mkdir(path, 0700)) goto cleanup;
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		if (write_test_file(temp_dir, files[i], "")) goto cleanup;
+	}
+
+	if ((server = mock_provider_start(&mock_options)) == NULL) goto cleanup;
+	snprintf(url_template, sizeof(url_template), "http://127.0.0.1:%d/{name}", mock_provider_port(server));
+	struct tag_provider provider = {"mock", url_template, tag_keys, NULL, NULL, NULL};
+
+	remove_database_files("pipeline_test.tdb");
+	if ((db = open_database("pipeline_test.tdb", PROFILE_INTERACTIVE)) == NULL || init_tables(db)) goto cleanup;
+	snprintf(sql, sizeof(sql), "INSERT INTO listings VALUES (1, 'l', 1, '%s'), (2, 'm', 1, '%s/missing');", temp_dir, temp_dir);
+	if (sqlite3_exec(db->connection, sql, NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+
+	// queues of two items and transactions of two items make every stage wait on the next one
+	if (scan_and_enrich_listing(db, 1, &provider, 1, &provider_options, &options, &provider_stats, &stats) ||
+		stats.items_scanned != 8 || stats.items_skipped != 1 || stats.transactions < 4 || provider_stats.items != 8 ||
+		provider_stats.requests != 8 || provider_stats.failed_requests != 0 || provider_stats.items_tagged != 7 ||
+		provider_stats.item_tags_added != 14 || get_item_tags_count(db, 1) != 2) {
+		fprintf(stderr, "Error, wrong pipeline run: %zu items, %zu skipped, %zu transactions, %zu requests, %lld tags added\n",
+			stats.items_scanned, stats.items_skipped, stats.transactions, provider_stats.requests, provider_stats.item_tags_added);
+		goto cleanup;
+	}
+	if (sqlite3_prepare_v2(db->connection, "SELECT count(*) FROM items WHERE listing_id=1;", -1, &stmt, NULL) != SQLITE_OK ||
+		sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) != 7) {
+		fputs("Error, the pipeline did not add the scanned items\n", stderr);
+		goto cleanup;
+	}
+
+	// a second run looks the existing items up again, they already have every tag
+	if (scan_and_enrich_listing(db, 1, &provider, 1, &provider_options, NULL, &provider_stats, &stats) ||
+		stats.items_skipped != 1 || provider_stats.items_tagged != 7 || provider_stats.item_tags_added != 0) {
+		fprintf(stderr, "Error, wrong pipeline run over existing items: %zu skipped, %zu tagged, %lld tags added\n",
+			stats.items_skipped, provider_stats.items_tagged, provider_stats.item_tags_added);
+		goto cleanup;
+	}
+
+	// items whose url is too long fail their requests without failing the run
+	memset(long_template, 'x', PROVIDER_URL_SIZE);
+	strcpy(long_template + PROVIDER_URL_SIZE, "{name}");
+	struct tag_provider long_provider = {"long", long_template, tag_keys, NULL, NULL, NULL};
+	if (scan_and_enrich_listing(db, 1, &long_provider, 1, &provider_options, NULL, &provider_stats, &stats) ||
+		provider_stats.requests != 8 || provider_stats.failed_requests != 8 || provider_stats.items_tagged != 0) {
+		fprintf(stderr, "Error, overlong urls failed the pipeline: %zu requests, %zu failed\n",
+			provider_stats.requests, provider_stats.failed_requests);
+		goto cleanup;
+	}
+
+	// two listings with the same relpath, the item of the refreshed one is not the other one's
+	for (int i = 0; i < 2; i++) {
+		if ((other_dirs[i] = mkdtemp(other_patterns[i])) == NULL || write_test_file(other_dirs[i], "x.txt", "")) goto cleanup;
+	}
+	snprintf(sql, sizeof(sql), "INSERT INTO listings VALUES (3, 'n', 1, '%s'), (4, 'o', 1, '%s');", other_dirs[0], other_dirs[1]);
+	if (sqlite3_exec(db->connection, sql, NULL, NULL, NULL) != SQLITE_OK || refresh_listing(db, 3)) goto cleanup;
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (scan_and_enrich_listing(db, 4, &provider, 1, &provider_options, NULL, &provider_stats, &stats) ||
+		stats.items_scanned != 1 || stats.items_skipped != 1 || provider_stats.items_tagged != 0 ||
+		sqlite3_prepare_v2(db->connection, "SELECT count(*) FROM itemtags JOIN items USING (item_id) WHERE listing_id=3;",
+						   -1, &stmt, NULL) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) != 0) {
+		fputs("Error, the pipeline tagged the item of another listing with the same relpath\n", stderr);
+		goto cleanup;
+	}
+
+	// a listing that can't be scanned fails the run
+	if (scan_and_enrich_listing(db, 2, &provider, 1, NULL, NULL, NULL, NULL) != -1) {
+		fputs("Error, the pipeline did not fail on a missing listing directory\n", stderr);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	sqlite3_finalize(stmt);
+	close_database(db);
+	remove_database_files("pipeline_test.tdb");
+	mock_provider_stop(server);
+	cleanup_provider_connections();
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", temp_dir, files[i]);
+		remove(path);
+	}
+	snprintf(path, sizeof(path), "%s/sub", temp_dir);
+	remove(path);
+	remove(temp_dir);
+	for (int i = 0; i < 2 && other_dirs[i] != NULL; i++) {
+		snprintf(path, sizeof(path), "%s/x.txt", other_dirs[i]);
+		remove(path);
+		remove(other_dirs[i]);
+	}
+	return result;
+}
 
 int main(void) {
 	// testing helper functions
@@ -281,8 +2192,8 @@ int main(void) {
 
 	// testing database functions
 	
-	sqlite3 *database;
-	database = open_database(NULL);
+	struct tagger_db *database;
+	database = open_database(NULL, PROFILE_INTERACTIVE);
 
 	if (database == NULL) {
 		fputs("Could not open database\n", stderr);
@@ -332,6 +2243,174 @@ int main(void) {
 	}
 	fputs("add_tag_to_item() test passed\n", stderr);
 
+	if (test_tag_trie(database)) {
+		fputs("tag_trie test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag_trie test passed\n", stderr);
+
+	if (test_tag_trigrams(database)) {
+		fputs("tag_trigrams test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag_trigrams test passed\n", stderr);
+
+	if (test_tag_cooccurrence(database)) {
+		fputs("tag_cooccurrence test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag_cooccurrence test passed\n", stderr);
+
+	if (test_tag_facets(database)) {
+		fputs("tag_facets test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag_facets test passed\n", stderr);
+
+	if (test_cursors(database)) {
+		fputs("cursors test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("cursors test passed\n", stderr);
+
+	if (test_statement_cache(database)) {
+		fputs("statement cache test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("statement cache test passed\n", stderr);
+
+	if (test_database_profiles(database)) {
+		fputs("database profiles test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("database profiles test passed\n", stderr);
+
+	if (test_db_pool(database)) {
+		fputs("db_pool test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("db_pool test passed\n", stderr);
+
+	if (test_update_tags_batch(database)) {
+		fputs("update_tags_batch test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("update_tags_batch test passed\n", stderr);
+
+	if (test_bulk_import(database)) {
+		fputs("bulk import test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("bulk import test passed\n", stderr);
+
+	if (test_export(database)) {
+		fputs("export test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("export test passed\n", stderr);
+
+	if (test_migrations(database)) {
+		fputs("migrations test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("migrations test passed\n", stderr);
+
+	if (test_listing_shards()) {
+		fputs("listing shards test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("listing shards test passed\n", stderr);
+
+	if (test_maintenance()) {
+		fputs("maintenance test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("maintenance test passed\n", stderr);
+
+	if (test_tag_set_operations()) {
+		fputs("tag set operations test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag set operations test passed\n", stderr);
+
+	if (test_fetch_engine()) {
+		fputs("fetch engine test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("fetch engine test passed\n", stderr);
+
+	if (test_response_buffer()) {
+		fputs("response buffer test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("response buffer test passed\n", stderr);
+
+	if (test_http_cache()) {
+		fputs("HTTP cache test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("HTTP cache test passed\n", stderr);
+
+	if (test_json_stream()) {
+		fputs("JSON stream test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("JSON stream test passed\n", stderr);
+
+	if (test_rate_limiter()) {
+		fputs("rate limiter test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("rate limiter test passed\n", stderr);
+
+	if (test_retry_policy()) {
+		fputs("retry policy test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("retry policy test passed\n", stderr);
+
+	if (test_tag_providers()) {
+		fputs("tag providers test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("tag providers test passed\n", stderr);
+
+	if (test_mock_provider()) {
+		fputs("mock provider test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("mock provider test passed\n", stderr);
+
+	if (test_pipeline()) {
+		fputs("pipeline test failed\n", stderr);
+		close_database(database);
+		return -1;
+	}
+	fputs("pipeline test passed\n", stderr);
+
 	close_database(database);
 
 	fputs("----- All tests passed -----\n", stderr);